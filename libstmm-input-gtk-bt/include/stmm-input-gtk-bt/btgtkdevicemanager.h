@@ -29,7 +29,9 @@
 
 #include <gtkmm.h>
 
+#include <array>
 #include <vector>
+#include <unordered_map>
 #include <string>
 #include <memory>
 #include <utility>
@@ -49,6 +51,7 @@ namespace Bt
 	class GtkWindowData;
 	class GtkWindowDataFactory;
 	class BtGtkListenerExtraData;
+	class KeyDispatchSnapshot;
 } // namespace Bt
 } // namespace Private
 
@@ -75,6 +78,122 @@ public:
 	static std::pair<shared_ptr<BtGtkDeviceManager>, std::string> create(const std::string& sAppName
 																		, bool bEnableEventClasses, const std::vector<Event::Class>& aEnDisableEventClasses) noexcept;
 
+	/** How the connections to the devices are handled by the main loop.
+	 */
+	enum RECEIVE_ENGINE
+	{
+		RECEIVE_ENGINE_SOURCES = 0, /**< A main loop source for each connected device. */
+		RECEIVE_ENGINE_EPOLL = 1, /**< A single main loop source multiplexing all connections with epoll. */
+		RECEIVE_ENGINE_THREAD = 2, /**< A receiver thread reads all connections and hands the key packets to the main loop. */
+	};
+	/** Options of the server's sockets.
+	 * A value of 0 leaves the system default. The kernel might adjust
+	 * (or for bluetooth renegotiate) the requested values, getSocketTuning()
+	 * tells the values actually applied.
+	 *
+	 * Only the flush timeout drops data: the controller discards an L2CAP packet
+	 * it couldn't deliver within the timeout instead of retransmitting it, so that
+	 * a congested radio doesn't delay the key packets that follow. The MTUs just
+	 * bound the size of a datagram and the buffer sizes the number of datagrams
+	 * that can queue up.
+	 */
+	struct SocketTuning
+	{
+		int32_t m_nInMtu = 0; /**< The L2CAP incoming MTU in bytes. Bluetooth only. */
+		int32_t m_nOutMtu = 0; /**< The L2CAP outgoing MTU in bytes. Bluetooth only. */
+		int32_t m_nReceiveBufferSize = 0; /**< The SO_RCVBUF of each connection in bytes. */
+		int32_t m_nSendBufferSize = 0; /**< The SO_SNDBUF of each connection in bytes. */
+		/** The L2CAP flush timeout in milliseconds. Bluetooth only.
+		 * If positive the connections are also made flushable (BT_FLUSHABLE).
+		 * Values of 0xFFFF or greater mean infinite (no flush).
+		 */
+		int32_t m_nFlushTimeoutMsec = 0;
+		/** The L2CAP link mode flags (L2CAP_LM_* of &lt;bluetooth/l2cap.h&gt;). Bluetooth only.
+		 * Example: L2CAP_LM_ENCRYPT.
+		 */
+		int32_t m_nLinkMode = 0;
+	};
+	/** Initialization data.
+	 */
+	struct Init
+	{
+		std::string m_sAppName; /**< The application name. Can be empty. */
+		bool m_bEnableEventClasses = false; /**< Whether to enable or disable all but m_aEnDisableEventClasses. */
+		std::vector<Event::Class> m_aEnDisableEventClasses; /**< The event classes to be enabled or disabled according to m_bEnableEventClasses. */
+		/** The maximum number of datagrams read from a device's socket with a single system call.
+		 * If greater than 1 the datagrams are read with `recvmmsg` into a preallocated buffer,
+		 * if 1 with one `recvmsg` call per datagram. In both cases the reads are repeated
+		 * until the socket is drained or m_nReceiveMaxPerDispatch datagrams were handled.
+		 * Default is 16.
+		 */
+		int32_t m_nReceiveBatchSize = 16;
+		/** The maximum number of datagrams of a device that are handled in a main loop iteration.
+		 * Limits the time a chatty device can hold up the other event sources. Must be positive.
+		 * Default is 64.
+		 */
+		int32_t m_nReceiveMaxPerDispatch = 64;
+		/** Whether the time of the key events is the time the kernel received the packet.
+		 * If false it's the time the packet is read from the socket. Default is true.
+		 */
+		bool m_bReceiveKernelTimestamps = true;
+		/** The receive engine. Default is RECEIVE_ENGINE_SOURCES.
+		 * With many connected devices RECEIVE_ENGINE_EPOLL keeps the cost of a main loop
+		 * iteration independent of the number of connections.
+		 */
+		RECEIVE_ENGINE m_eReceiveEngine = RECEIVE_ENGINE_SOURCES;
+		/** The minimum number of messages the receiver thread can queue for the main loop.
+		 * Only used with RECEIVE_ENGINE_THREAD. When full the receiver thread waits.
+		 * Default is 1024.
+		 */
+		int32_t m_nReceiveThreadRingSize = 1024;
+		/** The path of a local (AF_UNIX) socket the server listens on instead of bluetooth.
+		 * If empty the server listens on L2CAP port 8353. If it starts with '@' the rest is
+		 * an abstract socket name. Clients use the same protocol over a SOCK_SEQPACKET connection.
+		 * Meant for tests and benchmarks without bluetooth hardware. Default is empty.
+		 */
+		std::string m_sLocalSocketPath;
+		/** The maximum number of connections waiting to be accepted.
+		 * When many devices (re)connect at the same time, for example after the
+		 * bluetooth adapter was reset, the connections exceeding it are refused
+		 * by the kernel. If not positive the system's maximum (SOMAXCONN) is used.
+		 * Default is 0.
+		 */
+		int32_t m_nListenBacklog = 0;
+		/** The options of the listening and the connection sockets.
+		 * If setting an option fails create() fails. Default is all system defaults.
+		 */
+		SocketTuning m_oSocketTuning;
+		/** Whether the server listens on each local bluetooth adapter separately.
+		 * If false it listens on all adapters with a single socket and the kernel
+		 * chooses the adapter of each connection. Machines with several adapters
+		 * can spread the clients across them to get around the per adapter connection
+		 * and airtime limits. Ignored if m_sLocalSocketPath isn't empty. Default is false.
+		 */
+		bool m_bListenPerAdapter = false;
+		/** The load difference at which an adapter refuses connections.
+		 * Only used if m_bListenPerAdapter is true. If positive a connection to an adapter
+		 * having at least this number of open connections more than the least loaded
+		 * adapter is closed right away. This sheds the load of the adapter, the refused
+		 * client isn't redirected: it has to connect to another adapter by itself.
+		 * Default is 0 (never refuse).
+		 */
+		int32_t m_nAdapterLoadMargin = 0;
+		/** The path of the file the received datagrams are captured to.
+		 * Each datagram is written with its receive time and the backend id of the
+		 * device in btsnoop format (as btmon does), so that the capture can be
+		 * inspected with the usual bluetooth tools and replayed in tests with
+		 * FakeGtkBackend. With RECEIVE_ENGINE_THREAD the device is instead identified
+		 * by the order in which the receiver thread first saw its address (0, 1, ...).
+		 * An existing file is overwritten. Default is empty (no capture).
+		 */
+		std::string m_sCaptureFilePath;
+	};
+	/** Creates an instance of this class.
+	 * @param oInit The initialization data.
+	 * @return The created instance and an empty string or null and an error string (example: couldn't create bluetooth server).
+	 */
+	static std::pair<shared_ptr<BtGtkDeviceManager>, std::string> create(const Init& oInit) noexcept;
+
 	void enableEventClass(const Event::Class& oEventClass) noexcept override;
 
 	/** Adds a stmi::GtkAccessor-wrapped Gtk::Window from which events should be received.
@@ -98,6 +217,102 @@ public:
 	 * @return Whether the window is currently tracked by the device manager.
 	 */
 	bool hasAccessor(const shared_ptr<Accessor>& refAccessor) noexcept override;
+
+	bool addEventListener(const shared_ptr<EventListener>& refEventListener, const shared_ptr<CallIf>& refCallIf) noexcept override;
+	bool addEventListener(const shared_ptr<EventListener>& refEventListener) noexcept override;
+	bool removeEventListener(const shared_ptr<EventListener>& refEventListener, bool bFinalize) noexcept override;
+	bool removeEventListener(const shared_ptr<EventListener>& refEventListener) noexcept override;
+
+	/** Diagnostic counters of a device.
+	 * They are collected since the device was added, across reconnections.
+	 * The histograms have logarithmic buckets: bucket 0 counts the durations shorter
+	 * than a microsecond, bucket i the durations in [2^(i-1), 2^i) microseconds and
+	 * the last bucket also all the longer ones.
+	 */
+	struct DeviceStats
+	{
+		static constexpr int32_t s_nTotHistogramBuckets = 24;
+		int64_t m_nDatagrams = 0; /**< The datagrams received. */
+		int64_t m_nBytes = 0; /**< The bytes received. */
+		int64_t m_nRecvCalls = 0; /**< The receive system calls, including those that found the socket empty. */
+		int64_t m_nMagicErrors = 0; /**< The datagrams with wrong magic numbers. Each closes the connection. */
+		int64_t m_nCmdErrors = 0; /**< The datagrams with an invalid command, record or header flags. Each closes the connection. */
+		int64_t m_nSizeErrors = 0; /**< The truncated datagrams. Each closes the connection. */
+		int64_t m_nNoops = 0; /**< The PACKET_CMD_NOOP packets, including the protocol handshakes. */
+		int64_t m_nKeyEvents = 0; /**< The key events sent to the listeners. */
+		int64_t m_nSuppressedRepeats = 0; /**< The presses of already pressed keys. Not sent to the listeners. */
+		int64_t m_nOrphanReleases = 0; /**< The releases of keys that weren't pressed. Not sent to the listeners. */
+		/** The time from the key event to the return of the last listener callback.
+		 * The time of a key event is the time its packet was received (for protocol v2
+		 * dated back by the capture time difference to the datagram's last record).
+		 */
+		std::array<int64_t, s_nTotHistogramBuckets> m_aDispatchHistogram{};
+		/** The time between consecutive datagrams of a connection. */
+		std::array<int64_t, s_nTotHistogramBuckets> m_aGapHistogram{};
+		int32_t m_nProtocolVersion = 1; /**< The protocol version of the last connection. */
+		int64_t m_nV2Datagrams = 0; /**< The protocol v2 (or later) datagrams. */
+		int64_t m_nLostDatagrams = 0; /**< The v2 datagrams missing in the sequence. */
+		int64_t m_nOutOfOrderDatagrams = 0; /**< The v2 datagrams received late or twice. */
+		int64_t m_nAcks = 0; /**< The acknowledgements sent to the client (protocol v3). */
+		/** The transit time of the v2 datagrams in excess of the fastest one of the connection.
+		 * The clocks of client and server aren't synchronized, the fastest
+		 * datagram is taken as reference.
+		 */
+		std::array<int64_t, s_nTotHistogramBuckets> m_aDelayHistogram{};
+	};
+	/** Snapshot of the diagnostic counters of a device.
+	 * The counters are always collected, the call just copies them.
+	 * @param nDeviceId The device id.
+	 * @param oStats Set to the counters of the device. Not changed if the device doesn't exist.
+	 * @return Whether the device exists.
+	 */
+	bool getDeviceStats(int32_t nDeviceId, DeviceStats& oStats) const noexcept;
+
+	/** Diagnostic counters of the server's connections.
+	 * They are collected since the device manager was created.
+	 * The connections refused by the kernel because the backlog was full aren't counted.
+	 */
+	struct ServerStats
+	{
+		int64_t m_nAccepted = 0; /**< The accepted connections. */
+		int64_t m_nReconnects = 0; /**< The accepted connections of already known devices. */
+		int64_t m_nRefused = 0; /**< The connections closed right after being accepted (example: too many devices). */
+		int64_t m_nAcceptErrors = 0; /**< The failed accept system calls (example: too many open files). */
+		/** The time from accepting a connection to its first key event.
+		 * Same buckets as DeviceStats::m_aDispatchHistogram.
+		 */
+		std::array<int64_t, DeviceStats::s_nTotHistogramBuckets> m_aFirstKeyHistogram{};
+	};
+	/** Snapshot of the diagnostic counters of the server.
+	 * @param oStats Set to the counters.
+	 */
+	void getServerStats(ServerStats& oStats) const noexcept;
+	/** The socket options applied by the kernel.
+	 * The buffer sizes are those of the listening socket as returned by getsockopt
+	 * (Linux reports twice the requested size because it includes its bookkeeping),
+	 * the connections get the same. The fields that don't apply to the transport are 0.
+	 * @param oApplied Set to the applied options. Not changed if there is no server.
+	 * @return Whether the server socket exists.
+	 */
+	bool getSocketTuning(SocketTuning& oApplied) const noexcept;
+
+	/** Diagnostic counters of a local adapter the server listens on.
+	 * There is a single adapter with an all zeroes address unless
+	 * Init::m_bListenPerAdapter was true.
+	 */
+	struct AdapterStats
+	{
+		std::string m_sAddress; /**< The address of the adapter. Example: "00:1A:7D:DA:71:13". */
+		int32_t m_nConnections = 0; /**< The currently open connections. */
+		int64_t m_nAccepted = 0; /**< The accepted connections. */
+		int64_t m_nRefused = 0; /**< The connections refused because of Init::m_nAdapterLoadMargin. */
+	};
+	/** Snapshot of the load of the adapters the server listens on.
+	 * A client (re)connecting to the least loaded adapter can choose it among the
+	 * addresses of this list.
+	 * @param aStats Set to the counters, one per adapter.
+	 */
+	void getAdapterStats(std::vector<AdapterStats>& aStats) const noexcept;
 protected:
 	void finalizeListener(ListenerData& oListenerData) noexcept override;
 	/** Constructor.
@@ -110,28 +325,36 @@ private:
 	friend class Private::Bt::GtkBackend;
 	void onDeviceAdded(const std::string& sName, int32_t nBackendId) noexcept;
 	void onDeviceRemoved(int32_t nBackendId) noexcept;
-	bool onBlueKey(int32_t nBackendId, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK) noexcept;
+	bool onBlueKey(int32_t nBackendId, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK, int64_t nTimeUsec) noexcept;
+	shared_ptr<Private::Bt::BtKeysDevice>& getBtKeysDevice(int32_t nBackendId) noexcept;
 
 	bool findWindow(Gtk::Window* p0GtkmmWindow
 					, std::vector< std::pair<Gtk::Window*, shared_ptr<Private::Bt::GtkWindowData> > >::iterator& itFind) noexcept;
 	bool hasAccessor(const shared_ptr<Accessor>& refAccessor, bool& bValid
 					, std::vector< std::pair<Gtk::Window*, shared_ptr<Private::Bt::GtkWindowData> > >::iterator& itFind) noexcept;
 	void removeAccessor(const std::vector< std::pair<Gtk::Window*, shared_ptr<Private::Bt::GtkWindowData> > >::iterator& itGtkData) noexcept;
+	void eraseWindow(const std::vector< std::pair<Gtk::Window*, shared_ptr<Private::Bt::GtkWindowData> > >::iterator& itGtkData) noexcept;
 	void cancelDeviceKeys(const shared_ptr<Private::Bt::BtKeysDevice>& refBtKeysDevice) noexcept;
 	void selectAccessor(const shared_ptr<Private::Bt::GtkWindowData>& refData) noexcept;
 	void deselectAccessor() noexcept;
 	void onIsActiveChanged(const shared_ptr<Private::Bt::GtkWindowData>& refWindowData) noexcept;
+	void invalidateKeySnapshot() noexcept;
+	void createKeySnapshot(Private::Bt::KeyDispatchSnapshot& oSnapshot) const noexcept;
 
 	friend class Private::Bt::GtkWindowData;
 	friend class Private::Bt::BtKeysDevice;
 	friend class Private::Bt::BtGtkListenerExtraData;
+	friend class Private::Bt::KeyDispatchSnapshot;
 private:
 	std::unique_ptr<Private::Bt::GtkWindowDataFactory> m_refFactory;
 	std::unique_ptr<Private::Bt::GtkBackend> m_refBackend;
 	// The GtkAccessor (GtkWindowData::m_refAccessor) will tell
 	// when the window gets deleted. The accessor can also be removed
 	// explicitely during a listener callback.
+	// Unordered: erasing moves the last element into the freed position.
 	std::vector<std::pair<Gtk::Window*, shared_ptr<Private::Bt::GtkWindowData> > > m_aGtkWindowData;
+	// Key: the window of an element of m_aGtkWindowData, Value: its index.
+	std::unordered_map<Gtk::Window*, int32_t> m_oGtkWindowIdx;
 	// The currently active accessor (window), can be null.
 	std::shared_ptr<Private::Bt::GtkWindowData> m_refSelected;
 	// Invariants:
@@ -141,7 +364,14 @@ private:
 
 	int32_t m_nCancelingNestedDepth;
 	//
-	std::vector< shared_ptr<Private::Bt::BtKeysDevice> > m_aBtDevices; // Index: nBackendId, Value: can be null!
+	std::vector< shared_ptr<Private::Bt::BtKeysDevice> > m_aBtDevices; // Index: SlotMapBase::getIndex(nBackendId), Value: can be null!
+	// What key events are sent with. Rebuilt lazily when outdated, that is
+	// when its epoch differs from m_nKeySnapshotEpoch, which is incremented
+	// each time the listeners, the selected accessor or the devices change.
+	// Not released while a key is being dispatched (m_nKeyDispatchDepth > 0).
+	shared_ptr<Private::Bt::KeyDispatchSnapshot> m_refKeySnapshot;
+	uint64_t m_nKeySnapshotEpoch;
+	int32_t m_nKeyDispatchDepth;
 	//
 	const int32_t m_nClassIdxKeyEvent;
 private:
@@ -21,13 +21,18 @@
 #include "bluetoothsources.h"
 #include "keypacket.h"
 
+#include <stmm-input/devicemanager.h>
+
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <cassert>
 
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 
 namespace stmi
 {
@@ -37,66 +42,30 @@ namespace Private
 namespace Bt
 {
 
-	//constexpr int32_t s_nMtu = 48; /// Bytes
 constexpr char s_nMagic1 = '7';
 constexpr char s_nMagic2 = 'A';
+constexpr char s_nMagic2V2 = 'B';
+constexpr char s_nMagic2Ack = 'C';
 
-BlueServerAcceptSource::BlueServerAcceptSource(int32_t nL2capPort) noexcept
+// The number of packets needed to hold a datagram of the given size
+static int32_t getMaxPacketsPerDatagram(int32_t nMaxDatagramSize) noexcept
+{
+	constexpr int32_t nPacketSize = static_cast<int32_t>(sizeof(KeyPacket));
+	return std::max<int32_t>(1, (nMaxDatagramSize + nPacketSize - 1) / nPacketSize);
+}
+
+BlueServerAcceptSource::BlueServerAcceptSource(const std::shared_ptr<ServerTransport>& refTransport) noexcept
 : Glib::Source()
-, m_nL2capPort(nL2capPort)
+, m_refTransport(refTransport)
 , m_nListenerFD(-1)
 {
 	static_assert(sizeof(int) <= sizeof(int32_t), "");
 	static_assert(false == FALSE, "");
 	static_assert(true == TRUE, "");
 	//
-	m_nListenerFD = ::socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-	//
+	assert(m_refTransport);
+	m_nListenerFD = m_refTransport->createListener("BlueServerAcceptSource()", m_sErrorStr);
 	if (m_nListenerFD < 0) {
-		m_sErrorStr = "BlueServerAcceptSource(): socket failed: " + std::string(strerror(errno));
-		return; //--------------------------------------------------------------
-	}
-	// bind socket to given port of the first available
-	// bluetooth adapter
-	::sockaddr_l2 oLocalAddr;
-	memset(&oLocalAddr, 0, sizeof(oLocalAddr));
-	const short nPort = static_cast<short>(m_nL2capPort); //0x20A1
-	oLocalAddr.l2_family = AF_BLUETOOTH;
-	memset(&(oLocalAddr.l2_bdaddr), 0, sizeof(oLocalAddr.l2_bdaddr)); // set to BDADDR_ANY !!!
-	oLocalAddr.l2_psm = htobs(nPort);
-	oLocalAddr.l2_cid = 0;
-	oLocalAddr.l2_bdaddr_type = 0;
-	//
-	auto nRes = ::bind(m_nListenerFD, reinterpret_cast<sockaddr*>(&oLocalAddr), sizeof(oLocalAddr));
-	//
-	if (nRes < 0) {
-		m_sErrorStr = "BlueServerAcceptSource(): bind failed: " + std::string(strerror(errno));
-		close(m_nListenerFD);
-		m_nListenerFD = -1;
-		return; //--------------------------------------------------------------
-	}
-	//// Set MTU
-	//struct l2cap_options oOpts;
-	//int nOptLen = static_cast<int>(sizeof(oOpts));
-	//nRes = getsockopt( m_nListenerFD, SOL_L2CAP, L2CAP_OPTIONS, &oOpts, &nOptLen );
-	//if (nRes == 0) {
-	//	oOpts.imtu = s_nMtu; // i
-	//	oOpts.omtu = s_nMtu; // not really used
-	//	nRes = setsockopt( m_nListenerFD, SOL_L2CAP, L2CAP_OPTIONS, &oOpts, nOptLen );
-	//}
-	//if (nRes < 0) {
-	//	m_sErrorStr = "BlueServerAcceptSource(): setsockopt failed: " + std::string(strerror(errno));
-	//	close(m_nListenerFD);
-	//	m_nListenerFD = -1;
-	//	return; //--------------------------------------------------------------
-	//}
-
-	// put socket into listening mode
-	nRes = ::listen(m_nListenerFD, 3);
-	if (nRes < 0) {
-		m_sErrorStr = "BlueServerAcceptSource(): listen failed: " + std::string(strerror(errno));
-		close(m_nListenerFD);
-		m_nListenerFD = -1;
 		return; //--------------------------------------------------------------
 	}
 
@@ -113,7 +82,7 @@ BlueServerAcceptSource::~BlueServerAcceptSource() noexcept
 		::close(m_nListenerFD);
 	}
 }
-sigc::connection BlueServerAcceptSource::connect(const sigc::slot<bool, int32_t, const struct sockaddr_l2&>& oSlot) noexcept
+sigc::connection BlueServerAcceptSource::connect(const sigc::slot<bool, int32_t, const bdaddr_t&>& oSlot) noexcept
 {
 	if (m_nListenerFD == -1) {
 		// Error, return an empty connection
@@ -171,34 +140,526 @@ bool BlueServerAcceptSource::dispatch(sigc::slot_base* p0Slot) noexcept
 		return bContinue; //----------------------------------------------------
 	}
 
-	::sockaddr_l2 oRemoteAddr;
-	memset(&oRemoteAddr, 0, sizeof(oRemoteAddr));
-	socklen_t nRemoteAdrLen = sizeof(oRemoteAddr);
-
-	// accept one connection
-	int32_t nFdClient = ::accept(m_nListenerFD, reinterpret_cast<sockaddr*>(&oRemoteAddr), &nRemoteAdrLen);
-	if (nFdClient < 0) {
-		std::cerr <<  "BlueServerAcceptSource::dispatch: accept failed: " << strerror(errno) << '\n';
-		// no idea if it's a good idea to just go on accepting
-		return bContinue; //----------------------------------------------------
+	auto& oSlot = *static_cast<sigc::slot<bool, int32_t, const bdaddr_t&>*>(p0Slot);
+	// accept all pending connections (at most a backlog's worth)
+	const int32_t nMaxAccepts = m_refTransport->getListenBacklog();
+	for (int32_t nAccept = 0; nAccept < nMaxAccepts; ++nAccept) {
+		bdaddr_t oRemoteAddr;
+		const int32_t nFdClient = m_refTransport->acceptClient(m_nListenerFD, oRemoteAddr);
+		if (nFdClient < 0) {
+			if (! ServerTransport::isNoPendingClient(errno)) {
+				std::cerr <<  "BlueServerAcceptSource::dispatch: accept failed: " << strerror(errno) << '\n';
+				// no idea if it's a good idea to just go on accepting
+			}
+			break; // for -----------
+		}
+		bContinue = oSlot(nFdClient, oRemoteAddr);
+		if (! bContinue) {
+			break; // for -----------
+		}
 	}
-	//char sBuf[19];
-	//ba2str( &(oRemoteAddr.l2_bdaddr), sBuf );
-
-	bContinue = (*static_cast<sigc::slot<bool, int32_t, const struct ::sockaddr_l2&>*>(p0Slot))(nFdClient, oRemoteAddr);
-
 	return bContinue;
 }
 ////////////////////////////////////////////////////////////////////////////////
-BlueServerReceiveSource::BlueServerReceiveSource(int32_t nBackendId, int32_t nClientFD) noexcept
-: Glib::Source()
-, m_nBackendId(nBackendId)
+BlueClientReceiver::BlueClientReceiver(int32_t nBackendId, int32_t nClientFD, const BlueReceiveOptions& oOptions
+										, const std::shared_ptr<BlueReceiveCounters>& refCounters) noexcept
+: m_nBackendId(nBackendId)
+, m_nCaptureId(nBackendId)
 , m_nClientFD(nClientFD)
+, m_nBatchSize(oOptions.m_nBatchSize)
+, m_nMaxPerDispatch(oOptions.m_nMaxPerDispatch)
+, m_nMaxPacketsPerDatagram(getMaxPacketsPerDatagram(oOptions.m_nMaxDatagramSize))
+, m_bKernelTimestamps(oOptions.m_bKernelTimestamps)
+, m_aPackets(static_cast<size_t>(m_nBatchSize * m_nMaxPacketsPerDatagram))
+, m_aIOVecs(static_cast<size_t>(m_nBatchSize))
+, m_aMsgHdrs(static_cast<size_t>(m_nBatchSize))
+, m_aControlBuffers(static_cast<size_t>(m_nBatchSize))
+, m_aReceivedBytes(static_cast<size_t>(m_nBatchSize), 0)
+, m_aReceivedTimes(static_cast<size_t>(m_nBatchSize), 0)
+, m_nProtocolVersion(PACKET_PROTOCOL_VERSION_1)
+, m_bV2Started(false)
+, m_nV2NextSequence(0)
+, m_nV2MinOffsetUsec(0)
+, m_nFlowCredit(std::min<int32_t>(oOptions.m_nFlowCredit, UINT16_MAX))
+, m_bAckPending(false)
+, m_refCounters(refCounters)
+, m_refCapture(oOptions.m_refCapture)
+, m_nLastDatagramUsec(-1)
 {
 	assert(m_nBackendId >= 0);
 	assert(m_nClientFD >= 0);
+	assert(m_refCounters);
+	assert(m_nBatchSize > 0);
+	assert(m_nMaxPerDispatch > 0);
+	assert(m_nFlowCredit > 0);
+
+	// The message headers point to the buffers once and for all
+	for (int32_t nIdx = 0; nIdx < m_nBatchSize; ++nIdx) {
+		auto& oIOVec = m_aIOVecs[nIdx];
+		oIOVec.iov_base = &(m_aPackets[nIdx * m_nMaxPacketsPerDatagram]);
+		oIOVec.iov_len = m_nMaxPacketsPerDatagram * sizeof(KeyPacket);
+		auto& oMsgHdr = m_aMsgHdrs[nIdx];
+		memset(&oMsgHdr, 0, sizeof(oMsgHdr));
+		oMsgHdr.msg_hdr.msg_iov = &oIOVec;
+		oMsgHdr.msg_hdr.msg_iovlen = 1;
+	}
+	if (m_bKernelTimestamps) {
+		const int nOn = 1;
+		const auto nRes = ::setsockopt(m_nClientFD, SOL_SOCKET, SO_TIMESTAMPNS, &nOn, sizeof(nOn));
+		if (nRes < 0) {
+			// fall back to the time of reading
+			m_bKernelTimestamps = false;
+		}
+	}
+}
+BlueClientReceiver::~BlueClientReceiver() noexcept
+{
+	closeConnection();
+}
+void BlueClientReceiver::closeConnection() noexcept
+{
+	if (m_nClientFD >= 0) {
+		::close(m_nClientFD);
+		m_nClientFD = -1;
+	}
+}
+void BlueClientReceiver::setCaptureId(int32_t nCaptureId) noexcept
+{
+	assert(nCaptureId >= 0);
+	m_nCaptureId = nCaptureId;
+}
+KeyPacket BlueClientReceiver::getClosePacket(bool bRemove) noexcept
+{
+	KeyPacket oPacket;
+	oPacket.m_nMagic1 = s_nMagic1;
+	oPacket.m_nMagic2 = s_nMagic2;
+	oPacket.m_nCmd = (bRemove ? PACKET_CMD_REMOVE_DEVICE : PACKET_CMD_NOOP);
+	oPacket.m_nKeyType = 0;
+	oPacket.m_nHardwareKey = 0;
+	return oPacket;
+}
+int32_t BlueClientReceiver::receiveDatagrams(int32_t nMaxDatagrams) noexcept
+{
+	assert((nMaxDatagrams > 0) && (nMaxDatagrams <= m_nBatchSize));
+	if (m_bKernelTimestamps) {
+		// the kernel overwrites msg_controllen with the used size
+		for (int32_t nIdx = 0; nIdx < nMaxDatagrams; ++nIdx) {
+			auto& oHdr = m_aMsgHdrs[nIdx].msg_hdr;
+			oHdr.msg_control = &(m_aControlBuffers[nIdx]);
+			oHdr.msg_controllen = sizeof(ControlBuffer);
+		}
+	}
+	BlueReceiveCounters::inc(m_refCounters->m_nRecvCalls);
+	if (m_nBatchSize == 1) {
+		const auto nBytesReceived = ::recvmsg(m_nClientFD, &(m_aMsgHdrs[0].msg_hdr), MSG_DONTWAIT);
+		if (nBytesReceived < 0) {
+			return (((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1); //-----
+		}
+		m_aReceivedBytes[0] = static_cast<int32_t>(nBytesReceived);
+		calcReceivedTimes(1);
+		return 1; //----------------------------------------------------------------
+	}
+	const auto nReceived = ::recvmmsg(m_nClientFD, &(m_aMsgHdrs[0]), static_cast<unsigned int>(nMaxDatagrams), MSG_DONTWAIT, nullptr);
+	if (nReceived < 0) {
+		return (((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1); //---------
+	}
+	for (int32_t nIdx = 0; nIdx < nReceived; ++nIdx) {
+		m_aReceivedBytes[nIdx] = static_cast<int32_t>(m_aMsgHdrs[nIdx].msg_len);
+	}
+	calcReceivedTimes(nReceived);
+	return static_cast<int32_t>(nReceived);
+}
+void BlueClientReceiver::calcReceivedTimes(int32_t nReceived) noexcept
+{
+	const int64_t nNowUsec = DeviceManager::getNowTimeMicroseconds();
+	if (! m_bKernelTimestamps) {
+		for (int32_t nIdx = 0; nIdx < nReceived; ++nIdx) {
+			m_aReceivedTimes[nIdx] = nNowUsec;
+		}
+		return; //--------------------------------------------------------------
+	}
+	// The kernel timestamps are CLOCK_REALTIME, convert to the device manager's
+	// clock through the age of the datagram
+	struct ::timespec oNowReal;
+	::clock_gettime(CLOCK_REALTIME, &oNowReal);
+	const int64_t nNowRealUsec = static_cast<int64_t>(oNowReal.tv_sec) * 1000000 + oNowReal.tv_nsec / 1000;
+	for (int32_t nIdx = 0; nIdx < nReceived; ++nIdx) {
+		int64_t nAgeUsec = 0;
+		struct ::msghdr& oHdr = m_aMsgHdrs[nIdx].msg_hdr;
+		for (struct ::cmsghdr* p0CMsg = CMSG_FIRSTHDR(&oHdr); p0CMsg != nullptr; p0CMsg = CMSG_NXTHDR(&oHdr, p0CMsg)) {
+			if ((p0CMsg->cmsg_level == SOL_SOCKET) && (p0CMsg->cmsg_type == SCM_TIMESTAMPNS)) {
+				struct ::timespec oStamp;
+				memcpy(&oStamp, CMSG_DATA(p0CMsg), sizeof(oStamp));
+				const int64_t nStampUsec = static_cast<int64_t>(oStamp.tv_sec) * 1000000 + oStamp.tv_nsec / 1000;
+				// the realtime clock might have been set back meanwhile
+				nAgeUsec = std::max<int64_t>(0, nNowRealUsec - nStampUsec);
+				break; // for -----------
+			}
+		}
+		m_aReceivedTimes[nIdx] = nNowUsec - nAgeUsec;
+	}
+}
+BlueClientReceiver::RECEIVE_RESULT BlueClientReceiver::receive(const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oSlot
+																, std::string& sError) noexcept
+{
+	assert(m_nClientFD >= 0);
+	static_assert(sizeof(KeyPacket) == 8, "");
+
+	// Drain the socket until it's empty or the budget is spent
+	int32_t nTotHandled = 0;
+	while (nTotHandled < m_nMaxPerDispatch) {
+		const int32_t nToReceive = std::min(m_nBatchSize, m_nMaxPerDispatch - nTotHandled);
+		const int32_t nReceived = receiveDatagrams(nToReceive);
+		if (nReceived < 0) {
+			sError = std::string("BlueClientReceiver::receive error: recv failed!\n  ") + strerror(errno);
+			return RECEIVE_RESULT_CLOSE; //-------------------------------------
+		}
+		for (int32_t nIdx = 0; nIdx < nReceived; ++nIdx) {
+			const int32_t nBytesReceived = m_aReceivedBytes[nIdx];
+			if (nBytesReceived == 0) {
+				// End of stream: the hang up is handled in the next iteration
+				return RECEIVE_RESULT_OK; //------------------------------------
+			}
+			countDatagram(nBytesReceived, m_aReceivedTimes[nIdx]);
+			if ((m_aMsgHdrs[nIdx].msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+				// the tail might have contained releases
+				BlueReceiveCounters::inc(m_refCounters->m_nSizeErrors);
+				sError = "BlueClientReceiver::receive error: datagram truncated!";
+				return RECEIVE_RESULT_CLOSE; //---------------------------------
+			}
+			if (m_refCapture && m_refCapture->isOpen()) {
+				// before processing, which converts the packets in place
+				m_refCapture->write(m_nCaptureId, m_aReceivedTimes[nIdx]
+									, reinterpret_cast<const uint8_t*>(&(m_aPackets[nIdx * m_nMaxPacketsPerDatagram]))
+									, nBytesReceived);
+			}
+			const auto eResult = processDatagram(oSlot, &(m_aPackets[nIdx * m_nMaxPacketsPerDatagram]), nBytesReceived
+												, m_aReceivedTimes[nIdx], sError);
+			if (eResult != RECEIVE_RESULT_OK) {
+				return eResult; //----------------------------------------------
+			}
+		}
+		nTotHandled += nReceived;
+		if (nReceived < nToReceive) {
+			// socket drained
+			break; // while -------
+		}
+	}
+	if (m_bAckPending) {
+		sendAck();
+	}
+	return RECEIVE_RESULT_OK;
+}
+BlueClientReceiver::RECEIVE_RESULT BlueClientReceiver::processDatagram(const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oSlot
+																		, KeyPacket* p0Packets, int32_t nBytesReceived
+																		, int64_t nTimeUsec, std::string& sError) noexcept
+{
+	constexpr auto nPktSize = sizeof(KeyPacket);
+//std::cout << "BlueClientReceiver::processDatagram() nBytesReceived=" << nBytesReceived << '\n';
+	if ((nBytesReceived >= 2) && (p0Packets[0].m_nMagic2 == s_nMagic2V2)) {
+		return processDatagramV2(oSlot, reinterpret_cast<const uint8_t*>(p0Packets), nBytesReceived, nTimeUsec, sError); //----
+	}
+	int32_t nPacket = 0;
+	int32_t nBufPos = 0;
+	// process full packets
+	while (nBufPos + static_cast<int32_t>(nPktSize) <= nBytesReceived) {
+		auto& oPacket = p0Packets[nPacket];
+		oPacket.m_nHardwareKey = btohl(oPacket.m_nHardwareKey);
+		if ((oPacket.m_nMagic1 != s_nMagic1) || (oPacket.m_nMagic2 != s_nMagic2)) {
+			BlueReceiveCounters::inc(m_refCounters->m_nMagicErrors);
+			sError = "BlueClientReceiver::receive error: magic numbers check failed!";
+			return RECEIVE_RESULT_CLOSE; //-------------------------------------
+		}
+		if (oPacket.m_nCmd == PACKET_CMD_REMOVE_DEVICE) {
+//std::cout << "BlueClientReceiver::processDatagram()  PACKET_CMD_REMOVE_DEVICE" << '\n';
+			return RECEIVE_RESULT_REMOVE; //------------------------------------
+		}
+		//if (oPacket.m_nCmd == PACKET_CMD_DISCONNECT_DEVICE) {
+		//	return RECEIVE_RESULT_CLOSE; //-------------------------------------
+		//}
+		if (oPacket.m_nCmd == PACKET_CMD_NOOP) {
+			BlueReceiveCounters::inc(m_refCounters->m_nNoops);
+			if (oPacket.m_nKeyType == PACKET_HELLO_KEY_TYPE) {
+				replyHello(oPacket.m_nHardwareKey);
+			}
+		} else {
+			if (oPacket.m_nCmd != PACKET_CMD_KEY) {
+				BlueReceiveCounters::inc(m_refCounters->m_nCmdErrors);
+				sError = "BlueClientReceiver::receive error: bad cmd field!";
+				return RECEIVE_RESULT_CLOSE; //---------------------------------
+			}
+			const bool bContinue = oSlot(m_nBackendId, false, oPacket, nTimeUsec);
+			if (!bContinue) {
+				// listener requests to stop processing
+				return RECEIVE_RESULT_STOP; //----------------------------------
+			}
+		}
+		//
+		++nPacket;
+		nBufPos += sizeof(KeyPacket);
+	}
+	if (nBufPos < nBytesReceived) {
+		BlueReceiveCounters::inc(m_refCounters->m_nSizeErrors);
+		sError = "BlueClientReceiver::receive error: pkt < 8 bytes!";
+		return RECEIVE_RESULT_CLOSE; //-----------------------------------------
+	}
+	return RECEIVE_RESULT_OK;
+}
+// Reads a chord key (varint) at nPos and advances it. Returns false if invalid.
+static bool readV2ChordKey(const uint8_t* p0Bytes, int32_t nBytes, int32_t& nPos
+							, int32_t& nKeyType, int32_t& nHardwareKey) noexcept
+{
+	uint32_t nValue;
+	const int32_t nSize = packetReadVarint(p0Bytes + nPos, nBytes - nPos, nValue);
+	if (nSize == 0) {
+		return false; //--------------------------------------------------------
+	}
+	nPos += nSize;
+	nKeyType = static_cast<int32_t>(nValue & 0x03);
+	nHardwareKey = static_cast<int32_t>(nValue >> 2);
+	return (nKeyType != 0);
+}
+// Reads a v2 record at nPos and advances it. Returns false if the record is invalid.
+// If the record is a chord nChordKeys is set to the number of keys, which start at nChordPos.
+static bool readV2Record(const uint8_t* p0Bytes, int32_t nBytes, int32_t& nPos
+						, int32_t& nCmd, int32_t& nKeyType, int32_t& nHardwareKey, uint32_t& nDeltaUsec
+						, int32_t& nChordKeys, int32_t& nChordPos) noexcept
+{
+	if (nPos >= nBytes) {
+		return false; //--------------------------------------------------------
+	}
+	const uint8_t nCmdType = p0Bytes[nPos];
+	++nPos;
+	nCmd = (nCmdType >> 4);
+	nKeyType = (nCmdType & 0x0F);
+	uint32_t nKey;
+	const int32_t nKeySize = packetReadVarint(p0Bytes + nPos, nBytes - nPos, nKey);
+	if ((nKeySize == 0) || (nKey > static_cast<uint32_t>(std::numeric_limits<int32_t>::max()))) {
+		return false; //--------------------------------------------------------
+	}
+	nPos += nKeySize;
+	nHardwareKey = static_cast<int32_t>(nKey);
+	const int32_t nDeltaSize = packetReadVarint(p0Bytes + nPos, nBytes - nPos, nDeltaUsec);
+	if (nDeltaSize == 0) {
+		return false; //--------------------------------------------------------
+	}
+	nPos += nDeltaSize;
+	if (nDeltaUsec > static_cast<uint32_t>(std::numeric_limits<int32_t>::max())) {
+		// A negative capture time difference wrapped around by the client
+		// must not date the preceding records back by more than half an hour
+		nDeltaUsec = 0;
+	}
+	nChordKeys = 0;
+	if (nCmd == PACKET_CMD_CHORD) {
+		// the key field holds the number of keys
+		if ((nHardwareKey < 1) || (nHardwareKey > PACKET_V2_MAX_CHORD_KEYS)) {
+			return false; //----------------------------------------------------
+		}
+		nChordKeys = nHardwareKey;
+		nChordPos = nPos;
+		int32_t nChordKeyType;
+		int32_t nChordHardwareKey;
+		for (int32_t nChordKey = 0; nChordKey < nChordKeys; ++nChordKey) {
+			if (! readV2ChordKey(p0Bytes, nBytes, nPos, nChordKeyType, nChordHardwareKey)) {
+				return false; //------------------------------------------------
+			}
+		}
+		return true; //---------------------------------------------------------
+	}
+	return ((nCmd == PACKET_CMD_KEY) || (nCmd == PACKET_CMD_NOOP) || (nCmd == PACKET_CMD_REMOVE_DEVICE));
+}
+BlueClientReceiver::RECEIVE_RESULT BlueClientReceiver::processDatagramV2(const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oSlot
+																		, const uint8_t* p0Bytes, int32_t nBytesReceived
+																		, int64_t nTimeUsec, std::string& sError) noexcept
+{
+	constexpr int32_t nHeaderSize = static_cast<int32_t>(sizeof(KeyPacketV2Header));
+	static_assert(nHeaderSize == 12, "");
+	if (nBytesReceived < nHeaderSize) {
+		BlueReceiveCounters::inc(m_refCounters->m_nSizeErrors);
+		sError = "BlueClientReceiver::receive error: v2 header truncated!";
+		return RECEIVE_RESULT_CLOSE; //-----------------------------------------
+	}
+	KeyPacketV2Header oHeader;
+	memcpy(&oHeader, p0Bytes, nHeaderSize);
+	if (oHeader.m_nMagic1 != s_nMagic1) {
+		BlueReceiveCounters::inc(m_refCounters->m_nMagicErrors);
+		sError = "BlueClientReceiver::receive error: magic numbers check failed!";
+		return RECEIVE_RESULT_CLOSE; //-----------------------------------------
+	}
+	if (oHeader.m_nFlags != 0) {
+		// No flags are defined yet
+		BlueReceiveCounters::inc(m_refCounters->m_nCmdErrors);
+		sError = "BlueClientReceiver::receive error: unknown v2 header flags!";
+		return RECEIVE_RESULT_CLOSE; //-----------------------------------------
+	}
+	const int32_t nTotRecords = oHeader.m_nCount;
+	int32_t nCmd;
+	int32_t nKeyType;
+	int32_t nHardwareKey;
+	uint32_t nDeltaUsec;
+	int32_t nChordKeys;
+	int32_t nChordPos;
+	// Validate the whole datagram before passing any key to the callback
+	// and calculate the capture time span of the records
+	int64_t nSpanUsec = 0;
+	int32_t nNoops = 0;
+	int32_t nPos = nHeaderSize;
+	for (int32_t nRecord = 0; nRecord < nTotRecords; ++nRecord) {
+		if (! readV2Record(p0Bytes, nBytesReceived, nPos, nCmd, nKeyType, nHardwareKey, nDeltaUsec, nChordKeys, nChordPos)) {
+			BlueReceiveCounters::inc(m_refCounters->m_nCmdErrors);
+			sError = "BlueClientReceiver::receive error: bad v2 record!";
+			return RECEIVE_RESULT_CLOSE; //-------------------------------------
+		}
+		nSpanUsec += nDeltaUsec;
+		if (nCmd == PACKET_CMD_NOOP) {
+			++nNoops;
+		}
+	}
+	if (nPos != nBytesReceived) {
+		BlueReceiveCounters::inc(m_refCounters->m_nSizeErrors);
+		sError = "BlueClientReceiver::receive error: v2 datagram size mismatch!";
+		return RECEIVE_RESULT_CLOSE; //-----------------------------------------
+	}
+	if (nNoops > 0) {
+		BlueReceiveCounters::inc(m_refCounters->m_nNoops, nNoops);
+	}
+	const uint32_t nBaseTimeUsec = btohl(oHeader.m_nBaseTimeUsec);
+	updateV2Stats(btohl(oHeader.m_nSequence), nBaseTimeUsec + static_cast<uint32_t>(nSpanUsec), nTimeUsec);
+
+	KeyPacket oPacket;
+	oPacket.m_nMagic1 = s_nMagic1;
+	oPacket.m_nMagic2 = s_nMagic2;
+	oPacket.m_nCmd = PACKET_CMD_KEY;
+	// The last record was captured just before the datagram was sent,
+	// the preceding ones are dated back by their capture time difference
+	int64_t nAgeUsec = nSpanUsec;
+	nPos = nHeaderSize;
+	for (int32_t nRecord = 0; nRecord < nTotRecords; ++nRecord) {
+		readV2Record(p0Bytes, nBytesReceived, nPos, nCmd, nKeyType, nHardwareKey, nDeltaUsec, nChordKeys, nChordPos);
+		nAgeUsec -= nDeltaUsec;
+		if (nCmd == PACKET_CMD_REMOVE_DEVICE) {
+			return RECEIVE_RESULT_REMOVE; //------------------------------------
+		}
+		if (nCmd == PACKET_CMD_CHORD) {
+			// All the keys have the same time, all but the last are passed as
+			// PACKET_CMD_CHORD so that the callback can deliver them together
+			bool bContinue = true;
+			for (int32_t nChordKey = 0; nChordKey < nChordKeys; ++nChordKey) {
+				readV2ChordKey(p0Bytes, nBytesReceived, nChordPos, nKeyType, nHardwareKey);
+				oPacket.m_nCmd = ((nChordKey + 1 < nChordKeys) ? PACKET_CMD_CHORD : PACKET_CMD_KEY);
+				oPacket.m_nKeyType = static_cast<char>(nKeyType);
+				oPacket.m_nHardwareKey = nHardwareKey;
+				bContinue = oSlot(m_nBackendId, false, oPacket, nTimeUsec - nAgeUsec) && bContinue;
+			}
+			oPacket.m_nCmd = PACKET_CMD_KEY;
+			if (!bContinue) {
+				// listener requests to stop processing
+				return RECEIVE_RESULT_STOP; //----------------------------------
+			}
+		} else if (nCmd == PACKET_CMD_KEY) {
+			oPacket.m_nKeyType = static_cast<char>(nKeyType);
+			oPacket.m_nHardwareKey = nHardwareKey;
+			const bool bContinue = oSlot(m_nBackendId, false, oPacket, nTimeUsec - nAgeUsec);
+			if (!bContinue) {
+				// listener requests to stop processing
+				return RECEIVE_RESULT_STOP; //----------------------------------
+			}
+		}
+	}
+	return RECEIVE_RESULT_OK;
+}
+void BlueClientReceiver::updateV2Stats(uint32_t nSequence, uint32_t nLastCaptureUsec, int64_t nTimeUsec) noexcept
+{
+	BlueReceiveCounters::inc(m_refCounters->m_nV2Datagrams);
+	// The client might not have waited for the handshake answer
+	setProtocolVersion(std::max(m_nProtocolVersion, PACKET_PROTOCOL_VERSION_2));
+	if (m_nProtocolVersion >= PACKET_PROTOCOL_VERSION_3) {
+		m_bAckPending = true;
+	}
+	const uint32_t nOffsetUsec = static_cast<uint32_t>(nTimeUsec) - nLastCaptureUsec;
+	if (! m_bV2Started) {
+		m_bV2Started = true;
+		m_nV2NextSequence = nSequence + 1;
+		m_nV2MinOffsetUsec = nOffsetUsec;
+		BlueReceiveCounters::inc(m_refCounters->m_aDelayHistogram[0]);
+		return; //--------------------------------------------------------------
+	}
+	const int32_t nGap = static_cast<int32_t>(nSequence - m_nV2NextSequence);
+	if (nGap >= 0) {
+		BlueReceiveCounters::inc(m_refCounters->m_nLostDatagrams, nGap);
+		m_nV2NextSequence = nSequence + 1;
+	} else {
+		BlueReceiveCounters::inc(m_refCounters->m_nOutOfOrderDatagrams);
+	}
+	// Both clocks wrap around at 32 bits, only differences are meaningful
+	int32_t nDelayUsec = static_cast<int32_t>(nOffsetUsec - m_nV2MinOffsetUsec);
+	if (nDelayUsec < 0) {
+		// Faster than all the previous datagrams: the new reference
+		m_nV2MinOffsetUsec = nOffsetUsec;
+		nDelayUsec = 0;
+	}
+	BlueReceiveCounters::inc(m_refCounters->m_aDelayHistogram[getStatsBucket(nDelayUsec)]);
+}
+void BlueClientReceiver::setProtocolVersion(int32_t nVersion) noexcept
+{
+	if (nVersion == m_nProtocolVersion) {
+		return; //--------------------------------------------------------------
+	}
+	m_nProtocolVersion = nVersion;
+	m_refCounters->m_nProtocolVersion.store(nVersion, std::memory_order_relaxed);
+}
+void BlueClientReceiver::countDatagram(int32_t nBytesReceived, int64_t nTimeUsec) noexcept
+{
+	BlueReceiveCounters::inc(m_refCounters->m_nDatagrams);
+	BlueReceiveCounters::inc(m_refCounters->m_nBytes, nBytesReceived);
+	if (m_nLastDatagramUsec >= 0) {
+		BlueReceiveCounters::inc(m_refCounters->m_aGapHistogram[getStatsBucket(nTimeUsec - m_nLastDatagramUsec)]);
+	}
+	m_nLastDatagramUsec = nTimeUsec;
+}
+void BlueClientReceiver::replyHello(int32_t nVersion) noexcept
+{
+	if (nVersion < PACKET_PROTOCOL_VERSION_2) {
+		return; //--------------------------------------------------------------
+	}
+	const int32_t nAccepted = std::min(nVersion, PACKET_PROTOCOL_VERSION_3);
+	KeyPacket oPacket;
+	oPacket.m_nMagic1 = s_nMagic1;
+	oPacket.m_nMagic2 = s_nMagic2;
+	oPacket.m_nCmd = PACKET_CMD_NOOP;
+	oPacket.m_nKeyType = PACKET_HELLO_KEY_TYPE;
+	oPacket.m_nHardwareKey = htobl(nAccepted);
+	const auto nRes = ::send(m_nClientFD, &oPacket, sizeof(oPacket), MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (nRes < 0) {
+		// The client goes on sending v1 packets
+		return; //--------------------------------------------------------------
+	}
+	setProtocolVersion(nAccepted);
+}
+void BlueClientReceiver::sendAck() noexcept
+{
+	KeyPacketAck oAck;
+	oAck.m_nMagic1 = s_nMagic1;
+	oAck.m_nMagic2 = s_nMagic2Ack;
+	oAck.m_nCredit = htobs(static_cast<uint16_t>(m_nFlowCredit));
+	oAck.m_nNextSequence = htobl(m_nV2NextSequence);
+	const auto nRes = ::send(m_nClientFD, &oAck, sizeof(oAck), MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (nRes < 0) {
+		// The client reopens its window after a timeout
+		return; //--------------------------------------------------------------
+	}
+	m_bAckPending = false;
+	BlueReceiveCounters::inc(m_refCounters->m_nAcks);
+}
 
-	m_oClientPollFD.set_fd(m_nClientFD);
+////////////////////////////////////////////////////////////////////////////////
+BlueServerReceiveSource::BlueServerReceiveSource(int32_t nBackendId, int32_t nClientFD
+												, const BlueReceiveOptions& oOptions
+												, const std::shared_ptr<BlueReceiveCounters>& refCounters) noexcept
+: Glib::Source()
+, m_oReceiver(nBackendId, nClientFD, oOptions, refCounters)
+{
+	m_oClientPollFD.set_fd(nClientFD);
 	m_oClientPollFD.set_events(Glib::IO_IN | Glib::IO_HUP | Glib::IO_ERR | Glib::IO_NVAL);
 	Glib::Source::add_poll(m_oClientPollFD);
 
@@ -207,13 +668,10 @@ BlueServerReceiveSource::BlueServerReceiveSource(int32_t nBackendId, int32_t nCl
 }
 BlueServerReceiveSource::~BlueServerReceiveSource() noexcept
 {
-	if (m_nClientFD >= 0) {
-		::close(m_nClientFD);
-	}
 }
-sigc::connection BlueServerReceiveSource::connect(const sigc::slot<bool, int32_t, bool, const KeyPacket&>& oSlot) noexcept
+sigc::connection BlueServerReceiveSource::connect(const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oSlot) noexcept
 {
-	if (m_nClientFD < 0) {
+	if (m_oReceiver.getClientFD() < 0) {
 		// Error, return an empty connection
 		return sigc::connection();
 	}
@@ -236,18 +694,18 @@ bool BlueServerReceiveSource::check() noexcept
 
 	return bRet;
 }
-bool BlueServerReceiveSource::closeConnection(sigc::slot_base* p0Slot, bool bRemove, KeyPacket& oPkt, const std::string& sErr) noexcept
+bool BlueServerReceiveSource::closeConnection(sigc::slot_base* p0Slot, bool bRemove, const std::string& sErr) noexcept
 {
 	Glib::Source::destroy();
 	if (! sErr.empty()) {
 		std::cerr << sErr << '\n';
 	}
-	::close(m_nClientFD);
-	m_nClientFD = -1;
+	m_oReceiver.closeConnection();
 	bool bContinue = false;
 	if (p0Slot != nullptr) {
-		bContinue = (*static_cast<sigc::slot<bool, int32_t, bool, const KeyPacket&>*>(p0Slot))
-													(m_nBackendId, bRemove, oPkt);
+		const KeyPacket oPkt = BlueClientReceiver::getClosePacket(bRemove);
+		bContinue = (*static_cast<sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>*>(p0Slot))
+													(m_oReceiver.getBackendId(), bRemove, oPkt, DeviceManager::getNowTimeMicroseconds());
 		//assert(!bContinue);
 	}
 	return bContinue;
@@ -265,72 +723,248 @@ bool BlueServerReceiveSource::dispatch(sigc::slot_base* p0Slot) noexcept
 	const bool bSomeError = ((nIOFlags & (Glib::IO_HUP | Glib::IO_ERR | Glib::IO_NVAL)) != 0);
 	if (bSomeError) {
 //std::cout << "BlueServerReceiveSource::dispatch()  Error: Glib::IO_HUP | Glib::IO_ERR | Glib::IO_NVAL!!" << '\n';
-		KeyPacket oDummyPacket;
-		bContinue = closeConnection(p0Slot, false, oDummyPacket, "");
+		bContinue = closeConnection(p0Slot, false, "");
 		return bContinue; //----------------------------------------------------
 	}
 	if ((nIOFlags & Glib::IO_IN) == 0) {
 		return bContinue; //----------------------------------------------------
 	}
-	constexpr auto nPktSize = sizeof(KeyPacket);
-	static_assert(nPktSize == 8, "");
-	//
-	constexpr auto nToRead = static_cast<size_t>(L2CAP_DEFAULT_MTU / nPktSize) - 1;
-	assert(nToRead > 0);
+	std::string sError;
+	const auto eResult = m_oReceiver.receive(*static_cast<sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>*>(p0Slot), sError);
+	switch (eResult) {
+	case BlueClientReceiver::RECEIVE_RESULT_OK:
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_STOP:
+		bContinue = closeConnection(nullptr, false, "");
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_CLOSE:
+		bContinue = closeConnection(p0Slot, false, sError);
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_REMOVE:
+		bContinue = closeConnection(p0Slot, true, "");
+		break;
+	}
+	return bContinue;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The epoll tag of the listener, client tags are (nSerial << 32) | nBackendId
+static constexpr uint64_t s_nEpollListenerTag = std::numeric_limits<uint64_t>::max();
+static constexpr int32_t s_nEpollMaxReadyEvents = 32;
+
+BlueServerEpollSource::BlueServerEpollSource(const std::shared_ptr<ServerTransport>& refTransport
+											, const BlueReceiveOptions& oOptions) noexcept
+: Glib::Source()
+, m_refTransport(refTransport)
+, m_nListenerFD(-1)
+, m_nEpollFD(-1)
+, m_oOptions(oOptions)
+, m_nSerialCounter(0)
+, m_aReadyEvents(s_nEpollMaxReadyEvents)
+{
+	assert(m_oOptions.m_nBatchSize > 0);
+	assert(m_oOptions.m_nMaxPerDispatch > 0);
+	m_nEpollFD = ::epoll_create1(EPOLL_CLOEXEC);
+	if (m_nEpollFD < 0) {
+		m_sErrorStr = "BlueServerEpollSource(): epoll_create1 failed: " + std::string(strerror(errno));
+		return; //--------------------------------------------------------------
+	}
+	assert(m_refTransport);
+	m_nListenerFD = m_refTransport->createListener("BlueServerEpollSource()", m_sErrorStr);
+	if (m_nListenerFD < 0) {
+		::close(m_nEpollFD);
+		m_nEpollFD = -1;
+		return; //--------------------------------------------------------------
+	}
+	struct ::epoll_event oEvent;
+	memset(&oEvent, 0, sizeof(oEvent));
+	oEvent.events = EPOLLIN;
+	oEvent.data.u64 = s_nEpollListenerTag;
+	if (::epoll_ctl(m_nEpollFD, EPOLL_CTL_ADD, m_nListenerFD, &oEvent) < 0) {
+		m_sErrorStr = "BlueServerEpollSource(): epoll_ctl failed: " + std::string(strerror(errno));
+		::close(m_nListenerFD);
+		m_nListenerFD = -1;
+		::close(m_nEpollFD);
+		m_nEpollFD = -1;
+		return; //--------------------------------------------------------------
+	}
 
-	KeyPacket aPackets[nToRead] __attribute__ ((aligned(__alignof__(KeyPacket))));
+	m_oEpollPollFD.set_fd(m_nEpollFD);
+	m_oEpollPollFD.set_events(Glib::IO_IN);
+	Glib::Source::add_poll(m_oEpollPollFD);
 
-	auto nBytesReceived = ::recv(m_nClientFD, &(aPackets[0]), nToRead * nPktSize, 0);
-	if (nBytesReceived < 0) {
-		KeyPacket oDummyPacket;
-		bContinue = closeConnection(p0Slot, false, oDummyPacket
-									, std::string("BlueServerReceiveSource::dispatch error: recv failed!\n  ") + strerror(errno));
+	set_priority(Glib::PRIORITY_DEFAULT);
+	set_can_recurse(false);
+}
+BlueServerEpollSource::~BlueServerEpollSource() noexcept
+{
+	m_aReceivers.clear();
+	if (m_nListenerFD >= 0) {
+		::close(m_nListenerFD);
+	}
+	if (m_nEpollFD >= 0) {
+		::close(m_nEpollFD);
+	}
+}
+sigc::connection BlueServerEpollSource::connect(const sigc::slot<bool, int32_t, const bdaddr_t&>& oAcceptSlot
+												, const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oReceiveSlot) noexcept
+{
+	if (m_nEpollFD == -1) {
+		// Error, return an empty connection
+		return sigc::connection();
+	}
+	m_oAcceptSlot = oAcceptSlot;
+	return connect_generic(oReceiveSlot);
+}
+bool BlueServerEpollSource::addClient(int32_t nBackendId, int32_t nClientFD
+										, const std::shared_ptr<BlueReceiveCounters>& refCounters) noexcept
+{
+	assert(nBackendId >= 0);
+	assert(nClientFD >= 0);
+	const int32_t nIdx = SlotMapBase::getIndex(nBackendId);
+	if (nIdx >= static_cast<int32_t>(m_aReceivers.size())) {
+		m_aReceivers.resize(nIdx + 1);
+		m_aReceiverSerials.resize(nIdx + 1, 0);
+	}
+	removeClient(nBackendId);
+	++m_nSerialCounter;
+	struct ::epoll_event oEvent;
+	memset(&oEvent, 0, sizeof(oEvent));
+	oEvent.events = EPOLLIN;
+	oEvent.data.u64 = (static_cast<uint64_t>(m_nSerialCounter) << 32) | static_cast<uint32_t>(nBackendId);
+	if (::epoll_ctl(m_nEpollFD, EPOLL_CTL_ADD, nClientFD, &oEvent) < 0) {
+		std::cerr << "BlueServerEpollSource::addClient error: epoll_ctl failed: " << strerror(errno) << '\n';
+		::close(nClientFD);
+		return false; //--------------------------------------------------------
+	}
+	m_aReceivers[nIdx] = std::make_unique<BlueClientReceiver>(nBackendId, nClientFD, m_oOptions, refCounters);
+	m_aReceiverSerials[nIdx] = m_nSerialCounter;
+	return true;
+}
+void BlueServerEpollSource::removeClient(int32_t nBackendId) noexcept
+{
+	auto& refReceiver = m_aReceivers[SlotMapBase::getIndex(nBackendId)];
+	if (! refReceiver) {
+		return; //--------------------------------------------------------------
+	}
+	::epoll_ctl(m_nEpollFD, EPOLL_CTL_DEL, refReceiver->getClientFD(), nullptr);
+	refReceiver.reset();
+}
+
+bool BlueServerEpollSource::prepare(int& nTimeout) noexcept
+{
+	nTimeout = -1;
+
+	return false;
+}
+bool BlueServerEpollSource::check() noexcept
+{
+	return ((m_oEpollPollFD.get_revents() & Glib::IO_IN) != 0);
+}
+bool BlueServerEpollSource::dispatch(sigc::slot_base* p0Slot) noexcept
+{
+	const bool bContinue = true;
+
+	if (p0Slot == nullptr) {
 		return bContinue; //----------------------------------------------------
 	}
-//std::cout << "BlueServerReceiveSource::dispatch() nBytesReceived=" << nBytesReceived << '\n';
-	int32_t nPacket = 0;
-	int32_t nBufPos = 0;
-	// process full packets
-	while (nBufPos + static_cast<int32_t>(nPktSize) <= nBytesReceived) {
-		auto& oPacket = aPackets[nPacket];
-		oPacket.m_nHardwareKey = btohl(oPacket.m_nHardwareKey);
-		if ((oPacket.m_nMagic1 != s_nMagic1) || (oPacket.m_nMagic2 != s_nMagic2)) {
-			bContinue = closeConnection(p0Slot, false, oPacket, "BlueServerReceiveSource::dispatch error: magic numbers check failed!");
-			return bContinue; //------------------------------------------------
+	const int32_t nReady = ::epoll_wait(m_nEpollFD, &(m_aReadyEvents[0]), s_nEpollMaxReadyEvents, 0);
+	if (nReady < 0) {
+		if (errno != EINTR) {
+			std::cerr << "BlueServerEpollSource::dispatch error: epoll_wait failed: " << strerror(errno) << '\n';
 		}
-		if (oPacket.m_nCmd == PACKET_CMD_REMOVE_DEVICE) {
-//std::cout << "BlueServerReceiveSource::dispatch()  PACKET_CMD_REMOVE_DEVICE" << '\n';
-			bContinue = closeConnection(p0Slot, true, oPacket, "");
-			return bContinue; //------------------------------------------------
+		return bContinue; //----------------------------------------------------
+	}
+	// Sockets that didn't get their turn because more than s_nEpollMaxReadyEvents
+	// were ready are still ready (level triggered) at the next iteration
+	for (int32_t nIdx = 0; nIdx < nReady; ++nIdx) {
+		const auto& oEvent = m_aReadyEvents[nIdx];
+		const uint64_t nTag = oEvent.data.u64;
+		if (nTag == s_nEpollListenerTag) {
+			acceptClient(oEvent.events);
+			continue; // for ------------
 		}
-		//if (oPacket.m_nCmd == PACKET_CMD_DISCONNECT_DEVICE) {
-		//	bContinue = closeConnection(p0Slot, false, oPacket, "");
-		//	return bContinue; //------------------------------------------------
-		//}
-		if (oPacket.m_nCmd != PACKET_CMD_NOOP) {
-			if (oPacket.m_nCmd != PACKET_CMD_KEY) {
-				bContinue = closeConnection(p0Slot, false, oPacket, "BlueServerReceiveSource::dispatch error: bad cmd field!");
-				return bContinue; //--------------------------------------------
-
-			}
-			bContinue = (*static_cast<sigc::slot<bool, int32_t, bool, const KeyPacket&>*>(p0Slot))
-														(m_nBackendId, false, oPacket);
-			if (!bContinue) {
-				// listener requests to stop processing
-				bContinue = closeConnection(nullptr, false, oPacket, "");
-				return bContinue; //--------------------------------------------
+		const int32_t nBackendId = static_cast<int32_t>(nTag & 0xFFFFFFFFu);
+		const uint32_t nSerial = static_cast<uint32_t>(nTag >> 32);
+		const int32_t nRecvIdx = SlotMapBase::getIndex(nBackendId);
+		if ((nRecvIdx >= static_cast<int32_t>(m_aReceivers.size())) || (! m_aReceivers[nRecvIdx])
+				|| (m_aReceiverSerials[nRecvIdx] != nSerial)) {
+			// connection was closed or replaced while handling a previous event
+			continue; // for ------------
+		}
+		receiveClient(p0Slot, nBackendId, oEvent.events);
+	}
+	return bContinue;
+}
+void BlueServerEpollSource::acceptClient(uint32_t nEvents) noexcept
+{
+	if ((nEvents & (EPOLLHUP | EPOLLERR)) != 0) {
+		std::cerr << "BlueServerEpollSource::dispatch: accept failed:";
+		if ((nEvents & EPOLLHUP) != 0) {
+			std::cerr << " EPOLLHUP";
+		}
+		if ((nEvents & EPOLLERR) != 0) {
+			std::cerr << " EPOLLERR";
+		}
+		std::cerr << '\n';
+		return; //--------------------------------------------------------------
+	}
+	// accept all pending connections (at most a backlog's worth)
+	const int32_t nMaxAccepts = m_refTransport->getListenBacklog();
+	for (int32_t nAccept = 0; nAccept < nMaxAccepts; ++nAccept) {
+		bdaddr_t oRemoteAddr;
+		const int32_t nFdClient = m_refTransport->acceptClient(m_nListenerFD, oRemoteAddr);
+		if (nFdClient < 0) {
+			if (! ServerTransport::isNoPendingClient(errno)) {
+				std::cerr <<  "BlueServerEpollSource::dispatch: accept failed: " << strerror(errno) << '\n';
 			}
+			return; //----------------------------------------------------------
+		}
+		const bool bGoOnListening = m_oAcceptSlot(nFdClient, oRemoteAddr);
+		if (! bGoOnListening) {
+			::epoll_ctl(m_nEpollFD, EPOLL_CTL_DEL, m_nListenerFD, nullptr);
+			::close(m_nListenerFD);
+			m_nListenerFD = -1;
+			return; //----------------------------------------------------------
 		}
-		//
-		++nPacket;
-		nBufPos += sizeof(KeyPacket);
 	}
-	if (nBufPos < nBytesReceived) {
-		KeyPacket oDummyPacket;
-		bContinue = closeConnection(p0Slot, false, oDummyPacket, "BlueServerReceiveSource::dispatch error: pkt < 8 bytes!");
-		return bContinue; //----------------------------------------------------
+}
+void BlueServerEpollSource::receiveClient(sigc::slot_base* p0Slot, int32_t nBackendId, uint32_t nEvents) noexcept
+{
+	if ((nEvents & (EPOLLHUP | EPOLLERR)) != 0) {
+		closeClient(p0Slot, nBackendId, false, "");
+		return; //--------------------------------------------------------------
+	}
+	if ((nEvents & EPOLLIN) == 0) {
+		return; //--------------------------------------------------------------
+	}
+	std::string sError;
+	const auto eResult = m_aReceivers[SlotMapBase::getIndex(nBackendId)]->receive(*static_cast<sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>*>(p0Slot), sError);
+	switch (eResult) {
+	case BlueClientReceiver::RECEIVE_RESULT_OK:
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_STOP:
+		closeClient(nullptr, nBackendId, false, "");
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_CLOSE:
+		closeClient(p0Slot, nBackendId, false, sError);
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_REMOVE:
+		closeClient(p0Slot, nBackendId, true, "");
+		break;
+	}
+}
+void BlueServerEpollSource::closeClient(sigc::slot_base* p0Slot, int32_t nBackendId, bool bRemove, const std::string& sErr) noexcept
+{
+	if (! sErr.empty()) {
+		std::cerr << sErr << '\n';
+	}
+	removeClient(nBackendId);
+	if (p0Slot != nullptr) {
+		const KeyPacket oPkt = BlueClientReceiver::getClosePacket(bRemove);
+		(*static_cast<sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>*>(p0Slot))
+													(nBackendId, bRemove, oPkt, DeviceManager::getNowTimeMicroseconds());
 	}
-	return bContinue;
 }
 
 } // namespace Bt
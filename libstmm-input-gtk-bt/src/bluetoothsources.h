@@ -21,16 +21,26 @@
 #ifndef STMI_BLUETOOTH_SOURCES_H
 #define STMI_BLUETOOTH_SOURCES_H
 
+#include "bluetransport.h"
+#include "btstats.h"
+#include "keypacket.h"
+#include "packetcapture.h"
+#include "slotmap.h"
 
 #include <glibmm.h>
 
+#include <memory>
 #include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <sys/epoll.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 
-namespace stmi { namespace Private { namespace Bt { struct KeyPacket; } } }
-
 namespace stmi
 {
 
@@ -45,23 +55,26 @@ namespace Bt
 class BlueServerAcceptSource : public Glib::Source
 {
 public:
-	explicit BlueServerAcceptSource(int32_t nL2capPort) noexcept;
+	/** Constructor.
+	 * @param refTransport The transport. Cannot be null.
+	 */
+	explicit BlueServerAcceptSource(const std::shared_ptr<ServerTransport>& refTransport) noexcept;
 	virtual ~BlueServerAcceptSource() noexcept;
 
 	/** Set source's callback function.
 	 * The callback has the following signature:
 	 *
-	 *     bRet = oCallback(nIOFlags, nClientFD, oRemoteAddr);
+	 *     bRet = oCallback(nClientFD, oRemoteAddr);
 	 *
 	 * nClientFD: The connection file descriptor to the new client.
-	 * oRemoteAddr: The bluetooth remote address of the client.
+	 * oRemoteAddr: The address identifying the client (see ServerTransport::acceptClient()).
 	 * bRet: whether the source should go on listening.
 	 *
 	 * Note that the file descriptor owner is transferred to the callback.
 	 * @param slot The slot.
 	 * @return The connection. Is empty if not connected.
 	 */
-	sigc::connection connect(const sigc::slot<bool, int32_t, const struct ::sockaddr_l2&>& oSlot) noexcept;
+	sigc::connection connect(const sigc::slot<bool, int32_t, const bdaddr_t&>& oSlot) noexcept;
 
 	/** The error string.
 	 * @return The error string or empty if server running.
@@ -76,7 +89,7 @@ protected:
 	bool dispatch(sigc::slot_base* oSlot) noexcept override;
 private:
 	//
-	int32_t m_nL2capPort;
+	std::shared_ptr<ServerTransport> m_refTransport;
 	int32_t m_nListenerFD;
 	std::string m_sErrorStr;
 	//
@@ -88,23 +101,177 @@ private:
 };
 
 ////////////////////////////////////////////////////////////////////////////////
+/** The options of the receivers.
+ */
+struct BlueReceiveOptions
+{
+	/** The maximum number of datagrams read with one `recvmmsg` call. If 1 `recvmsg` is used. Must be positive. */
+	int32_t m_nBatchSize = 16;
+	/** The maximum number of datagrams handled per receive() call. Must be positive. */
+	int32_t m_nMaxPerDispatch = 64;
+	/** Whether to stamp the packets with the time the kernel received them (SO_TIMESTAMPNS)
+	 * rather than the time they are read from the socket. */
+	bool m_bKernelTimestamps = true;
+	/** The size of the receive buffer of each datagram in bytes. Longer datagrams are
+	 * truncated and close the connection. Should be at least the L2CAP incoming MTU. */
+	int32_t m_nMaxDatagramSize = L2CAP_DEFAULT_MTU;
+	/** The credit granted to protocol v3 clients: the number of datagrams they can send
+	 * without waiting for an acknowledgement. Must be positive. */
+	int32_t m_nFlowCredit = PACKET_V3_DEFAULT_CREDIT;
+	/** If not null and open the received datagrams are written to it before being processed.
+	 * Must only be shared by receivers running in the same thread. */
+	std::shared_ptr<PacketCaptureWriter> m_refCapture;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Receives the key packets of a connected client.
+ * All the datagrams queued in the socket are handled in one call, up to
+ * a maximum, so that a busy client doesn't cost a main loop iteration per datagram
+ * and at the same time can't starve the other clients.
+ */
+class BlueClientReceiver
+{
+public:
+	/** Constructor.
+	 * @param nBackendId The id passed to the callback.
+	 * @param nClientFD The connection file descriptor. Ownership is transferred to the receiver.
+	 * @param oOptions The options.
+	 * @param refCounters The counters updated by the receiver. Cannot be null.
+	 */
+	BlueClientReceiver(int32_t nBackendId, int32_t nClientFD, const BlueReceiveOptions& oOptions
+						, const std::shared_ptr<BlueReceiveCounters>& refCounters) noexcept;
+	~BlueClientReceiver() noexcept;
+
+	enum RECEIVE_RESULT
+	{
+		RECEIVE_RESULT_OK = 0, /**< The connection is still open. */
+		RECEIVE_RESULT_STOP = 1, /**< The callback requested to stop processing. */
+		RECEIVE_RESULT_CLOSE = 2, /**< The connection was lost or the client sent garbage. */
+		RECEIVE_RESULT_REMOVE = 3, /**< The client requested to be removed. */
+	};
+	/** Receives the queued datagrams and passes the key packets to the callback.
+	 * The callback has the signature of BlueServerReceiveSource::connect() and
+	 * is only called for PACKET_CMD_KEY and PACKET_CMD_CHORD packets.
+	 * The keys of a chord are passed in sequence without interruption, all but
+	 * the last with command PACKET_CMD_CHORD. The callback can't stop the
+	 * processing in the middle of a chord.
+	 * If the result is not RECEIVE_RESULT_OK the caller should close the connection.
+	 * @param oSlot The callback.
+	 * @param sError Set to the error description if the result is RECEIVE_RESULT_CLOSE. Can be empty.
+	 * @return The result.
+	 */
+	RECEIVE_RESULT receive(const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oSlot, std::string& sError) noexcept;
+	/** Closes the file descriptor.
+	 */
+	void closeConnection() noexcept;
+
+	inline int32_t getBackendId() const noexcept { return m_nBackendId; }
+	/** Sets the id the datagrams are recorded with in the capture.
+	 * By default it's the backend id.
+	 * @param nCaptureId The id. Must not be negative.
+	 */
+	void setCaptureId(int32_t nCaptureId) noexcept;
+	inline int32_t getClientFD() const noexcept { return m_nClientFD; }
+	/** The packet passed to the callback when the connection is closed.
+	 * @param bRemove Whether the client requested to be removed.
+	 * @return The packet with command PACKET_CMD_REMOVE_DEVICE if bRemove, PACKET_CMD_NOOP otherwise.
+	 */
+	static KeyPacket getClosePacket(bool bRemove) noexcept;
+
+private:
+	RECEIVE_RESULT processDatagram(const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oSlot
+									, KeyPacket* p0Packets, int32_t nBytesReceived, int64_t nTimeUsec
+									, std::string& sError) noexcept;
+	RECEIVE_RESULT processDatagramV2(const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oSlot
+									, const uint8_t* p0Bytes, int32_t nBytesReceived, int64_t nTimeUsec
+									, std::string& sError) noexcept;
+	// Answers the handshake of a client supporting nVersion
+	void replyHello(int32_t nVersion) noexcept;
+	// Acknowledges the v2 datagrams received so far (v3)
+	void sendAck() noexcept;
+	void updateV2Stats(uint32_t nSequence, uint32_t nLastCaptureUsec, int64_t nTimeUsec) noexcept;
+	void setProtocolVersion(int32_t nVersion) noexcept;
+	void countDatagram(int32_t nBytesReceived, int64_t nTimeUsec) noexcept;
+	// Sets m_aReceivedTimes from the control messages of the received datagrams
+	void calcReceivedTimes(int32_t nReceived) noexcept;
+	// Returns the number of datagrams received, 0 if none is queued or -1 if error
+	int32_t receiveDatagrams(int32_t nMaxDatagrams) noexcept;
+private:
+	const int32_t m_nBackendId;
+	int32_t m_nCaptureId; // The id written to m_refCapture
+	int32_t m_nClientFD;
+	const int32_t m_nBatchSize;
+	const int32_t m_nMaxPerDispatch;
+	const int32_t m_nMaxPacketsPerDatagram;
+	bool m_bKernelTimestamps;
+	// Preallocated receive buffers, datagram i is at m_aPackets[i * m_nMaxPacketsPerDatagram]
+	std::vector<KeyPacket> m_aPackets; // Size: m_nBatchSize * m_nMaxPacketsPerDatagram
+	std::vector<struct ::iovec> m_aIOVecs; // Size: m_nBatchSize
+	std::vector<struct ::mmsghdr> m_aMsgHdrs; // Size: m_nBatchSize
+	union ControlBuffer
+	{
+		struct ::cmsghdr m_oAlign;
+		char m_aBuf[CMSG_SPACE(sizeof(struct ::timespec))];
+	};
+	std::vector<ControlBuffer> m_aControlBuffers; // Size: m_nBatchSize
+	// The byte sizes of the received datagrams
+	std::vector<int32_t> m_aReceivedBytes; // Size: m_nBatchSize
+	// The times (DeviceManager::getNowTimeMicroseconds() clock) the datagrams were received
+	std::vector<int64_t> m_aReceivedTimes; // Size: m_nBatchSize
+	//
+	int32_t m_nProtocolVersion; // The protocol version negotiated with the client
+	bool m_bV2Started; // Whether a v2 datagram was received
+	uint32_t m_nV2NextSequence; // The expected sequence number of the next v2 datagram
+	uint32_t m_nV2MinOffsetUsec; // The minimum difference between receive and capture time
+	const int32_t m_nFlowCredit;
+	bool m_bAckPending; // Whether v2 datagrams were received since the last acknowledgement (v3)
+	//
+	const std::shared_ptr<BlueReceiveCounters> m_refCounters;
+	const std::shared_ptr<PacketCaptureWriter> m_refCapture;
+	int64_t m_nLastDatagramUsec; // The receive time of the previous datagram, -1 if none
+private:
+	BlueClientReceiver(const BlueClientReceiver& oSource) = delete;
+	BlueClientReceiver& operator=(const BlueClientReceiver& oSource) = delete;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** A source for each connected client.
+ */
 class BlueServerReceiveSource : public Glib::Source
 {
 public:
-	BlueServerReceiveSource(int32_t nBackendId, int32_t nClientFD) noexcept;
+	/** Constructor.
+	 * @see BlueClientReceiver::BlueClientReceiver()
+	 */
+	BlueServerReceiveSource(int32_t nBackendId, int32_t nClientFD, const BlueReceiveOptions& oOptions
+							, const std::shared_ptr<BlueReceiveCounters>& refCounters) noexcept;
 	virtual ~BlueServerReceiveSource() noexcept;
 
-	// int32_t nBackendId, KeyPacket oPkt
-	sigc::connection connect(const sigc::slot<bool, int32_t, bool, const KeyPacket&>& oSlot) noexcept;
+	/** Set source's callback function.
+	 * The callback has the following signature:
+	 *
+	 *     bRet = oCallback(nBackendId, bRemove, oPkt, nTimeUsec);
+	 *
+	 * nBackendId: The id passed to the constructor.
+	 * bRemove: Whether the client requested to be removed. Only true if oPkt.m_nCmd is PACKET_CMD_REMOVE_DEVICE.
+	 * oPkt: The key packet. If oPkt.m_nCmd is PACKET_CMD_CHORD the key is part of a chord
+	 *       and more keys with the same time follow, the last with PACKET_CMD_KEY.
+	 *       If oPkt.m_nCmd is neither the connection was closed.
+	 * nTimeUsec: The time the packet was received in DeviceManager::getNowTimeMicroseconds() clock.
+	 * bRet: whether the source should go on receiving.
+	 *
+	 * @param slot The slot.
+	 * @return The connection. Is empty if not connected.
+	 */
+	sigc::connection connect(const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oSlot) noexcept;
 protected:
 	bool prepare(int& nTimeout) noexcept override;
 	bool check() noexcept override;
 	bool dispatch(sigc::slot_base* oSlot) noexcept override;
 private:
-	bool closeConnection(sigc::slot_base* p0Slot, bool bRemove, KeyPacket& oPkt, const std::string& sErr) noexcept;
+	bool closeConnection(sigc::slot_base* p0Slot, bool bRemove, const std::string& sErr) noexcept;
 private:
-	int32_t m_nBackendId;
-	int32_t m_nClientFD;
+	BlueClientReceiver m_oReceiver;
 
 	Glib::PollFD m_oClientPollFD;
 private:
@@ -112,6 +279,79 @@ private:
 	BlueServerReceiveSource& operator=(const BlueServerReceiveSource& oSource) = delete;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+/** Server accepting and receiving from all the clients with a single source.
+ * The listener and client sockets are multiplexed with an epoll file descriptor,
+ * which is the only file descriptor polled by the main loop. The cost of a main
+ * loop iteration therefore doesn't depend on the number of (idle) connections.
+ */
+class BlueServerEpollSource : public Glib::Source
+{
+public:
+	/** Constructor.
+	 * @param refTransport The transport. Cannot be null.
+	 * @param oOptions The options of the client receivers.
+	 */
+	BlueServerEpollSource(const std::shared_ptr<ServerTransport>& refTransport, const BlueReceiveOptions& oOptions) noexcept;
+	virtual ~BlueServerEpollSource() noexcept;
+
+	/** Set source's callback functions.
+	 * The accept callback should call addClient() for the connections it wants to keep.
+	 * @param oAcceptSlot The accept callback. See BlueServerAcceptSource::connect().
+	 * @param oReceiveSlot The receive callback. See BlueServerReceiveSource::connect().
+	 * @return The connection. Is empty if not connected.
+	 */
+	sigc::connection connect(const sigc::slot<bool, int32_t, const bdaddr_t&>& oAcceptSlot
+							, const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oReceiveSlot) noexcept;
+	/** Adds a client connection.
+	 * If a connection with the same id slot index already exists it is closed without calling the receive callback.
+	 * @param nBackendId The id passed to the receive callback. A SlotMap id.
+	 * @param nClientFD The connection file descriptor. Ownership is transferred to the source.
+	 * @param refCounters The counters updated by the client's receiver. Cannot be null.
+	 * @return Whether the client could be added. If false the file descriptor was closed.
+	 */
+	bool addClient(int32_t nBackendId, int32_t nClientFD, const std::shared_ptr<BlueReceiveCounters>& refCounters) noexcept;
+
+	/** The error string.
+	 * @return The error string or empty if server running.
+	 */
+	const std::string& getErrorStr() const noexcept
+	{
+		return m_sErrorStr;
+	}
+protected:
+	bool prepare(int& nTimeout) noexcept override;
+	bool check() noexcept override;
+	bool dispatch(sigc::slot_base* oSlot) noexcept override;
+private:
+	void acceptClient(uint32_t nEvents) noexcept;
+	void receiveClient(sigc::slot_base* p0Slot, int32_t nBackendId, uint32_t nEvents) noexcept;
+	void closeClient(sigc::slot_base* p0Slot, int32_t nBackendId, bool bRemove, const std::string& sErr) noexcept;
+	void removeClient(int32_t nBackendId) noexcept;
+private:
+	std::shared_ptr<ServerTransport> m_refTransport;
+	int32_t m_nListenerFD;
+	int32_t m_nEpollFD;
+	const BlueReceiveOptions m_oOptions;
+	std::string m_sErrorStr;
+	//
+	sigc::slot<bool, int32_t, const bdaddr_t&> m_oAcceptSlot;
+	//
+	std::vector< std::unique_ptr<BlueClientReceiver> > m_aReceivers; // Index: SlotMapBase::getIndex(nBackendId), Value: can be null
+	// Incremented for each added client, used to discard events of closed connections
+	// with the same id within a dispatch
+	std::vector< uint32_t > m_aReceiverSerials; // Size: m_aReceivers.size()
+	uint32_t m_nSerialCounter;
+	//
+	std::vector<struct ::epoll_event> m_aReadyEvents;
+	//
+	Glib::PollFD m_oEpollPollFD;
+	//
+private:
+	BlueServerEpollSource(const BlueServerEpollSource& oSource) = delete;
+	BlueServerEpollSource& operator=(const BlueServerEpollSource& oSource) = delete;
+};
+
 } // namespace Bt
 } // namespace Private
 
@@ -0,0 +1,490 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   bluetooththreadsource.cc
+ */
+
+#include "bluetooththreadsource.h"
+
+#include <stmm-input/devicemanager.h>
+
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <cassert>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <bluetooth/l2cap.h>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+// The epoll tags of the listener and the stop eventfd, client tags are the connection serials
+static constexpr uint64_t s_nThreadListenerTag = std::numeric_limits<uint64_t>::max();
+static constexpr uint64_t s_nThreadStopTag = std::numeric_limits<uint64_t>::max() - 1;
+static constexpr uint64_t s_nThreadRefusedTag = std::numeric_limits<uint64_t>::max() - 2;
+static constexpr int32_t s_nThreadMaxReadyEvents = 32;
+// How long the receiver thread waits for the main thread to make room in the full ring
+static constexpr int32_t s_nThreadRingFullWaitMicrosec = 500;
+
+void BlueThreadConnections::add(uint32_t nSerial, int32_t nBackendId) noexcept
+{
+	assert(nBackendId >= 0);
+	assert(m_oBackendIds.find(nSerial) == m_oBackendIds.end());
+	auto itFind = m_oSerials.find(nBackendId);
+	if (itFind != m_oSerials.end()) {
+		// superseded
+		m_oBackendIds.erase(itFind->second);
+		itFind->second = nSerial;
+	} else {
+		m_oSerials.emplace(nBackendId, nSerial);
+	}
+	m_oBackendIds.emplace(nSerial, nBackendId);
+}
+int32_t BlueThreadConnections::getBackendId(uint32_t nSerial) const noexcept
+{
+	auto itFind = m_oBackendIds.find(nSerial);
+	if (itFind == m_oBackendIds.end()) {
+		return -1; //-----------------------------------------------------------
+	}
+	return itFind->second;
+}
+int32_t BlueThreadConnections::remove(uint32_t nSerial) noexcept
+{
+	auto itFind = m_oBackendIds.find(nSerial);
+	if (itFind == m_oBackendIds.end()) {
+		return -1; //-----------------------------------------------------------
+	}
+	const int32_t nBackendId = itFind->second;
+	m_oBackendIds.erase(itFind);
+	m_oSerials.erase(nBackendId);
+	return nBackendId;
+}
+void BlueThreadConnections::clear() noexcept
+{
+	m_oBackendIds.clear();
+	m_oSerials.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlueServerThreadSource::BlueServerThreadSource(const std::shared_ptr<ServerTransport>& refTransport
+												, const BlueReceiveOptions& oOptions, int32_t nRingSize) noexcept
+: Glib::Source()
+, m_nWakeUpFD(-1)
+, m_oRing(nRingSize)
+, m_oRefusedSerials(nRingSize)
+, m_nRefusedFD(-1)
+, m_nStopFD(-1)
+, m_bStopRequested(false)
+, m_refTransport(refTransport)
+, m_nListenerFD(-1)
+, m_nEpollFD(-1)
+, m_oOptions(oOptions)
+, m_nSerialCounter(0)
+, m_bWakeUpPending(false)
+{
+	assert(m_refTransport);
+	assert(m_oOptions.m_nBatchSize > 0);
+	assert(m_oOptions.m_nMaxPerDispatch > 0);
+	m_nWakeUpFD = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	m_nStopFD = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	m_nRefusedFD = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((m_nWakeUpFD < 0) || (m_nStopFD < 0) || (m_nRefusedFD < 0)) {
+		m_sErrorStr = "BlueServerThreadSource(): eventfd failed: " + std::string(strerror(errno));
+		closeFDs();
+		return; //--------------------------------------------------------------
+	}
+	m_nEpollFD = ::epoll_create1(EPOLL_CLOEXEC);
+	if (m_nEpollFD < 0) {
+		m_sErrorStr = "BlueServerThreadSource(): epoll_create1 failed: " + std::string(strerror(errno));
+		closeFDs();
+		return; //--------------------------------------------------------------
+	}
+	m_nListenerFD = m_refTransport->createListener("BlueServerThreadSource()", m_sErrorStr);
+	if (m_nListenerFD < 0) {
+		closeFDs();
+		return; //--------------------------------------------------------------
+	}
+	struct ::epoll_event oEvent;
+	memset(&oEvent, 0, sizeof(oEvent));
+	oEvent.events = EPOLLIN;
+	oEvent.data.u64 = s_nThreadListenerTag;
+	auto nRes = ::epoll_ctl(m_nEpollFD, EPOLL_CTL_ADD, m_nListenerFD, &oEvent);
+	if (nRes == 0) {
+		oEvent.data.u64 = s_nThreadStopTag;
+		nRes = ::epoll_ctl(m_nEpollFD, EPOLL_CTL_ADD, m_nStopFD, &oEvent);
+	}
+	if (nRes == 0) {
+		oEvent.data.u64 = s_nThreadRefusedTag;
+		nRes = ::epoll_ctl(m_nEpollFD, EPOLL_CTL_ADD, m_nRefusedFD, &oEvent);
+	}
+	if (nRes < 0) {
+		m_sErrorStr = "BlueServerThreadSource(): epoll_ctl failed: " + std::string(strerror(errno));
+		closeFDs();
+		return; //--------------------------------------------------------------
+	}
+	m_oThreadKeySlot = [this](int32_t nSerial, bool /*bRemove*/, const KeyPacket& oPkt, int64_t nTimeUsec) -> bool
+	{
+		ThreadMsg oMsg;
+		oMsg.m_eType = MSG_TYPE_KEY;
+		oMsg.m_nSerial = static_cast<uint32_t>(nSerial);
+		oMsg.m_bRemove = false;
+		oMsg.m_oPacket = oPkt;
+		oMsg.m_nTimeUsec = nTimeUsec;
+		return threadPush(oMsg);
+	};
+
+	m_oWakeUpPollFD.set_fd(m_nWakeUpFD);
+	m_oWakeUpPollFD.set_events(Glib::IO_IN);
+	Glib::Source::add_poll(m_oWakeUpPollFD);
+
+	set_priority(Glib::PRIORITY_DEFAULT);
+	set_can_recurse(false);
+}
+BlueServerThreadSource::~BlueServerThreadSource() noexcept
+{
+	stop();
+	closeFDs();
+}
+void BlueServerThreadSource::closeFDs() noexcept
+{
+	for (int32_t* p0FD : {&m_nListenerFD, &m_nEpollFD, &m_nStopFD, &m_nRefusedFD, &m_nWakeUpFD}) {
+		if (*p0FD >= 0) {
+			::close(*p0FD);
+			*p0FD = -1;
+		}
+	}
+}
+sigc::connection BlueServerThreadSource::connect(const sigc::slot<int32_t, const bdaddr_t&, int32_t, const std::shared_ptr<BlueReceiveCounters>&>& oConnectSlot
+												, const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oReceiveSlot) noexcept
+{
+	if (m_nEpollFD == -1) {
+		// Error, return an empty connection
+		return sigc::connection();
+	}
+	assert(! m_oThread.joinable());
+	m_oConnectSlot = oConnectSlot;
+	auto oConnection = connect_generic(oReceiveSlot);
+	try {
+		m_oThread = std::thread(&BlueServerThreadSource::threadRun, this);
+	} catch (const std::system_error& oErr) {
+		m_sErrorStr = std::string("BlueServerThreadSource::connect: thread creation failed: ") + oErr.what();
+		oConnection.disconnect();
+		return sigc::connection(); //-------------------------------------------
+	}
+	return oConnection;
+}
+void BlueServerThreadSource::stop() noexcept
+{
+	if (! m_oThread.joinable()) {
+		return; //--------------------------------------------------------------
+	}
+	m_bStopRequested.store(true, std::memory_order_release);
+	const uint64_t nOne = 1;
+	const auto nRes = ::write(m_nStopFD, &nOne, sizeof(nOne));
+	if (nRes < 0) {
+		std::cerr << "BlueServerThreadSource::stop error: write failed: " << strerror(errno) << '\n';
+	}
+	m_oThread.join();
+	m_oConnections.clear();
+}
+
+bool BlueServerThreadSource::prepare(int& nTimeout) noexcept
+{
+	nTimeout = -1;
+	// messages left by a previous dispatch
+	return ! m_oRing.empty();
+}
+bool BlueServerThreadSource::check() noexcept
+{
+	return ((m_oWakeUpPollFD.get_revents() & Glib::IO_IN) != 0) || ! m_oRing.empty();
+}
+bool BlueServerThreadSource::dispatch(sigc::slot_base* p0Slot) noexcept
+{
+	const bool bContinue = true;
+
+	if (p0Slot == nullptr) {
+		return bContinue; //----------------------------------------------------
+	}
+	uint64_t nCounter;
+	const auto nRes = ::read(m_nWakeUpFD, &nCounter, sizeof(nCounter));
+	if ((nRes < 0) && (errno != EAGAIN)) {
+		std::cerr << "BlueServerThreadSource::dispatch error: read failed: " << strerror(errno) << '\n';
+	}
+	auto& oReceiveSlot = *static_cast<sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>*>(p0Slot);
+	// Don't starve the other sources if the receiver thread keeps filling the ring
+	int32_t nBudget = m_oRing.capacity();
+	ThreadMsg oMsg;
+	while ((nBudget > 0) && m_oRing.pop(oMsg)) {
+		--nBudget;
+		if (oMsg.m_eType == MSG_TYPE_CONNECTED) {
+			const int32_t nBackendId = m_oConnectSlot(oMsg.m_oBdAddr, oMsg.m_nAdapterIdx, oMsg.m_refCounters);
+			if (nBackendId >= 0) {
+				m_oConnections.add(oMsg.m_nSerial, nBackendId);
+			} else {
+				// The receiver thread closes the socket, its messages are dropped
+				// because the connection is unknown
+				if (! m_oRefusedSerials.push(oMsg.m_nSerial)) {
+					std::cerr << "BlueServerThreadSource::dispatch error: too many refused connections" << '\n';
+				}
+				const uint64_t nOne = 1;
+				const auto nRes = ::write(m_nRefusedFD, &nOne, sizeof(nOne));
+				if (nRes < 0) {
+					std::cerr << "BlueServerThreadSource::dispatch error: write failed: " << strerror(errno) << '\n';
+				}
+			}
+			oMsg.m_refCounters.reset();
+			continue; // while ------
+		}
+		if (oMsg.m_eType == MSG_TYPE_KEY) {
+			const int32_t nBackendId = m_oConnections.getBackendId(oMsg.m_nSerial);
+			if (nBackendId >= 0) {
+				oReceiveSlot(nBackendId, false, oMsg.m_oPacket, oMsg.m_nTimeUsec);
+			}
+		} else {
+			assert(oMsg.m_eType == MSG_TYPE_CLOSED);
+			const int32_t nBackendId = m_oConnections.remove(oMsg.m_nSerial);
+			if (nBackendId < 0) {
+				// ignored or superseded connection
+				continue; // while ------
+			}
+			const KeyPacket oPkt = BlueClientReceiver::getClosePacket(oMsg.m_bRemove);
+			oReceiveSlot(nBackendId, oMsg.m_bRemove, oPkt, DeviceManager::getNowTimeMicroseconds());
+		}
+	}
+	return bContinue;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Receiver thread
+void BlueServerThreadSource::threadRun() noexcept
+{
+	std::vector<struct ::epoll_event> aReadyEvents(s_nThreadMaxReadyEvents);
+	bool bStop = false;
+	while (! bStop) {
+		const int32_t nReady = ::epoll_wait(m_nEpollFD, &(aReadyEvents[0]), s_nThreadMaxReadyEvents, -1);
+		if (nReady < 0) {
+			if (errno == EINTR) {
+				continue; // while ------
+			}
+			std::cerr << "BlueServerThreadSource::threadRun error: epoll_wait failed: " << strerror(errno) << '\n';
+			break; // while ---------
+		}
+		for (int32_t nIdx = 0; nIdx < nReady; ++nIdx) {
+			const auto& oEvent = aReadyEvents[nIdx];
+			const uint64_t nTag = oEvent.data.u64;
+			if (nTag == s_nThreadStopTag) {
+				bStop = true;
+				break; // for -----------
+			}
+			if (nTag == s_nThreadListenerTag) {
+				threadAccept(oEvent.events);
+			} else if (nTag == s_nThreadRefusedTag) {
+				threadCloseRefused();
+			} else {
+				threadReceive(static_cast<uint32_t>(nTag), oEvent.events);
+			}
+		}
+		if (m_bWakeUpPending) {
+			threadWakeUpMain();
+		}
+	}
+	// closes the sockets
+	m_oClients.clear();
+}
+void BlueServerThreadSource::threadAccept(uint32_t nEvents) noexcept
+{
+	if ((nEvents & (EPOLLHUP | EPOLLERR)) != 0) {
+		std::cerr << "BlueServerThreadSource::threadAccept: accept failed: EPOLLHUP or EPOLLERR" << '\n';
+		return; //--------------------------------------------------------------
+	}
+	// accept all pending connections (at most a backlog's worth)
+	const int32_t nMaxAccepts = m_refTransport->getListenBacklog();
+	for (int32_t nAccept = 0; nAccept < nMaxAccepts; ++nAccept) {
+		bdaddr_t oClientBdAddr;
+		const int32_t nFdClient = m_refTransport->acceptClient(m_nListenerFD, oClientBdAddr);
+		if (nFdClient < 0) {
+			if (! ServerTransport::isNoPendingClient(errno)) {
+				std::cerr <<  "BlueServerThreadSource::threadAccept: accept failed: " << strerror(errno) << '\n';
+			}
+			return; //----------------------------------------------------------
+		}
+		threadAddClient(nFdClient, oClientBdAddr);
+	}
+}
+void BlueServerThreadSource::threadAddClient(int32_t nFdClient, const bdaddr_t& oClientBdAddr) noexcept
+{
+	// Close the old connection of the same device
+	for (auto& oPair : m_oClients) {
+		if (bacmp(&(oPair.second.m_oBdAddr), &oClientBdAddr) == 0) {
+			threadClose(oPair.first, false, true, "");
+			break; // for -----------
+		}
+	}
+	const int32_t nAdapterIdx = m_refTransport->getAdapterIdx(nFdClient);
+	// The serial is also used as the (non negative) id of the receiver
+	do {
+		m_nSerialCounter = (m_nSerialCounter + 1) & 0x7FFFFFFFu;
+	} while (m_nSerialCounter == 0);
+	const uint32_t nSerial = m_nSerialCounter;
+
+	struct ::epoll_event oEvent;
+	memset(&oEvent, 0, sizeof(oEvent));
+	oEvent.events = EPOLLIN;
+	oEvent.data.u64 = nSerial;
+	if (::epoll_ctl(m_nEpollFD, EPOLL_CTL_ADD, nFdClient, &oEvent) < 0) {
+		std::cerr << "BlueServerThreadSource::threadAddClient error: epoll_ctl failed: " << strerror(errno) << '\n';
+		::close(nFdClient);
+		m_refTransport->getAcceptCounters().incRefused();
+		m_refTransport->releaseAdapterConnection(nAdapterIdx);
+		return; //--------------------------------------------------------------
+	}
+	auto refCounters = std::make_shared<BlueReceiveCounters>();
+	ClientData& oClient = m_oClients[nSerial];
+	oClient.m_refReceiver = std::make_unique<BlueClientReceiver>(static_cast<int32_t>(nSerial), nFdClient, m_oOptions
+																, refCounters);
+	oClient.m_oBdAddr = oClientBdAddr;
+	if (m_oOptions.m_refCapture) {
+		oClient.m_refReceiver->setCaptureId(threadGetCaptureId(oClientBdAddr));
+	}
+
+	ThreadMsg oMsg;
+	oMsg.m_eType = MSG_TYPE_CONNECTED;
+	oMsg.m_nSerial = nSerial;
+	oMsg.m_bRemove = false;
+	oMsg.m_oBdAddr = oClientBdAddr;
+	oMsg.m_nAdapterIdx = nAdapterIdx;
+	oMsg.m_refCounters = std::move(refCounters);
+	threadPush(oMsg);
+}
+int32_t BlueServerThreadSource::threadGetCaptureId(const bdaddr_t& oClientBdAddr) noexcept
+{
+	// the same for all the connections of a device, so that replaying the
+	// capture reconnects the device rather than adding a new one
+	auto itFind = m_oCaptureIds.find(oClientBdAddr);
+	if (itFind != m_oCaptureIds.end()) {
+		return itFind->second; //-----------------------------------------------
+	}
+	const int32_t nCaptureId = static_cast<int32_t>(m_oCaptureIds.size());
+	m_oCaptureIds.emplace(oClientBdAddr, nCaptureId);
+	return nCaptureId;
+}
+void BlueServerThreadSource::threadReceive(uint32_t nSerial, uint32_t nEvents) noexcept
+{
+	auto itFind = m_oClients.find(nSerial);
+	if (itFind == m_oClients.end()) {
+		// closed while handling a previous event
+		return; //--------------------------------------------------------------
+	}
+	if ((nEvents & (EPOLLHUP | EPOLLERR)) != 0) {
+		threadClose(nSerial, false, true, "");
+		return; //--------------------------------------------------------------
+	}
+	if ((nEvents & EPOLLIN) == 0) {
+		return; //--------------------------------------------------------------
+	}
+	std::string sError;
+	const auto eResult = itFind->second.m_refReceiver->receive(m_oThreadKeySlot, sError);
+	switch (eResult) {
+	case BlueClientReceiver::RECEIVE_RESULT_OK:
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_STOP:
+		// stopping
+		threadClose(nSerial, false, false, "");
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_CLOSE:
+		threadClose(nSerial, false, true, sError);
+		break;
+	case BlueClientReceiver::RECEIVE_RESULT_REMOVE:
+		threadClose(nSerial, true, true, "");
+		break;
+	}
+}
+void BlueServerThreadSource::threadClose(uint32_t nSerial, bool bRemove, bool bNotify, const std::string& sErr) noexcept
+{
+	if (! sErr.empty()) {
+		std::cerr << sErr << '\n';
+	}
+	auto itFind = m_oClients.find(nSerial);
+	assert(itFind != m_oClients.end());
+	::epoll_ctl(m_nEpollFD, EPOLL_CTL_DEL, itFind->second.m_refReceiver->getClientFD(), nullptr);
+	m_oClients.erase(itFind);
+	if (bNotify) {
+		ThreadMsg oMsg;
+		oMsg.m_eType = MSG_TYPE_CLOSED;
+		oMsg.m_nSerial = nSerial;
+		oMsg.m_bRemove = bRemove;
+		threadPush(oMsg);
+	}
+}
+void BlueServerThreadSource::threadCloseRefused() noexcept
+{
+	uint64_t nCounter;
+	const auto nRes = ::read(m_nRefusedFD, &nCounter, sizeof(nCounter));
+	if ((nRes < 0) && (errno != EAGAIN)) {
+		std::cerr << "BlueServerThreadSource::threadCloseRefused error: read failed: " << strerror(errno) << '\n';
+	}
+	uint32_t nSerial;
+	while (m_oRefusedSerials.pop(nSerial)) {
+		if (m_oClients.find(nSerial) != m_oClients.end()) {
+			// the main thread already released the connection
+			threadClose(nSerial, false, false, "");
+		}
+	}
+}
+bool BlueServerThreadSource::threadPush(const ThreadMsg& oMsg) noexcept
+{
+	while (! m_oRing.push(oMsg)) {
+		// The ring is full: wait for the main thread to make room.
+		// The kernel meanwhile keeps buffering (and eventually flow controls) the clients.
+		threadWakeUpMain();
+		if (m_bStopRequested.load(std::memory_order_acquire)) {
+			return false; //----------------------------------------------------
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(s_nThreadRingFullWaitMicrosec));
+	}
+	m_bWakeUpPending = true;
+	return true;
+}
+void BlueServerThreadSource::threadWakeUpMain() noexcept
+{
+	m_bWakeUpPending = false;
+	const uint64_t nOne = 1;
+	const auto nRes = ::write(m_nWakeUpFD, &nOne, sizeof(nOne));
+	if ((nRes < 0) && (errno != EAGAIN)) {
+		std::cerr << "BlueServerThreadSource::threadWakeUpMain error: write failed: " << strerror(errno) << '\n';
+	}
+}
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
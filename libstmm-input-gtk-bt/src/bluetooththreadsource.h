@@ -0,0 +1,213 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   bluetooththreadsource.h
+ */
+
+#ifndef STMI_BLUETOOTH_THREAD_SOURCE_H
+#define STMI_BLUETOOTH_THREAD_SOURCE_H
+
+#include "bluetoothsources.h"
+#include "bluetransport.h"
+#include "keypacket.h"
+#include "spscring.h"
+
+#include <glibmm.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <bluetooth/bluetooth.h>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+////////////////////////////////////////////////////////////////////////////////
+/** The backend ids of the receiver thread's connections.
+ * A connection is superseded when a newer one gets the same backend id (the
+ * device reconnected): its remaining messages, the close included, must be
+ * dropped, otherwise they would act on the newer connection.
+ */
+class BlueThreadConnections
+{
+public:
+	/** Adds a connection.
+	 * The connection that had the same backend id, if any, is superseded.
+	 * @param nSerial The connection serial. Must not already be added.
+	 * @param nBackendId The backend id. Must not be negative.
+	 */
+	void add(uint32_t nSerial, int32_t nBackendId) noexcept;
+	/** The backend id of a connection.
+	 * @param nSerial The connection serial.
+	 * @return The backend id or -1 if the connection is unknown or superseded.
+	 */
+	int32_t getBackendId(uint32_t nSerial) const noexcept;
+	/** Removes a connection.
+	 * @param nSerial The connection serial.
+	 * @return The backend id or -1 if the connection is unknown or superseded.
+	 */
+	int32_t remove(uint32_t nSerial) noexcept;
+	/** Removes all connections.
+	 */
+	void clear() noexcept;
+private:
+	std::unordered_map<uint32_t, int32_t> m_oBackendIds; // Key: connection serial, Value: nBackendId
+	std::unordered_map<int32_t, uint32_t> m_oSerials; // Key: nBackendId, Value: the current connection serial
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Server with a receiver thread.
+ * The receiver thread owns the listener and client sockets, multiplexed with epoll.
+ * It accepts the connections and validates and decodes the key packets, which are
+ * handed to the main thread through a lock-free ring. The main context is woken up
+ * through an eventfd.
+ *
+ * Reading the packets therefore isn't delayed by a busy main loop (long redraws,
+ * slow listeners).
+ */
+class BlueServerThreadSource : public Glib::Source
+{
+public:
+	/** Constructor.
+	 * Creates the sockets, the thread is started by connect().
+	 * @param refTransport The transport. Cannot be null.
+	 * @param oOptions The options of the client receivers.
+	 * @param nRingSize The minimum number of messages the ring can hold. Must be positive.
+	 */
+	BlueServerThreadSource(const std::shared_ptr<ServerTransport>& refTransport, const BlueReceiveOptions& oOptions
+							, int32_t nRingSize) noexcept;
+	virtual ~BlueServerThreadSource() noexcept;
+
+	/** Set source's callback functions and start the receiver thread.
+	 * The callbacks are called in the main thread.
+	 *
+	 * The connect callback has the following signature:
+	 *
+	 *     nBackendId = oConnectCallback(oBdAddr, nAdapterIdx, refCounters);
+	 *
+	 * oBdAddr: The address identifying the client (see ServerTransport::acceptClient()).
+	 * nAdapterIdx: The adapter the connection was accepted on (see ServerTransport::getAdapterIdx()).
+	 * refCounters: The counters of the connection, updated by the receiver thread.
+	 * nBackendId: The id passed to the receive callback for the packets of the connection
+	 *             or -1 if the connection is refused (the receiver thread closes it).
+	 *
+	 * The receive callback has the signature of BlueServerReceiveSource::connect(),
+	 * its return value is ignored.
+	 *
+	 * If a client connects while a connection with the same address is open, the old
+	 * connection is closed first (bRemove is false).
+	 * @param oConnectSlot The connect callback.
+	 * @param oReceiveSlot The receive callback.
+	 * @return The connection. Is empty if not connected or the thread couldn't be started.
+	 */
+	sigc::connection connect(const sigc::slot<int32_t, const bdaddr_t&, int32_t, const std::shared_ptr<BlueReceiveCounters>&>& oConnectSlot
+							, const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oReceiveSlot) noexcept;
+	/** Stops and joins the receiver thread.
+	 * All connections are closed. The callbacks are no longer called.
+	 */
+	void stop() noexcept;
+
+	/** The error string.
+	 * @return The error string or empty if server running.
+	 */
+	const std::string& getErrorStr() const noexcept
+	{
+		return m_sErrorStr;
+	}
+protected:
+	bool prepare(int& nTimeout) noexcept override;
+	bool check() noexcept override;
+	bool dispatch(sigc::slot_base* oSlot) noexcept override;
+private:
+	enum MSG_TYPE
+	{
+		MSG_TYPE_CONNECTED = 0,
+		MSG_TYPE_KEY = 1,
+		MSG_TYPE_CLOSED = 2,
+	};
+	struct ThreadMsg
+	{
+		MSG_TYPE m_eType;
+		uint32_t m_nSerial; // The connection
+		bool m_bRemove; // MSG_TYPE_CLOSED
+		KeyPacket m_oPacket; // MSG_TYPE_KEY
+		int64_t m_nTimeUsec; // MSG_TYPE_KEY
+		bdaddr_t m_oBdAddr; // MSG_TYPE_CONNECTED
+		int32_t m_nAdapterIdx; // MSG_TYPE_CONNECTED
+		std::shared_ptr<BlueReceiveCounters> m_refCounters; // MSG_TYPE_CONNECTED
+	};
+	void closeFDs() noexcept;
+	// Receiver thread functions
+	void threadRun() noexcept;
+	void threadAccept(uint32_t nEvents) noexcept;
+	void threadAddClient(int32_t nFdClient, const bdaddr_t& oClientBdAddr) noexcept;
+	int32_t threadGetCaptureId(const bdaddr_t& oClientBdAddr) noexcept;
+	void threadReceive(uint32_t nSerial, uint32_t nEvents) noexcept;
+	void threadClose(uint32_t nSerial, bool bRemove, bool bNotify, const std::string& sErr) noexcept;
+	void threadCloseRefused() noexcept;
+	bool threadPush(const ThreadMsg& oMsg) noexcept;
+	void threadWakeUpMain() noexcept;
+private:
+	std::string m_sErrorStr;
+	// Main thread
+	int32_t m_nWakeUpFD; // eventfd written by the receiver thread
+	sigc::slot<int32_t, const bdaddr_t&, int32_t, const std::shared_ptr<BlueReceiveCounters>&> m_oConnectSlot;
+	BlueThreadConnections m_oConnections;
+	Glib::PollFD m_oWakeUpPollFD;
+	// Shared
+	SpscRing<ThreadMsg> m_oRing;
+	SpscRing<uint32_t> m_oRefusedSerials; // The connections refused by the main thread
+	int32_t m_nRefusedFD; // eventfd written by the main thread
+	int32_t m_nStopFD; // eventfd written by the main thread
+	std::atomic<bool> m_bStopRequested;
+	std::thread m_oThread;
+	// Receiver thread (set up by the main thread before it is started)
+	std::shared_ptr<ServerTransport> m_refTransport;
+	int32_t m_nListenerFD;
+	int32_t m_nEpollFD;
+	const BlueReceiveOptions m_oOptions;
+	uint32_t m_nSerialCounter;
+	struct ClientData
+	{
+		std::unique_ptr<BlueClientReceiver> m_refReceiver;
+		bdaddr_t m_oBdAddr;
+	};
+	std::unordered_map<uint32_t, ClientData> m_oClients; // Key: connection serial
+	// The ids of the devices in the capture, which can't be the backend ids because
+	// they are assigned by the main thread. Only used if capturing.
+	std::unordered_map<bdaddr_t, int32_t, BdAddrHash, BdAddrEqual> m_oCaptureIds; // Key: client address
+	sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t> m_oThreadKeySlot;
+	bool m_bWakeUpPending;
+private:
+	BlueServerThreadSource(const BlueServerThreadSource& oSource) = delete;
+	BlueServerThreadSource& operator=(const BlueServerThreadSource& oSource) = delete;
+};
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
+
+#endif /* STMI_BLUETOOTH_THREAD_SOURCE_H */
@@ -0,0 +1,541 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   bluetransport.cc
+ */
+
+#include "bluetransport.h"
+#include "keypacket.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+// The L2CAP flush timeout meaning no flush
+constexpr int32_t s_nInfiniteFlushTimeout = 0xFFFF; // L2CAP_DEFAULT_FLUSH_TO
+
+ServerTransport::ServerTransport(int32_t nListenBacklog, const BtGtkDeviceManager::SocketTuning& oTuning
+								, int32_t nAdapterLoadMargin) noexcept
+: m_nListenBacklog((nListenBacklog > 0) ? nListenBacklog : SOMAXCONN)
+, m_oTuning(oTuning)
+, m_nAdapterLoadMargin(nAdapterLoadMargin)
+, m_nTotAdapters(0)
+{
+	initAdapters(1);
+}
+void ServerTransport::initAdapters(int32_t nTotAdapters) noexcept
+{
+	assert(nTotAdapters > 0);
+	m_aAdapterCounters.reset(new BlueAdapterCounters[nTotAdapters]);
+	m_nTotAdapters = nTotAdapters;
+}
+int32_t ServerTransport::acceptClient(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept
+{
+	while (true) {
+		const int32_t nFdClient = acceptClientImpl(nListenerFD, oClientAddr);
+		if (nFdClient < 0) {
+			if (! isNoPendingClient(errno)) {
+				BlueReceiveCounters::inc(m_oAcceptCounters.m_nAcceptErrors);
+			}
+			return -1; //-------------------------------------------------------
+		}
+		if (! setBufferSizes(nFdClient)) {
+			const int nErrno = errno;
+			::close(nFdClient);
+			BlueReceiveCounters::inc(m_oAcceptCounters.m_nAcceptErrors);
+			errno = nErrno;
+			return -1; //-------------------------------------------------------
+		}
+		const int32_t nAdapterIdx = getAdapterIdx(nFdClient);
+		BlueAdapterCounters& oAdapter = m_aAdapterCounters[nAdapterIdx];
+		if (isAdapterOverloaded(nAdapterIdx)) {
+			// load shedding: the client has to choose another adapter by itself
+			::close(nFdClient);
+			BlueReceiveCounters::inc(oAdapter.m_nRefused);
+			m_oAcceptCounters.incRefused();
+			continue; // while ------
+		}
+		BlueReceiveCounters::inc(m_oAcceptCounters.m_nAccepted);
+		BlueReceiveCounters::inc(oAdapter.m_nAccepted);
+		oAdapter.m_nConnections.fetch_add(1, std::memory_order_relaxed);
+		return nFdClient; //----------------------------------------------------
+	}
+}
+bool ServerTransport::isAdapterOverloaded(int32_t nAdapterIdx) const noexcept
+{
+	if ((m_nAdapterLoadMargin <= 0) || (m_nTotAdapters <= 1)) {
+		return false; //--------------------------------------------------------
+	}
+	int32_t nMinConnections = m_aAdapterCounters[0].m_nConnections.load(std::memory_order_relaxed);
+	for (int32_t nIdx = 1; nIdx < m_nTotAdapters; ++nIdx) {
+		nMinConnections = std::min(nMinConnections, m_aAdapterCounters[nIdx].m_nConnections.load(std::memory_order_relaxed));
+	}
+	const int32_t nConnections = m_aAdapterCounters[nAdapterIdx].m_nConnections.load(std::memory_order_relaxed);
+	return (nConnections >= nMinConnections + m_nAdapterLoadMargin);
+}
+bdaddr_t ServerTransport::getAdapterAddr(int32_t nAdapterIdx) const noexcept
+{
+	assert((nAdapterIdx >= 0) && (nAdapterIdx < m_nTotAdapters));
+	bdaddr_t oAddr;
+	memset(&oAddr, 0, sizeof(oAddr));
+	return oAddr;
+}
+int32_t ServerTransport::getAdapterIdx(int32_t /*nClientFD*/) const noexcept
+{
+	return 0;
+}
+void ServerTransport::releaseAdapterConnection(int32_t nAdapterIdx) noexcept
+{
+	assert((nAdapterIdx >= 0) && (nAdapterIdx < m_nTotAdapters));
+	m_aAdapterCounters[nAdapterIdx].m_nConnections.fetch_sub(1, std::memory_order_relaxed);
+}
+const BlueAdapterCounters& ServerTransport::getAdapterCounters(int32_t nAdapterIdx) const noexcept
+{
+	assert((nAdapterIdx >= 0) && (nAdapterIdx < m_nTotAdapters));
+	return m_aAdapterCounters[nAdapterIdx];
+}
+bool ServerTransport::setBufferSizes(int32_t nFD) noexcept
+{
+	if (m_oTuning.m_nReceiveBufferSize > 0) {
+		const int nSize = m_oTuning.m_nReceiveBufferSize;
+		if (::setsockopt(nFD, SOL_SOCKET, SO_RCVBUF, &nSize, sizeof(nSize)) < 0) {
+			return false; //----------------------------------------------------
+		}
+	}
+	if (m_oTuning.m_nSendBufferSize > 0) {
+		const int nSize = m_oTuning.m_nSendBufferSize;
+		if (::setsockopt(nFD, SOL_SOCKET, SO_SNDBUF, &nSize, sizeof(nSize)) < 0) {
+			return false; //----------------------------------------------------
+		}
+	}
+	return true;
+}
+void ServerTransport::readAppliedBufferSizes(int32_t nListenerFD) noexcept
+{
+	int nSize = 0;
+	socklen_t nOptLen = sizeof(nSize);
+	if (::getsockopt(nListenerFD, SOL_SOCKET, SO_RCVBUF, &nSize, &nOptLen) == 0) {
+		m_oAppliedTuning.m_nReceiveBufferSize = nSize;
+	}
+	nSize = 0;
+	nOptLen = sizeof(nSize);
+	if (::getsockopt(nListenerFD, SOL_SOCKET, SO_SNDBUF, &nSize, &nOptLen) == 0) {
+		m_oAppliedTuning.m_nSendBufferSize = nSize;
+	}
+}
+bool ServerTransport::isNoPendingClient(int nErrno) noexcept
+{
+	return (nErrno == EAGAIN) || (nErrno == EWOULDBLOCK);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The addresses of the local bluetooth adapters that are up
+static std::vector<bdaddr_t> getUpAdapterAddrs() noexcept
+{
+	std::vector<bdaddr_t> aAddrs;
+	for (int32_t nDevId = 0; nDevId < HCI_MAX_DEV; ++nDevId) {
+		::hci_dev_info oInfo;
+		memset(&oInfo, 0, sizeof(oInfo));
+		if (::hci_devinfo(nDevId, &oInfo) < 0) {
+			continue; // for ------
+		}
+		if (! ::hci_test_bit(HCI_UP, &(oInfo.flags))) {
+			continue; // for ------
+		}
+		aAddrs.push_back(oInfo.bdaddr);
+	}
+	return aAddrs;
+}
+
+L2capServerTransport::L2capServerTransport(int32_t nL2capPort, bool bPerAdapter, int32_t nAdapterLoadMargin
+											, int32_t nListenBacklog, const BtGtkDeviceManager::SocketTuning& oTuning) noexcept
+: ServerTransport(nListenBacklog, oTuning, (bPerAdapter ? nAdapterLoadMargin : 0))
+, m_nL2capPort(nL2capPort)
+, m_bPerAdapter(bPerAdapter)
+, m_nNextAdapterIdx(0)
+{
+}
+L2capServerTransport::~L2capServerTransport() noexcept
+{
+	closeAdapterListeners();
+}
+void L2capServerTransport::closeAdapterListeners() noexcept
+{
+	for (const int32_t nListenerFD : m_aAdapterListenerFDs) {
+		::close(nListenerFD);
+	}
+	m_aAdapterListenerFDs.clear();
+}
+int32_t L2capServerTransport::createListener(const std::string& sCaller, std::string& sError) noexcept
+{
+	if (! m_bPerAdapter) {
+		bdaddr_t oAnyAddr;
+		memset(&oAnyAddr, 0, sizeof(oAnyAddr)); // BDADDR_ANY
+		const int32_t nListenerFD = createAdapterListener(oAnyAddr, sCaller, sError);
+		if (nListenerFD >= 0) {
+			readAppliedL2capOptions(nListenerFD);
+			readAppliedBufferSizes(nListenerFD);
+		}
+		return nListenerFD; //--------------------------------------------------
+	}
+	closeAdapterListeners();
+	m_aAdapterAddrs = getUpAdapterAddrs();
+	if (m_aAdapterAddrs.empty()) {
+		sError = sCaller + ": no bluetooth adapter is up";
+		return -1; //-----------------------------------------------------------
+	}
+	const int32_t nEpollFD = ::epoll_create1(EPOLL_CLOEXEC);
+	if (nEpollFD < 0) {
+		sError = sCaller + ": epoll_create1 failed: " + std::string(strerror(errno));
+		return -1; //-----------------------------------------------------------
+	}
+	const int32_t nTotAdapters = static_cast<int32_t>(m_aAdapterAddrs.size());
+	for (int32_t nAdapterIdx = 0; nAdapterIdx < nTotAdapters; ++nAdapterIdx) {
+		const int32_t nListenerFD = createAdapterListener(m_aAdapterAddrs[nAdapterIdx], sCaller, sError);
+		if (nListenerFD < 0) {
+			closeAdapterListeners();
+			::close(nEpollFD);
+			return -1; //-------------------------------------------------------
+		}
+		m_aAdapterListenerFDs.push_back(nListenerFD);
+		struct ::epoll_event oEvent;
+		memset(&oEvent, 0, sizeof(oEvent));
+		oEvent.events = EPOLLIN;
+		oEvent.data.u32 = static_cast<uint32_t>(nAdapterIdx);
+		if (::epoll_ctl(nEpollFD, EPOLL_CTL_ADD, nListenerFD, &oEvent) < 0) {
+			sError = sCaller + ": epoll_ctl failed: " + std::string(strerror(errno));
+			closeAdapterListeners();
+			::close(nEpollFD);
+			return -1; //-------------------------------------------------------
+		}
+	}
+	initAdapters(nTotAdapters);
+	m_nNextAdapterIdx = 0;
+	readAppliedL2capOptions(m_aAdapterListenerFDs[0]);
+	readAppliedBufferSizes(m_aAdapterListenerFDs[0]);
+	return nEpollFD;
+}
+int32_t L2capServerTransport::createAdapterListener(const bdaddr_t& oAdapterAddr, const std::string& sCaller
+													, std::string& sError) noexcept
+{
+	int32_t nListenerFD = ::socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
+	//
+	if (nListenerFD < 0) {
+		sError = sCaller + ": socket failed: " + std::string(strerror(errno));
+		return -1; //-----------------------------------------------------------
+	}
+	// bind socket to given port of the adapter, with BDADDR_ANY
+	// of all bluetooth adapters
+	::sockaddr_l2 oLocalAddr;
+	memset(&oLocalAddr, 0, sizeof(oLocalAddr));
+	const short nPort = static_cast<short>(m_nL2capPort); //0x20A1
+	oLocalAddr.l2_family = AF_BLUETOOTH;
+	bacpy(&(oLocalAddr.l2_bdaddr), &oAdapterAddr);
+	oLocalAddr.l2_psm = htobs(nPort);
+	oLocalAddr.l2_cid = 0;
+	oLocalAddr.l2_bdaddr_type = 0;
+	//
+	auto nRes = ::bind(nListenerFD, reinterpret_cast<sockaddr*>(&oLocalAddr), sizeof(oLocalAddr));
+	//
+	if (nRes < 0) {
+		sError = sCaller + ": bind failed: " + std::string(strerror(errno));
+		close(nListenerFD);
+		return -1; //-----------------------------------------------------------
+	}
+	// the options are inherited by the accepted connections
+	if (! setL2capOptions(nListenerFD, sCaller, sError)) {
+		close(nListenerFD);
+		return -1; //-----------------------------------------------------------
+	}
+	if (! setBufferSizes(nListenerFD)) {
+		sError = sCaller + ": setsockopt (buffer size) failed: " + std::string(strerror(errno));
+		close(nListenerFD);
+		return -1; //-----------------------------------------------------------
+	}
+
+	// put socket into listening mode
+	nRes = ::listen(nListenerFD, getListenBacklog());
+	if (nRes < 0) {
+		sError = sCaller + ": listen failed: " + std::string(strerror(errno));
+		close(nListenerFD);
+		return -1; //-----------------------------------------------------------
+	}
+	return nListenerFD;
+}
+bool L2capServerTransport::setL2capOptions(int32_t nListenerFD, const std::string& sCaller, std::string& sError) noexcept
+{
+	const BtGtkDeviceManager::SocketTuning& oTuning = getTuning();
+	if ((oTuning.m_nInMtu > 0) || (oTuning.m_nOutMtu > 0) || (oTuning.m_nFlushTimeoutMsec > 0)) {
+		::l2cap_options oOpts;
+		memset(&oOpts, 0, sizeof(oOpts));
+		socklen_t nOptLen = sizeof(oOpts);
+		auto nRes = ::getsockopt(nListenerFD, SOL_L2CAP, L2CAP_OPTIONS, &oOpts, &nOptLen);
+		if (nRes == 0) {
+			if (oTuning.m_nInMtu > 0) {
+				oOpts.imtu = static_cast<uint16_t>(std::min<int32_t>(oTuning.m_nInMtu, 0xFFFF));
+			}
+			if (oTuning.m_nOutMtu > 0) {
+				oOpts.omtu = static_cast<uint16_t>(std::min<int32_t>(oTuning.m_nOutMtu, 0xFFFF));
+			}
+			if (oTuning.m_nFlushTimeoutMsec > 0) {
+				oOpts.flush_to = static_cast<uint16_t>(std::min<int32_t>(oTuning.m_nFlushTimeoutMsec, s_nInfiniteFlushTimeout));
+			}
+			nRes = ::setsockopt(nListenerFD, SOL_L2CAP, L2CAP_OPTIONS, &oOpts, nOptLen);
+		}
+		if (nRes < 0) {
+			sError = sCaller + ": setsockopt (L2CAP options) failed: " + std::string(strerror(errno));
+			return false; //----------------------------------------------------
+		}
+	}
+	if ((oTuning.m_nFlushTimeoutMsec > 0) && (oTuning.m_nFlushTimeoutMsec < s_nInfiniteFlushTimeout)) {
+		const int nFlushable = BT_FLUSHABLE_ON;
+		if (::setsockopt(nListenerFD, SOL_BLUETOOTH, BT_FLUSHABLE, &nFlushable, sizeof(nFlushable)) < 0) {
+			sError = sCaller + ": setsockopt (flushable) failed: " + std::string(strerror(errno));
+			return false; //----------------------------------------------------
+		}
+	}
+	if (oTuning.m_nLinkMode != 0) {
+		const int nLinkMode = oTuning.m_nLinkMode;
+		if (::setsockopt(nListenerFD, SOL_L2CAP, L2CAP_LM, &nLinkMode, sizeof(nLinkMode)) < 0) {
+			sError = sCaller + ": setsockopt (link mode) failed: " + std::string(strerror(errno));
+			return false; //----------------------------------------------------
+		}
+	}
+	return true;
+}
+void L2capServerTransport::readAppliedL2capOptions(int32_t nListenerFD) noexcept
+{
+	BtGtkDeviceManager::SocketTuning& oApplied = appliedTuning();
+	::l2cap_options oOpts;
+	memset(&oOpts, 0, sizeof(oOpts));
+	socklen_t nOptLen = sizeof(oOpts);
+	if (::getsockopt(nListenerFD, SOL_L2CAP, L2CAP_OPTIONS, &oOpts, &nOptLen) == 0) {
+		oApplied.m_nInMtu = oOpts.imtu;
+		oApplied.m_nOutMtu = oOpts.omtu;
+		oApplied.m_nFlushTimeoutMsec = oOpts.flush_to;
+	}
+	int nLinkMode = 0;
+	nOptLen = sizeof(nLinkMode);
+	if (::getsockopt(nListenerFD, SOL_L2CAP, L2CAP_LM, &nLinkMode, &nOptLen) == 0) {
+		oApplied.m_nLinkMode = nLinkMode;
+	}
+}
+int32_t L2capServerTransport::acceptClientImpl(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept
+{
+	if (! m_bPerAdapter) {
+		return acceptOn(nListenerFD, oClientAddr); //---------------------------
+	}
+	// nListenerFD is the epoll instance: try the adapters' listeners in turn
+	const int32_t nTotAdapters = static_cast<int32_t>(m_aAdapterListenerFDs.size());
+	for (int32_t nCount = 0; nCount < nTotAdapters; ++nCount) {
+		const int32_t nAdapterIdx = (m_nNextAdapterIdx + nCount) % nTotAdapters;
+		const int32_t nFdClient = acceptOn(m_aAdapterListenerFDs[nAdapterIdx], oClientAddr);
+		if (nFdClient >= 0) {
+			m_nNextAdapterIdx = (nAdapterIdx + 1) % nTotAdapters;
+			return nFdClient; //------------------------------------------------
+		}
+		if (! isNoPendingClient(errno)) {
+			return -1; //-------------------------------------------------------
+		}
+	}
+	errno = EAGAIN;
+	return -1;
+}
+int32_t L2capServerTransport::acceptOn(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept
+{
+	::sockaddr_l2 oRemoteAddr;
+	memset(&oRemoteAddr, 0, sizeof(oRemoteAddr));
+	socklen_t nRemoteAdrLen = sizeof(oRemoteAddr);
+
+	// accept one connection
+	const int32_t nFdClient = ::accept4(nListenerFD, reinterpret_cast<sockaddr*>(&oRemoteAddr), &nRemoteAdrLen
+										, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (nFdClient < 0) {
+		return -1; //-----------------------------------------------------------
+	}
+	//char sBuf[19];
+	//ba2str( &(oRemoteAddr.l2_bdaddr), sBuf );
+	oClientAddr = oRemoteAddr.l2_bdaddr;
+	return nFdClient;
+}
+std::string L2capServerTransport::getDescription() const noexcept
+{
+	std::string sDesc = "L2CAP port " + std::to_string(m_nL2capPort);
+	if (m_bPerAdapter) {
+		sDesc += " of adapters";
+		for (const bdaddr_t& oAddr : m_aAdapterAddrs) {
+			char sAddr[19];
+			memset(sAddr, 0, sizeof(sAddr));
+			ba2str(&oAddr, sAddr);
+			sDesc += std::string(" ") + sAddr;
+		}
+	}
+	return sDesc;
+}
+bdaddr_t L2capServerTransport::getAdapterAddr(int32_t nAdapterIdx) const noexcept
+{
+	if (! m_bPerAdapter) {
+		return ServerTransport::getAdapterAddr(nAdapterIdx); //-----------------
+	}
+	assert((nAdapterIdx >= 0) && (nAdapterIdx < static_cast<int32_t>(m_aAdapterAddrs.size())));
+	return m_aAdapterAddrs[nAdapterIdx];
+}
+int32_t L2capServerTransport::getAdapterIdx(int32_t nClientFD) const noexcept
+{
+	if (m_aAdapterAddrs.size() <= 1) {
+		return 0; //------------------------------------------------------------
+	}
+	// the local address of a connection is the one of its adapter
+	::sockaddr_l2 oLocalAddr;
+	memset(&oLocalAddr, 0, sizeof(oLocalAddr));
+	socklen_t nLocalAddrLen = sizeof(oLocalAddr);
+	if (::getsockname(nClientFD, reinterpret_cast<sockaddr*>(&oLocalAddr), &nLocalAddrLen) < 0) {
+		return 0; //------------------------------------------------------------
+	}
+	const int32_t nTotAdapters = static_cast<int32_t>(m_aAdapterAddrs.size());
+	for (int32_t nAdapterIdx = 0; nAdapterIdx < nTotAdapters; ++nAdapterIdx) {
+		if (bacmp(&(m_aAdapterAddrs[nAdapterIdx]), &(oLocalAddr.l2_bdaddr)) == 0) {
+			return nAdapterIdx; //----------------------------------------------
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+UnixServerTransport::UnixServerTransport(const std::string& sPath, int32_t nListenBacklog
+										, const BtGtkDeviceManager::SocketTuning& oTuning) noexcept
+: ServerTransport(nListenBacklog, oTuning, 0)
+, m_sPath(sPath)
+, m_bUnlinkPath(false)
+, m_nAnonymousCounter(0)
+{
+}
+UnixServerTransport::~UnixServerTransport() noexcept
+{
+	if (m_bUnlinkPath) {
+		::unlink(m_sPath.c_str());
+	}
+}
+int32_t UnixServerTransport::createListener(const std::string& sCaller, std::string& sError) noexcept
+{
+	::sockaddr_un oLocalAddr;
+	memset(&oLocalAddr, 0, sizeof(oLocalAddr));
+	oLocalAddr.sun_family = AF_UNIX;
+	if (m_sPath.empty() || (m_sPath.size() >= sizeof(oLocalAddr.sun_path))) {
+		sError = sCaller + ": socket path empty or too long";
+		return -1; //-----------------------------------------------------------
+	}
+	const bool bAbstract = (m_sPath[0] == '@');
+	// abstract names start with a null character
+	memcpy(oLocalAddr.sun_path + (bAbstract ? 1 : 0), m_sPath.c_str() + (bAbstract ? 1 : 0), m_sPath.size() - (bAbstract ? 1 : 0));
+	const socklen_t nLocalAddrLen = static_cast<socklen_t>(offsetof(::sockaddr_un, sun_path) + m_sPath.size() + (bAbstract ? 0 : 1));
+
+	const int32_t nListenerFD = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (nListenerFD < 0) {
+		sError = sCaller + ": socket failed: " + std::string(strerror(errno));
+		return -1; //-----------------------------------------------------------
+	}
+	if (! bAbstract) {
+		// remove the socket file left behind by a previous server
+		struct ::stat oStat;
+		if ((::lstat(m_sPath.c_str(), &oStat) == 0) && S_ISSOCK(oStat.st_mode)) {
+			::unlink(m_sPath.c_str());
+		}
+	}
+	auto nRes = ::bind(nListenerFD, reinterpret_cast<sockaddr*>(&oLocalAddr), nLocalAddrLen);
+	if (nRes < 0) {
+		sError = sCaller + ": bind failed: " + std::string(strerror(errno));
+		::close(nListenerFD);
+		return -1; //-----------------------------------------------------------
+	}
+	m_bUnlinkPath = ! bAbstract;
+	if (! setBufferSizes(nListenerFD)) {
+		sError = sCaller + ": setsockopt (buffer size) failed: " + std::string(strerror(errno));
+		::close(nListenerFD);
+		return -1; //-----------------------------------------------------------
+	}
+	nRes = ::listen(nListenerFD, getListenBacklog());
+	if (nRes < 0) {
+		sError = sCaller + ": listen failed: " + std::string(strerror(errno));
+		::close(nListenerFD);
+		return -1; //-----------------------------------------------------------
+	}
+	readAppliedBufferSizes(nListenerFD);
+	return nListenerFD;
+}
+int32_t UnixServerTransport::acceptClientImpl(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept
+{
+	::sockaddr_un oRemoteAddr;
+	memset(&oRemoteAddr, 0, sizeof(oRemoteAddr));
+	socklen_t nRemoteAdrLen = sizeof(oRemoteAddr);
+
+	// accept one connection
+	const int32_t nFdClient = ::accept4(nListenerFD, reinterpret_cast<sockaddr*>(&oRemoteAddr), &nRemoteAdrLen
+										, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (nFdClient < 0) {
+		return -1; //-----------------------------------------------------------
+	}
+	// Is the client bound to an abstract name containing its address?
+	const std::string sPrefix = PACKET_UNIX_CLIENT_NAME_PREFIX;
+	constexpr int32_t nAddrStrLen = 17; // "XX:XX:XX:XX:XX:XX"
+	const int32_t nNameLen = static_cast<int32_t>(nRemoteAdrLen) - static_cast<int32_t>(offsetof(::sockaddr_un, sun_path));
+	if ((nNameLen == 1 + static_cast<int32_t>(sPrefix.size()) + nAddrStrLen) && (oRemoteAddr.sun_path[0] == '\0')
+			&& (sPrefix.compare(0, sPrefix.size(), oRemoteAddr.sun_path + 1, sPrefix.size()) == 0)) {
+		const std::string sAddr(oRemoteAddr.sun_path + 1 + sPrefix.size(), nAddrStrLen);
+		if (::bachk(sAddr.c_str()) >= 0) {
+			::str2ba(sAddr.c_str(), &oClientAddr);
+			return nFdClient; //------------------------------------------------
+		}
+	}
+	do {
+		m_nAnonymousCounter = (m_nAnonymousCounter + 1) & 0xFFFFFFu;
+	} while (m_nAnonymousCounter == 0);
+	memset(&oClientAddr, 0, sizeof(oClientAddr));
+	oClientAddr.b[0] = static_cast<uint8_t>(m_nAnonymousCounter & 0xFFu);
+	oClientAddr.b[1] = static_cast<uint8_t>((m_nAnonymousCounter >> 8) & 0xFFu);
+	oClientAddr.b[2] = static_cast<uint8_t>((m_nAnonymousCounter >> 16) & 0xFFu);
+	return nFdClient;
+}
+std::string UnixServerTransport::getDescription() const noexcept
+{
+	return "local socket " + m_sPath;
+}
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
@@ -0,0 +1,273 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   bluetransport.h
+ */
+
+#ifndef STMI_BLUE_TRANSPORT_H
+#define STMI_BLUE_TRANSPORT_H
+
+#include "btstats.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+struct BdAddrHash
+{
+	std::size_t operator()(const bdaddr_t& oBdAddr) const noexcept
+	{
+		uint64_t nValue = 0;
+		for (const uint8_t nByte : oBdAddr.b) {
+			nValue = (nValue << 8) | nByte;
+		}
+		return std::hash<uint64_t>{}(nValue);
+	}
+};
+struct BdAddrEqual
+{
+	bool operator()(const bdaddr_t& oBdAddr1, const bdaddr_t& oBdAddr2) const noexcept
+	{
+		return (bacmp(&oBdAddr1, &oBdAddr2) == 0);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** The transport of the client connections.
+ * The connections are SOCK_SEQPACKET sockets carrying the btkeys protocol,
+ * the transport only determines how they are created and how clients are identified.
+ */
+class ServerTransport
+{
+public:
+	virtual ~ServerTransport() noexcept = default;
+	/** Creates the listening socket.
+	 * The socket is non blocking: acceptClient() fails with EAGAIN when
+	 * there are no pending connections.
+	 * @param sCaller The prefix of the error string.
+	 * @param sError Set to the error string if failed.
+	 * @return The socket or -1 if failed.
+	 */
+	virtual int32_t createListener(const std::string& sCaller, std::string& sError) noexcept = 0;
+	/** Accepts a connection.
+	 * The connection socket is non blocking and close-on-exec.
+	 * Might be called from a thread other than the one that created the transport,
+	 * but never concurrently.
+	 *
+	 * The connection is counted as open on its adapter until releaseAdapterConnection()
+	 * is called. Connections on overloaded adapters (see the constructor) are closed
+	 * and the next pending connection is accepted instead.
+	 * @param nListenerFD The socket returned by createListener().
+	 * @param oClientAddr Set to the address identifying the client (device).
+	 * @return The connection file descriptor or -1 if failed (errno is set).
+	 */
+	int32_t acceptClient(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept;
+	/** Whether acceptClient() failed because there are no more pending connections.
+	 * @param nErrno The errno set by acceptClient().
+	 * @return Whether the accept loop should just stop.
+	 */
+	static bool isNoPendingClient(int nErrno) noexcept;
+	/** A description of where the server listens.
+	 * @return The description. Example: "L2CAP port 8353".
+	 */
+	virtual std::string getDescription() const noexcept = 0;
+	/** The maximum number of pending connections passed to listen().
+	 * The accept loops accept at most this number of connections at a time.
+	 * @return The backlog. Is positive.
+	 */
+	int32_t getListenBacklog() const noexcept { return m_nListenBacklog; }
+	/** The connection counters.
+	 * Incremented by acceptClient() except m_nRefused, which must be incremented
+	 * by whoever closes an accepted connection without serving it.
+	 * @return The counters.
+	 */
+	BlueAcceptCounters& getAcceptCounters() noexcept { return m_oAcceptCounters; }
+	const BlueAcceptCounters& getAcceptCounters() const noexcept { return m_oAcceptCounters; }
+	/** The socket options requested in the constructor.
+	 * @return The options.
+	 */
+	const BtGtkDeviceManager::SocketTuning& getTuning() const noexcept { return m_oTuning; }
+	/** The socket options applied by the kernel.
+	 * Set by createListener(), all 0 before.
+	 * @return The options.
+	 */
+	const BtGtkDeviceManager::SocketTuning& getAppliedTuning() const noexcept { return m_oAppliedTuning; }
+
+	/** The number of local adapters the transport listens on.
+	 * Set by createListener(). Is 1 unless listening on each bluetooth adapter separately.
+	 * @return The number of adapters.
+	 */
+	int32_t getTotAdapters() const noexcept { return m_nTotAdapters; }
+	/** The address of a local adapter.
+	 * @param nAdapterIdx The index. Must be from 0 to getTotAdapters() - 1.
+	 * @return The address or all zeroes if the listener isn't bound to an adapter.
+	 */
+	virtual bdaddr_t getAdapterAddr(int32_t nAdapterIdx) const noexcept;
+	/** The adapter a connection was accepted on.
+	 * Can be called by any thread.
+	 * @param nClientFD The connection returned by acceptClient().
+	 * @return The index of the adapter.
+	 */
+	virtual int32_t getAdapterIdx(int32_t nClientFD) const noexcept;
+	/** Tells that a connection returned by acceptClient() was closed or won't be served.
+	 * Can be called by any thread.
+	 * @param nAdapterIdx The adapter of the connection as returned by getAdapterIdx().
+	 */
+	void releaseAdapterConnection(int32_t nAdapterIdx) noexcept;
+	/** The counters of an adapter.
+	 * @param nAdapterIdx The index. Must be from 0 to getTotAdapters() - 1.
+	 * @return The counters.
+	 */
+	const BlueAdapterCounters& getAdapterCounters(int32_t nAdapterIdx) const noexcept;
+protected:
+	/** Constructor.
+	 * @param nListenBacklog The backlog passed to listen(). If not positive SOMAXCONN.
+	 * @param oTuning The socket options.
+	 * @param nAdapterLoadMargin If positive connections on an adapter with at least this number
+	 *                           of open connections more than the least loaded adapter are refused.
+	 */
+	ServerTransport(int32_t nListenBacklog, const BtGtkDeviceManager::SocketTuning& oTuning
+					, int32_t nAdapterLoadMargin) noexcept;
+	/** Sets the number of adapters and resets their counters.
+	 * Must be called by createListener() implementations before returning the socket.
+	 * @param nTotAdapters The number of adapters. Must be positive.
+	 */
+	void initAdapters(int32_t nTotAdapters) noexcept;
+	/** Sets the buffer sizes of a socket.
+	 * Called by createListener() implementations for the listening socket
+	 * and by acceptClient() for each connection, since they aren't inherited.
+	 * @param nFD The socket.
+	 * @return Whether successful (errno is set if not).
+	 */
+	bool setBufferSizes(int32_t nFD) noexcept;
+	/** Sets the applied buffer sizes to those reported by the listening socket.
+	 * @param nListenerFD The listening socket.
+	 */
+	void readAppliedBufferSizes(int32_t nListenerFD) noexcept;
+	/** The applied socket options, to be set by createListener() implementations.
+	 * @return The options.
+	 */
+	BtGtkDeviceManager::SocketTuning& appliedTuning() noexcept { return m_oAppliedTuning; }
+	/** Accepts a connection with accept4(SOCK_NONBLOCK | SOCK_CLOEXEC).
+	 * @see acceptClient().
+	 */
+	virtual int32_t acceptClientImpl(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept = 0;
+private:
+	bool isAdapterOverloaded(int32_t nAdapterIdx) const noexcept;
+private:
+	const int32_t m_nListenBacklog;
+	const BtGtkDeviceManager::SocketTuning m_oTuning;
+	const int32_t m_nAdapterLoadMargin;
+	BtGtkDeviceManager::SocketTuning m_oAppliedTuning;
+	BlueAcceptCounters m_oAcceptCounters;
+	int32_t m_nTotAdapters;
+	std::unique_ptr<BlueAdapterCounters[]> m_aAdapterCounters; // Size: m_nTotAdapters
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Bluetooth L2CAP transport.
+ * Listens on a port either of all adapters with a single socket, the kernel
+ * choosing the adapter of a connection, or of each adapter that is up with a
+ * socket per adapter. In the latter case the socket returned by createListener()
+ * is an epoll instance that is readable when any of the adapters' sockets is.
+ */
+class L2capServerTransport final : public ServerTransport
+{
+public:
+	/** Constructor.
+	 * @param nL2capPort The port.
+	 * @param bPerAdapter Whether to listen on each adapter separately.
+	 * @param nAdapterLoadMargin See ServerTransport(). Only used if bPerAdapter is true.
+	 * @param nListenBacklog The backlog passed to listen(). If not positive SOMAXCONN.
+	 * @param oTuning The socket options.
+	 */
+	L2capServerTransport(int32_t nL2capPort, bool bPerAdapter, int32_t nAdapterLoadMargin, int32_t nListenBacklog
+						, const BtGtkDeviceManager::SocketTuning& oTuning) noexcept;
+	~L2capServerTransport() noexcept;
+
+	int32_t createListener(const std::string& sCaller, std::string& sError) noexcept override;
+	std::string getDescription() const noexcept override;
+	bdaddr_t getAdapterAddr(int32_t nAdapterIdx) const noexcept override;
+	int32_t getAdapterIdx(int32_t nClientFD) const noexcept override;
+protected:
+	int32_t acceptClientImpl(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept override;
+private:
+	// Creates a listening socket bound to the port of the given adapter (BDADDR_ANY for all)
+	int32_t createAdapterListener(const bdaddr_t& oAdapterAddr, const std::string& sCaller, std::string& sError) noexcept;
+	// Sets the L2CAP options of the listening socket, inherited by the connections
+	bool setL2capOptions(int32_t nListenerFD, const std::string& sCaller, std::string& sError) noexcept;
+	void readAppliedL2capOptions(int32_t nListenerFD) noexcept;
+	void closeAdapterListeners() noexcept;
+	static int32_t acceptOn(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept;
+private:
+	const int32_t m_nL2capPort;
+	const bool m_bPerAdapter;
+	std::vector<bdaddr_t> m_aAdapterAddrs; // If m_bPerAdapter the addresses of the adapters
+	std::vector<int32_t> m_aAdapterListenerFDs; // If m_bPerAdapter the listeners, same index as m_aAdapterAddrs
+	int32_t m_nNextAdapterIdx; // The adapter accepted from first, rotates for fairness
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Local (AF_UNIX) transport.
+ * Allows to run the whole server without bluetooth hardware, for tests and benchmarks.
+ *
+ * A client that binds its socket to the abstract name PACKET_UNIX_CLIENT_NAME_PREFIX
+ * followed by an address ("XX:XX:XX:XX:XX:XX") is identified by that address,
+ * and is therefore recognized when it reconnects. Other clients get a new
+ * address of the form 00:00:00:XX:XX:XX for each connection.
+ */
+class UnixServerTransport final : public ServerTransport
+{
+public:
+	/** Constructor.
+	 * @param sPath The path of the socket. If it starts with '@' it's an abstract name.
+	 * @param nListenBacklog The backlog passed to listen(). If not positive SOMAXCONN.
+	 * @param oTuning The socket options. Only the buffer sizes apply.
+	 */
+	UnixServerTransport(const std::string& sPath, int32_t nListenBacklog
+						, const BtGtkDeviceManager::SocketTuning& oTuning) noexcept;
+	~UnixServerTransport() noexcept;
+
+	int32_t createListener(const std::string& sCaller, std::string& sError) noexcept override;
+	std::string getDescription() const noexcept override;
+protected:
+	int32_t acceptClientImpl(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept override;
+private:
+	const std::string m_sPath;
+	bool m_bUnlinkPath; // Whether the socket file was created by createListener()
+	uint32_t m_nAnonymousCounter;
+};
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
+
+#endif /* STMI_BLUE_TRANSPORT_H */
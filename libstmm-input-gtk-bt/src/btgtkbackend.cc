@@ -22,8 +22,12 @@
 
 #include "btgtkdevicemanager.h"
 #include "bluetoothsources.h"
+#include "bluetooththreadsource.h"
+#include "bluetransport.h"
 #include "keypacket.h"
+#include "packetreplay.h"
 
+#include <stmm-input/devicemanager.h>
 #include <stmm-input/hardwarekey.h>
 #include <stmm-input-ev/keyevent.h>
 
@@ -37,6 +41,7 @@
 #include <bluetooth/l2cap.h>
 
 #include <string.h>
+#include <unistd.h>
 
 namespace stmi
 {
@@ -48,9 +53,9 @@ namespace Bt
 
 static const int32_t s_nL2capPort = 0x20A1;
 
-std::pair<unique_ptr<GtkBackend>, std::string> GtkBackend::create(BtGtkDeviceManager* p0Owner, const std::string& sAppName) noexcept
+std::pair<unique_ptr<GtkBackend>, std::string> GtkBackend::create(BtGtkDeviceManager* p0Owner, const BtGtkDeviceManager::Init& oInit) noexcept
 {
-	auto refBackend = std::unique_ptr<GtkBackend>(new GtkBackend(p0Owner, sAppName));
+	auto refBackend = std::unique_ptr<GtkBackend>(new GtkBackend(p0Owner, oInit));
 	auto sError = refBackend->initServer();
 	if (! sError.empty()) {
 		return std::make_pair(unique_ptr<GtkBackend>{}, std::move(sError));
@@ -58,39 +63,119 @@ std::pair<unique_ptr<GtkBackend>, std::string> GtkBackend::create(BtGtkDeviceMan
 	return std::make_pair(std::move(refBackend), std::move(sError));
 }
 
-GtkBackend::GtkBackend(BtGtkDeviceManager* p0Owner, const std::string& sAppName) noexcept
+GtkBackend::GtkBackend(BtGtkDeviceManager* p0Owner, const BtGtkDeviceManager::Init& oInit) noexcept
 : m_p0Owner(p0Owner)
-, m_sAppName(sAppName)
+, m_sAppName(oInit.m_sAppName)
+, m_eReceiveEngine(oInit.m_eReceiveEngine)
+, m_nReceiveThreadRingSize(std::max<int32_t>(1, oInit.m_nReceiveThreadRingSize))
+, m_sLocalSocketPath(oInit.m_sLocalSocketPath)
+, m_nListenBacklog(oInit.m_nListenBacklog)
+, m_bListenPerAdapter(oInit.m_bListenPerAdapter)
+, m_nAdapterLoadMargin(oInit.m_nAdapterLoadMargin)
+, m_oSocketTuning(oInit.m_oSocketTuning)
+, m_sCaptureFilePath(oInit.m_sCaptureFilePath)
+, m_nReconnects(0)
+, m_nChordBackendId(-1)
 {
 	assert(p0Owner != nullptr);
+	m_oReceiveOptions.m_nBatchSize = std::max<int32_t>(1, oInit.m_nReceiveBatchSize);
+	m_oReceiveOptions.m_nMaxPerDispatch = std::max<int32_t>(1, oInit.m_nReceiveMaxPerDispatch);
+	m_oReceiveOptions.m_bKernelTimestamps = oInit.m_bReceiveKernelTimestamps;
+	// datagrams can be as long as the incoming MTU
+	m_oReceiveOptions.m_nMaxDatagramSize = std::max<int32_t>(L2CAP_DEFAULT_MTU
+															, std::min<int32_t>(oInit.m_oSocketTuning.m_nInMtu, 0xFFFF));
 }
 GtkBackend::~GtkBackend() noexcept
 {
 	if (m_refServerAccept) {
 		m_refServerAccept->destroy();
 	}
+	if (m_refServerEpoll) {
+		m_refServerEpoll->destroy();
+	}
+	if (m_refServerThread) {
+		m_refServerThread->stop();
+		m_refServerThread->destroy();
+	}
+	if (! m_refTransport) {
+		return; //--------------------------------------------------------------
+	}
 	if (! m_sAppName.empty()) {
 		std::cout << m_sAppName << ": ";
 	}
-	std::cout << "Bluetooth btkeys server stopped on L2CAP port " << s_nL2capPort << '\n';
+	std::cout << "Bluetooth btkeys server stopped on " << m_refTransport->getDescription() << '\n';
 }
 std::string GtkBackend::initServer() noexcept
 {
-	//TODO pass -1 and let the bind choose the port
-	// then spawn a SDP entry process to publicize the port
-	m_refServerAccept = Glib::RefPtr<BlueServerAcceptSource>(new BlueServerAcceptSource(s_nL2capPort));
-	if (! m_refServerAccept->getErrorStr().empty()) {
-		std::string sError = "Bluetooth error (initServer):\n -> " + m_refServerAccept->getErrorStr();
-		return sError; //-------------------------------------------------------
+	if (! m_sCaptureFilePath.empty()) {
+		auto refCapture = std::make_shared<PacketCaptureWriter>();
+		std::string sError;
+		if (! refCapture->open(m_sCaptureFilePath, sError)) {
+			return "Bluetooth error (initServer):\n -> " + sError; //-------------
+		}
+		m_oReceiveOptions.m_refCapture = std::move(refCapture);
+	}
+	if (m_sLocalSocketPath.empty()) {
+		//TODO pass -1 and let the bind choose the port
+		// then spawn a SDP entry process to publicize the port
+		m_refTransport = std::make_shared<L2capServerTransport>(s_nL2capPort, m_bListenPerAdapter, m_nAdapterLoadMargin
+																, m_nListenBacklog, m_oSocketTuning);
+	} else {
+		m_refTransport = std::make_shared<UnixServerTransport>(m_sLocalSocketPath, m_nListenBacklog, m_oSocketTuning);
+	}
+	if (m_eReceiveEngine == BtGtkDeviceManager::RECEIVE_ENGINE_THREAD) {
+		m_refServerThread = Glib::RefPtr<BlueServerThreadSource>(new BlueServerThreadSource(m_refTransport
+																		, m_oReceiveOptions, m_nReceiveThreadRingSize));
+		if (! m_refServerThread->getErrorStr().empty()) {
+			std::string sError = "Bluetooth error (initServer):\n -> " + m_refServerThread->getErrorStr();
+			return sError; //---------------------------------------------------
+		}
+	} else if (m_eReceiveEngine == BtGtkDeviceManager::RECEIVE_ENGINE_EPOLL) {
+		m_refServerEpoll = Glib::RefPtr<BlueServerEpollSource>(new BlueServerEpollSource(m_refTransport
+																						, m_oReceiveOptions));
+		if (! m_refServerEpoll->getErrorStr().empty()) {
+			std::string sError = "Bluetooth error (initServer):\n -> " + m_refServerEpoll->getErrorStr();
+			return sError; //---------------------------------------------------
+		}
+	} else {
+		m_refServerAccept = Glib::RefPtr<BlueServerAcceptSource>(new BlueServerAcceptSource(m_refTransport));
+		if (! m_refServerAccept->getErrorStr().empty()) {
+			std::string sError = "Bluetooth error (initServer):\n -> " + m_refServerAccept->getErrorStr();
+			return sError; //---------------------------------------------------
+		}
+	}
+	if (m_refServerThread) {
+		auto oConnection = m_refServerThread->connect(sigc::mem_fun(this, &GtkBackend::doServerThreadConnected)
+													, sigc::mem_fun(this, &GtkBackend::doServerReceive));
+		if (! oConnection.connected()) {
+			std::string sError = "Bluetooth error (initServer):\n -> " + m_refServerThread->getErrorStr();
+			return sError; //---------------------------------------------------
+		}
+		m_refServerThread->attach();
+	} else if (m_refServerEpoll) {
+		m_refServerEpoll->connect(sigc::mem_fun(this, &GtkBackend::doServerAcceptClient)
+								, sigc::mem_fun(this, &GtkBackend::doServerReceive));
+		m_refServerEpoll->attach();
+	} else {
+		m_refServerAccept->connect(sigc::mem_fun(this, &GtkBackend::doServerAcceptClient));
+		m_refServerAccept->attach();
 	}
 	if (! m_sAppName.empty()) {
 		std::cout << m_sAppName << ": ";
 	}
-	std::cout << "Bluetooth btkeys server started on L2CAP port " << s_nL2capPort << '\n';
-	m_refServerAccept->connect(sigc::mem_fun(this, &GtkBackend::doServerAcceptClient));
-	m_refServerAccept->attach();
+	std::cout << "Bluetooth btkeys server started on " << m_refTransport->getDescription() << '\n';
 	return "";
 }
+int64_t GtkBackend::replayCapture(const std::string& sPath, bool bOriginalPacing, std::string& sError) noexcept
+{
+	PacketReplay oReplay(m_oReceiveOptions);
+	if (! oReplay.open(sPath, sError)) {
+		return -1; //-----------------------------------------------------------
+	}
+	// the replayed connections are like those of the receiver thread
+	return oReplay.replay(sigc::mem_fun(this, &GtkBackend::doServerThreadConnected)
+						, sigc::mem_fun(this, &GtkBackend::doServerReceive), bOriginalPacing, sError);
+}
 int32_t GtkBackend::getBackendId(const std::vector<bdaddr_t>& aAddrs, const bdaddr_t& oBdAddr) noexcept
 {
 	auto itFind = std::find_if(aAddrs.begin(), aAddrs.end(), [&](const bdaddr_t& oCurBdAddr)
@@ -104,69 +189,229 @@ int32_t GtkBackend::getBackendId(const std::vector<bdaddr_t>& aAddrs, const bdad
 }
 int32_t GtkBackend::getBackendId(const bdaddr_t& oBdAddr) const noexcept
 {
-	return getBackendId(m_aPermanentAddrs, oBdAddr);
+	auto itFind = m_oBackendIds.find(oBdAddr);
+	if (itFind == m_oBackendIds.end()) {
+		return -1; //-----------------------------------------------------------
+	}
+	return itFind->second;
 }
-bool GtkBackend::doServerAcceptClient(int32_t nClientFD, const struct sockaddr_l2& oClientAddr) noexcept
+int32_t GtkBackend::assignBackendId(const bdaddr_t& oClientBdAddr, bool& bKnownDevice) noexcept
 {
-	const bdaddr_t& oClientBdAddr = oClientAddr.l2_bdaddr;
 	int32_t nBackendId = getBackendId(oClientBdAddr);
-	const bool bKnownDevice = (nBackendId >= 0);
+	bKnownDevice = (nBackendId >= 0);
 	if (! bKnownDevice) {
-		bdaddr_t oEmptyBdAddr;
-		resetBdAddr(oEmptyBdAddr);
-		nBackendId = getBackendId(oEmptyBdAddr);
+		DeviceData oData;
+		oData.m_oBdAddr = oClientBdAddr;
+		nBackendId = m_oDevices.insert(std::move(oData));
 		if (nBackendId < 0) {
-			nBackendId = static_cast<int32_t>(m_aPermanentAddrs.size());
-			m_aPermanentAddrs.push_back(oClientBdAddr);
-			m_aInputSources.push_back({});
-		} else {
-			m_aPermanentAddrs[nBackendId] = oClientBdAddr;
-			assert(! m_aInputSources[nBackendId]);
+			return -1; //-------------------------------------------------------
 		}
+		m_oBackendIds.emplace(oClientBdAddr, nBackendId);
 	} else {
-		auto& refSource = m_aInputSources[nBackendId];
+		DeviceData& oData = *m_oDevices.find(nBackendId);
+		auto& refSource = oData.m_refInputSource;
 		if (refSource) {
 			refSource->destroy();
 			refSource.reset();
 		}
+		// the old connection is replaced
+		releaseAdapterConnection(oData.m_nAdapterIdx);
 	}
-	auto& refSource = m_aInputSources[nBackendId];
-	refSource = Glib::RefPtr<BlueServerReceiveSource>(new BlueServerReceiveSource(nBackendId, nClientFD));
-	refSource->connect(sigc::mem_fun(this, &GtkBackend::doServerReceive));
-	refSource->attach();
+	return nBackendId;
+}
+void GtkBackend::releaseBackendId(int32_t nBackendId) noexcept
+{
+	DeviceData* p0Data = m_oDevices.find(nBackendId);
+	assert(p0Data != nullptr);
+	m_oBackendIds.erase(p0Data->m_oBdAddr);
+	m_oDevices.erase(nBackendId);
+}
+void GtkBackend::releaseAdapterConnection(int32_t& nAdapterIdx) noexcept
+{
+	if (nAdapterIdx < 0) {
+		return; //--------------------------------------------------------------
+	}
+	if (m_refTransport) {
+		m_refTransport->releaseAdapterConnection(nAdapterIdx);
+	}
+	nAdapterIdx = -1;
+}
+bool GtkBackend::doServerAcceptClient(int32_t nClientFD, const bdaddr_t& oClientBdAddr) noexcept
+{
+	int32_t nAdapterIdx = m_refTransport->getAdapterIdx(nClientFD);
+	bool bKnownDevice;
+	const int32_t nBackendId = assignBackendId(oClientBdAddr, bKnownDevice);
+	if (nBackendId < 0) {
+		std::cerr << "Bluetooth: too many devices, connection of " << getBdAddrAsString(oClientBdAddr) << " refused" << '\n';
+		::close(nClientFD);
+		m_refTransport->getAcceptCounters().incRefused();
+		releaseAdapterConnection(nAdapterIdx);
+		return true; //---------------------------------------------------------
+	}
+	auto refCounters = std::make_shared<BlueReceiveCounters>();
+	if (m_refServerEpoll) {
+		// replaces the old connection if known device
+		const bool bAdded = m_refServerEpoll->addClient(nBackendId, nClientFD, refCounters);
+		if (! bAdded) {
+			m_refTransport->getAcceptCounters().incRefused();
+			releaseAdapterConnection(nAdapterIdx);
+			if (! bKnownDevice) {
+				releaseBackendId(nBackendId);
+			}
+			return true; //-----------------------------------------------------
+		}
+	} else {
+		auto& refSource = m_oDevices.find(nBackendId)->m_refInputSource;
+		refSource = Glib::RefPtr<BlueServerReceiveSource>(new BlueServerReceiveSource(nBackendId, nClientFD
+																					, m_oReceiveOptions, refCounters));
+		refSource->connect(sigc::mem_fun(this, &GtkBackend::doServerReceive));
+		refSource->attach();
+	}
+	setReceiveCounters(nBackendId, bKnownDevice, refCounters);
+	m_oDevices.find(nBackendId)->m_nAdapterIdx = nAdapterIdx;
 
 	if (! bKnownDevice) {
 		m_p0Owner->onDeviceAdded(getBdAddrAsString(oClientBdAddr), nBackendId);
 	}
 	return true;
 }
-bool GtkBackend::doServerReceive(int32_t nBackendId, bool bRemove, const KeyPacket& oPkt) noexcept
+int32_t GtkBackend::doServerThreadConnected(const bdaddr_t& oClientBdAddr, int32_t nAdapterIdx
+											, const shared_ptr<BlueReceiveCounters>& refCounters) noexcept
+{
+	bool bKnownDevice;
+	const int32_t nBackendId = assignBackendId(oClientBdAddr, bKnownDevice);
+	if (nBackendId < 0) {
+		std::cerr << "Bluetooth: too many devices, connection of " << getBdAddrAsString(oClientBdAddr) << " ignored" << '\n';
+		if (m_refTransport) {
+			m_refTransport->getAcceptCounters().incRefused();
+		}
+		releaseAdapterConnection(nAdapterIdx);
+		return -1; //-----------------------------------------------------------
+	}
+	setReceiveCounters(nBackendId, bKnownDevice, refCounters);
+	m_oDevices.find(nBackendId)->m_nAdapterIdx = nAdapterIdx;
+	if (! bKnownDevice) {
+		m_p0Owner->onDeviceAdded(getBdAddrAsString(oClientBdAddr), nBackendId);
+	}
+	return nBackendId;
+}
+void GtkBackend::setReceiveCounters(int32_t nBackendId, bool bKnownDevice, const shared_ptr<BlueReceiveCounters>& refCounters) noexcept
+{
+	assert(refCounters);
+	DeviceData& oData = *m_oDevices.find(nBackendId);
+	auto& refCurCounters = oData.m_refReceiveCounters;
+	if (bKnownDevice && refCurCounters) {
+		refCurCounters->addTo(oData.m_oPastReceiveStats);
+	}
+	if (bKnownDevice) {
+		++m_nReconnects;
+	}
+	oData.m_nConnectTimeUsec = DeviceManager::getNowTimeMicroseconds();
+	refCurCounters = refCounters;
+}
+void GtkBackend::addServerStats(BtGtkDeviceManager::ServerStats& oStats) const noexcept
+{
+	if (m_refTransport) {
+		m_refTransport->getAcceptCounters().addTo(oStats);
+	}
+	oStats.m_nReconnects += m_nReconnects;
+	for (int32_t nIdx = 0; nIdx < BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets; ++nIdx) {
+		oStats.m_aFirstKeyHistogram[nIdx] += m_aFirstKeyHistogram[nIdx];
+	}
+}
+void GtkBackend::getAdapterStats(std::vector<BtGtkDeviceManager::AdapterStats>& aStats) const noexcept
+{
+	aStats.clear();
+	if (! m_refTransport) {
+		return; //--------------------------------------------------------------
+	}
+	const int32_t nTotAdapters = m_refTransport->getTotAdapters();
+	for (int32_t nAdapterIdx = 0; nAdapterIdx < nTotAdapters; ++nAdapterIdx) {
+		const BlueAdapterCounters& oCounters = m_refTransport->getAdapterCounters(nAdapterIdx);
+		BtGtkDeviceManager::AdapterStats oStats;
+		oStats.m_sAddress = getBdAddrAsString(m_refTransport->getAdapterAddr(nAdapterIdx));
+		oStats.m_nConnections = oCounters.m_nConnections.load(std::memory_order_relaxed);
+		oStats.m_nAccepted = oCounters.m_nAccepted.load(std::memory_order_relaxed);
+		oStats.m_nRefused = oCounters.m_nRefused.load(std::memory_order_relaxed);
+		aStats.push_back(std::move(oStats));
+	}
+}
+bool GtkBackend::getAppliedSocketTuning(BtGtkDeviceManager::SocketTuning& oApplied) const noexcept
+{
+	if (! m_refTransport) {
+		return false; //--------------------------------------------------------
+	}
+	oApplied = m_refTransport->getAppliedTuning();
+	return true;
+}
+void GtkBackend::addReceiveStats(int32_t nBackendId, BtGtkDeviceManager::DeviceStats& oStats) const noexcept
 {
-	assert((nBackendId >= 0) && (nBackendId < static_cast<int32_t>(m_aInputSources.size())));
+	const DeviceData* p0Data = m_oDevices.find(nBackendId);
+	if (p0Data == nullptr) {
+		return; //--------------------------------------------------------------
+	}
+	mergeReceiveStats(p0Data->m_oPastReceiveStats, oStats);
+	const auto& refCurCounters = p0Data->m_refReceiveCounters;
+	if (refCurCounters) {
+		refCurCounters->addTo(oStats);
+	}
+}
+bool GtkBackend::doServerReceive(int32_t nBackendId, bool bRemove, const KeyPacket& oPkt, int64_t nTimeUsec) noexcept
+{
+	DeviceData* p0Data = m_oDevices.find(nBackendId);
+	if (p0Data == nullptr) {
+		// stale id of a removed device
+		return false; //--------------------------------------------------------
+	}
+	if (((oPkt.m_nCmd == PACKET_CMD_KEY) || (oPkt.m_nCmd == PACKET_CMD_CHORD)) && (p0Data->m_nConnectTimeUsec >= 0)) {
+		// first key of the connection, the capture time of a v2 key might date it
+		// back to before the connection was accepted
+		++m_aFirstKeyHistogram[getStatsBucket(std::max<int64_t>(0, nTimeUsec - p0Data->m_nConnectTimeUsec))];
+		p0Data->m_nConnectTimeUsec = -1;
+	}
+	if (oPkt.m_nCmd == PACKET_CMD_CHORD) {
+		// keep the chord's keys until the last one is received
+		if (m_nChordBackendId != nBackendId) {
+			m_aChordKeys.clear();
+			m_nChordBackendId = nBackendId;
+		}
+		m_aChordKeys.push_back(std::make_pair(static_cast<KeyEvent::KEY_INPUT_TYPE>(oPkt.m_nKeyType)
+											, static_cast<HARDWARE_KEY>(oPkt.m_nHardwareKey)));
+		return true; //---------------------------------------------------------
+	}
 	if (oPkt.m_nCmd == PACKET_CMD_KEY) {
+		assert(m_p0Owner != nullptr);
+		bool bContinue = true;
+		if (m_nChordBackendId == nBackendId) {
+			// last key of a chord: deliver all its keys in one go
+			for (const auto& oChordKey : m_aChordKeys) {
+				bContinue = m_p0Owner->onBlueKey(nBackendId, oChordKey.first, oChordKey.second, nTimeUsec) && bContinue;
+			}
+			m_aChordKeys.clear();
+			m_nChordBackendId = -1;
+		}
 		const auto eType = static_cast<KeyEvent::KEY_INPUT_TYPE>(oPkt.m_nKeyType);
 		const auto eHK = static_cast<HARDWARE_KEY>(oPkt.m_nHardwareKey);
-		assert(m_p0Owner != nullptr);
-		const bool bContinue = m_p0Owner->onBlueKey(nBackendId, eType, eHK);
+		bContinue = m_p0Owner->onBlueKey(nBackendId, eType, eHK, nTimeUsec) && bContinue;
 		return bContinue; //----------------------------------------------------
 	}
-	m_aInputSources[nBackendId].reset();
+	if (m_nChordBackendId == nBackendId) {
+		// connection closed in the middle of a chord
+		m_aChordKeys.clear();
+		m_nChordBackendId = -1;
+	}
+	p0Data->m_refInputSource.reset();
+	releaseAdapterConnection(p0Data->m_nAdapterIdx);
 	if (bRemove) {
 		assert(oPkt.m_nCmd == PACKET_CMD_REMOVE_DEVICE);
-		assert((nBackendId >= 0) && (nBackendId < static_cast<int32_t>(m_aPermanentAddrs.size())));
-		resetBdAddr(m_aPermanentAddrs[nBackendId]);
+		releaseBackendId(nBackendId);
 		m_p0Owner->onDeviceRemoved(nBackendId);
 	}
 	return false;
 }
-void GtkBackend::resetBdAddr(bdaddr_t& oBdAddr) noexcept
-{
-	memset(static_cast<void*>(&oBdAddr), 0, sizeof(bdaddr_t));
-}
 bool GtkBackend::isEmptyBdAddr(const bdaddr_t& oBdAddr) noexcept
 {
-	bdaddr_t oEmptyBdAddr;
-	resetBdAddr(oEmptyBdAddr);
+	const bdaddr_t oEmptyBdAddr{};
 	return (bacmp(&oEmptyBdAddr, &oBdAddr) == 0);
 }
 std::string GtkBackend::getBdAddrAsString(const bdaddr_t& oBdAddr) noexcept
@@ -22,14 +22,20 @@
 #define STMI_BT_GTK_BACKEND_H
 
 #include "btgtkdevicemanager.h"
+#include "bluetoothsources.h"
+#include "bluetransport.h"
+#include "btstats.h"
+#include "slotmap.h"
 
 #include <stmm-input-ev/keyevent.h>
 #include <stmm-input/hardwarekey.h>
 
 #include <gtkmm.h>
 
+#include <array>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -50,6 +56,8 @@ using std::weak_ptr;
 
 class BlueServerAcceptSource;
 class BlueServerReceiveSource;
+class BlueServerEpollSource;
+class BlueServerThreadSource;
 struct KeyPacket;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -57,12 +65,12 @@ class GtkBackend
 {
 public:
 	// returns backend and empty string or null and error string.
-	static std::pair<unique_ptr<GtkBackend>, std::string> create(BtGtkDeviceManager* p0Owner, const std::string& sAppName) noexcept;
+	static std::pair<unique_ptr<GtkBackend>, std::string> create(BtGtkDeviceManager* p0Owner, const BtGtkDeviceManager::Init& oInit) noexcept;
 
 	virtual ~GtkBackend() noexcept;
 protected:
-	//friend unique_ptr<GtkBackend> create(BtGtkDeviceManager* p0Owner, const std::string& sAppName);
-	GtkBackend(BtGtkDeviceManager* p0Owner, const std::string& sAppName) noexcept;
+	//friend unique_ptr<GtkBackend> create(BtGtkDeviceManager* p0Owner, const BtGtkDeviceManager::Init& oInit);
+	GtkBackend(BtGtkDeviceManager* p0Owner, const BtGtkDeviceManager::Init& oInit) noexcept;
 	// returns error string if failed
 	std::string initServer() noexcept;
 
@@ -76,42 +84,106 @@ protected:
 	{
 		m_p0Owner->onDeviceAdded(sName, nBackendId);
 	}
-	bool onBlueKey(int32_t nBackendId, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK) noexcept
+	bool onBlueKey(int32_t nBackendId, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK, int64_t nTimeUsec) noexcept
 	{
-		return m_p0Owner->onBlueKey(nBackendId, eType, eHK);
+		return m_p0Owner->onBlueKey(nBackendId, eType, eHK, nTimeUsec);
 	}
+	// For FakeGtkBackend: replays a capture file (see BtGtkDeviceManager::Init::m_sCaptureFilePath)
+	// through the client receivers and the packet dispatch of the server.
+	// The devices get the addresses of PacketReplay::getReplayBdAddr().
+	// Returns the number of datagrams replayed or -1 and sets sError.
+	int64_t replayCapture(const std::string& sPath, bool bOriginalPacing, std::string& sError) noexcept;
 
 	// -1 if device unknown
 	int32_t getBackendId(const bdaddr_t& oBdAddr) const noexcept;
 	// -1 if device not in vector, oBdAddr can be [0,0,0,0,0,0]
 	static int32_t getBackendId(const std::vector<bdaddr_t>& aAddrs, const bdaddr_t& oBdAddr) noexcept;
-	// sets to 0
-	static void resetBdAddr(bdaddr_t& oBdAddr) noexcept;
 	// tells whether 0
 	static bool isEmptyBdAddr(const bdaddr_t& oBdAddr) noexcept;
 	// ba2str wrapper
 	static std::string getBdAddrAsString(const bdaddr_t& oBdAddr) noexcept;
+
+	// For BtGtkDeviceManager's diagnostics
+	friend class ::stmi::BtGtkDeviceManager;
+	// Adds the connection counters to oStats
+	void addServerStats(BtGtkDeviceManager::ServerStats& oStats) const noexcept;
+	// Sets the counters of the adapters the server listens on, empty if no transport
+	void getAdapterStats(std::vector<BtGtkDeviceManager::AdapterStats>& aStats) const noexcept;
+	// Sets the socket options applied by the kernel, false if no transport
+	bool getAppliedSocketTuning(BtGtkDeviceManager::SocketTuning& oApplied) const noexcept;
+	// Adds the receive counters of a device to oStats, nothing if unknown id
+	void addReceiveStats(int32_t nBackendId, BtGtkDeviceManager::DeviceStats& oStats) const noexcept;
 private:
+	// returns the id of the (possibly new) device with the given address
+	// or -1 if there are too many devices
+	int32_t assignBackendId(const bdaddr_t& oClientBdAddr, bool& bKnownDevice) noexcept;
+	void releaseBackendId(int32_t nBackendId) noexcept;
 		// device has connected
-	bool doServerAcceptClient(int32_t nClientFD, const struct sockaddr_l2& oClientAddr) noexcept;
+	bool doServerAcceptClient(int32_t nClientFD, const bdaddr_t& oClientBdAddr) noexcept;
+		// device has connected (RECEIVE_ENGINE_THREAD)
+	int32_t doServerThreadConnected(const bdaddr_t& oClientBdAddr, int32_t nAdapterIdx
+									, const shared_ptr<BlueReceiveCounters>& refCounters) noexcept;
+	// sets the counters and the connect time of the device's new connection
+	void setReceiveCounters(int32_t nBackendId, bool bKnownDevice, const shared_ptr<BlueReceiveCounters>& refCounters) noexcept;
+	// tells the transport a connection on the adapter is closed and sets nAdapterIdx to -1
+	// nothing if already -1
+	void releaseAdapterConnection(int32_t& nAdapterIdx) noexcept;
 	// data received from device
-	bool doServerReceive(int32_t nBackendId, bool bRemove, const KeyPacket& oPkt) noexcept;
+	bool doServerReceive(int32_t nBackendId, bool bRemove, const KeyPacket& oPkt, int64_t nTimeUsec) noexcept;
 
 private:
 	BtGtkDeviceManager* m_p0Owner;
 	std::string m_sAppName;
-
+	BlueReceiveOptions m_oReceiveOptions;
+	const BtGtkDeviceManager::RECEIVE_ENGINE m_eReceiveEngine;
+	const int32_t m_nReceiveThreadRingSize;
+	const std::string m_sLocalSocketPath;
+	const int32_t m_nListenBacklog;
+	const bool m_bListenPerAdapter;
+	const int32_t m_nAdapterLoadMargin;
+	const BtGtkDeviceManager::SocketTuning m_oSocketTuning;
+	const std::string m_sCaptureFilePath;
+	// Shared by the server source
+	std::shared_ptr<ServerTransport> m_refTransport;
+
+	// RECEIVE_ENGINE_SOURCES
 	Glib::RefPtr<BlueServerAcceptSource> m_refServerAccept;
+	// RECEIVE_ENGINE_EPOLL
+	Glib::RefPtr<BlueServerEpollSource> m_refServerEpoll;
+	// RECEIVE_ENGINE_THREAD
+	Glib::RefPtr<BlueServerThreadSource> m_refServerThread;
 
 	// Bluetooth devices are only removed if a disconnect command is sent by the client
 	// If a device gets disconnected the device manager keeps the device alive
 	// while the backend waits for it to reconnect (on a different socket!) but
 	// with the unique bluetooth address to identify it!
-	// This vector never shrinks, at most a value is set to null when a client
-	// disconnects (explicitely or because out of range).
-	// This allows to use the index as id.
-	std::vector< bdaddr_t > m_aPermanentAddrs;
-	std::vector< Glib::RefPtr<BlueServerReceiveSource> > m_aInputSources; // Size: m_aPermanentAddrs.size()
+	// A device is removed from the slot map when the client sends the remove
+	// command, which frees its slot (and id) for the next new device.
+	struct DeviceData
+	{
+		bdaddr_t m_oBdAddr;
+		Glib::RefPtr<BlueServerReceiveSource> m_refInputSource; // RECEIVE_ENGINE_SOURCES only
+		// The counters of the current (or last) connection
+		shared_ptr<BlueReceiveCounters> m_refReceiveCounters;
+		// The counters of the previous connections
+		BtGtkDeviceManager::DeviceStats m_oPastReceiveStats;
+		// The time the current connection was accepted, -1 once its first key was received
+		int64_t m_nConnectTimeUsec = -1;
+		// The adapter of the current connection, -1 if not connected
+		int32_t m_nAdapterIdx = -1;
+	};
+	// Backend ids are SlotMap ids: a removed device's id is not reused
+	// as is even if its slot is. Use SlotMapBase::getIndex() to index
+	// tables kept in parallel.
+	SlotMap<DeviceData> m_oDevices; // Id: nBackendId
+	std::unordered_map<bdaddr_t, int32_t, BdAddrHash, BdAddrEqual> m_oBackendIds; // Key: address, Value: nBackendId
+
+	int64_t m_nReconnects;
+	std::array<int64_t, BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets> m_aFirstKeyHistogram{};
+
+	// The keys of the chord being received (PACKET_CMD_CHORD), delivered with the last one
+	int32_t m_nChordBackendId; // -1 if none
+	std::vector< std::pair<KeyEvent::KEY_INPUT_TYPE, HARDWARE_KEY> > m_aChordKeys;
 
 private:
 	GtkBackend(const GtkBackend& oSource) = delete;
@@ -23,6 +23,7 @@
 #include "btgtkkeysdevice.h"
 #include "btgtkwindowdata.h"
 #include "btgtkbackend.h"
+#include "slotmap.h"
 
 #include <stmm-input-ev/keyevent.h>
 
@@ -56,6 +57,8 @@ using Private::Bt::BtKeysDevice;
 using Private::Bt::GtkWindowData;
 using Private::Bt::GtkWindowDataFactory;
 using Private::Bt::BtGtkListenerExtraData;
+using Private::Bt::KeyDispatchSnapshot;
+using Private::SlotMapBase;
 
 #ifdef STMM_SNAP_PACKAGING
 static std::string getEnvString(const char* p0Name) noexcept
@@ -87,6 +90,14 @@ static bool execCmd(const char* sCmd, std::string& sResult, std::string& sError)
 
 std::pair<shared_ptr<BtGtkDeviceManager>, std::string> BtGtkDeviceManager::create(const std::string& sAppName
 																				, bool bEnableEventClasses, const std::vector<Event::Class>& aEnDisableEventClasses) noexcept
+{
+	Init oInit;
+	oInit.m_sAppName = sAppName;
+	oInit.m_bEnableEventClasses = bEnableEventClasses;
+	oInit.m_aEnDisableEventClasses = aEnDisableEventClasses;
+	return create(oInit);
+}
+std::pair<shared_ptr<BtGtkDeviceManager>, std::string> BtGtkDeviceManager::create(const Init& oInit) noexcept
 {
 	#ifdef STMM_SNAP_PACKAGING
 	{
@@ -105,9 +116,9 @@ std::pair<shared_ptr<BtGtkDeviceManager>, std::string> BtGtkDeviceManager::creat
 	}
 	#endif //STMM_SNAP_PACKAGING
 
-	shared_ptr<BtGtkDeviceManager> refInstance(new BtGtkDeviceManager(bEnableEventClasses, aEnDisableEventClasses));
+	shared_ptr<BtGtkDeviceManager> refInstance(new BtGtkDeviceManager(oInit.m_bEnableEventClasses, oInit.m_aEnDisableEventClasses));
 	//
-	auto oPairBackend = GtkBackend::create(refInstance.operator->(), sAppName);
+	auto oPairBackend = GtkBackend::create(refInstance.operator->(), oInit);
 	unique_ptr<GtkBackend>& refBackend = oPairBackend.first;
 	std::string& sError = oPairBackend.second;
 	if (! sError.empty()) {
@@ -123,6 +134,8 @@ BtGtkDeviceManager::BtGtkDeviceManager(bool bEnableEventClasses, const std::vect
 					, {Event::Class{typeid(DeviceMgmtEvent)}, Event::Class{typeid(KeyEvent)}}
 					, bEnableEventClasses, aEnDisableEventClasses)
 , m_nCancelingNestedDepth(0)
+, m_nKeySnapshotEpoch(1)
+, m_nKeyDispatchDepth(0)
 , m_nClassIdxKeyEvent(getEventClassIndex(Event::Class{typeid(KeyEvent)}))
 {
 }
@@ -145,7 +158,7 @@ void BtGtkDeviceManager::onDeviceAdded(const std::string& sName, int32_t nBacken
 	assert(std::dynamic_pointer_cast<BtGtkDeviceManager>(refChildThis));
 	auto refThis = std::static_pointer_cast<BtGtkDeviceManager>(refChildThis);
 	//
-	auto refNewDevice = std::make_shared<BtKeysDevice>(sName, refThis);
+	auto refNewDevice = std::make_shared<BtKeysDevice>(sName, refThis, nBackendId);
 	#ifndef NDEBUG
 	auto itFind = std::find_if(m_aBtDevices.begin(), m_aBtDevices.end()
 					, [&](const shared_ptr<Private::Bt::BtKeysDevice>& refDevice)
@@ -155,11 +168,13 @@ void BtGtkDeviceManager::onDeviceAdded(const std::string& sName, int32_t nBacken
 	#endif
 	assert(itFind == m_aBtDevices.end());
 	//
-	if (nBackendId >= static_cast<int32_t>(m_aBtDevices.size())) {
-		m_aBtDevices.resize(nBackendId + 1);
+	const int32_t nIdx = SlotMapBase::getIndex(nBackendId);
+	if (nIdx >= static_cast<int32_t>(m_aBtDevices.size())) {
+		m_aBtDevices.resize(nIdx + 1);
 	}
-	assert(! m_aBtDevices[nBackendId]);
-	m_aBtDevices[nBackendId] = refNewDevice;
+	assert(! m_aBtDevices[nIdx]);
+	m_aBtDevices[nIdx] = refNewDevice;
+	invalidateKeySnapshot();
 	//
 	#ifndef NDEBUG
 	const bool bAdded =
@@ -171,9 +186,7 @@ void BtGtkDeviceManager::onDeviceAdded(const std::string& sName, int32_t nBacken
 void BtGtkDeviceManager::onDeviceRemoved(int32_t nBackendId) noexcept
 {
 //std::cout << "BtGtkDeviceManager::onDeviceRemoved nBackendId=" << nBackendId << '\n';
-	assert((nBackendId >= 0) && (nBackendId < static_cast<int32_t>(m_aBtDevices.size())));
-	shared_ptr<BtKeysDevice>& refBtKeysDevice = m_aBtDevices[nBackendId];
-	assert(refBtKeysDevice);
+	shared_ptr<BtKeysDevice>& refBtKeysDevice = getBtKeysDevice(nBackendId);
 	//
 	cancelDeviceKeys(refBtKeysDevice);
 	refBtKeysDevice->removingDevice();
@@ -184,29 +197,114 @@ void BtGtkDeviceManager::onDeviceRemoved(int32_t nBackendId) noexcept
 	#endif //NDEBUG
 	StdDeviceManager::removeDevice(refBtKeysDevice);
 	assert(bRemoved);
-	//m_aBtDevices.erase(itFind);
-	m_aBtDevices[nBackendId].reset();
+	refBtKeysDevice.reset();
+	invalidateKeySnapshot();
 	//
 	sendDeviceMgmtToListeners(DeviceMgmtEvent::DEVICE_MGMT_REMOVED, refRemovedBtKeysDevice);
 }
-bool BtGtkDeviceManager::onBlueKey(int32_t nBackendId, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK) noexcept
+bool BtGtkDeviceManager::onBlueKey(int32_t nBackendId, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK, int64_t nTimeUsec) noexcept
 {
 //std::cout << "BtGtkDeviceManager::onBlueKey eHK=" << static_cast<int32_t>(eHK) << '\n';
-	assert((nBackendId >= 0) && (nBackendId < static_cast<int32_t>(m_aBtDevices.size())));
 	if (!m_refSelected) {
 		// shouldn't happen
 		return true; //---------------------------------------------------------
 	}
-	shared_ptr<BtKeysDevice>& refBtKeysDevice = m_aBtDevices[nBackendId];
-	assert(refBtKeysDevice);
-	return refBtKeysDevice->onBlueKey(eType, eHK, m_refSelected);
+	shared_ptr<BtKeysDevice>& refBtKeysDevice = getBtKeysDevice(nBackendId);
+	const int32_t nIdx = SlotMapBase::getIndex(nBackendId);
+	const bool bOutdated = (!m_refKeySnapshot) || (m_refKeySnapshot->m_nEpoch != m_nKeySnapshotEpoch);
+	bool bContinue;
+	if (bOutdated && (m_nKeyDispatchDepth > 0)) {
+		// The snapshot is in use by an outer dispatch: build a temporary one
+		KeyDispatchSnapshot oSnapshot;
+		createKeySnapshot(oSnapshot);
+		++m_nKeyDispatchDepth;
+		bContinue = refBtKeysDevice->onBlueKey(eType, eHK, nTimeUsec, oSnapshot, oSnapshot.m_aCapabilities[nIdx]);
+		--m_nKeyDispatchDepth;
+		return bContinue; //----------------------------------------------------
+	}
+	if (bOutdated) {
+		if (!m_refKeySnapshot) {
+			m_refKeySnapshot = std::make_shared<KeyDispatchSnapshot>();
+		}
+		createKeySnapshot(*m_refKeySnapshot);
+	}
+	const KeyDispatchSnapshot& oSnapshot = *m_refKeySnapshot;
+	++m_nKeyDispatchDepth;
+	bContinue = refBtKeysDevice->onBlueKey(eType, eHK, nTimeUsec, oSnapshot, oSnapshot.m_aCapabilities[nIdx]);
+	--m_nKeyDispatchDepth;
+	if ((m_nKeyDispatchDepth == 0) && (oSnapshot.m_nEpoch != m_nKeySnapshotEpoch)) {
+		// Don't keep listeners, accessor or devices alive until the next key
+		m_refKeySnapshot->clear();
+	}
+	return bContinue;
+}
+shared_ptr<BtKeysDevice>& BtGtkDeviceManager::getBtKeysDevice(int32_t nBackendId) noexcept
+{
+	const int32_t nIdx = SlotMapBase::getIndex(nBackendId);
+	assert(nIdx < static_cast<int32_t>(m_aBtDevices.size()));
+	shared_ptr<BtKeysDevice>& refBtKeysDevice = m_aBtDevices[nIdx];
+	assert(refBtKeysDevice && (refBtKeysDevice->getBackendId() == nBackendId));
+	return refBtKeysDevice;
+}
+void BtGtkDeviceManager::invalidateKeySnapshot() noexcept
+{
+	++m_nKeySnapshotEpoch;
+	if (m_refKeySnapshot && (m_nKeyDispatchDepth == 0)) {
+		m_refKeySnapshot->clear();
+	}
+}
+void BtGtkDeviceManager::createKeySnapshot(KeyDispatchSnapshot& oSnapshot) const noexcept
+{
+	oSnapshot.m_nEpoch = m_nKeySnapshotEpoch;
+	oSnapshot.m_nClassIdxKeyEvent = m_nClassIdxKeyEvent;
+	if (m_refSelected) {
+		oSnapshot.m_refSelectedAccessor = m_refSelected->getAccessor();
+	} else {
+		oSnapshot.m_refSelectedAccessor.reset();
+	}
+	oSnapshot.m_refListeners = getListeners();
+	oSnapshot.m_aCapabilities.assign(m_aBtDevices.begin(), m_aBtDevices.end());
+}
+bool BtGtkDeviceManager::addEventListener(const shared_ptr<EventListener>& refEventListener, const shared_ptr<CallIf>& refCallIf) noexcept
+{
+	const bool bAdded = StdDeviceManager::addEventListener(refEventListener, refCallIf);
+	if (bAdded) {
+		invalidateKeySnapshot();
+	}
+	return bAdded;
+}
+bool BtGtkDeviceManager::addEventListener(const shared_ptr<EventListener>& refEventListener) noexcept
+{
+	const bool bAdded = StdDeviceManager::addEventListener(refEventListener);
+	if (bAdded) {
+		invalidateKeySnapshot();
+	}
+	return bAdded;
+}
+bool BtGtkDeviceManager::removeEventListener(const shared_ptr<EventListener>& refEventListener, bool bFinalize) noexcept
+{
+	const bool bRemoved = StdDeviceManager::removeEventListener(refEventListener, bFinalize);
+	if (bRemoved) {
+		invalidateKeySnapshot();
+	}
+	return bRemoved;
+}
+bool BtGtkDeviceManager::removeEventListener(const shared_ptr<EventListener>& refEventListener) noexcept
+{
+	const bool bRemoved = StdDeviceManager::removeEventListener(refEventListener);
+	if (bRemoved) {
+		invalidateKeySnapshot();
+	}
+	return bRemoved;
 }
 void BtGtkDeviceManager::finalizeListener(ListenerData& oListenerData) noexcept
 {
 	++m_nCancelingNestedDepth;
 	const int64_t nEventTimeUsec = DeviceManager::getNowTimeMicroseconds();
 	for (auto& refBtKeysDevice : m_aBtDevices) {
-		refBtKeysDevice->finalizeListener(oListenerData, nEventTimeUsec);
+		if (refBtKeysDevice) {
+			refBtKeysDevice->finalizeListener(oListenerData, nEventTimeUsec);
+		}
 	}
 	--m_nCancelingNestedDepth;
 	if (m_nCancelingNestedDepth == 0) {
@@ -216,12 +314,26 @@ void BtGtkDeviceManager::finalizeListener(ListenerData& oListenerData) noexcept
 bool BtGtkDeviceManager::findWindow(Gtk::Window* p0GtkmmWindow
 				, std::vector< std::pair<Gtk::Window*, shared_ptr<GtkWindowData> > >::iterator& itFind) noexcept
 {
-	for (itFind = m_aGtkWindowData.begin(); itFind != m_aGtkWindowData.end(); ++itFind) {
-		if (itFind->first == p0GtkmmWindow) {
-			return true;
-		}
+	auto itIdx = m_oGtkWindowIdx.find(p0GtkmmWindow);
+	if (itIdx == m_oGtkWindowIdx.end()) {
+		itFind = m_aGtkWindowData.end();
+		return false; //--------------------------------------------------------
 	}
-	return false;
+	itFind = m_aGtkWindowData.begin() + itIdx->second;
+	assert(itFind->first == p0GtkmmWindow);
+	return true;
+}
+void BtGtkDeviceManager::eraseWindow(const std::vector< std::pair<Gtk::Window*, shared_ptr<GtkWindowData> > >::iterator& itGtkData) noexcept
+{
+	const int32_t nIdx = static_cast<int32_t>(itGtkData - m_aGtkWindowData.begin());
+	const int32_t nLastIdx = static_cast<int32_t>(m_aGtkWindowData.size()) - 1;
+	m_oGtkWindowIdx.erase(itGtkData->first);
+	if (nIdx != nLastIdx) {
+		auto& oLast = m_aGtkWindowData[nLastIdx];
+		m_oGtkWindowIdx[oLast.first] = nIdx;
+		*itGtkData = std::move(oLast);
+	}
+	m_aGtkWindowData.pop_back();
 }
 bool BtGtkDeviceManager::hasAccessor(const shared_ptr<Accessor>& refAccessor, bool& bValid
 				, std::vector< std::pair<Gtk::Window*, shared_ptr<GtkWindowData> > >::iterator& itFind) noexcept
@@ -246,6 +358,33 @@ bool BtGtkDeviceManager::hasAccessor(const shared_ptr<Accessor>& refAccessor) no
 	std::vector< std::pair<Gtk::Window*, shared_ptr<GtkWindowData> > >::iterator itFind;
 	return hasAccessor(refAccessor, bValid, itFind);
 }
+bool BtGtkDeviceManager::getDeviceStats(int32_t nDeviceId, DeviceStats& oStats) const noexcept
+{
+	for (const auto& refBtKeysDevice : m_aBtDevices) {
+		if (refBtKeysDevice && (refBtKeysDevice->getDeviceId() == nDeviceId)) {
+			DeviceStats oNewStats;
+			m_refBackend->addReceiveStats(refBtKeysDevice->getBackendId(), oNewStats);
+			refBtKeysDevice->addKeyStats(oNewStats);
+			oStats = oNewStats;
+			return true; //-----------------------------------------------------
+		}
+	}
+	return false;
+}
+void BtGtkDeviceManager::getServerStats(ServerStats& oStats) const noexcept
+{
+	ServerStats oNewStats;
+	m_refBackend->addServerStats(oNewStats);
+	oStats = oNewStats;
+}
+bool BtGtkDeviceManager::getSocketTuning(SocketTuning& oApplied) const noexcept
+{
+	return m_refBackend->getAppliedSocketTuning(oApplied);
+}
+void BtGtkDeviceManager::getAdapterStats(std::vector<AdapterStats>& aStats) const noexcept
+{
+	m_refBackend->getAdapterStats(aStats);
+}
 bool BtGtkDeviceManager::addAccessor(const shared_ptr<Accessor>& refAccessor) noexcept
 {
 //std::cout << "BtGtkDeviceManager::addAccessor()" << '\n';
@@ -270,6 +409,7 @@ bool BtGtkDeviceManager::addAccessor(const shared_ptr<Accessor>& refAccessor) no
 	}
 	Gtk::Window* p0GtkmmWindow = refGtkAccessor->getGtkmmWindow();
 	m_aGtkWindowData.emplace_back(p0GtkmmWindow, m_refFactory->create()); //getGtkWindowData()
+	m_oGtkWindowIdx.emplace(p0GtkmmWindow, static_cast<int32_t>(m_aGtkWindowData.size()) - 1);
 	shared_ptr<GtkWindowData> refData = m_aGtkWindowData.back().second;
 	GtkWindowData& oData = *refData;
 	oData.enable(refGtkAccessor, this);
@@ -278,6 +418,7 @@ bool BtGtkDeviceManager::addAccessor(const shared_ptr<Accessor>& refAccessor) no
 	if (!m_refSelected) {
 		if (bIsActive) {
 			m_refSelected = refData;
+			invalidateKeySnapshot();
 		}
 	} else {
 		if (bIsActive) {
@@ -296,6 +437,7 @@ bool BtGtkDeviceManager::addAccessor(const shared_ptr<Accessor>& refAccessor) no
 				deselectAccessor();
 			}
 			m_refSelected = refData;
+			invalidateKeySnapshot();
 		} else {
 			deselectAccessor();
 		}
@@ -326,7 +468,7 @@ void BtGtkDeviceManager::removeAccessor(const std::vector<std::pair<Gtk::Window*
 
 	refData->disable(); // doesn't clear accessor!
 	//
-	m_aGtkWindowData.erase(itGtkData);
+	eraseWindow(itGtkData);
 
 	if (bIsSelected) {
 		deselectAccessor();
@@ -336,6 +478,7 @@ void BtGtkDeviceManager::selectAccessor(const shared_ptr<GtkWindowData>& refData
 {
 //std::cout << "BtGtkDeviceManager::selectAccessor  accessor=" << (int64_t)&(*(refData->getAccessor())) << '\n';
 	m_refSelected = refData;
+	invalidateKeySnapshot();
 }
 void BtGtkDeviceManager::deselectAccessor() noexcept
 {
@@ -343,10 +486,13 @@ void BtGtkDeviceManager::deselectAccessor() noexcept
 	++m_nCancelingNestedDepth;
 	//
 	for (auto& refDevice : m_aBtDevices) {
-		// cancel all keys that are pressed for the currently selected accessor
-		refDevice->cancelSelectedAccessorKeys();
+		if (refDevice) {
+			// cancel all keys that are pressed for the currently selected accessor
+			refDevice->cancelSelectedAccessorKeys();
+		}
 	}
 	m_refSelected.reset();
+	invalidateKeySnapshot();
 	//
 	--m_nCancelingNestedDepth;
 	if (m_nCancelingNestedDepth == 0) {
@@ -22,6 +22,7 @@
 
 #include "btgtkwindowdata.h"
 #include "btgtklistenerextradata.h"
+#include "btstats.h"
 
 #include <stmm-input-ev/keyevent.h>
 #include <stmm-input-base/basicdevicemanager.h>
@@ -43,9 +44,14 @@ namespace Private
 namespace Bt
 {
 
-BtKeysDevice::BtKeysDevice(const std::string& sName, const shared_ptr<BtGtkDeviceManager>& refDeviceManager) noexcept
+BtKeysDevice::BtKeysDevice(const std::string& sName, const shared_ptr<BtGtkDeviceManager>& refDeviceManager, int32_t nBackendId) noexcept
 : BasicDevice<BtGtkDeviceManager>(sName, refDeviceManager)
+, m_nBackendId(nBackendId)
+, m_nKeyEvents(0)
+, m_nSuppressedRepeats(0)
+, m_nOrphanReleases(0)
 {
+	m_aDispatchHistogram.fill(0);
 }
 shared_ptr<Device> BtKeysDevice::getDevice() const noexcept
 {
@@ -81,55 +87,60 @@ std::vector<Capability::Class> BtKeysDevice::getCapabilityClasses() const noexce
 {
 	return {KeyCapability::getClass()};
 }
-bool BtKeysDevice::onBlueKey(KeyEvent::KEY_INPUT_TYPE eInputType, HARDWARE_KEY eHardwareKey
-							, const shared_ptr<GtkWindowData>& refWindowData) noexcept
+bool BtKeysDevice::onBlueKey(KeyEvent::KEY_INPUT_TYPE eInputType, HARDWARE_KEY eHardwareKey, int64_t nTimeUsec
+							, const KeyDispatchSnapshot& oSnapshot, const shared_ptr<KeyCapability>& refCapability) noexcept
 {
 	const bool bContinue = true;
-	auto refOwner = getOwnerDeviceManager();
-	if (!refOwner) {
-		return !bContinue; //---------------------------------------------------
+	// Called by the owner: no need to lock it
+	if (! HardwareKeySet::isValidKey(eHardwareKey)) {
+		return bContinue; //----------------------------------------------------
 	}
-	//
-	BtGtkDeviceManager* p0Owner = refOwner.get();
-	auto refListeners = p0Owner->getListeners();
-	uint64_t nPressedTimeStamp = std::numeric_limits<uint64_t>::max();
-	auto itFind = m_oPressedKeys.find(eHardwareKey);
-	const bool bHardwareKeyPressed = (itFind != m_oPressedKeys.end());
-	shared_ptr<BtKeysDevice> refKeysDevice = shared_from_this();
-	shared_ptr<KeyCapability> refCapability = refKeysDevice;
-	auto refWindowAccessor = refWindowData->getAccessor();
+	assert(refCapability.get() == this);
+	const auto& refWindowAccessor = oSnapshot.m_refSelectedAccessor;
 	assert(refWindowAccessor);
+	uint64_t nPressedTimeStamp = std::numeric_limits<uint64_t>::max();
+	const bool bHardwareKeyPressed = m_oPressedKeys.contains(eHardwareKey);
 	if (eInputType == KeyEvent::KEY_PRESS) {
 		if (bHardwareKeyPressed) {
 			// Key repeat: suppressed
+			++m_nSuppressedRepeats;
 			return bContinue; //------------------------------------------------
 		}
 		nPressedTimeStamp = BtGtkDeviceManager::getUniqueTimeStamp();
-		KeyData oKeyData;
-		oKeyData.m_nPressedTimeStamp = nPressedTimeStamp;
-		m_oPressedKeys.emplace(eHardwareKey, oKeyData);
+		m_oPressedKeys.insert(eHardwareKey, nPressedTimeStamp);
 	} else {
 		if (!bHardwareKeyPressed) {
 			// orphan release or release_cancel , ignore
 //std::cout << "BtKeysDevice::onBlueKey orphan release" << '\n';
+			++m_nOrphanReleases;
 			return bContinue; //------------------------------------------------
 		}
-		KeyData& oKeyData = itFind->second;
-		nPressedTimeStamp = oKeyData.m_nPressedTimeStamp;
-		m_oPressedKeys.erase(itFind);
+		nPressedTimeStamp = m_oPressedKeys.getTimeStamp(eHardwareKey);
+		m_oPressedKeys.erase(eHardwareKey);
 	}
 	shared_ptr<Event> refEvent;
-	const int64_t nEventTimeUsec = DeviceManager::getNowTimeMicroseconds();
-	for (auto& p0ListenerData : *refListeners) {
+	const int64_t nEventTimeUsec = nTimeUsec;
+	for (auto& p0ListenerData : *oSnapshot.m_refListeners) {
 		sendKeyEventToListener(*p0ListenerData, nEventTimeUsec, nPressedTimeStamp, eInputType, eHardwareKey
-								, refWindowAccessor, refCapability, p0Owner->m_nClassIdxKeyEvent, refEvent);
-		if ((eInputType == KeyEvent::KEY_PRESS) && (m_oPressedKeys.find(eHardwareKey) == m_oPressedKeys.end())) {
+								, refWindowAccessor, refCapability, oSnapshot.m_nClassIdxKeyEvent, refEvent);
+		if ((eInputType == KeyEvent::KEY_PRESS) && ! m_oPressedKeys.contains(eHardwareKey)) {
 			// The key was canceled by the callback
 			break; // for -------
 		}
 	}
+	++m_nKeyEvents;
+	++m_aDispatchHistogram[getStatsBucket(DeviceManager::getNowTimeMicroseconds() - nEventTimeUsec)];
 	return bContinue;
 }
+void BtKeysDevice::addKeyStats(BtGtkDeviceManager::DeviceStats& oStats) const noexcept
+{
+	oStats.m_nKeyEvents += m_nKeyEvents;
+	oStats.m_nSuppressedRepeats += m_nSuppressedRepeats;
+	oStats.m_nOrphanReleases += m_nOrphanReleases;
+	for (int32_t nIdx = 0; nIdx < BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets; ++nIdx) {
+		oStats.m_aDispatchHistogram[nIdx] += m_aDispatchHistogram[nIdx];
+	}
+}
 void BtKeysDevice::finalizeListener(BtGtkDeviceManager::ListenerData& oListenerData, int64_t nEventTimeUsec) noexcept
 {
 	auto refOwner = getOwnerDeviceManager();
@@ -152,13 +163,9 @@ void BtKeysDevice::finalizeListener(BtGtkDeviceManager::ListenerData& oListenerD
 	oListenerData.getExtraData(p0ExtraData);
 
 	// Send KEY_RELEASE_CANCEL for the currently pressed keys to the listener
-	// work on copy
-	auto oPressedKeys = m_oPressedKeys;
-	for (auto& oPair : oPressedKeys) {
-		const int32_t nHardwareKey = oPair.first;
-		const KeyData& oKeyData = oPair.second;
-		//
-		const auto nKeyPressedTimeStamp = oKeyData.m_nPressedTimeStamp;
+	// The callback might change the pressed keys: findNext() skips the removed ones
+	for (int32_t nHardwareKey = m_oPressedKeys.findNext(-1); nHardwareKey >= 0; nHardwareKey = m_oPressedKeys.findNext(nHardwareKey)) {
+		const auto nKeyPressedTimeStamp = m_oPressedKeys.getTimeStamp(nHardwareKey);
 		const HARDWARE_KEY eHardwareKey = static_cast<HARDWARE_KEY>(nHardwareKey);
 		//
 		if (p0ExtraData->isKeyCanceled(nHardwareKey)) {
@@ -201,14 +208,10 @@ void BtKeysDevice::cancelSelectedAccessorKeys() noexcept
 	shared_ptr<KeyCapability> refCapability = refThis;
 	// Remove all keys generated by the accessor (widget)
 	const int64_t nEventTimeUsec = DeviceManager::getNowTimeMicroseconds();
-	// work on copy
-	auto oPressedKeys = m_oPressedKeys;
-	for (auto& oPair : oPressedKeys) {
-		const int32_t nHardwareKey = oPair.first;
-		const KeyData& oKeyData = oPair.second;
-		//
+	// The callbacks might change the pressed keys: findNext() skips the removed ones
+	for (int32_t nHardwareKey = m_oPressedKeys.findNext(-1); nHardwareKey >= 0; nHardwareKey = m_oPressedKeys.findNext(nHardwareKey)) {
 		const HARDWARE_KEY eHardwareKey = static_cast<HARDWARE_KEY>(nHardwareKey);
-		const auto nKeyPressedTimeStamp = oKeyData.m_nPressedTimeStamp;
+		const auto nKeyPressedTimeStamp = m_oPressedKeys.getTimeStamp(nHardwareKey);
 		//
 		shared_ptr<Event> refEvent;
 		for (auto& p0ListenerData : *refListeners) {
@@ -23,6 +23,7 @@
 
 #include "btgtkdevicemanager.h"
 
+#include "hardwarekeyset.h"
 #include "recycler.h"
 
 #include <stmm-input-ev/keycapability.h>
@@ -32,16 +33,15 @@
 #include <stmm-input/device.h>
 #include <stmm-input/hardwarekey.h>
 
+#include <array>
 #include <memory>
 #include <string>
-#include <unordered_map>
 #include <vector>
 #include <cstdint>
 
 namespace stmi { class Accessor; }
 namespace stmi { class Event; }
 namespace stmi { class GtkAccessor; }
-namespace stmi { namespace Private { namespace Bt { class GtkWindowData; } } }
 
 namespace stmi
 {
@@ -55,11 +55,35 @@ namespace Bt
 using std::shared_ptr;
 using std::weak_ptr;
 
+/** What the key events of the devices are sent with.
+ * The device manager rebuilds it when the listeners, the selected accessor
+ * or the devices have changed, but never while a key is being dispatched with it.
+ * Sending a key event therefore doesn't need to copy (atomically reference
+ * count) any shared_ptr.
+ */
+class KeyDispatchSnapshot
+{
+public:
+	uint64_t m_nEpoch = 0; /**< The BtGtkDeviceManager epoch the snapshot was built in. */
+	int32_t m_nClassIdxKeyEvent = -1;
+	shared_ptr<GtkAccessor> m_refSelectedAccessor; /**< The accessor of the selected window. Can be null. */
+	shared_ptr<const std::vector<BtGtkDeviceManager::ListenerData*> > m_refListeners;
+	std::vector< shared_ptr<KeyCapability> > m_aCapabilities; /**< Index: SlotMapBase::getIndex(nBackendId), Value: can be null. */
+	/** Releases the referenced objects. Keeps the capacity of m_aCapabilities. */
+	void clear() noexcept
+	{
+		m_nEpoch = 0;
+		m_refSelectedAccessor.reset();
+		m_refListeners.reset();
+		m_aCapabilities.clear();
+	}
+};
+
 class BtKeysDevice final : public BasicDevice<BtGtkDeviceManager>, public KeyCapability
 						, public std::enable_shared_from_this<BtKeysDevice>, public sigc::trackable
 {
 public:
-	BtKeysDevice(const std::string& sName, const shared_ptr<BtGtkDeviceManager>& refDeviceManager) noexcept;
+	BtKeysDevice(const std::string& sName, const shared_ptr<BtGtkDeviceManager>& refDeviceManager, int32_t nBackendId) noexcept;
 	//
 	shared_ptr<Capability> getCapability(const Capability::Class& oClass) const noexcept override;
 	shared_ptr<Capability> getCapability(int32_t nCapabilityId) const noexcept override;
@@ -71,9 +95,18 @@ public:
 	//
 
 	inline int32_t getDeviceId() const noexcept { return Device::getId(); }
+	inline int32_t getBackendId() const noexcept { return m_nBackendId; }
 
 	// This is public so that there's no need to friend GtkBackend (or even FakeGtkBackend)
-	bool onBlueKey(KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK, const shared_ptr<GtkWindowData>& refWindowData) noexcept;
+	// Must be called by the owner device manager (which is therefore alive)
+	// nTimeUsec is the time the key packet was received
+	// oSnapshot must have a selected accessor and be kept alive by the caller
+	// refCapability is this device's entry in oSnapshot.m_aCapabilities
+	// Keys outside the HardwareKeySet range are ignored
+	bool onBlueKey(KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK, int64_t nTimeUsec
+					, const KeyDispatchSnapshot& oSnapshot, const shared_ptr<KeyCapability>& refCapability) noexcept;
+	// Adds the key event counters to oStats
+	void addKeyStats(BtGtkDeviceManager::DeviceStats& oStats) const noexcept;
 private:
 	friend class stmi::BtGtkDeviceManager;
 	void cancelSelectedAccessorKeys() noexcept;
@@ -92,31 +125,16 @@ private:
 								, int32_t nClassIdxKeyEvent
 								, shared_ptr<Event>& refEvent) noexcept;
 private:
-	struct KeyData
-	{
-		uint64_t m_nPressedTimeStamp;
-	};
-	std::unordered_map<HARDWARE_KEY, KeyData> m_oPressedKeys;
+	const int32_t m_nBackendId;
+	// The pressed keys with the pressed time stamp
+	Private::HardwareKeySet m_oPressedKeys;
 	//
-	class ReKeyEvent : public KeyEvent
-	{
-	public:
-		ReKeyEvent(int64_t nTimeUsec, const shared_ptr<Accessor>& refAccessor
-					, const shared_ptr<KeyCapability>& refKeyCapability, KEY_INPUT_TYPE eType, HARDWARE_KEY eKey) noexcept
-		: KeyEvent(nTimeUsec, refAccessor, refKeyCapability, eType, eKey)
-		{
-		}
-		void reInit(int64_t nTimeUsec, const shared_ptr<Accessor>& refAccessor
-				, const shared_ptr<KeyCapability>& refKeyCapability, KEY_INPUT_TYPE eType, HARDWARE_KEY eKey) noexcept
-		{
-			setTimeUsec(nTimeUsec);
-			setAccessor(refAccessor);
-			setKeyCapability(refKeyCapability);
-			setType(eType);
-			setKey(eKey);
-		}
-	};
-	Private::Recycler<ReKeyEvent, Event> m_oKeyEventRecycler;
+	int64_t m_nKeyEvents;
+	int64_t m_nSuppressedRepeats;
+	int64_t m_nOrphanReleases;
+	std::array<int64_t, BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets> m_aDispatchHistogram;
+	//
+	Private::Recycler<KeyEvent, Event> m_oKeyEventRecycler;
 	//
 private:
 	BtKeysDevice(const BtKeysDevice& oSource) = delete;
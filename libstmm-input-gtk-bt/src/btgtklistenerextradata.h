@@ -23,6 +23,12 @@
 
 #include "btgtkdevicemanager.h"
 
+#include "hardwarekeyset.h"
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+
 namespace stmi
 {
 
@@ -31,23 +37,40 @@ namespace Private
 namespace Bt
 {
 
+/** The keys already canceled for a listener.
+ * A key is canceled if its stamp equals the current epoch, reset() just
+ * increments the epoch.
+ */
 class BtGtkListenerExtraData final : public stmi::BtGtkDeviceManager::ListenerExtraData
 {
 public:
+	BtGtkListenerExtraData() noexcept
+	: m_nEpoch(1)
+	{
+		m_aCanceledEpochs.fill(0);
+	}
 	void reset() noexcept override
 	{
-		m_aCanceledKeys.clear();
+		++m_nEpoch;
+		if (m_nEpoch == 0) {
+			// wrapped around: stamps of the old epochs could match again
+			m_aCanceledEpochs.fill(0);
+			m_nEpoch = 1;
+		}
 	}
 	inline bool isKeyCanceled(int32_t nKey) const noexcept
 	{
-		return std::find(m_aCanceledKeys.begin(), m_aCanceledKeys.end(), nKey) != m_aCanceledKeys.end();
+		assert(HardwareKeySet::isValidKey(nKey));
+		return (m_aCanceledEpochs[nKey] == m_nEpoch);
 	}
 	inline void setKeyCanceled(int32_t nKey) noexcept
 	{
-		m_aCanceledKeys.push_back(nKey);
+		assert(HardwareKeySet::isValidKey(nKey));
+		m_aCanceledEpochs[nKey] = m_nEpoch;
 	}
 private:
-	std::vector<int32_t> m_aCanceledKeys;
+	std::array<uint16_t, HardwareKeySet::s_nTotKeys> m_aCanceledEpochs; // Index: key
+	uint16_t m_nEpoch; // Never 0
 };
 
 } // namespace Bt
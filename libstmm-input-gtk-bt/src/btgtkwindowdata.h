@@ -55,7 +55,6 @@ public:
 		//std::cout << "Bt::GtkWindowData::~GtkWindowData()" << '\n';
 		disable();
 	}
-	void reInit() noexcept {}
 
 	#ifdef STMI_TESTING_IFACE
 	virtual
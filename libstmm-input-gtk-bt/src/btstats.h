@@ -0,0 +1,181 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   btstats.h
+ */
+
+#ifndef STMI_BT_STATS_H
+#define STMI_BT_STATS_H
+
+#include "btgtkdevicemanager.h"
+#include "keypacket.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+/** The histogram bucket of a duration.
+ * @param nUsec The duration in microseconds.
+ * @return The index into a BtGtkDeviceManager::DeviceStats histogram.
+ */
+inline int32_t getStatsBucket(int64_t nUsec) noexcept
+{
+	if (nUsec <= 0) {
+		return 0; //------------------------------------------------------------
+	}
+	const int32_t nBucket = 64 - __builtin_clzll(static_cast<uint64_t>(nUsec));
+	const int32_t nLastBucket = BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets - 1;
+	return ((nBucket < nLastBucket) ? nBucket : nLastBucket);
+}
+
+/** Adds the receive fields of a snapshot to those of another.
+ * The protocol version is set rather than added, the last added snapshot wins.
+ * The key event fields aren't changed.
+ * @param oFrom The added snapshot.
+ * @param oTo The snapshot to add to.
+ */
+inline void mergeReceiveStats(const BtGtkDeviceManager::DeviceStats& oFrom, BtGtkDeviceManager::DeviceStats& oTo) noexcept
+{
+	oTo.m_nDatagrams += oFrom.m_nDatagrams;
+	oTo.m_nBytes += oFrom.m_nBytes;
+	oTo.m_nRecvCalls += oFrom.m_nRecvCalls;
+	oTo.m_nMagicErrors += oFrom.m_nMagicErrors;
+	oTo.m_nCmdErrors += oFrom.m_nCmdErrors;
+	oTo.m_nSizeErrors += oFrom.m_nSizeErrors;
+	oTo.m_nNoops += oFrom.m_nNoops;
+	oTo.m_nProtocolVersion = oFrom.m_nProtocolVersion;
+	oTo.m_nV2Datagrams += oFrom.m_nV2Datagrams;
+	oTo.m_nLostDatagrams += oFrom.m_nLostDatagrams;
+	oTo.m_nOutOfOrderDatagrams += oFrom.m_nOutOfOrderDatagrams;
+	oTo.m_nAcks += oFrom.m_nAcks;
+	for (int32_t nIdx = 0; nIdx < BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets; ++nIdx) {
+		oTo.m_aGapHistogram[nIdx] += oFrom.m_aGapHistogram[nIdx];
+		oTo.m_aDelayHistogram[nIdx] += oFrom.m_aDelayHistogram[nIdx];
+	}
+}
+
+/** The counters of a client connection's receiver.
+ * Written by the receiver only (possibly in the receiver thread) and read
+ * by the main thread. Since there's a single writer the counters are
+ * incremented with relaxed loads and stores instead of read-modify-write
+ * operations, which costs the same as plain integers.
+ */
+struct BlueReceiveCounters
+{
+	std::atomic<int64_t> m_nDatagrams{0};
+	std::atomic<int64_t> m_nBytes{0};
+	std::atomic<int64_t> m_nRecvCalls{0};
+	std::atomic<int64_t> m_nMagicErrors{0};
+	std::atomic<int64_t> m_nCmdErrors{0};
+	std::atomic<int64_t> m_nSizeErrors{0};
+	std::atomic<int64_t> m_nNoops{0};
+	std::array<std::atomic<int64_t>, BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets> m_aGapHistogram{};
+	std::atomic<int32_t> m_nProtocolVersion{PACKET_PROTOCOL_VERSION_1};
+	std::atomic<int64_t> m_nV2Datagrams{0};
+	std::atomic<int64_t> m_nLostDatagrams{0};
+	std::atomic<int64_t> m_nOutOfOrderDatagrams{0};
+	std::atomic<int64_t> m_nAcks{0};
+	std::array<std::atomic<int64_t>, BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets> m_aDelayHistogram{};
+
+	/** Increments a counter. Must only be called by the writer.
+	 * @param nCounter The counter.
+	 * @param nAdd The increment.
+	 */
+	static void inc(std::atomic<int64_t>& nCounter, int64_t nAdd = 1) noexcept
+	{
+		nCounter.store(nCounter.load(std::memory_order_relaxed) + nAdd, std::memory_order_relaxed);
+	}
+	/** Adds the counters to the receive fields of a snapshot.
+	 * @param oStats The snapshot.
+	 * @see mergeReceiveStats()
+	 */
+	void addTo(BtGtkDeviceManager::DeviceStats& oStats) const noexcept
+	{
+		BtGtkDeviceManager::DeviceStats oCur;
+		oCur.m_nDatagrams = m_nDatagrams.load(std::memory_order_relaxed);
+		oCur.m_nBytes = m_nBytes.load(std::memory_order_relaxed);
+		oCur.m_nRecvCalls = m_nRecvCalls.load(std::memory_order_relaxed);
+		oCur.m_nMagicErrors = m_nMagicErrors.load(std::memory_order_relaxed);
+		oCur.m_nCmdErrors = m_nCmdErrors.load(std::memory_order_relaxed);
+		oCur.m_nSizeErrors = m_nSizeErrors.load(std::memory_order_relaxed);
+		oCur.m_nNoops = m_nNoops.load(std::memory_order_relaxed);
+		oCur.m_nProtocolVersion = m_nProtocolVersion.load(std::memory_order_relaxed);
+		oCur.m_nV2Datagrams = m_nV2Datagrams.load(std::memory_order_relaxed);
+		oCur.m_nLostDatagrams = m_nLostDatagrams.load(std::memory_order_relaxed);
+		oCur.m_nOutOfOrderDatagrams = m_nOutOfOrderDatagrams.load(std::memory_order_relaxed);
+		oCur.m_nAcks = m_nAcks.load(std::memory_order_relaxed);
+		for (int32_t nIdx = 0; nIdx < BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets; ++nIdx) {
+			oCur.m_aGapHistogram[nIdx] = m_aGapHistogram[nIdx].load(std::memory_order_relaxed);
+			oCur.m_aDelayHistogram[nIdx] = m_aDelayHistogram[nIdx].load(std::memory_order_relaxed);
+		}
+		mergeReceiveStats(oCur, oStats);
+	}
+};
+
+/** The counters of the accepted connections.
+ * m_nAccepted and m_nAcceptErrors are written by the thread accepting the
+ * connections only, m_nRefused also by the main thread.
+ */
+struct BlueAcceptCounters
+{
+	std::atomic<int64_t> m_nAccepted{0};
+	std::atomic<int64_t> m_nAcceptErrors{0};
+	std::atomic<int64_t> m_nRefused{0};
+
+	/** Counts a connection that was closed right after being accepted.
+	 * Can be called by any thread.
+	 */
+	void incRefused() noexcept
+	{
+		m_nRefused.fetch_add(1, std::memory_order_relaxed);
+	}
+	/** Adds the counters to the fields of a snapshot.
+	 * @param oStats The snapshot.
+	 */
+	void addTo(BtGtkDeviceManager::ServerStats& oStats) const noexcept
+	{
+		oStats.m_nAccepted += m_nAccepted.load(std::memory_order_relaxed);
+		oStats.m_nAcceptErrors += m_nAcceptErrors.load(std::memory_order_relaxed);
+		oStats.m_nRefused += m_nRefused.load(std::memory_order_relaxed);
+	}
+};
+
+/** The counters of a local adapter (listener) of the server.
+ * m_nAccepted and m_nRefused are written by the thread accepting the
+ * connections only, m_nConnections also by the main thread.
+ */
+struct BlueAdapterCounters
+{
+	std::atomic<int32_t> m_nConnections{0}; // The currently open connections
+	std::atomic<int64_t> m_nAccepted{0};
+	std::atomic<int64_t> m_nRefused{0};
+};
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
+
+#endif /* STMI_BT_STATS_H */
@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   hardwarekeyset.cc
+ */
+
+#include "hardwarekeyset.h"
+
+namespace stmi
+{
+
+namespace Private
+{
+
+HardwareKeySet::HardwareKeySet() noexcept
+{
+	m_aWords.fill(0);
+	m_aSlots.fill(0);
+	m_aEntries.reserve(s_nReservedKeys);
+}
+void HardwareKeySet::insert(int32_t nKey, uint64_t nTimeStamp) noexcept
+{
+	assert(! contains(nKey));
+	m_aWords[nKey / s_nBitsPerWord] |= (uint64_t{1} << (nKey % s_nBitsPerWord));
+	m_aSlots[nKey] = static_cast<uint16_t>(m_aEntries.size());
+	m_aEntries.push_back(Entry{nKey, nTimeStamp});
+}
+bool HardwareKeySet::erase(int32_t nKey) noexcept
+{
+	if (! contains(nKey)) {
+		return false; //--------------------------------------------------------
+	}
+	m_aWords[nKey / s_nBitsPerWord] &= ~(uint64_t{1} << (nKey % s_nBitsPerWord));
+	// Move the last entry into the freed slot
+	const int32_t nSlot = m_aSlots[nKey];
+	const Entry& oLast = m_aEntries.back();
+	m_aSlots[oLast.m_nKey] = static_cast<uint16_t>(nSlot);
+	m_aEntries[nSlot] = oLast;
+	m_aEntries.pop_back();
+	return true;
+}
+void HardwareKeySet::clear() noexcept
+{
+	// The slots of keys not contained are never read
+	m_aWords.fill(0);
+	m_aEntries.clear();
+}
+int32_t HardwareKeySet::findNext(int32_t nKey) const noexcept
+{
+	assert((nKey >= -1) && (nKey < s_nTotKeys));
+	const int32_t nStart = nKey + 1;
+	if (nStart >= s_nTotKeys) {
+		return -1; //-----------------------------------------------------------
+	}
+	int32_t nWordIdx = nStart / s_nBitsPerWord;
+	// mask out the keys before nStart in the first word
+	uint64_t nWord = m_aWords[nWordIdx] & (~uint64_t{0} << (nStart % s_nBitsPerWord));
+	while (true) {
+		if (nWord != 0) {
+			return nWordIdx * s_nBitsPerWord + __builtin_ctzll(nWord); //-------
+		}
+		++nWordIdx;
+		if (nWordIdx >= s_nTotWords) {
+			return -1; //-------------------------------------------------------
+		}
+		nWord = m_aWords[nWordIdx];
+	}
+}
+
+} // namespace Private
+
+} // namespace stmi
@@ -0,0 +1,131 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   hardwarekeyset.h
+ */
+
+#ifndef STMI_HARDWARE_KEY_SET_H
+#define STMI_HARDWARE_KEY_SET_H
+
+#include <array>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+
+namespace stmi
+{
+
+namespace Private
+{
+
+/** Set of pressed hardware keys with their press time stamps.
+ * Membership is a bitset over the hardware key range. The time stamps are
+ * kept in a flat array holding only the contained keys, which a slot table
+ * indexed by key points into.
+ *
+ * Inserting and erasing don't allocate as long as the number of contained
+ * keys doesn't exceed the capacity reached so far (initially s_nReservedKeys).
+ *
+ * The set can be modified while it is iterated with findNext(), which
+ * reads the current state at each step: erased keys are no longer visited.
+ */
+class HardwareKeySet
+{
+public:
+	/** The number of keys. Valid keys are in the range [0, s_nTotKeys). */
+	static constexpr int32_t s_nTotKeys = 1024;
+	/** The number of contained keys for which space is reserved on construction. */
+	static constexpr int32_t s_nReservedKeys = 32;
+
+	HardwareKeySet() noexcept;
+
+	/** Whether a key is in the supported range.
+	 * @param nKey The key.
+	 * @return Whether valid.
+	 */
+	static inline bool isValidKey(int32_t nKey) noexcept
+	{
+		return (nKey >= 0) && (nKey < s_nTotKeys);
+	}
+	/** Whether the set contains a key.
+	 * @param nKey The key. Must be valid.
+	 * @return Whether contained.
+	 */
+	inline bool contains(int32_t nKey) const noexcept
+	{
+		assert(isValidKey(nKey));
+		return ((m_aWords[nKey / s_nBitsPerWord] >> (nKey % s_nBitsPerWord)) & 1u) != 0;
+	}
+	/** The time stamp of a contained key.
+	 * @param nKey The key. Must be contained.
+	 * @return The time stamp passed to insert().
+	 */
+	inline uint64_t getTimeStamp(int32_t nKey) const noexcept
+	{
+		assert(contains(nKey));
+		return m_aEntries[m_aSlots[nKey]].m_nTimeStamp;
+	}
+	/** Adds a key.
+	 * @param nKey The key. Must be valid and not contained.
+	 * @param nTimeStamp The press time stamp.
+	 */
+	void insert(int32_t nKey, uint64_t nTimeStamp) noexcept;
+	/** Removes a key.
+	 * @param nKey The key. Must be valid.
+	 * @return Whether the key was contained.
+	 */
+	bool erase(int32_t nKey) noexcept;
+	/** Removes all keys.
+	 */
+	void clear() noexcept;
+	/** Whether the set is empty.
+	 * @return Whether no key is contained.
+	 */
+	inline bool empty() const noexcept { return m_aEntries.empty(); }
+	/** The number of contained keys.
+	 * @return The size.
+	 */
+	inline int32_t size() const noexcept { return static_cast<int32_t>(m_aEntries.size()); }
+	/** The smallest contained key greater than the given one.
+	 * Example:
+	 *
+	 *     for (int32_t nKey = oSet.findNext(-1); nKey >= 0; nKey = oSet.findNext(nKey)) { ... }
+	 *
+	 * @param nKey The key or -1 to get the first.
+	 * @return The next contained key or -1 if none.
+	 */
+	int32_t findNext(int32_t nKey) const noexcept;
+private:
+	static constexpr int32_t s_nBitsPerWord = 64;
+	static constexpr int32_t s_nTotWords = s_nTotKeys / s_nBitsPerWord;
+	static_assert(s_nTotKeys % s_nBitsPerWord == 0, "");
+	static_assert(s_nTotKeys <= 65536, "slot type too small");
+	std::array<uint64_t, s_nTotWords> m_aWords;
+	std::array<uint16_t, s_nTotKeys> m_aSlots; // Index: key, Value: index into m_aEntries (only if contained)
+	struct Entry
+	{
+		int32_t m_nKey;
+		uint64_t m_nTimeStamp;
+	};
+	std::vector<Entry> m_aEntries; // Unordered
+};
+
+} // namespace Private
+
+} // namespace stmi
+
+#endif /* STMI_HARDWARE_KEY_SET_H */
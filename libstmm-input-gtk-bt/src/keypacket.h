@@ -36,6 +36,7 @@ enum PACKET_CMD {
 	, PACKET_CMD_NOOP = 1
 //	, PACKET_CMD_DISCONNECT_DEVICE = 2
 	, PACKET_CMD_REMOVE_DEVICE = 3
+	, PACKET_CMD_CHORD = 4 // v2 only
 };
 struct KeyPacket
 {
@@ -46,6 +47,112 @@ struct KeyPacket
 	int32_t m_nHardwareKey; // HARDWARE_KEY
 };
 
+// Protocol version 2
+//
+// Handshake: after connecting a client supporting v2 sends a (v1) PACKET_CMD_NOOP
+// packet with m_nKeyType set to PACKET_HELLO_KEY_TYPE and m_nHardwareKey to the
+// highest protocol version it supports. Servers not knowing v2 ignore it.
+// A v2 server answers with the same kind of packet containing the version it accepts.
+// Until the answer is received the client sends v1 packets. The server accepts
+// v1 and v2 datagrams at any time, they are distinguished by the second magic byte.
+//
+// A v2 datagram is a KeyPacketV2Header followed by m_nCount variable length records:
+//   byte:   (PACKET_CMD << 4) | KeyEvent::KEY_INPUT_TYPE
+//   varint: HARDWARE_KEY
+//   varint: microseconds between the capture of the previous record
+//           (or m_nBaseTimeUsec for the first record) and the capture of this one
+// A chord record holds keys pressed or released at the same time:
+//   byte:   (PACKET_CMD_CHORD << 4)
+//   varint: number of keys N (from 1 to PACKET_V2_MAX_CHORD_KEYS)
+//   varint: microseconds as for the other records
+//   N varints: (HARDWARE_KEY << 2) | KeyEvent::KEY_INPUT_TYPE
+// The server delivers the keys of a chord together with the same time.
+// Varints are unsigned LEB128: 7 bits per byte, least significant first,
+// the high bit is set if more bytes follow.
+// Multibyte fields are little endian.
+
+constexpr int32_t PACKET_PROTOCOL_VERSION_1 = 1;
+constexpr int32_t PACKET_PROTOCOL_VERSION_2 = 2;
+constexpr char PACKET_HELLO_KEY_TYPE = 'V';
+
+struct KeyPacketV2Header
+{
+	char m_nMagic1; // = '7'
+	char m_nMagic2; // = 'B'
+	uint8_t m_nCount; // The number of records
+	uint8_t m_nFlags; // = 0
+	uint32_t m_nSequence; // Incremented for each datagram sent on the connection
+	uint32_t m_nBaseTimeUsec; // Client capture time (microseconds, wraps around)
+};
+
+constexpr int32_t PACKET_V2_MAX_VARINT_SIZE = 5;
+constexpr int32_t PACKET_V2_MAX_RECORD_SIZE = 1 + 2 * PACKET_V2_MAX_VARINT_SIZE;
+constexpr int32_t PACKET_V2_MAX_CHORD_KEYS = 64;
+
+// Protocol version 3 (flow control)
+//
+// The datagrams are those of v2. In addition the server acknowledges the v2
+// datagrams with a KeyPacketAck, at most one per batch of datagrams it handles.
+// The acknowledgement holds the sequence number of the next datagram expected
+// and the credit: the number of datagrams the client may send without waiting
+// for the next acknowledgement. Until the first acknowledgement the credit is
+// PACKET_V3_INITIAL_CREDIT. A client out of credit keeps the keys in its queue,
+// where redundant presses and releases are merged, so that a congested link
+// costs latency rather than lost releases.
+
+constexpr int32_t PACKET_PROTOCOL_VERSION_3 = 3;
+constexpr int32_t PACKET_V3_INITIAL_CREDIT = 4;
+constexpr int32_t PACKET_V3_DEFAULT_CREDIT = 8;
+
+struct KeyPacketAck
+{
+	char m_nMagic1; // = '7'
+	char m_nMagic2; // = 'C'
+	uint16_t m_nCredit; // The number of datagrams that can be sent from m_nNextSequence on
+	uint32_t m_nNextSequence; // The sequence number of the next datagram expected
+};
+
+/** Writes a varint.
+ * @param p0Buf The buffer. Must have at least PACKET_V2_MAX_VARINT_SIZE bytes.
+ * @param nValue The value.
+ * @return The number of bytes written.
+ */
+inline int32_t packetWriteVarint(uint8_t* p0Buf, uint32_t nValue) noexcept
+{
+	int32_t nSize = 0;
+	while (nValue >= 0x80) {
+		p0Buf[nSize] = static_cast<uint8_t>((nValue & 0x7F) | 0x80);
+		nValue >>= 7;
+		++nSize;
+	}
+	p0Buf[nSize] = static_cast<uint8_t>(nValue);
+	return nSize + 1;
+}
+/** Reads a varint.
+ * @param p0Buf The buffer.
+ * @param nAvailable The number of bytes in the buffer.
+ * @param nValue Set to the value.
+ * @return The number of bytes read or 0 if truncated or too long.
+ */
+inline int32_t packetReadVarint(const uint8_t* p0Buf, int32_t nAvailable, uint32_t& nValue) noexcept
+{
+	nValue = 0;
+	const int32_t nMax = ((nAvailable < PACKET_V2_MAX_VARINT_SIZE) ? nAvailable : PACKET_V2_MAX_VARINT_SIZE);
+	for (int32_t nIdx = 0; nIdx < nMax; ++nIdx) {
+		const uint8_t nByte = p0Buf[nIdx];
+		nValue |= static_cast<uint32_t>(nByte & 0x7F) << (7 * nIdx);
+		if ((nByte & 0x80) == 0) {
+			return nIdx + 1; //-------------------------------------------------
+		}
+	}
+	return 0;
+}
+
+// Local (AF_UNIX SOCK_SEQPACKET) transport, used for tests and benchmarks:
+// a client binding its socket to the abstract name made of this prefix followed
+// by an address "XX:XX:XX:XX:XX:XX" is identified by the server with that address.
+constexpr char PACKET_UNIX_CLIENT_NAME_PREFIX[] = "stmm-input-bt-client-";
+
 } // namespace Bt
 } // namespace Private
 
@@ -0,0 +1,227 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   packetcapture.cc
+ */
+
+#include "packetcapture.h"
+
+#include "slotmap.h"
+
+#include <cassert>
+#include <cstring>
+
+#include <errno.h>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+static constexpr char s_aFileMagic[8] = {'b', 't', 's', 'n', 'o', 'o', 'p', '\0'};
+static constexpr uint32_t s_nFileVersion = 1;
+static constexpr uint32_t s_nDatalinkMonitor = 2001;
+static constexpr int32_t s_nFileHeaderSize = 16;
+static constexpr int32_t s_nRecordHeaderSize = 24;
+static constexpr uint32_t s_nOpcodeAclRx = 5; // BTSNOOP_OPCODE_ACL_RX_PKT
+// Microseconds from 0000-01-01 (the btsnoop epoch) to 1970-01-01
+static constexpr int64_t s_nEpochOffsetUsec = 0x00E03AB44A676000LL;
+static constexpr int32_t s_nAclHeaderSize = 4;
+static constexpr int32_t s_nL2capHeaderSize = 4;
+static constexpr uint16_t s_nAclStartFlag = 0x2000; // Packet boundary: first automatically flushable
+static constexpr uint16_t s_nL2capCid = 0x0040; // The first dynamically allocated channel
+static constexpr int32_t s_nMaxDatagramSize = 0xFFFF - s_nL2capHeaderSize;
+
+static void putBE32(uint8_t* p0, uint32_t nValue) noexcept
+{
+	p0[0] = static_cast<uint8_t>(nValue >> 24);
+	p0[1] = static_cast<uint8_t>(nValue >> 16);
+	p0[2] = static_cast<uint8_t>(nValue >> 8);
+	p0[3] = static_cast<uint8_t>(nValue);
+}
+static uint32_t getBE32(const uint8_t* p0) noexcept
+{
+	return (static_cast<uint32_t>(p0[0]) << 24) | (static_cast<uint32_t>(p0[1]) << 16)
+			| (static_cast<uint32_t>(p0[2]) << 8) | static_cast<uint32_t>(p0[3]);
+}
+static void putLE16(uint8_t* p0, uint16_t nValue) noexcept
+{
+	p0[0] = static_cast<uint8_t>(nValue);
+	p0[1] = static_cast<uint8_t>(nValue >> 8);
+}
+static uint16_t getLE16(const uint8_t* p0) noexcept
+{
+	return static_cast<uint16_t>(p0[0] | (p0[1] << 8));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+PacketCaptureWriter::PacketCaptureWriter() noexcept
+: m_p0File(nullptr)
+, m_nTotWritten(0)
+{
+}
+PacketCaptureWriter::~PacketCaptureWriter() noexcept
+{
+	close();
+}
+bool PacketCaptureWriter::open(const std::string& sPath, std::string& sError) noexcept
+{
+	close();
+	m_p0File = std::fopen(sPath.c_str(), "wb");
+	if (m_p0File == nullptr) {
+		sError = "Couldn't create capture file " + sPath + ": " + std::string(strerror(errno));
+		return false; //--------------------------------------------------------
+	}
+	uint8_t aHeader[s_nFileHeaderSize];
+	std::memcpy(aHeader, s_aFileMagic, sizeof(s_aFileMagic));
+	putBE32(aHeader + 8, s_nFileVersion);
+	putBE32(aHeader + 12, s_nDatalinkMonitor);
+	if (std::fwrite(aHeader, sizeof(aHeader), 1, m_p0File) != 1) {
+		sError = "Couldn't write capture file " + sPath + ": " + std::string(strerror(errno));
+		close();
+		return false; //--------------------------------------------------------
+	}
+	m_nTotWritten = 0;
+	return true;
+}
+void PacketCaptureWriter::close() noexcept
+{
+	if (m_p0File != nullptr) {
+		std::fclose(m_p0File);
+		m_p0File = nullptr;
+	}
+}
+void PacketCaptureWriter::write(int32_t nBackendId, int64_t nTimeUsec, const uint8_t* p0Data, int32_t nBytes) noexcept
+{
+	assert(nBackendId >= 0);
+	assert(p0Data != nullptr);
+	assert(nBytes > 0);
+	if ((m_p0File == nullptr) || (nBytes > s_nMaxDatagramSize)) {
+		return; //--------------------------------------------------------------
+	}
+	constexpr int32_t nPrefixSize = s_nRecordHeaderSize + s_nAclHeaderSize + s_nL2capHeaderSize;
+	uint8_t aPrefix[nPrefixSize];
+	const uint32_t nRecordSize = static_cast<uint32_t>(s_nAclHeaderSize + s_nL2capHeaderSize + nBytes);
+	putBE32(aPrefix, nRecordSize); // original length
+	putBE32(aPrefix + 4, nRecordSize); // included length
+	putBE32(aPrefix + 8, s_nOpcodeAclRx); // controller index 0
+	putBE32(aPrefix + 12, static_cast<uint32_t>(nBackendId)); // cumulative drops
+	const uint64_t nStamp = static_cast<uint64_t>(nTimeUsec + s_nEpochOffsetUsec);
+	putBE32(aPrefix + 16, static_cast<uint32_t>(nStamp >> 32));
+	putBE32(aPrefix + 20, static_cast<uint32_t>(nStamp));
+	uint8_t* p0Acl = aPrefix + s_nRecordHeaderSize;
+	const uint16_t nHandle = static_cast<uint16_t>(SlotMapBase::getIndex(nBackendId) & 0x0FFF);
+	putLE16(p0Acl, static_cast<uint16_t>(nHandle | s_nAclStartFlag));
+	putLE16(p0Acl + 2, static_cast<uint16_t>(s_nL2capHeaderSize + nBytes));
+	putLE16(p0Acl + 4, static_cast<uint16_t>(nBytes));
+	putLE16(p0Acl + 6, s_nL2capCid);
+	if ((std::fwrite(aPrefix, sizeof(aPrefix), 1, m_p0File) != 1)
+			|| (std::fwrite(p0Data, static_cast<size_t>(nBytes), 1, m_p0File) != 1)) {
+		// disk full? stop capturing
+		close();
+		return; //--------------------------------------------------------------
+	}
+	++m_nTotWritten;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+PacketCaptureReader::PacketCaptureReader() noexcept
+: m_p0File(nullptr)
+{
+}
+PacketCaptureReader::~PacketCaptureReader() noexcept
+{
+	close();
+}
+bool PacketCaptureReader::open(const std::string& sPath, std::string& sError) noexcept
+{
+	close();
+	m_p0File = std::fopen(sPath.c_str(), "rb");
+	if (m_p0File == nullptr) {
+		sError = "Couldn't open capture file " + sPath + ": " + std::string(strerror(errno));
+		return false; //--------------------------------------------------------
+	}
+	uint8_t aHeader[s_nFileHeaderSize];
+	if ((std::fread(aHeader, sizeof(aHeader), 1, m_p0File) != 1)
+			|| (std::memcmp(aHeader, s_aFileMagic, sizeof(s_aFileMagic)) != 0)
+			|| (getBE32(aHeader + 8) != s_nFileVersion)
+			|| (getBE32(aHeader + 12) != s_nDatalinkMonitor)) {
+		sError = "Not a btsnoop monitor capture file: " + sPath;
+		close();
+		return false; //--------------------------------------------------------
+	}
+	return true;
+}
+void PacketCaptureReader::close() noexcept
+{
+	if (m_p0File != nullptr) {
+		std::fclose(m_p0File);
+		m_p0File = nullptr;
+	}
+}
+bool PacketCaptureReader::read(CapturedDatagram& oDatagram, std::string& sError) noexcept
+{
+	if (m_p0File == nullptr) {
+		return false; //--------------------------------------------------------
+	}
+	while (true) {
+		uint8_t aHeader[s_nRecordHeaderSize];
+		const size_t nRead = std::fread(aHeader, 1, sizeof(aHeader), m_p0File);
+		if (nRead == 0) {
+			return false; //----------------------------------------------------
+		}
+		if (nRead < sizeof(aHeader)) {
+			sError = "Capture file: truncated record header";
+			return false; //----------------------------------------------------
+		}
+		const uint32_t nInclSize = getBE32(aHeader + 4);
+		const uint32_t nFlags = getBE32(aHeader + 8);
+		if (nInclSize > 0xFFFF + s_nAclHeaderSize) {
+			sError = "Capture file: invalid record size";
+			return false; //----------------------------------------------------
+		}
+		m_aRecord.resize(nInclSize);
+		if ((nInclSize > 0) && (std::fread(m_aRecord.data(), nInclSize, 1, m_p0File) != 1)) {
+			sError = "Capture file: truncated record";
+			return false; //----------------------------------------------------
+		}
+		if (((nFlags & 0xFFFFu) != s_nOpcodeAclRx)
+				|| (nInclSize <= static_cast<uint32_t>(s_nAclHeaderSize + s_nL2capHeaderSize))) {
+			// not written by PacketCaptureWriter
+			continue; // while ------
+		}
+		const int32_t nBytes = getLE16(m_aRecord.data() + s_nAclHeaderSize);
+		if (nBytes != static_cast<int32_t>(nInclSize) - s_nAclHeaderSize - s_nL2capHeaderSize) {
+			// fragmented or foreign L2CAP frame
+			continue; // while ------
+		}
+		const uint64_t nStamp = (static_cast<uint64_t>(getBE32(aHeader + 16)) << 32) | getBE32(aHeader + 20);
+		oDatagram.m_nBackendId = static_cast<int32_t>(getBE32(aHeader + 12) & 0x7FFFFFFFu);
+		oDatagram.m_nTimeUsec = static_cast<int64_t>(nStamp) - s_nEpochOffsetUsec;
+		const uint8_t* p0Data = m_aRecord.data() + s_nAclHeaderSize + s_nL2capHeaderSize;
+		oDatagram.m_aData.assign(p0Data, p0Data + nBytes);
+		return true;
+	}
+}
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
@@ -0,0 +1,144 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   packetcapture.h
+ */
+
+#ifndef STMI_PACKET_CAPTURE_H
+#define STMI_PACKET_CAPTURE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+/* The capture files are btsnoop files (version 1) with the Linux monitor
+ * datalink type, as written by btmon, so that they can be opened by the usual
+ * bluetooth tools. Each received datagram is a record with opcode "ACL RX"
+ * containing an ACL header (handle: the slot index of the backend id) and an
+ * L2CAP basic header followed by the datagram. The timestamp is the
+ * DeviceManager::getNowTimeMicroseconds() time of the datagram plus the btsnoop
+ * epoch offset, the full backend id is stored in the record's (otherwise unused)
+ * cumulative drops field.
+ *
+ * The receiver thread engine doesn't know the backend ids (the main thread
+ * assigns them), it records an id per client address instead. Both are the same
+ * for all the connections of a device, so that replaying a reconnection doesn't
+ * add a new device.
+ */
+
+////////////////////////////////////////////////////////////////////////////////
+/** A captured datagram.
+ */
+struct CapturedDatagram
+{
+	int32_t m_nBackendId = -1; /**< The backend id of the device (or the receiver thread's id of the device). */
+	int64_t m_nTimeUsec = 0; /**< The time the datagram was received in DeviceManager::getNowTimeMicroseconds() clock. */
+	std::vector<uint8_t> m_aData; /**< The datagram. */
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Writes received datagrams to a capture file.
+ * Not thread safe: all the receivers sharing an instance must run in the same
+ * thread (which is the case for each receive engine).
+ */
+class PacketCaptureWriter
+{
+public:
+	PacketCaptureWriter() noexcept;
+	~PacketCaptureWriter() noexcept;
+	/** Creates the capture file.
+	 * An existing file is overwritten.
+	 * @param sPath The path.
+	 * @param sError Set to the error string if failed.
+	 * @return Whether the file was created.
+	 */
+	bool open(const std::string& sPath, std::string& sError) noexcept;
+	/** Flushes and closes the file.
+	 */
+	void close() noexcept;
+	/** Whether the file is open.
+	 * @return Whether open.
+	 */
+	bool isOpen() const noexcept { return (m_p0File != nullptr); }
+	/** Appends a datagram.
+	 * Write errors close the file (the capture ends). Datagrams that don't
+	 * fit into an L2CAP frame are skipped.
+	 * @param nBackendId The backend id (or the receiver thread's id of the device). Must not be negative.
+	 * @param nTimeUsec The receive time in DeviceManager::getNowTimeMicroseconds() clock.
+	 * @param p0Data The datagram. Cannot be null.
+	 * @param nBytes The size of the datagram. Must be positive.
+	 */
+	void write(int32_t nBackendId, int64_t nTimeUsec, const uint8_t* p0Data, int32_t nBytes) noexcept;
+	/** The number of datagrams written.
+	 * @return The number of records.
+	 */
+	int64_t getTotWritten() const noexcept { return m_nTotWritten; }
+private:
+	std::FILE* m_p0File;
+	int64_t m_nTotWritten;
+private:
+	PacketCaptureWriter(const PacketCaptureWriter& oSource) = delete;
+	PacketCaptureWriter& operator=(const PacketCaptureWriter& oSource) = delete;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Reads the datagrams of a capture file.
+ * Records that aren't received ACL packets are skipped.
+ */
+class PacketCaptureReader
+{
+public:
+	PacketCaptureReader() noexcept;
+	~PacketCaptureReader() noexcept;
+	/** Opens a capture file.
+	 * @param sPath The path.
+	 * @param sError Set to the error string if failed.
+	 * @return Whether the file could be opened and has a valid header.
+	 */
+	bool open(const std::string& sPath, std::string& sError) noexcept;
+	/** Closes the file.
+	 */
+	void close() noexcept;
+	/** Reads the next datagram.
+	 * @param oDatagram Set to the datagram.
+	 * @param sError Set to the error string if the file is corrupted.
+	 * @return Whether a datagram was read. If false and sError is empty the end was reached.
+	 */
+	bool read(CapturedDatagram& oDatagram, std::string& sError) noexcept;
+private:
+	std::FILE* m_p0File;
+	std::vector<uint8_t> m_aRecord;
+private:
+	PacketCaptureReader(const PacketCaptureReader& oSource) = delete;
+	PacketCaptureReader& operator=(const PacketCaptureReader& oSource) = delete;
+};
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
+
+#endif /* STMI_PACKET_CAPTURE_H */
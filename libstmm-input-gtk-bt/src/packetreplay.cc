@@ -0,0 +1,184 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   packetreplay.cc
+ */
+
+#include "packetreplay.h"
+
+#include <stmm-input/devicemanager.h>
+
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <cassert>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+PacketReplay::PacketReplay(const BlueReceiveOptions& oOptions) noexcept
+: m_oOptions(oOptions)
+{
+	// never capture the replay
+	m_oOptions.m_refCapture.reset();
+}
+PacketReplay::~PacketReplay() noexcept
+{
+	closeConnections();
+}
+bool PacketReplay::open(const std::string& sPath, std::string& sError) noexcept
+{
+	return m_oReader.open(sPath, sError);
+}
+bdaddr_t PacketReplay::getReplayBdAddr(int32_t nRecordedId) noexcept
+{
+	assert(nRecordedId >= 0);
+	bdaddr_t oBdAddr;
+	// bdaddr_t is little endian: prints as "02:00:ii:ii:ii:ii"
+	const uint32_t nId = static_cast<uint32_t>(nRecordedId);
+	oBdAddr.b[0] = static_cast<uint8_t>(nId);
+	oBdAddr.b[1] = static_cast<uint8_t>(nId >> 8);
+	oBdAddr.b[2] = static_cast<uint8_t>(nId >> 16);
+	oBdAddr.b[3] = static_cast<uint8_t>(nId >> 24);
+	oBdAddr.b[4] = 0;
+	oBdAddr.b[5] = 0x02;
+	return oBdAddr;
+}
+PacketReplay::Connection* PacketReplay::addConnection(int32_t nRecordedId
+							, const sigc::slot<int32_t, const bdaddr_t&, int32_t, const std::shared_ptr<BlueReceiveCounters>&>& oConnectSlot
+							, std::string& sError) noexcept
+{
+	int aFDs[2];
+	const auto nRes = ::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, aFDs);
+	if (nRes < 0) {
+		sError = std::string("PacketReplay error: socketpair failed!\n  ") + strerror(errno);
+		return nullptr; //------------------------------------------------------
+	}
+	Connection& oConnection = m_oConnections[nRecordedId];
+	auto refCounters = std::make_shared<BlueReceiveCounters>();
+	const int32_t nBackendId = oConnectSlot(getReplayBdAddr(nRecordedId), -1, refCounters);
+	if (nBackendId < 0) {
+		// ignored, its datagrams are skipped
+		::close(aFDs[0]);
+		::close(aFDs[1]);
+		return &oConnection; //-------------------------------------------------
+	}
+	oConnection.m_nPeerFD = aFDs[1];
+	oConnection.m_refReceiver = std::make_unique<BlueClientReceiver>(nBackendId, aFDs[0], m_oOptions, refCounters);
+	return &oConnection;
+}
+void PacketReplay::closeConnection(Connection& oConnection) noexcept
+{
+	oConnection.m_refReceiver.reset();
+	if (oConnection.m_nPeerFD >= 0) {
+		::close(oConnection.m_nPeerFD);
+		oConnection.m_nPeerFD = -1;
+	}
+}
+void PacketReplay::closeConnections() noexcept
+{
+	for (auto& oPair : m_oConnections) {
+		closeConnection(oPair.second);
+	}
+	m_oConnections.clear();
+}
+void PacketReplay::drainPeer(int32_t nPeerFD) noexcept
+{
+	uint8_t aBuf[64];
+	while (::recv(nPeerFD, aBuf, sizeof(aBuf), MSG_DONTWAIT) > 0) {
+	}
+}
+int64_t PacketReplay::replay(const sigc::slot<int32_t, const bdaddr_t&, int32_t, const std::shared_ptr<BlueReceiveCounters>&>& oConnectSlot
+							, const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oReceiveSlot
+							, bool bOriginalPacing, std::string& sError) noexcept
+{
+	CapturedDatagram oDatagram;
+	int64_t nTotReplayed = 0;
+	int64_t nFirstRecordedUsec = -1;
+	int64_t nStartUsec = 0;
+	while (m_oReader.read(oDatagram, sError)) {
+		if (bOriginalPacing) {
+			if (nFirstRecordedUsec < 0) {
+				nFirstRecordedUsec = oDatagram.m_nTimeUsec;
+				nStartUsec = DeviceManager::getNowTimeMicroseconds();
+			} else {
+				const int64_t nWaitUsec = nStartUsec + (oDatagram.m_nTimeUsec - nFirstRecordedUsec)
+										- DeviceManager::getNowTimeMicroseconds();
+				if (nWaitUsec > 0) {
+					std::this_thread::sleep_for(std::chrono::microseconds(nWaitUsec));
+				}
+			}
+		}
+		Connection* p0Connection;
+		auto itFind = m_oConnections.find(oDatagram.m_nBackendId);
+		if (itFind == m_oConnections.end()) {
+			p0Connection = addConnection(oDatagram.m_nBackendId, oConnectSlot, sError);
+			if (p0Connection == nullptr) {
+				break; // while -------
+			}
+		} else {
+			p0Connection = &(itFind->second);
+		}
+		if (! p0Connection->m_refReceiver) {
+			continue; // while ------
+		}
+		const auto nSent = ::send(p0Connection->m_nPeerFD, oDatagram.m_aData.data(), oDatagram.m_aData.size()
+								, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (nSent < 0) {
+			sError = std::string("PacketReplay error: send failed!\n  ") + strerror(errno);
+			break; // while -------
+		}
+		++nTotReplayed;
+		auto& oReceiver = *(p0Connection->m_refReceiver);
+		std::string sReceiveError;
+		const auto eResult = oReceiver.receive(oReceiveSlot, sReceiveError);
+		drainPeer(p0Connection->m_nPeerFD);
+		if (eResult == BlueClientReceiver::RECEIVE_RESULT_OK) {
+			continue; // while ------
+		}
+		// close as BlueServerReceiveSource does, the next datagram
+		// of the device reconnects it
+		const int32_t nBackendId = oReceiver.getBackendId();
+		closeConnection(*p0Connection);
+		m_oConnections.erase(oDatagram.m_nBackendId);
+		if (eResult != BlueClientReceiver::RECEIVE_RESULT_STOP) {
+			const bool bRemove = (eResult == BlueClientReceiver::RECEIVE_RESULT_REMOVE);
+			oReceiveSlot(nBackendId, bRemove, BlueClientReceiver::getClosePacket(bRemove)
+						, DeviceManager::getNowTimeMicroseconds());
+		}
+	}
+	closeConnections();
+	if (! sError.empty()) {
+		return -1; //-----------------------------------------------------------
+	}
+	return nTotReplayed;
+}
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
@@ -0,0 +1,118 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   packetreplay.h
+ */
+
+#ifndef STMI_PACKET_REPLAY_H
+#define STMI_PACKET_REPLAY_H
+
+#include "bluetoothsources.h"
+#include "btstats.h"
+#include "keypacket.h"
+#include "packetcapture.h"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <bluetooth/bluetooth.h>
+
+namespace stmi
+{
+
+namespace Private
+{
+namespace Bt
+{
+
+////////////////////////////////////////////////////////////////////////////////
+/** Replays a capture file through the receive path.
+ * Each device of the capture gets a local socket pair: the recorded datagrams
+ * are sent to one end and received by a BlueClientReceiver on the other, so that
+ * they are parsed and dispatched exactly as if they came from the device.
+ * The receive times passed to the callback are those of the replay.
+ */
+class PacketReplay
+{
+public:
+	/** Constructor.
+	 * @param oOptions The options of the client receivers. The capture writer is ignored.
+	 */
+	explicit PacketReplay(const BlueReceiveOptions& oOptions) noexcept;
+	~PacketReplay() noexcept;
+
+	/** Opens the capture file.
+	 * @param sPath The path.
+	 * @param sError Set to the error string if failed.
+	 * @return Whether the file could be opened.
+	 */
+	bool open(const std::string& sPath, std::string& sError) noexcept;
+	/** Replays the opened capture file.
+	 * The first datagram of a recorded device calls the connect callback, which has
+	 * the signature of BlueServerThreadSource::connect()'s (the address is the one
+	 * returned by getReplayBdAddr() and the adapter index is -1).
+	 * The receive callback has the signature of BlueServerReceiveSource::connect(). If
+	 * it returns false the connection is closed (the device's next datagram reconnects it).
+	 *
+	 * Connections still open at the end of the capture are closed without calling
+	 * the receive callback.
+	 * @param oConnectSlot The connect callback.
+	 * @param oReceiveSlot The receive callback.
+	 * @param bOriginalPacing Whether the datagrams are sent with the recorded delays
+	 *                        between them or as fast as possible.
+	 * @param sError Set to the error string if failed.
+	 * @return The number of datagrams replayed or -1 if failed.
+	 */
+	int64_t replay(const sigc::slot<int32_t, const bdaddr_t&, int32_t, const std::shared_ptr<BlueReceiveCounters>&>& oConnectSlot
+					, const sigc::slot<bool, int32_t, bool, const KeyPacket&, int64_t>& oReceiveSlot
+					, bool bOriginalPacing, std::string& sError) noexcept;
+
+	/** The address of a recorded device.
+	 * @param nRecordedId The backend id stored in the capture. Must not be negative.
+	 * @return The address, never all zeroes.
+	 */
+	static bdaddr_t getReplayBdAddr(int32_t nRecordedId) noexcept;
+private:
+	struct Connection
+	{
+		int32_t m_nPeerFD = -1; // The end the datagrams are sent to
+		std::unique_ptr<BlueClientReceiver> m_refReceiver; // Null if the connect callback ignored the device
+	};
+	// Returns null if failed
+	Connection* addConnection(int32_t nRecordedId
+							, const sigc::slot<int32_t, const bdaddr_t&, int32_t, const std::shared_ptr<BlueReceiveCounters>&>& oConnectSlot
+							, std::string& sError) noexcept;
+	void closeConnection(Connection& oConnection) noexcept;
+	void closeConnections() noexcept;
+	// Discards the datagrams the receiver sent back (handshake replies)
+	static void drainPeer(int32_t nPeerFD) noexcept;
+private:
+	BlueReceiveOptions m_oOptions;
+	PacketCaptureReader m_oReader;
+	std::unordered_map<int32_t, Connection> m_oConnections; // Key: recorded backend id
+private:
+	PacketReplay(const PacketReplay& oSource) = delete;
+	PacketReplay& operator=(const PacketReplay& oSource) = delete;
+};
+
+} // namespace Bt
+} // namespace Private
+
+} // namespace stmi
+
+#endif /* STMI_PACKET_REPLAY_H */
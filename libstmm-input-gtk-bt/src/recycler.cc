@@ -19,3 +19,79 @@
  */
 
 #include "recycler.h"
+
+#include <new>
+
+namespace stmi
+{
+
+namespace Private
+{
+
+RecyclerPool::RecyclerPool(int32_t nMaxPooled) noexcept
+: m_nMaxPooled(nMaxPooled)
+, m_oOwnerThreadId(std::this_thread::get_id())
+, m_nBlockSize(0)
+, m_p0FreeHead(nullptr)
+, m_nForeignReleases(0)
+{
+	assert(nMaxPooled >= 0);
+}
+RecyclerPool::~RecyclerPool() noexcept
+{
+	// All blocks in use have been released since they hold a reference to the pool
+	assert(m_oStats.m_nLive == m_nForeignReleases.load(std::memory_order_relaxed));
+	while (m_p0FreeHead != nullptr) {
+		FreeBlock* p0Block = m_p0FreeHead;
+		m_p0FreeHead = p0Block->m_p0Next;
+		::operator delete(p0Block);
+	}
+}
+void* RecyclerPool::acquire(std::size_t nSize)
+{
+	assert(nSize > 0);
+	assert(std::this_thread::get_id() == m_oOwnerThreadId);
+	if ((m_nBlockSize == 0) && (nSize >= sizeof(FreeBlock))) {
+		m_nBlockSize = nSize;
+	}
+	void* p0Block;
+	if ((m_p0FreeHead != nullptr) && (nSize == m_nBlockSize)) {
+		FreeBlock* p0Free = m_p0FreeHead;
+		m_p0FreeHead = p0Free->m_p0Next;
+		--m_oStats.m_nPooled;
+		p0Free->~FreeBlock();
+		p0Block = p0Free;
+	} else {
+		p0Block = ::operator new(nSize);
+		++m_oStats.m_nMisses;
+	}
+	++m_oStats.m_nLive;
+	return p0Block;
+}
+void RecyclerPool::release(void* p0Block, std::size_t nSize) noexcept
+{
+	assert(p0Block != nullptr);
+	if (std::this_thread::get_id() != m_oOwnerThreadId) {
+		m_nForeignReleases.fetch_add(1, std::memory_order_relaxed);
+		::operator delete(p0Block);
+		return; //--------------------------------------------------------------
+	}
+	--m_oStats.m_nLive;
+	if ((nSize != m_nBlockSize) || (m_oStats.m_nPooled >= m_nMaxPooled)) {
+		::operator delete(p0Block);
+		return; //--------------------------------------------------------------
+	}
+	FreeBlock* p0Free = new (p0Block) FreeBlock{m_p0FreeHead};
+	m_p0FreeHead = p0Free;
+	++m_oStats.m_nPooled;
+}
+RecyclerStats RecyclerPool::getStats() const noexcept
+{
+	RecyclerStats oStats = m_oStats;
+	oStats.m_nLive -= m_nForeignReleases.load(std::memory_order_relaxed);
+	return oStats;
+}
+
+} // namespace Private
+
+} // namespace stmi
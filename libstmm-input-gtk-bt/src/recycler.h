@@ -21,10 +21,13 @@
 #ifndef STMI_RECYCLER_H
 #define STMI_RECYCLER_H
 
+#include <atomic>
 #include <cassert>
-#include <iostream>
-#include <vector>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <thread>
+#include <type_traits>
 
 
 namespace stmi
@@ -33,47 +36,157 @@ namespace stmi
 namespace Private
 {
 
+////////////////////////////////////////////////////////////////////////////////
+/** The statistics of a Recycler.
+ */
+struct RecyclerStats
+{
+	int32_t m_nLive = 0; /**< The number of blocks in use, that is instances not yet released. */
+	int32_t m_nPooled = 0; /**< The number of free blocks kept for reuse. */
+	int64_t m_nMisses = 0; /**< The number of blocks that had to be allocated from the heap. */
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Pool of equally sized memory blocks.
+ * The free blocks form an intrusive singly linked list: acquiring and releasing
+ * a block is O(1).
+ * The size of the blocks is set by the first acquire() call, blocks of
+ * other sizes are allocated from and freed to the heap.
+ *
+ * Blocks must be acquired by the thread that created the pool. They can be
+ * released by any thread, those released by other threads are freed to the heap
+ * so that the free list is only accessed by the creating thread.
+ */
+class RecyclerPool final
+{
+public:
+	/** Constructor.
+	 * @param nMaxPooled The maximum number of free blocks kept for reuse. Must not be negative.
+	 */
+	explicit RecyclerPool(int32_t nMaxPooled) noexcept;
+	~RecyclerPool() noexcept;
+
+	/** Get a block.
+	 * Must be called by the thread that created the pool.
+	 * @param nSize The size in bytes. Must be positive.
+	 * @return The block. Is not null.
+	 * @throws std::bad_alloc
+	 */
+	void* acquire(std::size_t nSize);
+	/** Return a block.
+	 * @param p0Block The block obtained with acquire(nSize). Cannot be null.
+	 * @param nSize The size in bytes.
+	 */
+	void release(void* p0Block, std::size_t nSize) noexcept;
+
+	/** The statistics.
+	 * Must be called by the thread that created the pool.
+	 * @return The statistics.
+	 */
+	RecyclerStats getStats() const noexcept;
+private:
+	struct FreeBlock
+	{
+		FreeBlock* m_p0Next;
+	};
+	const int32_t m_nMaxPooled;
+	const std::thread::id m_oOwnerThreadId;
+	std::size_t m_nBlockSize; // 0 until first acquire
+	FreeBlock* m_p0FreeHead;
+	RecyclerStats m_oStats; // m_nLive doesn't account for m_nForeignReleases
+	std::atomic<int32_t> m_nForeignReleases; // The blocks released by other threads
+private:
+	RecyclerPool(const RecyclerPool& oSource) = delete;
+	RecyclerPool& operator=(const RecyclerPool& oSource) = delete;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Allocator drawing from a RecyclerPool.
+ * Holds a reference to the pool so that the pool outlives the blocks
+ * allocated from it.
+ */
+template <class U>
+class RecyclerAllocator
+{
+public:
+	using value_type = U;
+
+	explicit RecyclerAllocator(const std::shared_ptr<RecyclerPool>& refPool) noexcept
+	: m_refPool(refPool)
+	{
+	}
+	template <class V>
+	RecyclerAllocator(const RecyclerAllocator<V>& oOther) noexcept
+	: m_refPool(oOther.m_refPool)
+	{
+	}
+	U* allocate(std::size_t nTot)
+	{
+		static_assert(alignof(U) <= alignof(std::max_align_t), "Over-aligned type.");
+		return static_cast<U*>(m_refPool->acquire(nTot * sizeof(U)));
+	}
+	void deallocate(U* p0U, std::size_t nTot) noexcept
+	{
+		m_refPool->release(p0U, nTot * sizeof(U));
+	}
+	template <class V>
+	bool operator==(const RecyclerAllocator<V>& oOther) const noexcept
+	{
+		return (m_refPool == oOther.m_refPool);
+	}
+	template <class V>
+	bool operator!=(const RecyclerAllocator<V>& oOther) const noexcept
+	{
+		return (m_refPool != oOther.m_refPool);
+	}
+private:
+	template <class V> friend class RecyclerAllocator;
+	std::shared_ptr<RecyclerPool> m_refPool;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** Recycling factory for shared_ptr wrapped classes.
+ * The instance and the shared_ptr control block are constructed in a single
+ * memory block taken from a pool. When the last reference is dropped the
+ * instance is destroyed and the block is returned to the pool, which is O(1)
+ * no matter how many instances are held elsewhere (for example by listeners
+ * queueing events).
+ *
+ * Instances can outlive the recycler.
  */
 template <class T, class B = T>
 class Recycler final
 {
 public:
-	Recycler() noexcept = default;
+	/** The default maximum number of free blocks kept for reuse. */
+	static constexpr int32_t s_nDefaultMaxPooled = 64;
+	/** Constructor.
+	 * @param nMaxPooled The maximum number of free blocks kept for reuse. Must not be negative.
+	 */
+	explicit Recycler(int32_t nMaxPooled = s_nDefaultMaxPooled) noexcept
+	: m_refPool(std::make_shared<RecyclerPool>(nMaxPooled))
+	{
+	}
 
-	/** Construct or recycle the shared_ptr wrapped instance of T.
+	/** Construct the shared_ptr wrapped instance of T in a recycled block.
 	 * T must be same or subclass of B.
-	 * T must have a constructor T(const P& ... oParam)
-	 * and public member function reInit(const P& ... oParam) with the same params.
+	 * T must have a public constructor T(const P& ... oParam).
 	 */
 	template <typename ...P>
 	void create(std::shared_ptr<B>& refOutB, const P& ... oParam)
 	{
 		static_assert(std::is_base_of<B,T>::value, "Wrong type.");
-		for (auto& refB : m_oAll) {
-			if (refB.use_count() == 1) {
-//#ifndef NDEBUG
-//static int32_t nCount = 0;
-//std::cout << "recycled " << nCount << '\n';
-//++nCount;
-//#endif //NDEBUG
-				T* p0T = static_cast<T*>(refB.get());
-				p0T->reInit(oParam...);
-				refOutB = refB;
-				return; //------------------------------------------------------
-			}
-		}
-		// not found: create new instance
-		if (std::is_same<B,T>::value) {
-			m_oAll.emplace_back(std::make_shared<T>(oParam...));
-		} else {
-			m_oAll.emplace_back(std::shared_ptr<B>(new T(oParam...)));
-		}
-		refOutB = m_oAll.back();
+		refOutB = std::allocate_shared<T>(RecyclerAllocator<T>{m_refPool}, oParam...);
+	}
+	/** The statistics of the pool.
+	 * @return The statistics.
+	 */
+	RecyclerStats getStats() const noexcept
+	{
+		return m_refPool->getStats();
 	}
 private:
-	std::vector< std::shared_ptr<B> > m_oAll;
+	std::shared_ptr<RecyclerPool> m_refPool;
 private:
 	Recycler(const Recycler& oSource) = delete;
 	Recycler& operator=(const Recycler& oSource) = delete;
@@ -84,4 +197,3 @@ private:
 } // namespace stmi
 
 #endif /* STMI_RECYCLER_H */
-
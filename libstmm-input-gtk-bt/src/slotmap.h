@@ -0,0 +1,186 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   slotmap.h
+ */
+
+#ifndef STMI_SLOT_MAP_H
+#define STMI_SLOT_MAP_H
+
+#include <utility>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+
+namespace stmi
+{
+
+namespace Private
+{
+
+/** The id arithmetic of SlotMap.
+ * An id is a non negative number made of the index of the slot in the low
+ * s_nIndexBits bits and the generation of the slot in the remaining bits.
+ * Tables that are kept in parallel to a slot map are indexed with getIndex().
+ */
+class SlotMapBase
+{
+public:
+	/** The number of bits of the id holding the slot index. */
+	static constexpr int32_t s_nIndexBits = 16;
+	/** The maximum number of slots. */
+	static constexpr int32_t s_nMaxSlots = (1 << s_nIndexBits);
+
+	/** The slot index of an id.
+	 * @param nId The id. Must be non negative.
+	 * @return The index.
+	 */
+	static inline int32_t getIndex(int32_t nId) noexcept
+	{
+		assert(nId >= 0);
+		return (nId & (s_nMaxSlots - 1));
+	}
+	/** The generation of an id.
+	 * @param nId The id. Must be non negative.
+	 * @return The generation.
+	 */
+	static inline int32_t getGeneration(int32_t nId) noexcept
+	{
+		assert(nId >= 0);
+		return (nId >> s_nIndexBits);
+	}
+protected:
+	static constexpr int32_t s_nGenerationMask = (1 << (31 - s_nIndexBits)) - 1;
+	static inline int32_t makeId(int32_t nIdx, int32_t nGeneration) noexcept
+	{
+		return ((nGeneration & s_nGenerationMask) << s_nIndexBits) | nIdx;
+	}
+};
+
+/** Dense table of values addressed by ids that detect reuse.
+ * Erasing a value puts its slot on a free list and increments the slot's
+ * generation, so that the erased id is no longer found even after the slot
+ * was reused by insert(). Inserting and erasing are O(1).
+ *
+ * The first value inserted in a slot gets an id equal to the slot index.
+ * Generations wrap around after 2^(31 - s_nIndexBits) reuses of a slot.
+ */
+template <class T>
+class SlotMap : public SlotMapBase
+{
+public:
+	SlotMap() noexcept
+	: m_nTotUsed(0)
+	{
+	}
+	/** Adds a value.
+	 * @param oValue The value.
+	 * @return The id of the value or -1 if all s_nMaxSlots slots are in use.
+	 */
+	int32_t insert(T&& oValue) noexcept
+	{
+		int32_t nIdx;
+		if (! m_aFreeIdxs.empty()) {
+			nIdx = m_aFreeIdxs.back();
+			m_aFreeIdxs.pop_back();
+		} else {
+			nIdx = static_cast<int32_t>(m_aSlots.size());
+			if (nIdx >= s_nMaxSlots) {
+				return -1; //-------------------------------------------------------
+			}
+			m_aSlots.emplace_back();
+		}
+		Slot& oSlot = m_aSlots[nIdx];
+		assert(! oSlot.m_bUsed);
+		oSlot.m_oValue = std::move(oValue);
+		oSlot.m_bUsed = true;
+		++m_nTotUsed;
+		return makeId(nIdx, oSlot.m_nGeneration);
+	}
+	/** Removes a value.
+	 * The slot's value is reset to a default constructed T.
+	 * @param nId The id.
+	 * @return Whether the id was valid.
+	 */
+	bool erase(int32_t nId) noexcept
+	{
+		if (! contains(nId)) {
+			return false; //--------------------------------------------------------
+		}
+		const int32_t nIdx = getIndex(nId);
+		Slot& oSlot = m_aSlots[nIdx];
+		oSlot.m_oValue = T{};
+		oSlot.m_bUsed = false;
+		oSlot.m_nGeneration = ((oSlot.m_nGeneration + 1) & s_nGenerationMask);
+		m_aFreeIdxs.push_back(nIdx);
+		--m_nTotUsed;
+		return true;
+	}
+	/** Whether an id is valid.
+	 * @param nId The id. Can be negative.
+	 * @return Whether the id was returned by insert() and wasn't erased since.
+	 */
+	bool contains(int32_t nId) const noexcept
+	{
+		if (nId < 0) {
+			return false; //--------------------------------------------------------
+		}
+		const int32_t nIdx = getIndex(nId);
+		if (nIdx >= static_cast<int32_t>(m_aSlots.size())) {
+			return false; //--------------------------------------------------------
+		}
+		const Slot& oSlot = m_aSlots[nIdx];
+		return oSlot.m_bUsed && (oSlot.m_nGeneration == getGeneration(nId));
+	}
+	/** The value of an id.
+	 * @param nId The id. Can be negative.
+	 * @return The value or null if the id is not valid.
+	 */
+	T* find(int32_t nId) noexcept
+	{
+		return (contains(nId) ? &(m_aSlots[getIndex(nId)].m_oValue) : nullptr);
+	}
+	const T* find(int32_t nId) const noexcept
+	{
+		return (contains(nId) ? &(m_aSlots[getIndex(nId)].m_oValue) : nullptr);
+	}
+	/** The number of values.
+	 * @return The size.
+	 */
+	int32_t size() const noexcept { return m_nTotUsed; }
+	/** The number of slots.
+	 * Indexes of valid ids are smaller than this value.
+	 * @return The number of used and free slots.
+	 */
+	int32_t getTotSlots() const noexcept { return static_cast<int32_t>(m_aSlots.size()); }
+private:
+	struct Slot
+	{
+		T m_oValue{};
+		int32_t m_nGeneration = 0;
+		bool m_bUsed = false;
+	};
+	std::vector<Slot> m_aSlots;
+	std::vector<int32_t> m_aFreeIdxs; // The indexes of the unused slots, last in first out
+	int32_t m_nTotUsed;
+};
+
+} // namespace Private
+
+} // namespace stmi
+
+#endif /* STMI_SLOT_MAP_H */
@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   spscring.h
+ *
+ * stmm-input-btkb has a copy (without namespace Private): keep them in sync.
+ */
+
+#ifndef STMI_SPSC_RING_H
+#define STMI_SPSC_RING_H
+
+#include <atomic>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+
+namespace stmi
+{
+
+namespace Private
+{
+
+/** Lock-free single producer single consumer ring buffer.
+ * push() must only be called by one thread, pop() only by one (other) thread.
+ * The capacity is a power of two.
+ */
+template<class T>
+class SpscRing final
+{
+public:
+	/** Constructor.
+	 * @param nMinCapacity The minimum capacity. Is rounded up to a power of two. Must be positive.
+	 */
+	explicit SpscRing(int32_t nMinCapacity) noexcept
+	: m_nHead(0)
+	, m_nTail(0)
+	{
+		assert(nMinCapacity > 0);
+		uint32_t nCapacity = 1;
+		while (nCapacity < static_cast<uint32_t>(nMinCapacity)) {
+			nCapacity <<= 1;
+		}
+		m_nMask = nCapacity - 1;
+		m_aSlots.resize(nCapacity);
+	}
+	/** The capacity.
+	 * @return The maximum number of values the ring can hold.
+	 */
+	int32_t capacity() const noexcept
+	{
+		return static_cast<int32_t>(m_nMask + 1);
+	}
+	/** The number of values that can be added. Producer only.
+	 * The consumer might free more in the meantime.
+	 * @return The free slots.
+	 */
+	int32_t freeSlots() const noexcept
+	{
+		const uint32_t nTail = m_nTail.load(std::memory_order_relaxed);
+		const uint32_t nHead = m_nHead.load(std::memory_order_acquire);
+		return static_cast<int32_t>(m_nMask + 1 - (nTail - nHead));
+	}
+	/** Adds a value. Producer only.
+	 * @param oValue The value.
+	 * @return Whether there was space for the value.
+	 */
+	bool push(const T& oValue) noexcept
+	{
+		const uint32_t nTail = m_nTail.load(std::memory_order_relaxed);
+		const uint32_t nHead = m_nHead.load(std::memory_order_acquire);
+		if (nTail - nHead > m_nMask) {
+			return false; // full
+		}
+		m_aSlots[nTail & m_nMask] = oValue;
+		m_nTail.store(nTail + 1, std::memory_order_release);
+		return true;
+	}
+	/** Removes the oldest value. Consumer only.
+	 * @param oValue Set to the removed value.
+	 * @return Whether the ring wasn't empty.
+	 */
+	bool pop(T& oValue) noexcept
+	{
+		const uint32_t nHead = m_nHead.load(std::memory_order_relaxed);
+		const uint32_t nTail = m_nTail.load(std::memory_order_acquire);
+		if (nHead == nTail) {
+			return false; // empty
+		}
+		oValue = m_aSlots[nHead & m_nMask];
+		m_nHead.store(nHead + 1, std::memory_order_release);
+		return true;
+	}
+	/** Whether the ring is empty. Consumer only.
+	 * @return Whether pop() would fail.
+	 */
+	bool empty() const noexcept
+	{
+		return (m_nHead.load(std::memory_order_relaxed) == m_nTail.load(std::memory_order_acquire));
+	}
+private:
+	static constexpr int32_t s_nCacheLineSize = 64;
+	// Head and tail are free running counters, written by consumer
+	// and producer respectively: keep them on different cache lines
+	std::atomic<uint32_t> m_nHead;
+	char m_aPadHead[s_nCacheLineSize - sizeof(std::atomic<uint32_t>)];
+	std::atomic<uint32_t> m_nTail;
+	char m_aPadTail[s_nCacheLineSize - sizeof(std::atomic<uint32_t>)];
+	uint32_t m_nMask;
+	std::vector<T> m_aSlots;
+private:
+	SpscRing(const SpscRing& oSource) = delete;
+	SpscRing& operator=(const SpscRing& oSource) = delete;
+};
+
+} // namespace Private
+
+} // namespace stmi
+
+#endif /* STMI_SPSC_RING_H */
@@ -62,6 +62,7 @@ set(        STMMI_TEMP_EXTERNAL_LIBRARIES    "")
 list(APPEND STMMI_TEMP_EXTERNAL_LIBRARIES     "${STMMINPUTGTK_LIBRARIES}")
 list(APPEND STMMI_TEMP_EXTERNAL_LIBRARIES     "${STMMINPUTEV_LIBRARIES}")
 list(APPEND STMMI_TEMP_EXTERNAL_LIBRARIES     "${BLUETOOTH_LIBRARIES}")
+list(APPEND STMMI_TEMP_EXTERNAL_LIBRARIES     "-lpthread")
 
 set(        STMMINPUTGTKBT_EXTRA_LIBRARIES     "")
 list(APPEND STMMINPUTGTKBT_EXTRA_LIBRARIES     "${STMMI_TEMP_EXTERNAL_LIBRARIES}")
@@ -0,0 +1,233 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   benchDispatch.cc
+ */
+/* Dispatch scaling microbenchmark.
+ *
+ * Measures the cost of a key event entering the device manager (through
+ * FakeGtkBackend::simulateKeyEvent) and being sent to all the listeners,
+ * sweeping the number of listeners, devices and held keys per device.
+ *
+ *   press    Each device presses its held keys.
+ *   release  Each device releases its held keys.
+ *   cancel   The active window loses the focus while all the keys are held
+ *            (one event per canceled key).
+ *
+ * Usage: benchDispatch [--listeners N] [--devices N] [--held N] [--min-ms N]
+ *
+ * Without --listeners, --devices or --held the respective values are swept.
+ * Each measurement is repeated until it took at least --min-ms milliseconds
+ * (default 200). The result is the time and the number of heap allocations
+ * per key event (not per listener callback).
+ */
+
+#include "benchutil.h"
+#include "fakebtgtkdevicemanager.h"
+
+#include <stmm-input-gtk/gtkaccessor.h>
+#include <stmm-input-ev/keyevent.h>
+#include <stmm-input/hardwarekey.h>
+
+#include <gtkmm.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+static int64_t s_nTotAllocations = 0;
+
+void* operator new(std::size_t nSize)
+{
+	++s_nTotAllocations;
+	void* p0 = std::malloc((nSize == 0) ? 1 : nSize);
+	if (p0 == nullptr) {
+		throw std::bad_alloc{};
+	}
+	return p0;
+}
+void operator delete(void* p0) noexcept
+{
+	std::free(p0);
+}
+void operator delete(void* p0, std::size_t /*nSize*/) noexcept
+{
+	std::free(p0);
+}
+
+namespace stmi
+{
+
+namespace testing
+{
+
+class DispatchBench
+{
+public:
+	struct Result
+	{
+		double m_fNsPerEvent = 0.0;
+		double m_fAllocsPerEvent = 0.0;
+	};
+	DispatchBench(int32_t nListeners, int32_t nDevices, int32_t nHeld) noexcept
+	: m_nHeld(nHeld)
+	, m_nTotCallbacks(0)
+	{
+		m_refDM = FakeBtGtkDeviceManager::create(false, {});
+		m_p0Backend = m_refDM->getBackend();
+		m_refWin = Glib::RefPtr<Gtk::Window>(new Gtk::Window());
+		m_refAccessor = std::make_shared<stmi::GtkAccessor>(m_refWin);
+		m_refDM->addAccessor(m_refAccessor);
+		m_refDM->makeWindowActive(m_refAccessor);
+		for (int32_t nDevice = 0; nDevice < nDevices; ++nDevice) {
+			char sAddr[18];
+			std::snprintf(sAddr, sizeof(sAddr), "BE:BE:00:00:%02X:%02X", (nDevice >> 8) & 0xFF, nDevice & 0xFF);
+			m_aBackendIds.push_back(m_p0Backend->simulateNewDevice(Bt::FakeGtkBackend::getBdAddrFromString(sAddr)));
+		}
+		for (int32_t nListener = 0; nListener < nListeners; ++nListener) {
+			auto refListener = std::make_shared<EventListener>([&](const shared_ptr<Event>& /*refEvent*/)
+			{
+				++m_nTotCallbacks;
+			});
+			m_refDM->addEventListener(refListener, std::shared_ptr<CallIf>{});
+			m_aListeners.push_back(refListener);
+		}
+	}
+	void measure(int64_t nMinUsec, Result& oPress, Result& oRelease, Result& oCancel) noexcept
+	{
+		int64_t nPressUsec = 0;
+		int64_t nReleaseUsec = 0;
+		int64_t nCancelUsec = 0;
+		int64_t nPressAllocs = 0;
+		int64_t nReleaseAllocs = 0;
+		int64_t nCancelAllocs = 0;
+		int64_t nRounds = 0;
+		while ((nRounds == 0) || (std::min(std::min(nPressUsec, nReleaseUsec), nCancelUsec) < nMinUsec)) {
+			timed(&DispatchBench::pressAll, nPressUsec, nPressAllocs);
+			timed(&DispatchBench::releaseAll, nReleaseUsec, nReleaseAllocs);
+			pressAll();
+			timed(&DispatchBench::loseFocus, nCancelUsec, nCancelAllocs);
+			m_refDM->makeWindowActive(m_refAccessor);
+			++nRounds;
+		}
+		const double fTotEvents = static_cast<double>(nRounds * static_cast<int64_t>(m_aBackendIds.size()) * m_nHeld);
+		oPress.m_fNsPerEvent = 1000.0 * nPressUsec / fTotEvents;
+		oPress.m_fAllocsPerEvent = nPressAllocs / fTotEvents;
+		oRelease.m_fNsPerEvent = 1000.0 * nReleaseUsec / fTotEvents;
+		oRelease.m_fAllocsPerEvent = nReleaseAllocs / fTotEvents;
+		oCancel.m_fNsPerEvent = 1000.0 * nCancelUsec / fTotEvents;
+		oCancel.m_fAllocsPerEvent = nCancelAllocs / fTotEvents;
+	}
+private:
+	void timed(void (DispatchBench::*p0Step)(), int64_t& nTotUsec, int64_t& nTotAllocs) noexcept
+	{
+		const int64_t nAllocsBefore = s_nTotAllocations;
+		const int64_t nStartUsec = benchNowUsec();
+		(this->*p0Step)();
+		nTotUsec += benchNowUsec() - nStartUsec;
+		nTotAllocs += s_nTotAllocations - nAllocsBefore;
+	}
+	void pressAll() noexcept
+	{
+		sendAll(KeyEvent::KEY_PRESS);
+	}
+	void releaseAll() noexcept
+	{
+		sendAll(KeyEvent::KEY_RELEASE);
+	}
+	void sendAll(KeyEvent::KEY_INPUT_TYPE eType) noexcept
+	{
+		for (int32_t nKey = 0; nKey < m_nHeld; ++nKey) {
+			const HARDWARE_KEY eKey = static_cast<HARDWARE_KEY>(s_nFirstKey + nKey);
+			for (const int32_t nBackendId : m_aBackendIds) {
+				m_p0Backend->simulateKeyEvent(nBackendId, eType, eKey);
+			}
+		}
+	}
+	void loseFocus() noexcept
+	{
+		auto& refWinData = m_refDM->getFactory()->getFakeWindowData(m_refWin.operator->());
+		refWinData->simulateWindowSetActive(false);
+	}
+private:
+	static constexpr int32_t s_nFirstKey = 1; // HK_ESC
+	const int32_t m_nHeld;
+	shared_ptr<FakeBtGtkDeviceManager> m_refDM;
+	Bt::FakeGtkBackend* m_p0Backend;
+	Glib::RefPtr<Gtk::Window> m_refWin;
+	shared_ptr<stmi::GtkAccessor> m_refAccessor;
+	std::vector<int32_t> m_aBackendIds;
+	std::vector< shared_ptr<EventListener> > m_aListeners;
+	int64_t m_nTotCallbacks;
+};
+
+static std::vector<int32_t> getSweep(const BenchArgs& oArgs, const std::string& sName, const std::vector<int32_t>& aDefault) noexcept
+{
+	const int32_t nValue = oArgs.getInt(sName, 0);
+	if (nValue > 0) {
+		return {nValue}; //-----------------------------------------------------
+	}
+	return aDefault;
+}
+
+int benchDispatchMain(int nArgC, char** aArgV) noexcept
+{
+	const BenchArgs oArgs(nArgC, aArgV);
+	const std::vector<int32_t> aListeners = getSweep(oArgs, "--listeners", {1, 4, 16, 64, 256});
+	const std::vector<int32_t> aDevices = getSweep(oArgs, "--devices", {1, 8, 64});
+	const std::vector<int32_t> aHeld = getSweep(oArgs, "--held", {1, 10, 100});
+	const int64_t nMinUsec = static_cast<int64_t>(std::max(1, oArgs.getInt("--min-ms", 200))) * 1000;
+
+	auto refApp = Gtk::Application::create("net.testlibsnirvana.stmi.bench");
+
+	std::cout << "listeners devices held |     press ns/ev allocs/ev |   release ns/ev allocs/ev |    cancel ns/ev allocs/ev" << '\n';
+	std::cout << std::fixed << std::setprecision(2);
+	for (const int32_t nListeners : aListeners) {
+		for (const int32_t nDevices : aDevices) {
+			for (const int32_t nHeld : aHeld) {
+				DispatchBench::Result oPress;
+				DispatchBench::Result oRelease;
+				DispatchBench::Result oCancel;
+				{
+					DispatchBench oBench(nListeners, nDevices, nHeld);
+					oBench.measure(nMinUsec, oPress, oRelease, oCancel);
+				}
+				std::cout << std::setw(9) << nListeners << std::setw(8) << nDevices << std::setw(5) << nHeld << " |";
+				for (const auto& oRes : {oPress, oRelease, oCancel}) {
+					std::cout << std::setw(16) << oRes.m_fNsPerEvent << std::setw(10) << oRes.m_fAllocsPerEvent << " |";
+				}
+				std::cout << '\n';
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+} // namespace testing
+
+} // namespace stmi
+
+int main(int nArgC, char** aArgV)
+{
+	return stmi::testing::benchDispatchMain(nArgC, aArgV);
+}
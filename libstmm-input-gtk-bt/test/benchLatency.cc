@@ -0,0 +1,352 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   benchLatency.cc
+ */
+/* End-to-end latency benchmark.
+ *
+ * A BtKeyClient (from stmm-input-btkb) connects to a BtGtkDeviceManager listening
+ * on a local socket. The time from the send call to the EventListener callback
+ * is measured for each key event.
+ *
+ * Usage: benchLatency [--pattern tap|chord|stream|all] [--count N] [--rate N]
+ *                     [--engine sources|epoll|thread] [--protocol 1|2|3] [--socket PATH]
+ *                     [--coalesce USEC] [--sender-thread]
+ *
+ *   tap     Press and release of a key sent one after the other, --rate taps per second.
+ *   chord   Ten keys pressed together then released together, --rate chords per second.
+ *   stream  Evenly spaced key events, --rate events per second (default 1000).
+ *
+ * --count is the number of measured key events of each pattern, --rate must be at least 1.
+ * --coalesce sets the client's coalescing window (default 0, no coalescing), the
+ * measured latency includes the time the keys wait in it.
+ * --sender-thread moves the client's connection to its sender thread.
+ * The window the events are sent to is faked, a display is needed nonetheless
+ * to create the Gtk::Window.
+ */
+
+#include "benchkeyclient.h"
+#include "benchutil.h"
+#include "fakebtgtkwindowdata.h"
+
+#include "btgtkbackend.h"
+#include "btgtkdevicemanager.h"
+
+#include <stmm-input-gtk/gtkaccessor.h>
+#include <stmm-input-ev/keyevent.h>
+#include <stmm-input/hardwarekey.h>
+
+#include <gtkmm.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+namespace stmi
+{
+
+namespace testing
+{
+
+////////////////////////////////////////////////////////////////////////////////
+/* Device manager with the real backend (sockets) and fake window data,
+ * so that the window can be activated without a window manager.
+ */
+class BenchBtGtkDeviceManager : public BtGtkDeviceManager
+{
+public:
+	static std::pair<shared_ptr<BenchBtGtkDeviceManager>, std::string> create(const Init& oInit) noexcept
+	{
+		shared_ptr<BenchBtGtkDeviceManager> refInstance(
+				new BenchBtGtkDeviceManager(oInit.m_bEnableEventClasses, oInit.m_aEnDisableEventClasses));
+		auto oPairBackend = Private::Bt::GtkBackend::create(refInstance.operator->(), oInit);
+		std::unique_ptr<Private::Bt::GtkBackend>& refBackend = oPairBackend.first;
+		std::string& sError = oPairBackend.second;
+		if (! sError.empty()) {
+			return std::make_pair(shared_ptr<BenchBtGtkDeviceManager>{}, std::move(sError)); //--------
+		}
+		auto refFactory = std::make_unique<Bt::FakeGtkWindowDataFactory>();
+		refInstance->m_p0Factory = refFactory.get();
+		std::unique_ptr<Private::Bt::GtkWindowDataFactory> refF(refFactory.release());
+		refInstance->init(refF, refBackend);
+		return std::make_pair(refInstance, std::move(sError));
+	}
+	void makeWindowActive(const shared_ptr<stmi::GtkAccessor>& refGtkAccessor) noexcept
+	{
+		auto& refWinData = m_p0Factory->getFakeWindowData(refGtkAccessor->getGtkmmWindow());
+		assert(refWinData);
+		refWinData->simulateWindowSetActive(true);
+	}
+protected:
+	BenchBtGtkDeviceManager(bool bEnableEventClasses, const std::vector<Event::Class>& aEnDisableEventClasses) noexcept
+	: BtGtkDeviceManager(bEnableEventClasses, aEnDisableEventClasses)
+	, m_p0Factory(nullptr)
+	{
+	}
+private:
+	Bt::FakeGtkWindowDataFactory* m_p0Factory;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+class LatencyBench
+{
+public:
+	enum PATTERN
+	{
+		PATTERN_TAP = 0
+		, PATTERN_CHORD = 1
+		, PATTERN_STREAM = 2
+	};
+	LatencyBench(const std::shared_ptr<BenchBtGtkDeviceManager>& refDM, BenchKeyClient& oClient) noexcept
+	: m_refDM(refDM)
+	, m_oClient(oClient)
+	, m_bMeasuring(false)
+	, m_nTotReceived(0)
+	, m_nLastReceivedUsec(0)
+	{
+		m_refListener = std::make_shared<EventListener>([&](const shared_ptr<Event>& refEvent)
+		{
+			onEvent(refEvent);
+		});
+		m_refDM->addEventListener(m_refListener, std::shared_ptr<CallIf>{});
+	}
+	// Connects the client and negotiates the protocol
+	bool warmUp(int32_t nProtocolVersion) noexcept
+	{
+		m_oClient.connect();
+		runUntil([&]() { return m_oClient.isConnected() || ! m_oClient.getError().empty(); }, s_nConnectTimeoutUsec);
+		if (! m_oClient.isConnected()) {
+			std::cerr << "Couldn't connect: " << m_oClient.getError() << '\n';
+			return false; //----------------------------------------------------
+		}
+		// the handshake answer is read as soon as it arrives
+		runUntil([&]() { return m_oClient.getProtocolVersion() >= nProtocolVersion; }, s_nConnectTimeoutUsec);
+		// the first keys pay for the allocations
+		for (int32_t nRound = 0; nRound < s_nWarmUpRounds; ++nRound) {
+			sendKey(KeyEvent::KEY_PRESS, s_aKeys[0]);
+			sendKey(KeyEvent::KEY_RELEASE, s_aKeys[0]);
+			runUntil([&]() { return getTotPending() == 0; }, s_nDrainTimeoutUsec);
+		}
+		m_oPending.clear();
+		return true;
+	}
+	void run(PATTERN ePattern, int32_t nCount, int32_t nRate) noexcept
+	{
+		assert(nRate >= 1);
+		m_oStats = LatencyStats(nCount);
+		m_nTotReceived = 0;
+		m_nLastReceivedUsec = 0;
+		m_bMeasuring = true;
+		const int32_t nEventsPerSend = ((ePattern == PATTERN_TAP) ? 2 : ((ePattern == PATTERN_CHORD) ? s_nChordKeys : 1));
+		const int32_t nTotSends = (nCount + nEventsPerSend - 1) / nEventsPerSend;
+		const int64_t nStartUsec = benchNowUsec();
+		int32_t nSent = 0;
+		runUntil([&]()
+		{
+			// send what's due since the last main loop iteration
+			const int64_t nDue = (benchNowUsec() - nStartUsec) * nRate / 1000000 + 1;
+			while ((nSent < nTotSends) && (nSent < nDue)) {
+				sendPattern(ePattern, nSent);
+				++nSent;
+			}
+			return (nSent == nTotSends) && (getTotPending() == 0);
+		}, static_cast<int64_t>(nTotSends) * 1000000 / nRate + s_nDrainTimeoutUsec);
+		m_bMeasuring = false;
+
+		const int32_t nLost = getTotPending();
+		m_oPending.clear();
+		const std::string sTitle = ((ePattern == PATTERN_TAP) ? "tap" : ((ePattern == PATTERN_CHORD) ? "chord" : "stream"));
+		m_oStats.print(std::cout, sTitle + " @" + std::to_string(nRate) + "/s");
+		const int64_t nElapsedUsec = m_nLastReceivedUsec - nStartUsec;
+		const int64_t nEventsPerSec = ((nElapsedUsec > 0) ? static_cast<int64_t>(m_nTotReceived) * 1000000 / nElapsedUsec : 0);
+		std::cout << "                         events/s=" << nEventsPerSec << "  lost=" << nLost << '\n';
+	}
+private:
+	template<class Cond>
+	void runUntil(Cond oCond, int64_t nTimeoutUsec) noexcept
+	{
+		auto refContext = Glib::MainContext::get_default();
+		const int64_t nDeadlineUsec = benchNowUsec() + nTimeoutUsec;
+		while ((! oCond()) && (benchNowUsec() < nDeadlineUsec)) {
+			if (! refContext->iteration(false)) {
+				// nothing to do: don't spin at full speed
+				::usleep(50);
+			}
+		}
+	}
+	void sendPattern(PATTERN ePattern, int32_t nSendIdx) noexcept
+	{
+		if (ePattern == PATTERN_TAP) {
+			const HARDWARE_KEY eKey = s_aKeys[nSendIdx % s_nChordKeys];
+			sendKey(KeyEvent::KEY_PRESS, eKey);
+			sendKey(KeyEvent::KEY_RELEASE, eKey);
+		} else if (ePattern == PATTERN_CHORD) {
+			const KeyEvent::KEY_INPUT_TYPE eType = (((nSendIdx % 2) == 0) ? KeyEvent::KEY_PRESS : KeyEvent::KEY_RELEASE);
+			std::vector< std::pair<int32_t, int32_t> > aKeys;
+			const int64_t nNowUsec = benchNowUsec();
+			for (const HARDWARE_KEY eKey : s_aKeys) {
+				aKeys.emplace_back(static_cast<int32_t>(eType), static_cast<int32_t>(eKey));
+				m_oPending[std::make_pair(eType, eKey)].push_back(nNowUsec);
+			}
+			m_oClient.sendKeys(aKeys);
+		} else {
+			const KeyEvent::KEY_INPUT_TYPE eType = (((nSendIdx % 2) == 0) ? KeyEvent::KEY_PRESS : KeyEvent::KEY_RELEASE);
+			sendKey(eType, s_aKeys[(nSendIdx / 2) % s_nChordKeys]);
+		}
+	}
+	void sendKey(KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eKey) noexcept
+	{
+		m_oPending[std::make_pair(eType, eKey)].push_back(benchNowUsec());
+		m_oClient.sendKey(static_cast<int32_t>(eType), static_cast<int32_t>(eKey));
+	}
+	void onEvent(const shared_ptr<Event>& refEvent) noexcept
+	{
+		const int64_t nNowUsec = benchNowUsec();
+		if (refEvent->getEventClass() != typeid(KeyEvent)) {
+			return; //----------------------------------------------------------
+		}
+		auto p0KeyEvent = static_cast<KeyEvent*>(refEvent.get());
+		auto itFind = m_oPending.find(std::make_pair(p0KeyEvent->getType(), p0KeyEvent->getKey()));
+		if ((itFind == m_oPending.end()) || itFind->second.empty()) {
+			// example: a cancel
+			return; //----------------------------------------------------------
+		}
+		const int64_t nSentUsec = itFind->second.front();
+		itFind->second.pop_front();
+		if (m_bMeasuring) {
+			m_oStats.add(nNowUsec - nSentUsec);
+			++m_nTotReceived;
+			m_nLastReceivedUsec = nNowUsec;
+		}
+	}
+	int32_t getTotPending() const noexcept
+	{
+		int32_t nTot = 0;
+		for (const auto& oPair : m_oPending) {
+			nTot += static_cast<int32_t>(oPair.second.size());
+		}
+		return nTot;
+	}
+private:
+	static constexpr int32_t s_nChordKeys = 10;
+	static const std::array<HARDWARE_KEY, s_nChordKeys> s_aKeys;
+	static constexpr int64_t s_nConnectTimeoutUsec = 5 * 1000000;
+	static constexpr int64_t s_nDrainTimeoutUsec = 2 * 1000000;
+	static constexpr int32_t s_nWarmUpRounds = 10;
+
+	shared_ptr<BenchBtGtkDeviceManager> m_refDM;
+	BenchKeyClient& m_oClient;
+	shared_ptr<EventListener> m_refListener;
+	// Key: (type, key), Value: the send times of the not yet received events
+	std::map< std::pair<KeyEvent::KEY_INPUT_TYPE, HARDWARE_KEY>, std::deque<int64_t> > m_oPending;
+	bool m_bMeasuring;
+	LatencyStats m_oStats;
+	int32_t m_nTotReceived;
+	int64_t m_nLastReceivedUsec;
+};
+const std::array<HARDWARE_KEY, LatencyBench::s_nChordKeys> LatencyBench::s_aKeys{{
+		HK_Q, HK_W, HK_E, HK_R, HK_T, HK_Y, HK_U, HK_I, HK_O, HK_P
+		}};
+constexpr int32_t LatencyBench::s_nChordKeys;
+
+int benchLatencyMain(int nArgC, char** aArgV) noexcept
+{
+	const BenchArgs oArgs(nArgC, aArgV);
+	const std::string sPattern = oArgs.getString("--pattern", "all");
+	const int32_t nCount = std::max(1, oArgs.getInt("--count", 2000));
+	// 0: the default of each pattern
+	const int32_t nRate = oArgs.getInt("--rate", 0);
+	if (oArgs.has("--rate") && (nRate < 1)) {
+		std::cerr << "--rate must be at least 1" << '\n';
+		return EXIT_FAILURE; //-------------------------------------------------
+	}
+	const std::string sEngine = oArgs.getString("--engine", "sources");
+	const int32_t nProtocol = std::min(std::max(oArgs.getInt("--protocol", 2), 1), 3);
+	const int32_t nCoalesceUsec = oArgs.getInt("--coalesce", 0);
+	if (nCoalesceUsec < 0) {
+		std::cerr << "--coalesce must not be negative" << '\n';
+		return EXIT_FAILURE; //-------------------------------------------------
+	}
+	const bool bSenderThread = oArgs.has("--sender-thread");
+	const std::string sSocket = oArgs.getString("--socket", "@stmm-input-bt-bench-" + std::to_string(::getpid()));
+
+	auto refApp = Gtk::Application::create("net.testlibsnirvana.stmi.bench");
+
+	BtGtkDeviceManager::Init oInit;
+	oInit.m_sLocalSocketPath = sSocket;
+	if (sEngine == "epoll") {
+		oInit.m_eReceiveEngine = BtGtkDeviceManager::RECEIVE_ENGINE_EPOLL;
+	} else if (sEngine == "thread") {
+		oInit.m_eReceiveEngine = BtGtkDeviceManager::RECEIVE_ENGINE_THREAD;
+	} else {
+		oInit.m_eReceiveEngine = BtGtkDeviceManager::RECEIVE_ENGINE_SOURCES;
+	}
+	auto oPairDM = BenchBtGtkDeviceManager::create(oInit);
+	if (! oPairDM.first) {
+		std::cerr << oPairDM.second << '\n';
+		return EXIT_FAILURE; //-------------------------------------------------
+	}
+	auto& refDM = oPairDM.first;
+	auto refWin = Glib::RefPtr<Gtk::Window>(new Gtk::Window());
+	auto refGtkAccessor = std::make_shared<stmi::GtkAccessor>(refWin);
+	refDM->addAccessor(refGtkAccessor);
+	refDM->makeWindowActive(refGtkAccessor);
+
+	BenchKeyClient oClient(sSocket, "BE:BE:00:00:00:01", nProtocol);
+	oClient.setCoalesceWindow(nCoalesceUsec);
+	if (bSenderThread) {
+		std::string sError;
+		if (! oClient.startSenderThread(sError)) {
+			std::cerr << sError << '\n';
+			return EXIT_FAILURE; //---------------------------------------------
+		}
+	}
+	LatencyBench oBench(refDM, oClient);
+	if (! oBench.warmUp(nProtocol)) {
+		return EXIT_FAILURE; //-------------------------------------------------
+	}
+	std::cout << "engine=" << sEngine << "  protocol=" << oClient.getProtocolVersion() << "  count=" << nCount
+			<< "  coalesce=" << nCoalesceUsec << "  sender-thread=" << (bSenderThread ? "yes" : "no") << '\n';
+	if ((sPattern == "all") || (sPattern == "tap")) {
+		oBench.run(LatencyBench::PATTERN_TAP, nCount, ((nRate > 0) ? nRate : 100));
+	}
+	if ((sPattern == "all") || (sPattern == "chord")) {
+		oBench.run(LatencyBench::PATTERN_CHORD, nCount, ((nRate > 0) ? nRate : 50));
+	}
+	if ((sPattern == "all") || (sPattern == "stream")) {
+		oBench.run(LatencyBench::PATTERN_STREAM, nCount, ((nRate > 0) ? nRate : 1000));
+	}
+	return EXIT_SUCCESS;
+}
+
+} // namespace testing
+
+} // namespace stmi
+
+int main(int nArgC, char** aArgV)
+{
+	return stmi::testing::benchLatencyMain(nArgC, aArgV);
+}
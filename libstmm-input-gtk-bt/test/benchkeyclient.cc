@@ -0,0 +1,92 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   benchkeyclient.cc
+ */
+
+#include "benchkeyclient.h"
+
+// from stmm-input-btkb
+#include "btclienttransport.h"
+#include "btkeyclient.h"
+#include "btkeyservers.h"
+
+namespace stmi
+{
+
+namespace testing
+{
+
+// Generous timeouts and no noops during a run
+static constexpr int32_t s_nBenchTimeoutConnect = 5 * 1000;
+static constexpr int32_t s_nBenchTimeoutSend = 5 * 1000;
+static constexpr int32_t s_nBenchNoopAfter = 60 * 1000;
+
+BenchKeyClient::BenchKeyClient(const std::string& sSocketPath, const std::string& sIdentity
+								, int32_t nMaxProtocolVersion) noexcept
+: m_sSocketPath(sSocketPath)
+, m_sIdentity(sIdentity)
+, m_refClient(std::make_unique<BtKeyClient>(s_nBenchTimeoutConnect, s_nBenchTimeoutSend, s_nBenchNoopAfter
+											, nMaxProtocolVersion))
+{
+}
+BenchKeyClient::~BenchKeyClient() noexcept
+{
+}
+void BenchKeyClient::setCoalesceWindow(int32_t nWindowUsec) noexcept
+{
+	m_refClient->setCoalesceWindow(nWindowUsec);
+}
+bool BenchKeyClient::startSenderThread(std::string& sError) noexcept
+{
+	return m_refClient->startSenderThread(sError);
+}
+void BenchKeyClient::connect() noexcept
+{
+	m_refClient->connectToServer(std::make_unique<UnixClientTransport>(m_sSocketPath
+																		, BtKeyServers::getAddrFromString(m_sIdentity)));
+}
+bool BenchKeyClient::isConnected() const noexcept
+{
+	const auto eState = m_refClient->getState();
+	return (eState == BtKeyClient::STATE_CONNECTED) || (eState == BtKeyClient::STATE_SENDING);
+}
+int32_t BenchKeyClient::getProtocolVersion() const noexcept
+{
+	return m_refClient->getProtocolVersion();
+}
+const std::string& BenchKeyClient::getError() const noexcept
+{
+	return m_refClient->getError();
+}
+void BenchKeyClient::sendKey(int32_t nType, int32_t nKey) noexcept
+{
+	m_refClient->sendKeyToServer(static_cast<hk::KEY_INPUT_TYPE>(nType), static_cast<hk::HARDWARE_KEY>(nKey));
+}
+void BenchKeyClient::sendKeys(const std::vector< std::pair<int32_t, int32_t> >& aKeys) noexcept
+{
+	std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> > aHkKeys;
+	aHkKeys.reserve(aKeys.size());
+	for (const auto& oPair : aKeys) {
+		aHkKeys.emplace_back(static_cast<hk::KEY_INPUT_TYPE>(oPair.first), static_cast<hk::HARDWARE_KEY>(oPair.second));
+	}
+	m_refClient->sendKeysToServer(aHkKeys);
+}
+
+} // namespace testing
+
+} // namespace stmi
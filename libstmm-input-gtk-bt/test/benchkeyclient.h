@@ -0,0 +1,83 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   benchkeyclient.h
+ */
+
+#ifndef STMI_TESTING_BENCH_KEY_CLIENT_H
+#define STMI_TESTING_BENCH_KEY_CLIENT_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace stmi { class BtKeyClient; }
+
+namespace stmi
+{
+
+namespace testing
+{
+
+/** Wraps stmm-input-btkb's BtKeyClient connecting to a local socket.
+ * The btkb headers can't be included together with the stmm-input ones
+ * (same include guards), therefore types and keys are passed as integers.
+ * Their values are those of KeyEvent::KEY_INPUT_TYPE and HARDWARE_KEY.
+ */
+class BenchKeyClient
+{
+public:
+	/** Constructor.
+	 * @param sSocketPath The local socket of the server.
+	 * @param sIdentity The address identifying the client. Example: "BE:BE:00:00:00:01".
+	 * @param nMaxProtocolVersion The maximum protocol version (1 to 3).
+	 */
+	BenchKeyClient(const std::string& sSocketPath, const std::string& sIdentity, int32_t nMaxProtocolVersion) noexcept;
+	~BenchKeyClient() noexcept;
+
+	/** Sets the coalescing window of the client.
+	 * Must be called before connecting.
+	 * @param nWindowUsec The window in microseconds. 0 means no coalescing.
+	 */
+	void setCoalesceWindow(int32_t nWindowUsec) noexcept;
+	/** Moves the connection to the client's sender thread.
+	 * Must be called before connecting and after setCoalesceWindow().
+	 * @param sError Set to the error if false is returned.
+	 * @return Whether the thread was started.
+	 */
+	bool startSenderThread(std::string& sError) noexcept;
+	void connect() noexcept;
+	bool isConnected() const noexcept;
+	int32_t getProtocolVersion() const noexcept;
+	const std::string& getError() const noexcept;
+
+	void sendKey(int32_t nType, int32_t nKey) noexcept;
+	void sendKeys(const std::vector< std::pair<int32_t, int32_t> >& aKeys) noexcept;
+private:
+	const std::string m_sSocketPath;
+	const std::string m_sIdentity;
+	std::unique_ptr<BtKeyClient> m_refClient;
+};
+
+} // namespace testing
+
+} // namespace stmi
+
+#endif /* STMI_TESTING_BENCH_KEY_CLIENT_H */
@@ -0,0 +1,141 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   benchutil.h
+ */
+
+#ifndef STMI_TESTING_BENCH_UTIL_H
+#define STMI_TESTING_BENCH_UTIL_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace stmi
+{
+
+namespace testing
+{
+
+/** Monotonic time in microseconds. */
+inline int64_t benchNowUsec() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+									std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/** Collects latency samples and computes percentiles.
+ */
+class LatencyStats
+{
+public:
+	explicit LatencyStats(int32_t nReserve = 0) noexcept
+	: m_bSorted(true)
+	{
+		m_aSamples.reserve(std::max<int32_t>(0, nReserve));
+	}
+	void add(int64_t nUsec) noexcept
+	{
+		m_aSamples.push_back(nUsec);
+		m_bSorted = false;
+	}
+	int32_t size() const noexcept
+	{
+		return static_cast<int32_t>(m_aSamples.size());
+	}
+	/** The sample at the given percentile (nearest rank).
+	 * @param fPercentile From 0 to 100.
+	 * @return The sample or 0 if no samples.
+	 */
+	int64_t getPercentile(double fPercentile) noexcept
+	{
+		if (m_aSamples.empty()) {
+			return 0; //--------------------------------------------------------
+		}
+		if (! m_bSorted) {
+			std::sort(m_aSamples.begin(), m_aSamples.end());
+			m_bSorted = true;
+		}
+		const double fRank = fPercentile / 100.0 * static_cast<double>(m_aSamples.size());
+		const int32_t nIdx = std::min(static_cast<int32_t>(m_aSamples.size()) - 1
+									, std::max<int32_t>(0, static_cast<int32_t>(fRank + 0.999999) - 1));
+		return m_aSamples[nIdx];
+	}
+	/** Prints count, p50, p99, p99.9 and max in microseconds on one line. */
+	void print(std::ostream& oOut, const std::string& sTitle) noexcept
+	{
+		oOut << std::left << std::setw(24) << sTitle << std::right
+				<< " n=" << std::setw(8) << size()
+				<< "  p50=" << std::setw(7) << getPercentile(50.0)
+				<< "  p99=" << std::setw(7) << getPercentile(99.0)
+				<< "  p999=" << std::setw(7) << getPercentile(99.9)
+				<< "  max=" << std::setw(7) << getPercentile(100.0) << " us" << '\n';
+	}
+private:
+	std::vector<int64_t> m_aSamples;
+	bool m_bSorted;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Minimal command line parsing: options of the form "--name value".
+ */
+class BenchArgs
+{
+public:
+	BenchArgs(int nArgC, char** aArgV) noexcept
+	{
+		for (int nIdx = 1; nIdx < nArgC; ++nIdx) {
+			m_aArgs.push_back(aArgV[nIdx]);
+		}
+	}
+	bool has(const std::string& sName) const noexcept
+	{
+		return (std::find(m_aArgs.begin(), m_aArgs.end(), sName) != m_aArgs.end());
+	}
+	std::string getString(const std::string& sName, const std::string& sDefault) const noexcept
+	{
+		auto itFind = std::find(m_aArgs.begin(), m_aArgs.end(), sName);
+		if ((itFind == m_aArgs.end()) || (std::next(itFind) == m_aArgs.end())) {
+			return sDefault; //-------------------------------------------------
+		}
+		return *std::next(itFind);
+	}
+	int32_t getInt(const std::string& sName, int32_t nDefault) const noexcept
+	{
+		const std::string sValue = getString(sName, "");
+		if (sValue.empty()) {
+			return nDefault; //-------------------------------------------------
+		}
+		return static_cast<int32_t>(std::strtol(sValue.c_str(), nullptr, 10));
+	}
+private:
+	std::vector<std::string> m_aArgs;
+};
+
+} // namespace testing
+
+} // namespace stmi
+
+#endif /* STMI_TESTING_BENCH_UTIL_H */
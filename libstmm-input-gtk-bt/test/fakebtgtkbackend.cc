@@ -32,7 +32,7 @@ namespace Bt
 {
 
 FakeGtkBackend::FakeGtkBackend(::stmi::BtGtkDeviceManager* p0Owner) noexcept
-: Private::Bt::GtkBackend(p0Owner, "")
+: Private::Bt::GtkBackend(p0Owner, ::stmi::BtGtkDeviceManager::Init{})
 {
 }
 
@@ -24,6 +24,7 @@
 #include "btgtkbackend.h"
 
 #include <stmm-input-ev/keyevent.h>
+#include <stmm-input/devicemanager.h>
 #include <stmm-input/hardwarekey.h>
 
 #include <bluetooth/bluetooth.h>
@@ -75,7 +76,16 @@ public:
 	// returns bContinue
 	bool simulateKeyEvent(int32_t nBackendId, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK) noexcept
 	{
-		return onBlueKey(nBackendId, eType, eHK);
+		return onBlueKey(nBackendId, eType, eHK, DeviceManager::getNowTimeMicroseconds());
+	}
+	// Replays a capture file through the real receivers and dispatch.
+	// The devices of the capture are added with the ids of the real backend,
+	// which would clash with those of simulateNewDevice(): don't mix them.
+	// returns the number of datagrams replayed or -1 and sets sError
+	int64_t simulateReplay(const std::string& sPath, bool bOriginalPacing, std::string& sError) noexcept
+	{
+		assert(m_aDeviceAddrs.empty());
+		return replayCapture(sPath, bOriginalPacing, sError);
 	}
 
 	static bdaddr_t getBdAddrFromString(const std::string& sBtAddr) noexcept;
@@ -56,6 +56,33 @@ TEST_CASE_METHOD(STFX<BtDMFixture>, "AddAccessor")
 	REQUIRE_FALSE(m_refAllEvDM->hasAccessor(refAccessor));
 }
 
+TEST_CASE_METHOD(STFX<BtDMFixture>, "AddRemoveManyAccessors")
+{
+	std::vector< Glib::RefPtr<Gtk::Window> > aWins;
+	std::vector< shared_ptr<stmi::GtkAccessor> > aAccessors;
+	for (int32_t nIdx = 0; nIdx < 8; ++nIdx) {
+		aWins.push_back(Glib::RefPtr<Gtk::Window>(new Gtk::Window()));
+		aAccessors.push_back(std::make_shared<stmi::GtkAccessor>(aWins.back()));
+		REQUIRE(m_refAllEvDM->addAccessor(aAccessors.back()));
+	}
+	REQUIRE_FALSE(m_refAllEvDM->addAccessor(aAccessors[3]));
+	// Remove the first, a middle and the last
+	REQUIRE(m_refAllEvDM->removeAccessor(aAccessors[0]));
+	REQUIRE(m_refAllEvDM->removeAccessor(aAccessors[4]));
+	REQUIRE(m_refAllEvDM->removeAccessor(aAccessors[7]));
+	REQUIRE_FALSE(m_refAllEvDM->removeAccessor(aAccessors[4]));
+	for (int32_t nIdx = 0; nIdx < 8; ++nIdx) {
+		const bool bRemoved = (nIdx == 0) || (nIdx == 4) || (nIdx == 7);
+		REQUIRE(m_refAllEvDM->hasAccessor(aAccessors[nIdx]) == !bRemoved);
+	}
+	REQUIRE(m_refAllEvDM->addAccessor(aAccessors[4]));
+	REQUIRE(m_refAllEvDM->hasAccessor(aAccessors[4]));
+	for (auto& refAccessor : aAccessors) {
+		m_refAllEvDM->removeAccessor(refAccessor);
+		REQUIRE_FALSE(m_refAllEvDM->hasAccessor(refAccessor));
+	}
+}
+
 TEST_CASE_METHOD(STFX<BtDMFixture>, "AddListener")
 {
 	auto refListener = std::make_shared<stmi::EventListener>(
@@ -164,6 +191,35 @@ TEST_CASE_METHOD(STFX<BtDMOneWinOneAccOneDevOneListenerFixture>, "SingleKeyPress
 	REQUIRE(p0KeyEvent->getType() == stmi::KeyEvent::KEY_PRESS);
 }
 
+TEST_CASE_METHOD(STFX<BtDMOneWinOneAccOneDevOneListenerFixture>, "DeviceStatsKeyCounters")
+{
+	m_refAllEvDM->makeWindowActive(m_refGtkAccessor1);
+
+	m_p0FakeBackend->simulateKeyEvent(m_nBtDeviceId, KeyEvent::KEY_PRESS, stmi::HK_F1);
+	m_p0FakeBackend->simulateKeyEvent(m_nBtDeviceId, KeyEvent::KEY_PRESS, stmi::HK_F1); // repeat
+	m_p0FakeBackend->simulateKeyEvent(m_nBtDeviceId, KeyEvent::KEY_RELEASE, stmi::HK_F2); // orphan
+	m_p0FakeBackend->simulateKeyEvent(m_nBtDeviceId, KeyEvent::KEY_RELEASE, stmi::HK_F1);
+
+	REQUIRE(m_aReceivedEvents1.size() == 2);
+	const int32_t nDeviceId = m_aReceivedEvents1[0]->getCapability()->getDevice()->getId();
+
+	BtGtkDeviceManager::DeviceStats oStats;
+	REQUIRE(m_refAllEvDM->getDeviceStats(nDeviceId, oStats));
+	REQUIRE(oStats.m_nKeyEvents == 2);
+	REQUIRE(oStats.m_nSuppressedRepeats == 1);
+	REQUIRE(oStats.m_nOrphanReleases == 1);
+	int64_t nTotDispatched = 0;
+	for (const auto nCount : oStats.m_aDispatchHistogram) {
+		nTotDispatched += nCount;
+	}
+	REQUIRE(nTotDispatched == 2);
+	// the fake backend doesn't receive datagrams
+	REQUIRE(oStats.m_nDatagrams == 0);
+
+	REQUIRE_FALSE(m_refAllEvDM->getDeviceStats(nDeviceId + 1000, oStats));
+	REQUIRE(oStats.m_nKeyEvents == 2);
+}
+
 TEST_CASE_METHOD(STFX<BtDMOneWinOneAccOneDevOneListenerFixture>, "TwoAccessorKeyCancel")
 {
 	auto refWin2 = Glib::RefPtr<Gtk::Window>(new Gtk::Window());
@@ -0,0 +1,277 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   testClientReceiver.cxx
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "bluetoothsources.h"
+#include "btstats.h"
+#include "keypacket.h"
+
+#include <stmm-input-ev/keyevent.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+
+namespace stmi
+{
+
+namespace testing
+{
+
+using namespace Private::Bt;
+
+namespace
+{
+// A receiver reading from one end of a local socket pair, the test writes to the other
+class ReceiverPair
+{
+public:
+	ReceiverPair()
+	: ReceiverPair(getOptions())
+	{
+	}
+	explicit ReceiverPair(const BlueReceiveOptions& oOptions)
+	: m_refCounters(std::make_shared<BlueReceiveCounters>())
+	{
+		int aFDs[2];
+		const int nRet = ::socketpair(AF_UNIX, SOCK_SEQPACKET, 0, aFDs);
+		REQUIRE(nRet == 0);
+		m_nPeerFD = aFDs[1];
+		m_refReceiver = std::make_unique<BlueClientReceiver>(0, aFDs[0], oOptions, m_refCounters);
+	}
+	~ReceiverPair()
+	{
+		m_refReceiver.reset();
+		::close(m_nPeerFD);
+	}
+	static BlueReceiveOptions getOptions()
+	{
+		BlueReceiveOptions oOptions;
+		oOptions.m_bKernelTimestamps = false;
+		return oOptions;
+	}
+	void send(const std::vector<uint8_t>& aDatagram)
+	{
+		const auto nRet = ::send(m_nPeerFD, aDatagram.data(), aDatagram.size(), 0);
+		REQUIRE(nRet == static_cast<ssize_t>(aDatagram.size()));
+	}
+	void sendHello(int32_t nVersion)
+	{
+		KeyPacket oPacket;
+		oPacket.m_nMagic1 = '7';
+		oPacket.m_nMagic2 = 'A';
+		oPacket.m_nCmd = PACKET_CMD_NOOP;
+		oPacket.m_nKeyType = PACKET_HELLO_KEY_TYPE;
+		oPacket.m_nHardwareKey = htobl(nVersion);
+		const uint8_t* p0Bytes = reinterpret_cast<const uint8_t*>(&oPacket);
+		send(std::vector<uint8_t>(p0Bytes, p0Bytes + sizeof(oPacket)));
+	}
+	// Returns the number of bytes read from the peer end, 0 if none
+	int32_t readBack(void* p0Buf, int32_t nBufSize)
+	{
+		const auto nRet = ::recv(m_nPeerFD, p0Buf, nBufSize, MSG_DONTWAIT);
+		return ((nRet < 0) ? 0 : static_cast<int32_t>(nRet));
+	}
+	BlueClientReceiver::RECEIVE_RESULT receive()
+	{
+		std::string sError;
+		return m_refReceiver->receive([&](int32_t /*nBackendId*/, bool /*bRemove*/, const KeyPacket& oPacket, int64_t /*nTimeUsec*/)
+		{
+			m_aReceivedKeys.push_back(oPacket.m_nHardwareKey);
+			return true;
+		}, sError);
+	}
+	BtGtkDeviceManager::DeviceStats getStats() const
+	{
+		BtGtkDeviceManager::DeviceStats oStats;
+		m_refCounters->addTo(oStats);
+		return oStats;
+	}
+
+	std::shared_ptr<BlueReceiveCounters> m_refCounters;
+	std::unique_ptr<BlueClientReceiver> m_refReceiver;
+	int32_t m_nPeerFD = -1;
+	std::vector<int32_t> m_aReceivedKeys;
+};
+
+// A v2 datagram with one key press record per key, all captured at nCaptureUsec
+std::vector<uint8_t> makeV2Datagram(uint32_t nSequence, uint32_t nCaptureUsec, const std::vector<int32_t>& aKeys, uint8_t nFlags = 0)
+{
+	KeyPacketV2Header oHeader;
+	oHeader.m_nMagic1 = '7';
+	oHeader.m_nMagic2 = 'B';
+	oHeader.m_nCount = static_cast<uint8_t>(aKeys.size());
+	oHeader.m_nFlags = nFlags;
+	oHeader.m_nSequence = htobl(nSequence);
+	oHeader.m_nBaseTimeUsec = htobl(nCaptureUsec);
+	const uint8_t* p0Header = reinterpret_cast<const uint8_t*>(&oHeader);
+	std::vector<uint8_t> aDatagram(p0Header, p0Header + sizeof(oHeader));
+	for (const int32_t nKey : aKeys) {
+		uint8_t aRecord[PACKET_V2_MAX_RECORD_SIZE];
+		int32_t nSize = 0;
+		aRecord[nSize++] = static_cast<uint8_t>((PACKET_CMD_KEY << 4) | 1); // KEY_PRESS
+		nSize += packetWriteVarint(aRecord + nSize, static_cast<uint32_t>(nKey));
+		nSize += packetWriteVarint(aRecord + nSize, 0);
+		aDatagram.insert(aDatagram.end(), aRecord, aRecord + nSize);
+	}
+	return aDatagram;
+}
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ClientReceiverV2Stats")
+{
+	ReceiverPair oPair;
+	// The capture clock goes back by 5 milliseconds: the second datagram
+	// took that much longer than the first to arrive
+	oPair.send(makeV2Datagram(10, 100000, {30}));
+	oPair.send(makeV2Datagram(11, 95000, {31}));
+	// 12 and 13 are lost
+	oPair.send(makeV2Datagram(14, 95000, {32}));
+	// late
+	oPair.send(makeV2Datagram(12, 95000, {33}));
+	REQUIRE(oPair.receive() == BlueClientReceiver::RECEIVE_RESULT_OK);
+	REQUIRE(oPair.m_aReceivedKeys == std::vector<int32_t>{30, 31, 32, 33});
+
+	const auto oStats = oPair.getStats();
+	REQUIRE(oStats.m_nDatagrams == 4);
+	REQUIRE(oStats.m_nProtocolVersion == PACKET_PROTOCOL_VERSION_2);
+	REQUIRE(oStats.m_nV2Datagrams == 4);
+	REQUIRE(oStats.m_nLostDatagrams == 2);
+	REQUIRE(oStats.m_nOutOfOrderDatagrams == 1);
+	REQUIRE(oStats.m_nAcks == 0);
+	int64_t nTotDelays = 0;
+	for (const int64_t nCount : oStats.m_aDelayHistogram) {
+		nTotDelays += nCount;
+	}
+	REQUIRE(nTotDelays == 4);
+	// the first datagram is the reference, the others are at least 5 milliseconds late
+	REQUIRE(oStats.m_aDelayHistogram[0] == 1);
+	int64_t nTotLate = 0;
+	for (int32_t nIdx = getStatsBucket(5000); nIdx < BtGtkDeviceManager::DeviceStats::s_nTotHistogramBuckets; ++nIdx) {
+		nTotLate += oStats.m_aDelayHistogram[nIdx];
+	}
+	REQUIRE(nTotLate == 3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ClientReceiverV2UnknownFlags")
+{
+	ReceiverPair oPair;
+	oPair.send(makeV2Datagram(0, 1000, {30}, 0x01));
+	REQUIRE(oPair.receive() == BlueClientReceiver::RECEIVE_RESULT_CLOSE);
+	REQUIRE(oPair.m_aReceivedKeys.empty());
+	REQUIRE(oPair.getStats().m_nCmdErrors == 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ClientReceiverTruncated")
+{
+	// both with recvmsg and recvmmsg
+	for (const int32_t nBatchSize : {1, 16}) {
+		auto oOptions = ReceiverPair::getOptions();
+		oOptions.m_nBatchSize = nBatchSize;
+		oOptions.m_nMaxDatagramSize = 2 * sizeof(KeyPacket);
+		ReceiverPair oPair(oOptions);
+		// three v1 packets, the last (the release) doesn't fit
+		std::vector<uint8_t> aDatagram;
+		for (const auto eType : {KeyEvent::KEY_PRESS, KeyEvent::KEY_PRESS, KeyEvent::KEY_RELEASE}) {
+			KeyPacket oPacket;
+			oPacket.m_nMagic1 = '7';
+			oPacket.m_nMagic2 = 'A';
+			oPacket.m_nCmd = PACKET_CMD_KEY;
+			oPacket.m_nKeyType = static_cast<char>(eType);
+			oPacket.m_nHardwareKey = htobl(30);
+			const uint8_t* p0Bytes = reinterpret_cast<const uint8_t*>(&oPacket);
+			aDatagram.insert(aDatagram.end(), p0Bytes, p0Bytes + sizeof(oPacket));
+		}
+		oPair.send(aDatagram);
+		REQUIRE(oPair.receive() == BlueClientReceiver::RECEIVE_RESULT_CLOSE);
+		REQUIRE(oPair.m_aReceivedKeys.empty());
+		REQUIRE(oPair.getStats().m_nSizeErrors == 1);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ClientReceiverV3Ack")
+{
+	auto oOptions = ReceiverPair::getOptions();
+	oOptions.m_nFlowCredit = 5;
+	ReceiverPair oPair(oOptions);
+	oPair.sendHello(PACKET_PROTOCOL_VERSION_3);
+	REQUIRE(oPair.receive() == BlueClientReceiver::RECEIVE_RESULT_OK);
+	KeyPacket oReply;
+	REQUIRE(oPair.readBack(&oReply, sizeof(oReply)) == static_cast<int32_t>(sizeof(oReply)));
+	REQUIRE(oReply.m_nKeyType == PACKET_HELLO_KEY_TYPE);
+	REQUIRE(static_cast<int32_t>(btohl(oReply.m_nHardwareKey)) == PACKET_PROTOCOL_VERSION_3);
+	// no datagrams yet: nothing to acknowledge
+	uint8_t aBuf[64];
+	REQUIRE(oPair.readBack(aBuf, sizeof(aBuf)) == 0);
+
+	// the datagrams handled by a receive() call are acknowledged once
+	oPair.send(makeV2Datagram(0, 1000, {30}));
+	oPair.send(makeV2Datagram(1, 2000, {31}));
+	oPair.send(makeV2Datagram(2, 3000, {32, 33}));
+	REQUIRE(oPair.receive() == BlueClientReceiver::RECEIVE_RESULT_OK);
+	KeyPacketAck oAck;
+	REQUIRE(oPair.readBack(&oAck, sizeof(oAck)) == static_cast<int32_t>(sizeof(oAck)));
+	REQUIRE(oAck.m_nMagic1 == '7');
+	REQUIRE(oAck.m_nMagic2 == 'C');
+	REQUIRE(btohs(oAck.m_nCredit) == 5);
+	REQUIRE(btohl(oAck.m_nNextSequence) == 3);
+	REQUIRE(oPair.readBack(aBuf, sizeof(aBuf)) == 0);
+
+	oPair.send(makeV2Datagram(3, 4000, {34}));
+	REQUIRE(oPair.receive() == BlueClientReceiver::RECEIVE_RESULT_OK);
+	REQUIRE(oPair.readBack(&oAck, sizeof(oAck)) == static_cast<int32_t>(sizeof(oAck)));
+	REQUIRE(btohl(oAck.m_nNextSequence) == 4);
+
+	const auto oStats = oPair.getStats();
+	REQUIRE(oStats.m_nProtocolVersion == PACKET_PROTOCOL_VERSION_3);
+	REQUIRE(oStats.m_nAcks == 2);
+	REQUIRE(oPair.m_aReceivedKeys.size() == 5);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ClientReceiverV2NoAck")
+{
+	ReceiverPair oPair;
+	oPair.sendHello(PACKET_PROTOCOL_VERSION_2);
+	REQUIRE(oPair.receive() == BlueClientReceiver::RECEIVE_RESULT_OK);
+	KeyPacket oReply;
+	REQUIRE(oPair.readBack(&oReply, sizeof(oReply)) == static_cast<int32_t>(sizeof(oReply)));
+	REQUIRE(static_cast<int32_t>(btohl(oReply.m_nHardwareKey)) == PACKET_PROTOCOL_VERSION_2);
+	oPair.send(makeV2Datagram(0, 1000, {30}));
+	REQUIRE(oPair.receive() == BlueClientReceiver::RECEIVE_RESULT_OK);
+	uint8_t aBuf[64];
+	REQUIRE(oPair.readBack(aBuf, sizeof(aBuf)) == 0);
+	REQUIRE(oPair.getStats().m_nAcks == 0);
+}
+
+} // namespace testing
+
+} // namespace stmi
@@ -0,0 +1,99 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   testHardwareKeySet.cxx
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "hardwarekeyset.h"
+
+#include <vector>
+
+namespace stmi
+{
+
+namespace testing
+{
+
+using Private::HardwareKeySet;
+
+static std::vector<int32_t> getKeys(const HardwareKeySet& oSet)
+{
+	std::vector<int32_t> aKeys;
+	for (int32_t nKey = oSet.findNext(-1); nKey >= 0; nKey = oSet.findNext(nKey)) {
+		aKeys.push_back(nKey);
+	}
+	return aKeys;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("HardwareKeySetInsertErase")
+{
+	HardwareKeySet oSet;
+	REQUIRE(oSet.empty());
+	REQUIRE(getKeys(oSet).empty());
+
+	oSet.insert(0x301, 7);
+	oSet.insert(1, 5);
+	oSet.insert(63, 6);
+	oSet.insert(64, 8);
+	REQUIRE(oSet.size() == 4);
+	REQUIRE(oSet.contains(63));
+	REQUIRE_FALSE(oSet.contains(62));
+	REQUIRE(getKeys(oSet) == std::vector<int32_t>{1, 63, 64, 0x301});
+
+	REQUIRE(oSet.erase(1));
+	REQUIRE_FALSE(oSet.erase(1));
+	// the time stamps follow the moved entries
+	REQUIRE(oSet.getTimeStamp(63) == 6);
+	REQUIRE(oSet.getTimeStamp(64) == 8);
+	REQUIRE(oSet.getTimeStamp(0x301) == 7);
+	REQUIRE(getKeys(oSet) == std::vector<int32_t>{63, 64, 0x301});
+
+	REQUIRE_FALSE(HardwareKeySet::isValidKey(-1));
+	REQUIRE_FALSE(HardwareKeySet::isValidKey(HardwareKeySet::s_nTotKeys));
+
+	oSet.clear();
+	REQUIRE(oSet.empty());
+	REQUIRE_FALSE(oSet.contains(64));
+	REQUIRE(getKeys(oSet).empty());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("HardwareKeySetEraseWhileIterating")
+{
+	HardwareKeySet oSet;
+	for (int32_t nKey = 10; nKey < 200; nKey += 10) {
+		oSet.insert(nKey, static_cast<uint64_t>(nKey));
+	}
+	std::vector<int32_t> aVisited;
+	for (int32_t nKey = oSet.findNext(-1); nKey >= 0; nKey = oSet.findNext(nKey)) {
+		aVisited.push_back(nKey);
+		REQUIRE(oSet.getTimeStamp(nKey) == static_cast<uint64_t>(nKey));
+		// erase the current and the following key
+		oSet.erase(nKey);
+		oSet.erase(nKey + 10);
+	}
+	REQUIRE(aVisited == std::vector<int32_t>{10, 30, 50, 70, 90, 110, 130, 150, 170, 190});
+	REQUIRE(oSet.empty());
+}
+
+} // namespace testing
+
+} // namespace stmi
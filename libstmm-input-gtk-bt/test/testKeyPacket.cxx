@@ -0,0 +1,78 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   testKeyPacket.cxx
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "keypacket.h"
+
+namespace stmi
+{
+
+namespace testing
+{
+
+using namespace Private::Bt;
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("KeyPacketV2HeaderSize")
+{
+	REQUIRE(sizeof(KeyPacket) == 8);
+	REQUIRE(sizeof(KeyPacketV2Header) == 12);
+	REQUIRE(sizeof(KeyPacketAck) == 8);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("KeyPacketVarintRoundTrip")
+{
+	const uint32_t aValues[] = {0, 1, 0x7F, 0x80, 0x301, 0x3FFF, 0x4000, 1000000, 0xFFFFFFFF};
+	for (const uint32_t nValue : aValues) {
+		uint8_t aBuf[PACKET_V2_MAX_VARINT_SIZE];
+		const int32_t nWritten = packetWriteVarint(aBuf, nValue);
+		REQUIRE(nWritten >= 1);
+		REQUIRE(nWritten <= PACKET_V2_MAX_VARINT_SIZE);
+		uint32_t nRead;
+		const int32_t nReadSize = packetReadVarint(aBuf, nWritten, nRead);
+		REQUIRE(nReadSize == nWritten);
+		REQUIRE(nRead == nValue);
+	}
+	uint8_t aBuf[PACKET_V2_MAX_VARINT_SIZE];
+	// A key code fits in two bytes
+	REQUIRE(packetWriteVarint(aBuf, 0x301) == 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("KeyPacketVarintTruncated")
+{
+	uint8_t aBuf[PACKET_V2_MAX_VARINT_SIZE + 1];
+	const int32_t nWritten = packetWriteVarint(aBuf, 1000000);
+	REQUIRE(nWritten == 3);
+	uint32_t nRead;
+	REQUIRE(packetReadVarint(aBuf, nWritten - 1, nRead) == 0);
+	// Too long
+	for (int32_t nIdx = 0; nIdx < PACKET_V2_MAX_VARINT_SIZE + 1; ++nIdx) {
+		aBuf[nIdx] = 0x80;
+	}
+	REQUIRE(packetReadVarint(aBuf, PACKET_V2_MAX_VARINT_SIZE + 1, nRead) == 0);
+}
+
+} // namespace testing
+
+} // namespace stmi
@@ -0,0 +1,272 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   testPacketCapture.cxx
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "fixtureBtDM.h"
+
+#include "keypacket.h"
+#include "packetcapture.h"
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+
+namespace stmi
+{
+
+using std::shared_ptr;
+
+namespace testing
+{
+
+using Private::Bt::CapturedDatagram;
+using Private::Bt::KeyPacket;
+using Private::Bt::PacketCaptureReader;
+using Private::Bt::PacketCaptureWriter;
+
+namespace
+{
+std::string getCapturePath(const std::string& sName)
+{
+	return "/tmp/stmi-test-" + sName + "-" + std::to_string(::getpid()) + ".btsnoop";
+}
+KeyPacket makeKeyPacket(Private::Bt::PACKET_CMD eCmd, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK)
+{
+	KeyPacket oPacket;
+	oPacket.m_nMagic1 = '7';
+	oPacket.m_nMagic2 = 'A';
+	oPacket.m_nCmd = static_cast<char>(eCmd);
+	oPacket.m_nKeyType = static_cast<char>(eType);
+	oPacket.m_nHardwareKey = static_cast<int32_t>(htobl(static_cast<uint32_t>(eHK)));
+	return oPacket;
+}
+void writePacket(PacketCaptureWriter& oWriter, int32_t nBackendId, int64_t nTimeUsec, const KeyPacket& oPacket)
+{
+	oWriter.write(nBackendId, nTimeUsec, reinterpret_cast<const uint8_t*>(&oPacket), sizeof(KeyPacket));
+}
+// Writes a v2 datagram with a single key record
+void writeV2Key(PacketCaptureWriter& oWriter, int32_t nBackendId, int64_t nTimeUsec, uint32_t nSequence
+				, KeyEvent::KEY_INPUT_TYPE eType, HARDWARE_KEY eHK, uint8_t nFlags = 0)
+{
+	Private::Bt::KeyPacketV2Header oHeader;
+	oHeader.m_nMagic1 = '7';
+	oHeader.m_nMagic2 = 'B';
+	oHeader.m_nCount = 1;
+	oHeader.m_nFlags = nFlags;
+	oHeader.m_nSequence = htobl(nSequence);
+	oHeader.m_nBaseTimeUsec = htobl(static_cast<uint32_t>(nTimeUsec));
+	const uint8_t* p0Header = reinterpret_cast<const uint8_t*>(&oHeader);
+	std::vector<uint8_t> aDatagram(p0Header, p0Header + sizeof(oHeader));
+	uint8_t aRecord[Private::Bt::PACKET_V2_MAX_RECORD_SIZE];
+	int32_t nSize = 0;
+	aRecord[nSize++] = static_cast<uint8_t>((Private::Bt::PACKET_CMD_KEY << 4) | static_cast<int32_t>(eType));
+	nSize += Private::Bt::packetWriteVarint(aRecord + nSize, static_cast<uint32_t>(eHK));
+	nSize += Private::Bt::packetWriteVarint(aRecord + nSize, 0);
+	aDatagram.insert(aDatagram.end(), aRecord, aRecord + nSize);
+	oWriter.write(nBackendId, nTimeUsec, aDatagram.data(), static_cast<int32_t>(aDatagram.size()));
+}
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("PacketCaptureWriteRead")
+{
+	const std::string sPath = getCapturePath("capture");
+	std::string sError;
+	{
+		PacketCaptureWriter oWriter;
+		REQUIRE(oWriter.open(sPath, sError));
+		const std::vector<uint8_t> aData{1, 2, 3, 4, 5, 6, 7, 8, 9};
+		oWriter.write(3, 1000, aData.data(), static_cast<int32_t>(aData.size()));
+		// generation 1 of slot 0
+		oWriter.write(65536, 1500, aData.data(), 1);
+		REQUIRE(oWriter.getTotWritten() == 2);
+	}
+	PacketCaptureReader oReader;
+	REQUIRE(oReader.open(sPath, sError));
+	CapturedDatagram oDatagram;
+	REQUIRE(oReader.read(oDatagram, sError));
+	REQUIRE(oDatagram.m_nBackendId == 3);
+	REQUIRE(oDatagram.m_nTimeUsec == 1000);
+	REQUIRE(oDatagram.m_aData.size() == 9);
+	REQUIRE(oDatagram.m_aData[8] == 9);
+	REQUIRE(oReader.read(oDatagram, sError));
+	REQUIRE(oDatagram.m_nBackendId == 65536);
+	REQUIRE(oDatagram.m_nTimeUsec == 1500);
+	REQUIRE(oDatagram.m_aData.size() == 1);
+	REQUIRE_FALSE(oReader.read(oDatagram, sError));
+	REQUIRE(sError.empty());
+	oReader.close();
+	::unlink(sPath.c_str());
+
+	REQUIRE_FALSE(oReader.open(sPath, sError));
+	REQUIRE_FALSE(sError.empty());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE_METHOD(STFX<BtDMOneWinOneAccFixture>, "ReplayCapture")
+{
+	const std::string sPath = getCapturePath("replay");
+	std::string sError;
+	{
+		PacketCaptureWriter oWriter;
+		REQUIRE(oWriter.open(sPath, sError));
+		writePacket(oWriter, 5, 1000, makeKeyPacket(Private::Bt::PACKET_CMD_KEY, KeyEvent::KEY_PRESS, stmi::HK_F1));
+		writePacket(oWriter, 5, 2000, makeKeyPacket(Private::Bt::PACKET_CMD_KEY, KeyEvent::KEY_RELEASE, stmi::HK_F1));
+		writePacket(oWriter, 5, 3000, makeKeyPacket(Private::Bt::PACKET_CMD_REMOVE_DEVICE, KeyEvent::KEY_PRESS, stmi::HK_NULL));
+	}
+	std::vector< shared_ptr<stmi::Event> > aReceivedEvents;
+	auto refListener = std::make_shared<stmi::EventListener>(
+			[&](const shared_ptr<stmi::Event>& refEvent)
+			{
+				aReceivedEvents.emplace_back(refEvent);
+			});
+	REQUIRE(m_refAllEvDM->addEventListener(refListener, std::shared_ptr<stmi::CallIf>{}));
+	m_refAllEvDM->makeWindowActive(m_refGtkAccessor1);
+
+	auto p0FakeBackend = m_refAllEvDM->getBackend();
+	const int64_t nReplayed = p0FakeBackend->simulateReplay(sPath, false, sError);
+	::unlink(sPath.c_str());
+	REQUIRE(sError.empty());
+	REQUIRE(nReplayed == 3);
+
+	// added, press, release, removed
+	REQUIRE(aReceivedEvents.size() == 4);
+	REQUIRE(aReceivedEvents[0]->getEventClass() == typeid(stmi::DeviceMgmtEvent));
+	REQUIRE(std::static_pointer_cast<stmi::DeviceMgmtEvent>(aReceivedEvents[0])->getDeviceMgmtType() == stmi::DeviceMgmtEvent::DEVICE_MGMT_ADDED);
+	for (int32_t nIdx = 1; nIdx <= 2; ++nIdx) {
+		REQUIRE(aReceivedEvents[nIdx]->getEventClass() == typeid(stmi::KeyEvent));
+		auto p0KeyEvent = static_cast<stmi::KeyEvent*>(aReceivedEvents[nIdx].get());
+		REQUIRE(p0KeyEvent->getKey() == stmi::HK_F1);
+		REQUIRE(p0KeyEvent->getType() == ((nIdx == 1) ? stmi::KeyEvent::KEY_PRESS : stmi::KeyEvent::KEY_RELEASE));
+	}
+	REQUIRE(aReceivedEvents[3]->getEventClass() == typeid(stmi::DeviceMgmtEvent));
+	REQUIRE(std::static_pointer_cast<stmi::DeviceMgmtEvent>(aReceivedEvents[3])->getDeviceMgmtType() == stmi::DeviceMgmtEvent::DEVICE_MGMT_REMOVED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE_METHOD(STFX<BtDMOneWinOneAccFixture>, "ReplayFirstKeyHistogram")
+{
+	const std::string sPath = getCapturePath("firstkey");
+	std::string sError;
+	{
+		PacketCaptureWriter oWriter;
+		REQUIRE(oWriter.open(sPath, sError));
+		// device 5 sends a noop before its first key
+		writePacket(oWriter, 5, 1000, makeKeyPacket(Private::Bt::PACKET_CMD_NOOP, KeyEvent::KEY_PRESS, stmi::HK_NULL));
+		writePacket(oWriter, 5, 2000, makeKeyPacket(Private::Bt::PACKET_CMD_KEY, KeyEvent::KEY_PRESS, stmi::HK_F1));
+		writePacket(oWriter, 6, 2500, makeKeyPacket(Private::Bt::PACKET_CMD_KEY, KeyEvent::KEY_PRESS, stmi::HK_F2));
+		writePacket(oWriter, 5, 3000, makeKeyPacket(Private::Bt::PACKET_CMD_KEY, KeyEvent::KEY_RELEASE, stmi::HK_F1));
+		writePacket(oWriter, 6, 3500, makeKeyPacket(Private::Bt::PACKET_CMD_KEY, KeyEvent::KEY_RELEASE, stmi::HK_F2));
+	}
+	m_refAllEvDM->makeWindowActive(m_refGtkAccessor1);
+	BtGtkDeviceManager::ServerStats oStatsBefore;
+	m_refAllEvDM->getServerStats(oStatsBefore);
+	int64_t nTotBefore = 0;
+	for (const int64_t nCount : oStatsBefore.m_aFirstKeyHistogram) {
+		nTotBefore += nCount;
+	}
+	REQUIRE(nTotBefore == 0);
+
+	auto p0FakeBackend = m_refAllEvDM->getBackend();
+	const int64_t nReplayed = p0FakeBackend->simulateReplay(sPath, false, sError);
+	::unlink(sPath.c_str());
+	REQUIRE(sError.empty());
+	REQUIRE(nReplayed == 5);
+
+	// only the first key of each connection is counted
+	BtGtkDeviceManager::ServerStats oStats;
+	m_refAllEvDM->getServerStats(oStats);
+	int64_t nTotFirstKeys = 0;
+	for (const int64_t nCount : oStats.m_aFirstKeyHistogram) {
+		nTotFirstKeys += nCount;
+	}
+	REQUIRE(nTotFirstKeys == 2);
+	REQUIRE(oStats.m_nReconnects == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE_METHOD(STFX<BtDMOneWinOneAccFixture>, "ReplayReconnectKeepsReceiveStats")
+{
+	const std::string sPath = getCapturePath("reconnect");
+	std::string sError;
+	{
+		PacketCaptureWriter oWriter;
+		REQUIRE(oWriter.open(sPath, sError));
+		// first connection: datagram 1 is lost, the unknown flags close it
+		writeV2Key(oWriter, 5, 1000, 0, KeyEvent::KEY_PRESS, stmi::HK_F1);
+		writeV2Key(oWriter, 5, 2000, 2, KeyEvent::KEY_RELEASE, stmi::HK_F1);
+		writeV2Key(oWriter, 5, 3000, 3, KeyEvent::KEY_PRESS, stmi::HK_F1, 0x01);
+		// the next datagram reconnects the device
+		writeV2Key(oWriter, 5, 4000, 0, KeyEvent::KEY_PRESS, stmi::HK_F2);
+		writeV2Key(oWriter, 5, 5000, 1, KeyEvent::KEY_RELEASE, stmi::HK_F2);
+	}
+	std::vector< shared_ptr<stmi::Event> > aReceivedEvents;
+	auto refListener = std::make_shared<stmi::EventListener>(
+			[&](const shared_ptr<stmi::Event>& refEvent)
+			{
+				if (refEvent->getEventClass() == typeid(stmi::KeyEvent)) {
+					aReceivedEvents.emplace_back(refEvent);
+				}
+			});
+	REQUIRE(m_refAllEvDM->addEventListener(refListener, std::shared_ptr<stmi::CallIf>{}));
+	m_refAllEvDM->makeWindowActive(m_refGtkAccessor1);
+
+	auto p0FakeBackend = m_refAllEvDM->getBackend();
+	const int64_t nReplayed = p0FakeBackend->simulateReplay(sPath, false, sError);
+	::unlink(sPath.c_str());
+	REQUIRE(sError.empty());
+	REQUIRE(nReplayed == 5);
+
+	REQUIRE(aReceivedEvents.size() == 4);
+	const int32_t nDeviceId = aReceivedEvents[0]->getCapability()->getDevice()->getId();
+	BtGtkDeviceManager::ServerStats oServerStats;
+	m_refAllEvDM->getServerStats(oServerStats);
+	REQUIRE(oServerStats.m_nReconnects == 1);
+
+	// the counters of the first connection are kept
+	BtGtkDeviceManager::DeviceStats oStats;
+	REQUIRE(m_refAllEvDM->getDeviceStats(nDeviceId, oStats));
+	REQUIRE(oStats.m_nDatagrams == 5);
+	REQUIRE(oStats.m_nCmdErrors == 1);
+	REQUIRE(oStats.m_nProtocolVersion == Private::Bt::PACKET_PROTOCOL_VERSION_2);
+	REQUIRE(oStats.m_nV2Datagrams == 4);
+	REQUIRE(oStats.m_nLostDatagrams == 1);
+	REQUIRE(oStats.m_nOutOfOrderDatagrams == 0);
+	int64_t nTotDelays = 0;
+	for (const int64_t nCount : oStats.m_aDelayHistogram) {
+		nTotDelays += nCount;
+	}
+	REQUIRE(nTotDelays == 4);
+	int64_t nTotGaps = 0;
+	for (const int64_t nCount : oStats.m_aGapHistogram) {
+		nTotGaps += nCount;
+	}
+	REQUIRE(nTotGaps == 3);
+}
+
+} // namespace testing
+
+} // namespace stmi
@@ -0,0 +1,131 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   testRecycler.cxx
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "recycler.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace stmi
+{
+
+namespace testing
+{
+
+using Private::Recycler;
+
+namespace
+{
+class Base
+{
+public:
+	virtual ~Base() = default;
+};
+class Derived : public Base
+{
+public:
+	explicit Derived(int32_t nValue)
+	: m_nValue(nValue)
+	{
+		++s_nTotAlive;
+	}
+	~Derived()
+	{
+		--s_nTotAlive;
+	}
+	int32_t m_nValue;
+	static int32_t s_nTotAlive;
+};
+int32_t Derived::s_nTotAlive = 0;
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("RecyclerReusesReleasedBlocks")
+{
+	Recycler<Derived, Base> oRecycler(2);
+	std::shared_ptr<Base> ref1;
+	oRecycler.create(ref1, 1);
+	REQUIRE(static_cast<Derived*>(ref1.get())->m_nValue == 1);
+	REQUIRE(oRecycler.getStats().m_nLive == 1);
+	REQUIRE(oRecycler.getStats().m_nMisses == 1);
+	ref1.reset();
+	REQUIRE(Derived::s_nTotAlive == 0);
+	REQUIRE(oRecycler.getStats().m_nLive == 0);
+	REQUIRE(oRecycler.getStats().m_nPooled == 1);
+
+	oRecycler.create(ref1, 2);
+	REQUIRE(static_cast<Derived*>(ref1.get())->m_nValue == 2);
+	REQUIRE(oRecycler.getStats().m_nMisses == 1);
+	REQUIRE(oRecycler.getStats().m_nPooled == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("RecyclerCapAndRetainedInstances")
+{
+	std::vector< std::shared_ptr<Base> > aRetained;
+	{
+		Recycler<Derived, Base> oRecycler(2);
+		for (int32_t nIdx = 0; nIdx < 5; ++nIdx) {
+			aRetained.emplace_back();
+			oRecycler.create(aRetained.back(), nIdx);
+		}
+		REQUIRE(oRecycler.getStats().m_nLive == 5);
+		REQUIRE(oRecycler.getStats().m_nMisses == 5);
+		aRetained.resize(1);
+		// only two of the four released blocks are kept
+		REQUIRE(oRecycler.getStats().m_nLive == 1);
+		REQUIRE(oRecycler.getStats().m_nPooled == 2);
+	}
+	// outlives the recycler
+	REQUIRE(Derived::s_nTotAlive == 1);
+	REQUIRE(static_cast<Derived*>(aRetained[0].get())->m_nValue == 0);
+	aRetained.clear();
+	REQUIRE(Derived::s_nTotAlive == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("RecyclerReleaseInOtherThread")
+{
+	Recycler<Derived, Base> oRecycler(2);
+	std::shared_ptr<Base> ref1;
+	oRecycler.create(ref1, 1);
+	std::thread oThread([&]()
+	{
+		ref1.reset();
+	});
+	oThread.join();
+	REQUIRE(Derived::s_nTotAlive == 0);
+	// freed to the heap rather than pooled
+	REQUIRE(oRecycler.getStats().m_nLive == 0);
+	REQUIRE(oRecycler.getStats().m_nPooled == 0);
+
+	oRecycler.create(ref1, 2);
+	REQUIRE(oRecycler.getStats().m_nMisses == 2);
+	ref1.reset();
+	REQUIRE(oRecycler.getStats().m_nPooled == 1);
+}
+
+} // namespace testing
+
+} // namespace stmi
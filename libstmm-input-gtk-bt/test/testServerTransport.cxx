@@ -0,0 +1,216 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   testServerTransport.cxx
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "bluetransport.h"
+
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+
+namespace stmi
+{
+
+namespace testing
+{
+
+using Private::Bt::ServerTransport;
+
+namespace
+{
+std::string getSocketName(const std::string& sName)
+{
+	return "@stmi-test-" + sName + "-" + std::to_string(::getpid());
+}
+// Returns the connected socket or -1
+int32_t connectTo(const std::string& sAbstractName)
+{
+	::sockaddr_un oAddr;
+	memset(&oAddr, 0, sizeof(oAddr));
+	oAddr.sun_family = AF_UNIX;
+	// abstract names start with a null character instead of '@'
+	memcpy(oAddr.sun_path + 1, sAbstractName.c_str() + 1, sAbstractName.size() - 1);
+	const socklen_t nAddrLen = static_cast<socklen_t>(offsetof(::sockaddr_un, sun_path) + sAbstractName.size());
+	const int32_t nFD = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (nFD < 0) {
+		return -1;
+	}
+	if (::connect(nFD, reinterpret_cast<sockaddr*>(&oAddr), nAddrLen) < 0) {
+		::close(nFD);
+		return -1;
+	}
+	return nFD;
+}
+
+// A local transport pretending to listen on two adapters. The adapter of the
+// next accepted connection is chosen by the test.
+class TwoAdaptersTransport final : public ServerTransport
+{
+public:
+	TwoAdaptersTransport(const std::string& sAbstractName, int32_t nAdapterLoadMargin)
+	: ServerTransport(0, BtGtkDeviceManager::SocketTuning{}, nAdapterLoadMargin)
+	, m_oUnix(sAbstractName, 0, BtGtkDeviceManager::SocketTuning{})
+	, m_nNextAdapterIdx(0)
+	{
+	}
+	int32_t createListener(const std::string& sCaller, std::string& sError) noexcept override
+	{
+		const int32_t nListenerFD = m_oUnix.createListener(sCaller, sError);
+		if (nListenerFD >= 0) {
+			initAdapters(2);
+		}
+		return nListenerFD;
+	}
+	std::string getDescription() const noexcept override
+	{
+		return m_oUnix.getDescription();
+	}
+	int32_t getAdapterIdx(int32_t /*nClientFD*/) const noexcept override
+	{
+		return m_nNextAdapterIdx;
+	}
+	void setNextAdapterIdx(int32_t nAdapterIdx)
+	{
+		m_nNextAdapterIdx = nAdapterIdx;
+	}
+protected:
+	int32_t acceptClientImpl(int32_t nListenerFD, bdaddr_t& oClientAddr) noexcept override
+	{
+		memset(&oClientAddr, 0, sizeof(oClientAddr));
+		return ::accept4(nListenerFD, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	}
+private:
+	Private::Bt::UnixServerTransport m_oUnix;
+	int32_t m_nNextAdapterIdx;
+};
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ServerTransportAdapterLoadRefusal")
+{
+	const std::string sName = getSocketName("adapters");
+	// refuse connections on an adapter with 2 connections more than the other
+	TwoAdaptersTransport oTransport(sName, 2);
+	std::string sError;
+	const int32_t nListenerFD = oTransport.createListener("test", sError);
+	REQUIRE(nListenerFD >= 0);
+	REQUIRE(oTransport.getTotAdapters() == 2);
+
+	bdaddr_t oClientAddr;
+	std::vector<int32_t> aFDs;
+	oTransport.setNextAdapterIdx(0);
+	for (int32_t nIdx = 0; nIdx < 2; ++nIdx) {
+		aFDs.push_back(connectTo(sName));
+		REQUIRE(aFDs.back() >= 0);
+		const int32_t nFdClient = oTransport.acceptClient(nListenerFD, oClientAddr);
+		REQUIRE(nFdClient >= 0);
+		aFDs.push_back(nFdClient);
+	}
+	REQUIRE(oTransport.getAdapterCounters(0).m_nConnections == 2);
+	REQUIRE(oTransport.getAdapterCounters(1).m_nConnections == 0);
+
+	// adapter 0 is overloaded: the connection is closed and there's no other pending
+	aFDs.push_back(connectTo(sName));
+	REQUIRE(aFDs.back() >= 0);
+	REQUIRE(oTransport.acceptClient(nListenerFD, oClientAddr) < 0);
+	REQUIRE(ServerTransport::isNoPendingClient(errno));
+	REQUIRE(oTransport.getAdapterCounters(0).m_nRefused == 1);
+	REQUIRE(oTransport.getAdapterCounters(0).m_nConnections == 2);
+	REQUIRE(oTransport.getAcceptCounters().m_nRefused == 1);
+
+	// adapter 1 isn't
+	oTransport.setNextAdapterIdx(1);
+	aFDs.push_back(connectTo(sName));
+	REQUIRE(aFDs.back() >= 0);
+	const int32_t nFdClient = oTransport.acceptClient(nListenerFD, oClientAddr);
+	REQUIRE(nFdClient >= 0);
+	aFDs.push_back(nFdClient);
+	REQUIRE(oTransport.getAdapterCounters(1).m_nConnections == 1);
+	REQUIRE(oTransport.getAdapterCounters(1).m_nAccepted == 1);
+
+	// once a connection of adapter 0 is closed it accepts again
+	oTransport.releaseAdapterConnection(0);
+	oTransport.setNextAdapterIdx(0);
+	aFDs.push_back(connectTo(sName));
+	REQUIRE(aFDs.back() >= 0);
+	const int32_t nFdClient2 = oTransport.acceptClient(nListenerFD, oClientAddr);
+	REQUIRE(nFdClient2 >= 0);
+	aFDs.push_back(nFdClient2);
+	REQUIRE(oTransport.getAdapterCounters(0).m_nAccepted == 3);
+	REQUIRE(oTransport.getAcceptCounters().m_nAccepted == 4);
+
+	for (const int32_t nFD : aFDs) {
+		::close(nFD);
+	}
+	::close(nListenerFD);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ServerTransportSocketTuning")
+{
+	const std::string sName = getSocketName("tuning");
+	BtGtkDeviceManager::SocketTuning oTuning;
+	oTuning.m_nReceiveBufferSize = 65536;
+	oTuning.m_nSendBufferSize = 32768;
+	Private::Bt::UnixServerTransport oTransport(sName, 0, oTuning);
+	REQUIRE(oTransport.getAppliedTuning().m_nReceiveBufferSize == 0);
+	std::string sError;
+	const int32_t nListenerFD = oTransport.createListener("test", sError);
+	REQUIRE(nListenerFD >= 0);
+	// Linux doubles the requested sizes for its bookkeeping
+	const auto& oApplied = oTransport.getAppliedTuning();
+	REQUIRE(oApplied.m_nReceiveBufferSize >= oTuning.m_nReceiveBufferSize);
+	REQUIRE(oApplied.m_nSendBufferSize >= oTuning.m_nSendBufferSize);
+	// not applicable to local sockets
+	REQUIRE(oApplied.m_nInMtu == 0);
+	REQUIRE(oApplied.m_nFlushTimeoutMsec == 0);
+
+	// the options aren't inherited by the accepted connections, they are set again
+	const int32_t nFD = connectTo(sName);
+	REQUIRE(nFD >= 0);
+	bdaddr_t oClientAddr;
+	const int32_t nFdClient = oTransport.acceptClient(nListenerFD, oClientAddr);
+	REQUIRE(nFdClient >= 0);
+	int nSize = 0;
+	socklen_t nOptLen = sizeof(nSize);
+	REQUIRE(::getsockopt(nFdClient, SOL_SOCKET, SO_RCVBUF, &nSize, &nOptLen) == 0);
+	REQUIRE(nSize == oApplied.m_nReceiveBufferSize);
+	nOptLen = sizeof(nSize);
+	REQUIRE(::getsockopt(nFdClient, SOL_SOCKET, SO_SNDBUF, &nSize, &nOptLen) == 0);
+	REQUIRE(nSize == oApplied.m_nSendBufferSize);
+
+	::close(nFdClient);
+	::close(nFD);
+	::close(nListenerFD);
+}
+
+} // namespace testing
+
+} // namespace stmi
@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   testSlotMap.cxx
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "slotmap.h"
+
+#include <string>
+
+namespace stmi
+{
+
+namespace testing
+{
+
+using Private::SlotMap;
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("SlotMapInsertErase")
+{
+	SlotMap<std::string> oMap;
+	const int32_t nId0 = oMap.insert("A");
+	const int32_t nId1 = oMap.insert("B");
+	REQUIRE(nId0 == 0);
+	REQUIRE(nId1 == 1);
+	REQUIRE(oMap.size() == 2);
+	REQUIRE(*oMap.find(nId1) == "B");
+	REQUIRE(oMap.find(2) == nullptr);
+	REQUIRE(oMap.find(-1) == nullptr);
+
+	REQUIRE(oMap.erase(nId0));
+	REQUIRE_FALSE(oMap.erase(nId0));
+	REQUIRE(oMap.size() == 1);
+	REQUIRE(oMap.find(nId0) == nullptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("SlotMapReusedSlotDetectsStaleId")
+{
+	SlotMap<std::string> oMap;
+	const int32_t nId0 = oMap.insert("A");
+	oMap.insert("B");
+	oMap.erase(nId0);
+	const int32_t nId2 = oMap.insert("C");
+	// the freed slot is reused with a new generation
+	REQUIRE(SlotMap<std::string>::getIndex(nId2) == SlotMap<std::string>::getIndex(nId0));
+	REQUIRE(nId2 != nId0);
+	REQUIRE(oMap.getTotSlots() == 2);
+	REQUIRE_FALSE(oMap.contains(nId0));
+	REQUIRE(oMap.find(nId0) == nullptr);
+	REQUIRE(*oMap.find(nId2) == "C");
+}
+
+} // namespace testing
+
+} // namespace stmi
@@ -0,0 +1,252 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   testThreadConnections.cxx
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "bluetooththreadsource.h"
+#include "packetcapture.h"
+
+#include <glibmm.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace stmi
+{
+
+namespace testing
+{
+
+using Private::Bt::BlueReceiveCounters;
+using Private::Bt::BlueReceiveOptions;
+using Private::Bt::BlueServerThreadSource;
+using Private::Bt::BlueThreadConnections;
+using Private::Bt::CapturedDatagram;
+using Private::Bt::KeyPacket;
+using Private::Bt::PacketCaptureReader;
+using Private::Bt::PacketCaptureWriter;
+
+namespace
+{
+socklen_t setAbstractAddr(::sockaddr_un& oAddr, const std::string& sAbstractName)
+{
+	memset(&oAddr, 0, sizeof(oAddr));
+	oAddr.sun_family = AF_UNIX;
+	// abstract names start with a null character instead of '@'
+	memcpy(oAddr.sun_path + 1, sAbstractName.c_str() + 1, sAbstractName.size() - 1);
+	return static_cast<socklen_t>(offsetof(::sockaddr_un, sun_path) + sAbstractName.size());
+}
+// Returns the connected socket or -1
+// If sClientAddr isn't empty the client is identified by that bluetooth address
+int32_t connectTo(const std::string& sAbstractName, const std::string& sClientAddr = "")
+{
+	const int32_t nFD = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (nFD < 0) {
+		return -1;
+	}
+	::sockaddr_un oAddr;
+	if (! sClientAddr.empty()) {
+		const socklen_t nAddrLen = setAbstractAddr(oAddr, std::string("@") + Private::Bt::PACKET_UNIX_CLIENT_NAME_PREFIX + sClientAddr);
+		if (::bind(nFD, reinterpret_cast<sockaddr*>(&oAddr), nAddrLen) < 0) {
+			::close(nFD);
+			return -1;
+		}
+	}
+	const socklen_t nAddrLen = setAbstractAddr(oAddr, sAbstractName);
+	if (::connect(nFD, reinterpret_cast<sockaddr*>(&oAddr), nAddrLen) < 0) {
+		::close(nFD);
+		return -1;
+	}
+	return nFD;
+}
+// Runs the context until the condition is met or a timeout
+void iterateUntil(const Glib::RefPtr<Glib::MainContext>& refContext, const std::function<bool()>& oCondition)
+{
+	const auto oDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while ((! oCondition()) && (std::chrono::steady_clock::now() < oDeadline)) {
+		refContext->iteration(false);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ThreadConnectionsReconnectThenStaleClose")
+{
+	BlueThreadConnections oConnections;
+	oConnections.add(1, 7);
+	oConnections.add(2, 8);
+	REQUIRE(oConnections.getBackendId(1) == 7);
+	// device 7 reconnects
+	oConnections.add(3, 7);
+	REQUIRE(oConnections.getBackendId(3) == 7);
+	// the keys and the close of the old connection are dropped
+	REQUIRE(oConnections.getBackendId(1) == -1);
+	REQUIRE(oConnections.remove(1) == -1);
+	// the new connection is unaffected
+	REQUIRE(oConnections.getBackendId(3) == 7);
+	REQUIRE(oConnections.getBackendId(2) == 8);
+	REQUIRE(oConnections.remove(3) == 7);
+	REQUIRE(oConnections.getBackendId(3) == -1);
+	REQUIRE(oConnections.remove(2) == 8);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ThreadConnectionsCloseThenReconnect")
+{
+	BlueThreadConnections oConnections;
+	oConnections.add(1, 7);
+	REQUIRE(oConnections.remove(1) == 7);
+	oConnections.add(2, 7);
+	REQUIRE(oConnections.getBackendId(2) == 7);
+	REQUIRE(oConnections.remove(2) == 7);
+	// unknown (ignored) connection
+	REQUIRE(oConnections.remove(5) == -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ThreadSourceClosesRefusedConnection")
+{
+	Glib::init();
+	const std::string sName = "@stmi-test-refused-" + std::to_string(::getpid());
+	auto refTransport = std::make_shared<Private::Bt::UnixServerTransport>(sName, 0, BtGtkDeviceManager::SocketTuning{});
+	BlueReceiveOptions oOptions;
+	oOptions.m_bKernelTimestamps = false;
+	Glib::RefPtr<BlueServerThreadSource> refSource{new BlueServerThreadSource(refTransport, oOptions, 16)};
+	REQUIRE(refSource->getErrorStr().empty());
+	int32_t nTotConnects = 0;
+	int32_t nTotReceived = 0;
+	auto oConnection = refSource->connect(
+			[&](const bdaddr_t& /*oBdAddr*/, int32_t /*nAdapterIdx*/, const std::shared_ptr<BlueReceiveCounters>& /*refCounters*/) -> int32_t
+			{
+				++nTotConnects;
+				// refused
+				return -1;
+			}
+			, [&](int32_t /*nBackendId*/, bool /*bRemove*/, const KeyPacket& /*oPkt*/, int64_t /*nTimeUsec*/) -> bool
+			{
+				++nTotReceived;
+				return true;
+			});
+	REQUIRE(oConnection.connected());
+	auto refContext = Glib::MainContext::create();
+	refSource->attach(refContext);
+
+	const int32_t nClientFD = connectTo(sName);
+	REQUIRE(nClientFD >= 0);
+	iterateUntil(refContext, [&]() { return (nTotConnects > 0); });
+	REQUIRE(nTotConnects == 1);
+	// the receiver thread closes the refused connection
+	::pollfd oPollFD;
+	oPollFD.fd = nClientFD;
+	oPollFD.events = POLLIN;
+	oPollFD.revents = 0;
+	REQUIRE(::poll(&oPollFD, 1, 5000) == 1);
+	char aBuf[8];
+	REQUIRE(::recv(nClientFD, aBuf, sizeof(aBuf), MSG_DONTWAIT) == 0);
+	::close(nClientFD);
+
+	refSource->stop();
+	refSource->destroy();
+	REQUIRE(nTotReceived == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE("ThreadSourceCaptureIdsAcrossReconnections")
+{
+	Glib::init();
+	const std::string sName = "@stmi-test-capture-" + std::to_string(::getpid());
+	const std::string sPath = "/tmp/stmi-test-threadcapture-" + std::to_string(::getpid()) + ".btsnoop";
+	auto refTransport = std::make_shared<Private::Bt::UnixServerTransport>(sName, 0, BtGtkDeviceManager::SocketTuning{});
+	BlueReceiveOptions oOptions;
+	oOptions.m_bKernelTimestamps = false;
+	oOptions.m_refCapture = std::make_shared<PacketCaptureWriter>();
+	std::string sError;
+	REQUIRE(oOptions.m_refCapture->open(sPath, sError));
+	Glib::RefPtr<BlueServerThreadSource> refSource{new BlueServerThreadSource(refTransport, oOptions, 16)};
+	REQUIRE(refSource->getErrorStr().empty());
+	std::vector< std::shared_ptr<BlueReceiveCounters> > aCounters;
+	auto oConnection = refSource->connect(
+			[&](const bdaddr_t& /*oBdAddr*/, int32_t /*nAdapterIdx*/, const std::shared_ptr<BlueReceiveCounters>& refCounters) -> int32_t
+			{
+				aCounters.push_back(refCounters);
+				return 7;
+			}
+			, [&](int32_t /*nBackendId*/, bool /*bRemove*/, const KeyPacket& /*oPkt*/, int64_t /*nTimeUsec*/) -> bool
+			{
+				return true;
+			});
+	REQUIRE(oConnection.connected());
+	auto refContext = Glib::MainContext::create();
+	refSource->attach(refContext);
+
+	KeyPacket oNoop;
+	oNoop.m_nMagic1 = '7';
+	oNoop.m_nMagic2 = 'A';
+	oNoop.m_nCmd = Private::Bt::PACKET_CMD_NOOP;
+	oNoop.m_nKeyType = 0;
+	oNoop.m_nHardwareKey = 0;
+	// the device 11:22:33:44:55:66 connects, sends a packet and reconnects,
+	// another device connects in between
+	for (const char* p0ClientAddr : {"11:22:33:44:55:66", "11:22:33:44:55:77", "11:22:33:44:55:66"}) {
+		const int32_t nClientFD = connectTo(sName, p0ClientAddr);
+		REQUIRE(nClientFD >= 0);
+		const size_t nTotConnects = aCounters.size();
+		iterateUntil(refContext, [&]() { return (aCounters.size() > nTotConnects); });
+		REQUIRE(aCounters.size() == nTotConnects + 1);
+		REQUIRE(::send(nClientFD, &oNoop, sizeof(oNoop), 0) == static_cast<ssize_t>(sizeof(oNoop)));
+		auto& refCounters = aCounters.back();
+		iterateUntil(refContext, [&]() { return (refCounters->m_nDatagrams.load() > 0); });
+		REQUIRE(refCounters->m_nDatagrams.load() == 1);
+		::close(nClientFD);
+	}
+	refSource->stop();
+	refSource->destroy();
+	oOptions.m_refCapture->close();
+
+	// the capture ids are those of the receiver thread, not the backend id
+	PacketCaptureReader oReader;
+	REQUIRE(oReader.open(sPath, sError));
+	std::vector<int32_t> aCaptureIds;
+	CapturedDatagram oDatagram;
+	while (oReader.read(oDatagram, sError)) {
+		aCaptureIds.push_back(oDatagram.m_nBackendId);
+	}
+	oReader.close();
+	::unlink(sPath.c_str());
+	REQUIRE(sError.empty());
+	REQUIRE(aCaptureIds == std::vector<int32_t>{0, 1, 0});
+}
+
+} // namespace testing
+
+} // namespace stmi
@@ -22,12 +22,17 @@
 
 #include <glibmm.h>
 
+#include <algorithm>
+#include <atomic>
 #include <utility>
 #ifndef NDEBUG
 //#include <iostream>
 #endif //NDEBUG
 
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/timerfd.h>
 
 namespace stmi
 {
@@ -41,9 +46,9 @@ PendingWriteSource::PendingWriteSource(int32_t nClientFD) noexcept
 	static_assert(false == FALSE, "");
 	static_assert(true == TRUE, "");
 
-	static int32_t s_nSourceId = 0;
-	m_nUniqueId = s_nSourceId;
-	++s_nSourceId;
+	// sources can be created by the sender thread too
+	static std::atomic<int32_t> s_nSourceId{0};
+	m_nUniqueId = s_nSourceId.fetch_add(1, std::memory_order_relaxed);
 
 	m_oConnectPollFD.set_fd(m_nClientFD);
 	m_oConnectPollFD.set_events(Glib::IO_OUT | Glib::IO_HUP | Glib::IO_ERR | Glib::IO_NVAL);
@@ -112,30 +117,136 @@ bool PendingWriteSource::dispatch(sigc::slot_base* p0Slot) noexcept
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-IntervalTimeoutSource::IntervalTimeoutSource(int32_t nInterval) noexcept
-: Glib::TimeoutSource(nInterval)
-, m_nTotMillisec(0)
-, m_nInterval(nInterval)
+PendingReadSource::PendingReadSource(int32_t nClientFD) noexcept
+: Glib::Source()
+{
+	assert(nClientFD >= 0);
+
+	// sources can be created by the sender thread too
+	static std::atomic<int32_t> s_nSourceId{0};
+	m_nUniqueId = s_nSourceId.fetch_add(1, std::memory_order_relaxed);
+
+	m_oReadPollFD.set_fd(nClientFD);
+	m_oReadPollFD.set_events(Glib::IO_IN | Glib::IO_HUP | Glib::IO_ERR | Glib::IO_NVAL);
+	add_poll(m_oReadPollFD);
+
+	set_priority(Glib::PRIORITY_DEFAULT);
+	set_can_recurse(false);
+}
+PendingReadSource::~PendingReadSource() noexcept
+{
+}
+sigc::connection PendingReadSource::connect(const sigc::slot<bool, int32_t, bool>& oSlot) noexcept
+{
+	return connect_generic(oSlot);
+}
+
+bool PendingReadSource::prepare(int& nTimeout) noexcept
+{
+	nTimeout = -1;
+
+	return false;
+}
+bool PendingReadSource::check() noexcept
+{
+	return ((m_oReadPollFD.get_revents() & (Glib::IO_IN | Glib::IO_HUP | Glib::IO_ERR | Glib::IO_NVAL)) != 0);
+}
+bool PendingReadSource::dispatch(sigc::slot_base* p0Slot) noexcept
+{
+	if (p0Slot == nullptr) {
+		return false; //--------------------------------------------------------
+	}
+	auto nIOFlags = m_oReadPollFD.get_revents();
+	const bool bSomeError = ((nIOFlags & (Glib::IO_HUP | Glib::IO_ERR | Glib::IO_NVAL)) != 0);
+	if (((nIOFlags & Glib::IO_IN) == 0) && !bSomeError) {
+		// unknown event
+		return true; //---------------------------------------------------------
+	}
+	return (*static_cast<sigc::slot<bool, int32_t, bool>*>(p0Slot))(m_nUniqueId, bSomeError);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+OneShotTimerSource::OneShotTimerSource() noexcept
+: Glib::Source()
+, m_nTimerFD(-1)
+, m_bArmed(false)
+{
+	// g_get_monotonic_time() uses CLOCK_MONOTONIC
+	m_nTimerFD = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m_nTimerFD < 0) {
+		m_sErrorStr = "OneShotTimerSource(): timerfd_create failed: " + std::string(strerror(errno));
+		return; //--------------------------------------------------------------
+	}
+	m_oTimerPollFD.set_fd(m_nTimerFD);
+	m_oTimerPollFD.set_events(Glib::IO_IN);
+	add_poll(m_oTimerPollFD);
+
+	set_priority(Glib::PRIORITY_DEFAULT);
+	set_can_recurse(false);
+}
+OneShotTimerSource::~OneShotTimerSource() noexcept
+{
+	if (m_nTimerFD >= 0) {
+		::close(m_nTimerFD);
+	}
+}
+sigc::connection OneShotTimerSource::connect(const sigc::slot<bool>& oSlot) noexcept
+{
+	if (m_nTimerFD < 0) {
+		return sigc::connection();
+	}
+	return connect_generic(oSlot);
+}
+bool OneShotTimerSource::arm(int64_t nDeadlineUsec) noexcept
+{
+	if (m_nTimerFD < 0) {
+		return false; //--------------------------------------------------------
+	}
+	struct ::itimerspec oSpec;
+	memset(&oSpec, 0, sizeof(oSpec));
+	// a zero value would disarm the timer
+	const int64_t nUsec = std::max<int64_t>(nDeadlineUsec, 1);
+	oSpec.it_value.tv_sec = static_cast<time_t>(nUsec / 1000000);
+	oSpec.it_value.tv_nsec = static_cast<long>((nUsec % 1000000) * 1000);
+	if (::timerfd_settime(m_nTimerFD, TFD_TIMER_ABSTIME, &oSpec, nullptr) < 0) {
+		return false; //--------------------------------------------------------
+	}
+	m_bArmed = true;
+	return true;
+}
+void OneShotTimerSource::disarm() noexcept
 {
-	assert(nInterval > 0);
+	if ((m_nTimerFD < 0) || ! m_bArmed) {
+		return; //--------------------------------------------------------------
+	}
+	struct ::itimerspec oSpec;
+	memset(&oSpec, 0, sizeof(oSpec));
+	::timerfd_settime(m_nTimerFD, 0, &oSpec, nullptr);
+	m_bArmed = false;
 }
-IntervalTimeoutSource::~IntervalTimeoutSource() noexcept
+bool OneShotTimerSource::prepare(int& nTimeout) noexcept
 {
-//std::cout << "IntervalTimeoutSource::~IntervalTimeoutSource()" << '\n';
+	nTimeout = -1;
+
+	return false;
 }
-sigc::connection IntervalTimeoutSource::connectSlot(const sigc::slot<bool>& oSlot) noexcept
+bool OneShotTimerSource::check() noexcept
 {
-	m_oCallback = oSlot;
-	const sigc::slot<bool> oNoParamSlot = sigc::mem_fun(this, &IntervalTimeoutSource::callback);
-	return connect_generic(oNoParamSlot);
+	return ((m_oTimerPollFD.get_revents() & Glib::IO_IN) != 0);
 }
-bool IntervalTimeoutSource::callback() noexcept
+bool OneShotTimerSource::dispatch(sigc::slot_base* p0Slot) noexcept
 {
-	if (!m_oCallback) {
-		return false;
+	if (p0Slot == nullptr) {
+		return false; //--------------------------------------------------------
+	}
+	uint64_t nExpirations = 0;
+	const auto nRes = ::read(m_nTimerFD, &nExpirations, sizeof(nExpirations));
+	if ((nRes != sizeof(nExpirations)) || ! m_bArmed) {
+		// disarmed or rearmed in the meantime
+		return true; //---------------------------------------------------------
 	}
-	m_nTotMillisec += m_nInterval;
-	return m_oCallback();
+	m_bArmed = false;
+	return (*static_cast<sigc::slot<bool>*>(p0Slot))();
 }
 
 } // namespace stmi
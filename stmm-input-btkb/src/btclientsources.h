@@ -23,6 +23,7 @@
 
 #include <glibmm.h>
 
+#include <string>
 #include <cassert>
 
 #include <stdint.h>
@@ -69,34 +70,80 @@ private:
 };
 
 ////////////////////////////////////////////////////////////////////////////////
-class IntervalTimeoutSource : public Glib::TimeoutSource
+/* Waits for datagrams sent by the server (acknowledgements) or, in general,
+ * for a file descriptor to become readable (see BtKeySenderThread).
+ * Unlike PendingWriteSource it doesn't own the file descriptor.
+ */
+class PendingReadSource : public Glib::Source
 {
 public:
-	// nInterval The interval in milliseconds betwwen callbacks.
-	explicit IntervalTimeoutSource(int32_t nInterval) noexcept;
-	virtual ~IntervalTimeoutSource() noexcept;
-
-	int64_t getElapsed() const noexcept { return m_nTotMillisec; }
-	sigc::connection connect(const sigc::slot<bool>& /*oSlot*/) noexcept //override
-	{
-		assert(false);
-		return sigc::connection();
-	}
-	// The signature of the callback means:
-	//   bContinue = m_oCallback(nTotMillisec)
-	// nTotMillisec The total elapsed time since the timeout was started
-	sigc::connection connectSlot(const sigc::slot<bool>& oSlot) noexcept;
+	// nClientFD The connected socket
+	explicit PendingReadSource(int32_t nClientFD) noexcept;
+	virtual ~PendingReadSource() noexcept;
+
+	// A source can have only one callback type, that is the slot given as parameter.
+	//   bool = m_oCallback(nSourceId, bDisconnect)
+	// nSourceId The unique source id
+	// bDisconnect Tells whether the connection was lost.
+	sigc::connection connect(const sigc::slot<bool, int32_t, bool>& oSlot) noexcept;
+
+	int32_t getSourceId() const noexcept { return m_nUniqueId; }
 protected:
-	bool callback() noexcept;
+	bool prepare(int& nTimeout) noexcept override;
+	bool check() noexcept override;
+	bool dispatch(sigc::slot_base* oSlot) noexcept override;
+
+private:
+	int32_t m_nUniqueId;
+	//
+	Glib::PollFD m_oReadPollFD;
+	//
 private:
-	sigc::slot<bool> m_oCallback;
+	PendingReadSource() = delete;
+	PendingReadSource(const PendingReadSource& oSource) = delete;
+	PendingReadSource& operator=(const PendingReadSource& oSource) = delete;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/* A one-shot timer with microsecond precision (timerfd).
+ * Unlike Glib::TimeoutSource, which has millisecond granularity, it expires at
+ * a deadline of the monotonic clock. It can be rearmed after it expired.
+ */
+class OneShotTimerSource : public Glib::Source
+{
+public:
+	OneShotTimerSource() noexcept;
+	virtual ~OneShotTimerSource() noexcept;
+
+	// The error string, empty if the timer could be created.
+	const std::string& getErrorStr() const noexcept { return m_sErrorStr; }
+
+	// A source can have only one callback type, that is the slot given as parameter.
+	//   bool = m_oCallback()
+	// The callback is called once for each time the timer is armed and expires.
+	sigc::connection connect(const sigc::slot<bool>& oSlot) noexcept;
+
+	// nDeadlineUsec The expiry time in microseconds of the monotonic clock (g_get_monotonic_time()).
+	//               If in the past the timer expires immediately.
+	// Returns false if the timer couldn't be armed.
+	bool arm(int64_t nDeadlineUsec) noexcept;
+	void disarm() noexcept;
+	bool isArmed() const noexcept { return m_bArmed; }
+protected:
+	bool prepare(int& nTimeout) noexcept override;
+	bool check() noexcept override;
+	bool dispatch(sigc::slot_base* oSlot) noexcept override;
+
+private:
+	std::string m_sErrorStr;
+	int32_t m_nTimerFD;
+	bool m_bArmed;
+	//
+	Glib::PollFD m_oTimerPollFD;
 	//
-	int64_t m_nTotMillisec;
-	int32_t m_nInterval;
 private:
-	IntervalTimeoutSource() = delete;
-	IntervalTimeoutSource(const IntervalTimeoutSource& oSource) = delete;
-	IntervalTimeoutSource& operator=(const IntervalTimeoutSource& oSource) = delete;
+	OneShotTimerSource(const OneShotTimerSource& oSource) = delete;
+	OneShotTimerSource& operator=(const OneShotTimerSource& oSource) = delete;
 };
 
 } // namespace stmi
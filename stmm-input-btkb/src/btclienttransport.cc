@@ -0,0 +1,218 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   btclienttransport.cc
+ */
+#include "btclienttransport.h"
+#include "btkeyservers.h"
+#include "keypacket.h"
+
+#include <algorithm>
+#include <cstddef>
+
+#include <bluetooth/l2cap.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace stmi
+{
+
+// The L2CAP flush timeout meaning no flush
+constexpr int32_t s_nInfiniteFlushTimeout = 0xFFFF;
+
+bool ClientTransport::applyTuning(int32_t nFD, const ClientSocketTuning& oTuning, std::string& sError) noexcept
+{
+	if (oTuning.m_nReceiveBufferSize > 0) {
+		const int nSize = oTuning.m_nReceiveBufferSize;
+		if (::setsockopt(nFD, SOL_SOCKET, SO_RCVBUF, &nSize, sizeof(nSize)) < 0) {
+			sError = std::string("Socket setsockopt (receive buffer) failed: ") + strerror(errno);
+			return false; //----------------------------------------------------
+		}
+	}
+	if (oTuning.m_nSendBufferSize > 0) {
+		const int nSize = oTuning.m_nSendBufferSize;
+		if (::setsockopt(nFD, SOL_SOCKET, SO_SNDBUF, &nSize, sizeof(nSize)) < 0) {
+			sError = std::string("Socket setsockopt (send buffer) failed: ") + strerror(errno);
+			return false; //----------------------------------------------------
+		}
+	}
+	return true;
+}
+void ClientTransport::readAppliedTuning(int32_t nFD, ClientSocketTuning& oApplied) const noexcept
+{
+	int nSize = 0;
+	socklen_t nOptLen = sizeof(nSize);
+	if (::getsockopt(nFD, SOL_SOCKET, SO_RCVBUF, &nSize, &nOptLen) == 0) {
+		oApplied.m_nReceiveBufferSize = nSize;
+	}
+	nSize = 0;
+	nOptLen = sizeof(nSize);
+	if (::getsockopt(nFD, SOL_SOCKET, SO_SNDBUF, &nSize, &nOptLen) == 0) {
+		oApplied.m_nSendBufferSize = nSize;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+L2capClientTransport::L2capClientTransport(const bdaddr_t& oBtAddr, int32_t nL2capPort) noexcept
+: m_oBtAddr(BtKeyServers::getAddrCopy(oBtAddr))
+, m_nL2capPort(nL2capPort)
+{
+}
+int32_t L2capClientTransport::createSocket(std::string& sError) noexcept
+{
+	const int32_t nFD = ::socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+	if (nFD < 0) {
+		sError = std::string("Socket failed: ") + strerror(errno);
+	}
+	return nFD;
+}
+int32_t L2capClientTransport::connectSocket(int32_t nFD) noexcept
+{
+	::sockaddr_l2 oL2Addr;
+	::memset(&oL2Addr, 0, sizeof(::sockaddr_l2));
+
+	oL2Addr.l2_family = AF_BLUETOOTH;
+	oL2Addr.l2_psm = htobs(m_nL2capPort);
+	oL2Addr.l2_bdaddr = BtKeyServers::getAddrCopy(m_oBtAddr);
+
+	return ::connect(nFD, reinterpret_cast<sockaddr*>(&oL2Addr), sizeof(oL2Addr));
+}
+bool L2capClientTransport::applyTuning(int32_t nFD, const ClientSocketTuning& oTuning, std::string& sError) noexcept
+{
+	if (! ClientTransport::applyTuning(nFD, oTuning, sError)) {
+		return false; //--------------------------------------------------------
+	}
+	if ((oTuning.m_nInMtu > 0) || (oTuning.m_nOutMtu > 0) || (oTuning.m_nFlushTimeoutMsec > 0)) {
+		::l2cap_options oOpts;
+		::memset(&oOpts, 0, sizeof(oOpts));
+		socklen_t nOptLen = sizeof(oOpts);
+		auto nRes = ::getsockopt(nFD, SOL_L2CAP, L2CAP_OPTIONS, &oOpts, &nOptLen);
+		if (nRes == 0) {
+			if (oTuning.m_nInMtu > 0) {
+				oOpts.imtu = static_cast<uint16_t>(std::min<int32_t>(oTuning.m_nInMtu, 0xFFFF));
+			}
+			if (oTuning.m_nOutMtu > 0) {
+				oOpts.omtu = static_cast<uint16_t>(std::min<int32_t>(oTuning.m_nOutMtu, 0xFFFF));
+			}
+			if (oTuning.m_nFlushTimeoutMsec > 0) {
+				oOpts.flush_to = static_cast<uint16_t>(std::min<int32_t>(oTuning.m_nFlushTimeoutMsec, s_nInfiniteFlushTimeout));
+			}
+			nRes = ::setsockopt(nFD, SOL_L2CAP, L2CAP_OPTIONS, &oOpts, nOptLen);
+		}
+		if (nRes < 0) {
+			sError = std::string("Socket setsockopt (L2CAP options) failed: ") + strerror(errno);
+			return false; //----------------------------------------------------
+		}
+	}
+	if ((oTuning.m_nFlushTimeoutMsec > 0) && (oTuning.m_nFlushTimeoutMsec < s_nInfiniteFlushTimeout)) {
+		// the flush timeout only applies to flushable packets
+		const int nFlushable = BT_FLUSHABLE_ON;
+		if (::setsockopt(nFD, SOL_BLUETOOTH, BT_FLUSHABLE, &nFlushable, sizeof(nFlushable)) < 0) {
+			sError = std::string("Socket setsockopt (flushable) failed: ") + strerror(errno);
+			return false; //----------------------------------------------------
+		}
+	}
+	if (oTuning.m_nLinkMode != 0) {
+		const int nLinkMode = oTuning.m_nLinkMode;
+		if (::setsockopt(nFD, SOL_L2CAP, L2CAP_LM, &nLinkMode, sizeof(nLinkMode)) < 0) {
+			sError = std::string("Socket setsockopt (link mode) failed: ") + strerror(errno);
+			return false; //----------------------------------------------------
+		}
+	}
+	return true;
+}
+void L2capClientTransport::readAppliedTuning(int32_t nFD, ClientSocketTuning& oApplied) const noexcept
+{
+	ClientTransport::readAppliedTuning(nFD, oApplied);
+	::l2cap_options oOpts;
+	::memset(&oOpts, 0, sizeof(oOpts));
+	socklen_t nOptLen = sizeof(oOpts);
+	if (::getsockopt(nFD, SOL_L2CAP, L2CAP_OPTIONS, &oOpts, &nOptLen) == 0) {
+		oApplied.m_nInMtu = oOpts.imtu;
+		oApplied.m_nOutMtu = oOpts.omtu;
+		oApplied.m_nFlushTimeoutMsec = oOpts.flush_to;
+	}
+	int nLinkMode = 0;
+	nOptLen = sizeof(nLinkMode);
+	if (::getsockopt(nFD, SOL_L2CAP, L2CAP_LM, &nLinkMode, &nOptLen) == 0) {
+		oApplied.m_nLinkMode = nLinkMode;
+	}
+}
+std::string L2capClientTransport::getDescription() const noexcept
+{
+	return BtKeyServers::getStringFromAddr(m_oBtAddr) + " port " + std::to_string(m_nL2capPort);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns the address length or 0 if sName too long
+static socklen_t fillUnixAddr(const std::string& sName, bool bAbstract, ::sockaddr_un& oAddr) noexcept
+{
+	::memset(&oAddr, 0, sizeof(oAddr));
+	oAddr.sun_family = AF_UNIX;
+	if (sName.size() + 1 > sizeof(oAddr.sun_path)) {
+		return 0; //------------------------------------------------------------
+	}
+	// abstract names start with a null character, paths end with one
+	::memcpy(oAddr.sun_path + (bAbstract ? 1 : 0), sName.c_str(), sName.size());
+	return static_cast<socklen_t>(offsetof(::sockaddr_un, sun_path) + sName.size() + 1);
+}
+
+UnixClientTransport::UnixClientTransport(const std::string& sPath, const bdaddr_t& oIdentity) noexcept
+: m_sPath(sPath)
+, m_oIdentity(BtKeyServers::getAddrCopy(oIdentity))
+{
+}
+int32_t UnixClientTransport::createSocket(std::string& sError) noexcept
+{
+	const int32_t nFD = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (nFD < 0) {
+		sError = std::string("Socket failed: ") + strerror(errno);
+		return -1; //-----------------------------------------------------------
+	}
+	if (BtKeyServers::isEmptyAddr(m_oIdentity)) {
+		return nFD; //----------------------------------------------------------
+	}
+	::sockaddr_un oLocalAddr;
+	const socklen_t nLocalAddrLen = fillUnixAddr(PACKET_UNIX_CLIENT_NAME_PREFIX
+												+ BtKeyServers::getStringFromAddr(m_oIdentity), true, oLocalAddr);
+	if (::bind(nFD, reinterpret_cast<sockaddr*>(&oLocalAddr), nLocalAddrLen) < 0) {
+		sError = std::string("Socket bind failed: ") + strerror(errno);
+		::close(nFD);
+		return -1; //-----------------------------------------------------------
+	}
+	return nFD;
+}
+int32_t UnixClientTransport::connectSocket(int32_t nFD) noexcept
+{
+	const bool bAbstract = (! m_sPath.empty()) && (m_sPath[0] == '@');
+	::sockaddr_un oAddr;
+	const socklen_t nAddrLen = fillUnixAddr(m_sPath.substr(bAbstract ? 1 : 0), bAbstract, oAddr);
+	if (nAddrLen == 0) {
+		errno = ENAMETOOLONG;
+		return -1; //-----------------------------------------------------------
+	}
+	return ::connect(nFD, reinterpret_cast<sockaddr*>(&oAddr), nAddrLen);
+}
+std::string UnixClientTransport::getDescription() const noexcept
+{
+	return "local socket " + m_sPath;
+}
+
+} // namespace stmi
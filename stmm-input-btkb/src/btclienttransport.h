@@ -0,0 +1,117 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   btclienttransport.h
+ */
+
+#ifndef STMI_BT_CLIENT_TRANSPORT_H
+#define STMI_BT_CLIENT_TRANSPORT_H
+
+#include <string>
+
+#include <bluetooth/bluetooth.h>
+
+#include <stdint.h>
+
+namespace stmi
+{
+
+////////////////////////////////////////////////////////////////////////////////
+/** Options of the connection socket.
+ * A value of 0 leaves the system default. The fields marked L2CAP are ignored
+ * by other transports.
+ */
+struct ClientSocketTuning
+{
+	int32_t m_nInMtu = 0; // L2CAP incoming MTU in bytes
+	int32_t m_nOutMtu = 0; // L2CAP outgoing MTU in bytes
+	int32_t m_nReceiveBufferSize = 0; // SO_RCVBUF in bytes
+	int32_t m_nSendBufferSize = 0; // SO_SNDBUF in bytes
+	// L2CAP flush timeout in milliseconds, if positive the packets are also flushable.
+	int32_t m_nFlushTimeoutMsec = 0;
+	int32_t m_nLinkMode = 0; // L2CAP_LM_* flags
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** The transport of the connection to the server.
+ * The connection is a SOCK_SEQPACKET socket carrying the btkeys protocol.
+ */
+class ClientTransport
+{
+public:
+	virtual ~ClientTransport() noexcept = default;
+	// Creates the socket (blocking). Returns -1 and sets sError if failed.
+	virtual int32_t createSocket(std::string& sError) noexcept = 0;
+	// Connects the socket to the server. Returns the result of ::connect (errno is set).
+	virtual int32_t connectSocket(int32_t nFD) noexcept = 0;
+	// Sets the options of a socket returned by createSocket() before it connects.
+	// Returns false and sets sError if failed. The base sets the buffer sizes.
+	virtual bool applyTuning(int32_t nFD, const ClientSocketTuning& oTuning, std::string& sError) noexcept;
+	// Sets oApplied to the options of the socket as reported by the kernel.
+	// The L2CAP MTUs are only final once connected. The base reads the buffer sizes.
+	virtual void readAppliedTuning(int32_t nFD, ClientSocketTuning& oApplied) const noexcept;
+	// A description of the server. Example: "00:11:22:33:44:55 port 8353".
+	virtual std::string getDescription() const noexcept = 0;
+protected:
+	ClientTransport() noexcept = default;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Bluetooth L2CAP transport.
+ */
+class L2capClientTransport final : public ClientTransport
+{
+public:
+	L2capClientTransport(const bdaddr_t& oBtAddr, int32_t nL2capPort) noexcept;
+
+	int32_t createSocket(std::string& sError) noexcept override;
+	int32_t connectSocket(int32_t nFD) noexcept override;
+	bool applyTuning(int32_t nFD, const ClientSocketTuning& oTuning, std::string& sError) noexcept override;
+	void readAppliedTuning(int32_t nFD, ClientSocketTuning& oApplied) const noexcept override;
+	std::string getDescription() const noexcept override;
+private:
+	const bdaddr_t m_oBtAddr;
+	const int32_t m_nL2capPort;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** Local (AF_UNIX) transport.
+ * Connects to a server started with a local socket path (see
+ * BtGtkDeviceManager::Init::m_sLocalSocketPath).
+ * The socket is bound to the abstract name PACKET_UNIX_CLIENT_NAME_PREFIX followed by
+ * the identity address so that the server recognizes the device when it reconnects.
+ */
+class UnixClientTransport final : public ClientTransport
+{
+public:
+	// sPath: The path of the server socket. If it starts with '@' it's an abstract name.
+	// oIdentity: The address the server uses to identify the device. If it's all zeroes
+	//            the socket is not bound and the server assigns a new address for each connection.
+	UnixClientTransport(const std::string& sPath, const bdaddr_t& oIdentity) noexcept;
+
+	int32_t createSocket(std::string& sError) noexcept override;
+	int32_t connectSocket(int32_t nFD) noexcept override;
+	std::string getDescription() const noexcept override;
+private:
+	const std::string m_sPath;
+	const bdaddr_t m_oIdentity;
+};
+
+} // namespace stmi
+
+#endif /* STMI_BT_CLIENT_TRANSPORT_H */
+
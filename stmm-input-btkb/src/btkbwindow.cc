@@ -817,12 +817,14 @@ void BtkbWindow::onButtonConnect() noexcept
 }
 void BtkbWindow::onButtonDisconnect() noexcept
 {
+	flushQueuedKeys();
 	m_oBtKeyClient.disconnectFromServer();
 	setSensitivityForState();
 }
 void BtkbWindow::onButtonRemove() noexcept
 {
 	finalizeKeys();
+	flushQueuedKeys();
 	printStringToLog("Sending removal request ...");
 	m_oBtKeyClient.sendRemoveToServer();
 	setSensitivityForState();
@@ -903,7 +905,7 @@ bool BtkbWindow::pressKey(hk::HARDWARE_KEY eKey, PRESS_TYPE eType, const GdkEven
 	if (m_bKeysLogSentKeys && (m_oBtKeyClient.getState() == BtKeyClient::STATE_CONNECTED)) {
 		printStringToLog(std::string("Sending key ") + m_oInputStrings.getKeyString(eKey) + " pressed");
 	}
-	m_oBtKeyClient.sendKeyToServer(hk::KEY_PRESS, eKey);
+	queueKey(hk::KEY_PRESS, eKey);
 	return true;
 }
 bool BtkbWindow::releaseKey(hk::HARDWARE_KEY eKey, PRESS_TYPE eType, const GdkEventSequence* p0Finger, bool bCancel) noexcept
@@ -932,9 +934,37 @@ bool BtkbWindow::releaseKey(hk::HARDWARE_KEY eKey, PRESS_TYPE eType, const GdkEv
 	if (m_bKeysLogSentKeys && (m_oBtKeyClient.getState() == BtKeyClient::STATE_CONNECTED)) {
 		printStringToLog(std::string("Sending key ") + m_oInputStrings.getKeyString(eKey) + " " + (bCancel ? "canceled" : "released"));
 	}
-	m_oBtKeyClient.sendKeyToServer((bCancel ? hk::KEY_RELEASE_CANCEL : hk::KEY_RELEASE), eKey);
+	queueKey((bCancel ? hk::KEY_RELEASE_CANCEL : hk::KEY_RELEASE), eKey);
 	return true;
 }
+void BtkbWindow::queueKey(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey) noexcept
+{
+	m_aQueuedKeys.push_back(std::make_pair(eType, eKey));
+	if (! m_oFlushQueuedKeysConn.connected()) {
+		// GDK events have default priority: the idle is called once all the
+		// events received in the same frame are handled
+		m_oFlushQueuedKeysConn = Glib::signal_idle().connect(sigc::mem_fun(this, &BtkbWindow::onFlushQueuedKeys)
+															, Glib::PRIORITY_DEFAULT + 1);
+	}
+}
+bool BtkbWindow::onFlushQueuedKeys() noexcept
+{
+	flushQueuedKeys();
+	return false;
+}
+void BtkbWindow::flushQueuedKeys() noexcept
+{
+	m_oFlushQueuedKeysConn.disconnect();
+	if (m_aQueuedKeys.empty()) {
+		return; //--------------------------------------------------------------
+	}
+	if (m_aQueuedKeys.size() == 1) {
+		m_oBtKeyClient.sendKeyToServer(m_aQueuedKeys[0].first, m_aQueuedKeys[0].second);
+	} else {
+		m_oBtKeyClient.sendKeysToServer(m_aQueuedKeys);
+	}
+	m_aQueuedKeys.clear();
+}
 void BtkbWindow::onClientStateChanged() noexcept
 {
 	const BtKeyClient::STATE eState = m_oBtKeyClient.getState();
@@ -108,6 +108,11 @@ private:
 	};
 	bool pressKey(hk::HARDWARE_KEY eKey, PRESS_TYPE eType, const GdkEventSequence* p0Finger) noexcept;
 	bool releaseKey(hk::HARDWARE_KEY eKey, PRESS_TYPE eType, const GdkEventSequence* p0Finger, bool bCancel) noexcept;
+	// The keys pressed or released while handling the pending input events
+	// are sent together (as a chord) once the events are handled
+	void queueKey(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey) noexcept;
+	void flushQueuedKeys() noexcept;
+	bool onFlushQueuedKeys() noexcept;
 
 	void printStringToLog(const std::string& sStr) noexcept;
 
@@ -325,6 +330,9 @@ private:
 	};
 	std::vector<PressedKey> m_aPressedKeys; // Size: <= m_nTotColumns * m_nTotRows, Values: unique for tuple (key,type,finger)
 
+	std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> > m_aQueuedKeys;
+	sigc::connection m_oFlushQueuedKeysConn;
+
 	Glib::RefPtr<Gtk::TextBuffer> m_refTextBufferLog;
 	Glib::RefPtr<Gtk::TextBuffer::Mark> m_refTextBufferMarkBottom;
 	int32_t m_nTextBufferLogTotLines = 0;
@@ -18,13 +18,16 @@
  * File:   btkeyclient.cc
  */
 #include "btkeyclient.h"
+#include "btkeysender.h"
 #include "btkeyservers.h"
 
+#include <glib.h>
+
 #include <cassert>
 //#include <iostream>
 #include <algorithm>
+#include <utility>
 
-#include <bluetooth/l2cap.h>
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -36,29 +39,121 @@ namespace stmi
 
 constexpr char s_nMagic1 = '7';
 constexpr char s_nMagic2 = 'A';
+constexpr char s_nMagic2V2 = 'B';
+constexpr char s_nMagic2Ack = 'C';
 
 BtKeyClient::BtKeyClient() noexcept
-: BtKeyClient(s_nDefaultTimeoutConnect, s_nDefaultTimeoutSend, s_nDefaultInterval, s_nDefaultNoopAfter)
+: BtKeyClient(s_nDefaultTimeoutConnect, s_nDefaultTimeoutSend, s_nDefaultNoopAfter, s_nDefaultMaxProtocolVersion)
+{
+}
+BtKeyClient::BtKeyClient(int32_t nTimeoutConnect, int32_t nTimeoutSend, int32_t nNoopAfter
+						, int32_t nMaxProtocolVersion) noexcept
+: BtKeyClient(nTimeoutConnect, nTimeoutSend, nNoopAfter, nMaxProtocolVersion, Glib::RefPtr<Glib::MainContext>{})
 {
 }
-BtKeyClient::BtKeyClient(int32_t nTimeoutConnect, int32_t nTimeoutSend, int32_t nInterval, int32_t nNoopAfter) noexcept
+BtKeyClient::BtKeyClient(int32_t nTimeoutConnect, int32_t nTimeoutSend, int32_t nNoopAfter
+						, int32_t nMaxProtocolVersion, const Glib::RefPtr<Glib::MainContext>& refContext) noexcept
 : m_nTimeoutConnect(nTimeoutConnect)
 , m_nTimeoutSend(nTimeoutSend)
-, m_nInterval(nInterval)
 , m_nNoopAfter(nNoopAfter)
+, m_nMaxProtocolVersion(nMaxProtocolVersion)
 , m_eState(STATE_DISCONNECTED)
 , m_nClientFD(-1)
 , m_nL2capPort(-1)
-, m_nStartedConnectingTime(0)
-, m_nStartedSendingTime(0)
 , m_aBufferedKeys(s_nSendBufferSize)
 , m_nLastSentTime(-1)
-, m_nTotPackets(0)
+, m_nSendKeys(0)
+, m_nProtocolVersion(PACKET_PROTOCOL_VERSION_1)
+, m_bHelloPending(false)
+, m_nSequence(0)
+, m_nAckedSequence(0)
+, m_nCredit(0)
+, m_bWaitingForCredit(false)
+, m_nCoalesceWindowUsec(0)
+, m_refContext(refContext)
+, m_oScheduler(refContext)
+, m_nSenderDroppedKeys(0)
+{
+	assert((m_nMaxProtocolVersion >= PACKET_PROTOCOL_VERSION_1) && (m_nMaxProtocolVersion <= PACKET_PROTOCOL_VERSION_3));
+	::memset(&m_oSendHeader, 0, sizeof(m_oSendHeader));
+	::memset(m_aSendIov, 0, sizeof(m_aSendIov));
+	::memset(&m_oSendMsg, 0, sizeof(m_oSendMsg));
+	m_oSendMsg.msg_iov = m_aSendIov;
+	m_nConnectTimer = m_oScheduler.addTimer(sigc::mem_fun(this, &BtKeyClient::doConnectTimeout));
+	m_nSendTimer = m_oScheduler.addTimer(sigc::mem_fun(this, &BtKeyClient::doSendTimeout));
+	m_nKeepAliveTimer = m_oScheduler.addTimer(sigc::mem_fun(this, &BtKeyClient::doKeepAliveTimeout));
+	m_nCoalesceTimer = m_oScheduler.addTimer(sigc::mem_fun(this, &BtKeyClient::doCoalesceTimeout));
+}
+BtKeyClient::~BtKeyClient() noexcept
+{
+	// joins the thread
+	m_refSenderThread.reset();
+}
+
+bool BtKeyClient::startSenderThread(std::string& sError) noexcept
+{
+	assert(! m_refSenderThread);
+	assert(m_nClientFD < 0);
+	auto refSenderThread = std::make_unique<BtKeySenderThread>(m_nTimeoutConnect, m_nTimeoutSend, m_nNoopAfter
+																, m_nMaxProtocolVersion, m_oSocketTuning, m_nCoalesceWindowUsec);
+	if (! refSenderThread->start(sigc::mem_fun(this, &BtKeyClient::onSenderEvent), sError)) {
+		return false; //--------------------------------------------------------
+	}
+	m_refSenderThread = std::move(refSenderThread);
+	return true;
+}
+void BtKeyClient::onSenderEvent(const BtKeySenderEvent& oEvent) noexcept
+{
+	m_eState = oEvent.m_eState;
+	m_sLastError = oEvent.m_sError;
+	m_nProtocolVersion = oEvent.m_nProtocolVersion;
+	m_oAppliedSocketTuning = oEvent.m_oAppliedSocketTuning;
+	m_oSendStats = oEvent.m_oSendStats;
+	m_oSendStats.m_nDroppedKeys += m_nSenderDroppedKeys;
+	if (oEvent.m_bError) {
+		m_oErrorSignal();
+	} else {
+		m_oStateChangedSignal();
+	}
+}
+void BtKeyClient::dropSenderKeys(int32_t nTotKeys) noexcept
 {
+	// the sender thread is stuck, the keys would be late anyway
+	m_nSenderDroppedKeys += nTotKeys;
+	m_oSendStats.m_nDroppedKeys += nTotKeys;
 }
 
+void BtKeyClient::setCoalesceWindow(int32_t nWindowUsec) noexcept
+{
+	assert(nWindowUsec >= 0);
+	m_nCoalesceWindowUsec = nWindowUsec;
+}
 void BtKeyClient::connectToServer(const bdaddr_t& oBtAddr, int32_t nL2capPort) noexcept
 {
+	if (m_refSenderThread) {
+		if (! m_refSenderThread->connectToServer(oBtAddr, nL2capPort)) {
+			m_sLastError = "Sender thread queue full";
+			m_oErrorSignal();
+		}
+		return; //--------------------------------------------------------------
+	}
+	if ((m_eState == STATE_REMOVING) || (m_nClientFD >= 0)) {
+		return; //--------------------------------------------------------------
+	}
+	m_oBtAddr = BtKeyServers::getAddrCopy(oBtAddr);
+	m_nL2capPort = nL2capPort;
+	connectToServer(std::make_unique<L2capClientTransport>(oBtAddr, nL2capPort));
+}
+void BtKeyClient::connectToServer(std::unique_ptr<ClientTransport> refTransport) noexcept
+{
+	assert(refTransport);
+	if (m_refSenderThread) {
+		if (! m_refSenderThread->connectToServer(std::move(refTransport))) {
+			m_sLastError = "Sender thread queue full";
+			m_oErrorSignal();
+		}
+		return; //--------------------------------------------------------------
+	}
 	if (m_eState == STATE_REMOVING) {
 		// wait till fully disconnected
 		return; //--------------------------------------------------------------
@@ -70,10 +165,10 @@ void BtKeyClient::connectToServer(const bdaddr_t& oBtAddr, int32_t nL2capPort) n
 
 	assert(m_eState == STATE_DISCONNECTED);
 
+	m_refTransport = std::move(refTransport);
 	// allocate a socket
-	m_nClientFD = ::socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+	m_nClientFD = m_refTransport->createSocket(m_sLastError);
 	if (m_nClientFD < 0) {
-		m_sLastError = std::string("Socket failed: ") + strerror(errno);
 		m_oErrorSignal();
 		return; //--------------------------------------------------------------
 	}
@@ -95,31 +190,22 @@ void BtKeyClient::connectToServer(const bdaddr_t& oBtAddr, int32_t nL2capPort) n
 		m_oErrorSignal();
 		return; //--------------------------------------------------------------
 	}
-
-	m_oBtAddr = BtKeyServers::getAddrCopy(oBtAddr);
-	m_nL2capPort = nL2capPort;
-
-	::sockaddr_l2 oL2Addr;
-	::memset(&oL2Addr, 0, sizeof(::sockaddr_l2));
-
-	oL2Addr.l2_family = AF_BLUETOOTH;
-	oL2Addr.l2_psm = htobs(m_nL2capPort);
-	oL2Addr.l2_bdaddr = BtKeyServers::getAddrCopy(m_oBtAddr);
+	if (! m_refTransport->applyTuning(m_nClientFD, m_oSocketTuning, m_sLastError)) {
+		::close(m_nClientFD);
+		m_nClientFD = -1;
+		m_oErrorSignal();
+		return; //--------------------------------------------------------------
+	}
 
 	// connect to server
-	const auto nRes = ::connect(m_nClientFD, reinterpret_cast<sockaddr*>(&oL2Addr), sizeof(oL2Addr));
+	const auto nRes = m_refTransport->connectSocket(m_nClientFD);
 	if (nRes < 0) {
 		if (errno == EINPROGRESS) {
 			m_refPendingConnect = Glib::RefPtr<PendingWriteSource>{ new PendingWriteSource(m_nClientFD) };
 			m_refPendingConnect->connect(sigc::mem_fun(this, &BtKeyClient::doPendingConnect));
-			m_refPendingConnect->attach();
+			m_refPendingConnect->attach(m_refContext);
 //std::cout << "BtKeyClient::connectToServer  EINPROGRESS  nSourceId=" << m_refPendingConnect->getSourceId() << '\n';
-			if (!m_refIntervalTimeout) {
-				m_refIntervalTimeout = Glib::RefPtr<IntervalTimeoutSource>{ new IntervalTimeoutSource(m_nInterval) };
-				m_refIntervalTimeout->connectSlot(sigc::mem_fun(this, &BtKeyClient::doIntervalTimeout));
-				m_refIntervalTimeout->attach();
-			}
-			m_nStartedConnectingTime = m_refIntervalTimeout->getElapsed();
+			m_oScheduler.schedule(m_nConnectTimer, DeadlineScheduler::getNowUsec() + m_nTimeoutConnect * INT64_C(1000));
 			m_eState = STATE_CONNECTING;
 			m_oStateChangedSignal();
 		} else {
@@ -130,9 +216,7 @@ void BtKeyClient::connectToServer(const bdaddr_t& oBtAddr, int32_t nL2capPort) n
 			return; //----------------------------------------------------------
 		}
 	} else {
-		m_sLastError.clear();
-		m_eState = STATE_CONNECTED;
-		m_oStateChangedSignal();
+		setConnected();
 	}
 }
 bool BtKeyClient::doPendingConnect(int32_t nSourceId, bool bError) noexcept
@@ -153,11 +237,172 @@ bool BtKeyClient::doPendingConnect(int32_t nSourceId, bool bError) noexcept
 	}
 	m_refPendingConnect->removePoll();
 	m_refPendingConnect.reset();
+	m_oScheduler.cancel(m_nConnectTimer);
+	setConnected();
+//std::cout << "BtKeyClient::doPendingConnect  CONNECTED!" << '\n';
+	return ! bContinue;
+}
+void BtKeyClient::setConnected() noexcept
+{
 	m_sLastError.clear();
+	m_nProtocolVersion = PACKET_PROTOCOL_VERSION_1;
+	m_bHelloPending = false;
+	m_nSequence = 0;
+	m_nAckedSequence = 0;
+	m_nCredit = 0;
+	m_bWaitingForCredit = false;
+	m_aSentPressedKeys.clear();
+	m_oAppliedSocketTuning = ClientSocketTuning{};
+	m_refTransport->readAppliedTuning(m_nClientFD, m_oAppliedSocketTuning);
 	m_eState = STATE_CONNECTED;
+	m_nLastSentTime = DeadlineScheduler::getNowUsec();
+	scheduleKeepAlive();
+	sendHello();
 	m_oStateChangedSignal();
-//std::cout << "BtKeyClient::doPendingConnect  CONNECTED!" << '\n';
-	return ! bContinue;
+}
+void BtKeyClient::scheduleKeepAlive() noexcept
+{
+	if (m_nNoopAfter <= 0) {
+		return; //--------------------------------------------------------------
+	}
+	const int64_t nAfterMillisec = std::max(m_nNoopAfter, m_nTimeoutSend * 2);
+	m_oScheduler.schedule(m_nKeepAliveTimer, m_nLastSentTime + nAfterMillisec * 1000);
+}
+void BtKeyClient::sendHello() noexcept
+{
+	if (m_nMaxProtocolVersion < PACKET_PROTOCOL_VERSION_2) {
+		return; //--------------------------------------------------------------
+	}
+	// A NOOP packet: servers not supporting v2 ignore it
+	KeyPacket oHello;
+	oHello.m_nMagic1 = s_nMagic1;
+	oHello.m_nMagic2 = s_nMagic2;
+	oHello.m_nCmd = PACKET_CMD_NOOP;
+	oHello.m_nKeyType = PACKET_HELLO_KEY_TYPE;
+	oHello.m_nHardwareKey = htobl(m_nMaxProtocolVersion);
+	const auto nRes = ::send(m_nClientFD, &oHello, sizeof(KeyPacket), 0);
+	if (nRes < 0) {
+		// go on with v1, errors are detected by the next send
+		return; //--------------------------------------------------------------
+	}
+	m_bHelloPending = true;
+	// the answer is read as soon as it arrives
+	startReading();
+}
+void BtKeyClient::startReading() noexcept
+{
+	if (m_refPendingRead) {
+		return; //--------------------------------------------------------------
+	}
+	m_refPendingRead = Glib::RefPtr<PendingReadSource>{ new PendingReadSource(m_nClientFD) };
+	m_refPendingRead->connect(sigc::mem_fun(this, &BtKeyClient::doPendingRead));
+	m_refPendingRead->attach(m_refContext);
+}
+void BtKeyClient::checkHelloAnswer() noexcept
+{
+	assert(m_bHelloPending);
+	KeyPacket oAnswer;
+	const auto nRes = ::recv(m_nClientFD, &oAnswer, sizeof(KeyPacket), MSG_DONTWAIT);
+	if (nRes < 0) {
+		// not answered (yet), an old server never will
+		return; //--------------------------------------------------------------
+	}
+	if (nRes == 0) {
+		disconnectInternal("Server closed connection");
+		return; //--------------------------------------------------------------
+	}
+	m_bHelloPending = false;
+	if ((nRes != sizeof(KeyPacket)) || (oAnswer.m_nMagic1 != s_nMagic1) || (oAnswer.m_nMagic2 != s_nMagic2)
+			|| (oAnswer.m_nCmd != PACKET_CMD_NOOP) || (oAnswer.m_nKeyType != PACKET_HELLO_KEY_TYPE)) {
+		// unexpected, stay with v1
+		m_refPendingRead.reset();
+		return; //--------------------------------------------------------------
+	}
+	const int32_t nVersion = static_cast<int32_t>(btohl(oAnswer.m_nHardwareKey));
+	if ((nVersion >= PACKET_PROTOCOL_VERSION_2) && (nVersion <= m_nMaxProtocolVersion)) {
+		m_nProtocolVersion = nVersion;
+	}
+	if (isFlowControlled()) {
+		startFlowControl();
+	} else {
+		// nothing else to read
+		m_refPendingRead.reset();
+	}
+}
+void BtKeyClient::startFlowControl() noexcept
+{
+	m_nAckedSequence = m_nSequence;
+	m_nCredit = PACKET_V3_INITIAL_CREDIT;
+	m_bWaitingForCredit = false;
+	// the acks are read by the source that read the hello answer
+	startReading();
+}
+bool BtKeyClient::hasCredit() const noexcept
+{
+	if (! isFlowControlled()) {
+		return true; //---------------------------------------------------------
+	}
+	const uint32_t nInFlight = m_nSequence - m_nAckedSequence;
+	return (nInFlight < static_cast<uint32_t>(m_nCredit));
+}
+bool BtKeyClient::doPendingRead(int32_t nSourceId, bool bError) noexcept
+{
+	const bool bContinue = true;
+
+	if (!m_refPendingRead) {
+		return ! bContinue; //--------------------------------------------------
+	}
+	if (nSourceId != m_refPendingRead->getSourceId()) {
+		return ! bContinue; //--------------------------------------------------
+	}
+	if (bError) {
+		disconnectInternal("Server closed connection");
+		return ! bContinue; //--------------------------------------------------
+	}
+	if (m_bHelloPending) {
+		checkHelloAnswer();
+		if (!m_refPendingRead) {
+			// not flow controlled or disconnected
+			return ! bContinue; //----------------------------------------------
+		}
+		if (m_bHelloPending) {
+			// spurious wake up
+			return bContinue; //------------------------------------------------
+		}
+	}
+	while (true) {
+		KeyPacketAck oAck;
+		const auto nRes = ::recv(m_nClientFD, &oAck, sizeof(KeyPacketAck), MSG_DONTWAIT);
+		if (nRes < 0) {
+			// no more acks
+			break; // while -------
+		}
+		if (nRes == 0) {
+			disconnectInternal("Server closed connection");
+			return ! bContinue; //----------------------------------------------
+		}
+		if ((nRes != sizeof(KeyPacketAck)) || (oAck.m_nMagic1 != s_nMagic1) || (oAck.m_nMagic2 != s_nMagic2Ack)) {
+			// ignore
+			continue; // while ------
+		}
+		handleAck(oAck);
+	}
+	if (m_bWaitingForCredit && hasCredit()) {
+		sendPacketsFromBufferedKeys();
+	}
+	return bContinue;
+}
+void BtKeyClient::handleAck(const KeyPacketAck& oAck) noexcept
+{
+	const uint32_t nNextSequence = btohl(oAck.m_nNextSequence);
+	// the acknowledged sequence must be within the datagrams in flight
+	// (with wrap around)
+	if ((nNextSequence - m_nAckedSequence) > (m_nSequence - m_nAckedSequence)) {
+		return; //--------------------------------------------------------------
+	}
+	m_nAckedSequence = nNextSequence;
+	m_nCredit = std::max<int32_t>(1, btohs(oAck.m_nCredit));
+	++m_oSendStats.m_nAcks;
 }
 bool BtKeyClient::doPendingSend(int32_t nSourceId, bool bError) noexcept
 {
@@ -175,26 +420,35 @@ bool BtKeyClient::doPendingSend(int32_t nSourceId, bool bError) noexcept
 		disconnectInternal("Sending packet failed");
 		return ! bContinue; //--------------------------------------------------
 	}
-	const auto nRes = ::send(m_nClientFD, m_aPackets, sizeof(KeyPacket) * m_nTotPackets, 0);
+	const auto nRes = sendEncoded();
 	if (nRes < 0) {
 		disconnectInternal(std::string("Sending packet failed: ") + strerror(errno));
 		return ! bContinue; //--------------------------------------------------
 	}
-	assert(m_refIntervalTimeout);
-	m_nLastSentTime = m_refIntervalTimeout->getElapsed();
-	// sending succeeded
+	countSentEncoded();
+	m_nLastSentTime = DeadlineScheduler::getNowUsec();
+	scheduleKeepAlive();
+	// sending succeeded, stop polling (the source must not close the socket)
+	m_refPendingSend->removePoll();
+	m_refPendingSend.reset();
 	if (! m_aBufferedKeys.isEmpty()) {
 		// but a buffer of keys accumulated in the meantime
 		// TODO send it now or issue a timeout of 0?
 		sendPacketsFromBufferedKeys();
 	} else {
+		m_oScheduler.cancel(m_nSendTimer);
 		m_eState = STATE_CONNECTED;
 		m_oStateChangedSignal();
 	}
-	return bContinue;
+	return ! bContinue;
 }
 void BtKeyClient::disconnectFromServer() noexcept
 {
+	if (m_refSenderThread) {
+		// a full queue is extremely unlikely, the server times out anyway
+		m_refSenderThread->disconnectFromServer();
+		return; //--------------------------------------------------------------
+	}
 	if (m_eState == STATE_REMOVING) {
 		// the server to disconnect anyway
 		return;
@@ -212,6 +466,12 @@ void BtKeyClient::disconnectInternal(const std::string& sErrorString) noexcept
 	m_nClientFD = -1;
 	m_refPendingConnect.reset();
 	m_refPendingSend.reset();
+	m_refPendingRead.reset();
+	m_bWaitingForCredit = false;
+	m_oScheduler.cancel(m_nConnectTimer);
+	m_oScheduler.cancel(m_nSendTimer);
+	m_oScheduler.cancel(m_nKeepAliveTimer);
+	m_oScheduler.cancel(m_nCoalesceTimer);
 	m_sLastError = sErrorString;
 	m_eState = STATE_DISCONNECTED;
 	if (! sErrorString.empty()) {
@@ -219,40 +479,228 @@ void BtKeyClient::disconnectInternal(const std::string& sErrorString) noexcept
 	}
 	m_oStateChangedSignal();
 }
-void BtKeyClient::sendKeyToServer(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey) noexcept
+bool BtKeyClient::prepareBufferKey() noexcept
 {
 	if (m_eState == STATE_SENDING) {
 		// buffer the keys while trying to send the preceding batch
-		if (m_aBufferedKeys.isFull()) {
-			m_aBufferedKeys.read(); // forget oldest key
+		return true; //---------------------------------------------------------
+	}
+	if (m_eState != STATE_CONNECTED) {
+		return false; //--------------------------------------------------------
+	}
+	if (m_bHelloPending) {
+		checkHelloAnswer();
+	}
+	return (m_eState == STATE_CONNECTED);
+}
+void BtKeyClient::sendKeyToServer(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey) noexcept
+{
+	sendKeyToServer(eType, eKey, g_get_monotonic_time());
+}
+void BtKeyClient::sendKeyToServer(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey, int64_t nCaptureTimeUsec) noexcept
+{
+	if (m_refSenderThread) {
+		if (! m_refSenderThread->sendKeyToServer(eType, eKey, nCaptureTimeUsec)) {
+			dropSenderKeys(1);
 		}
-		m_aBufferedKeys.write(std::make_pair(eType, eKey));
-	} else if (m_eState == STATE_CONNECTED) {
-		if (m_aBufferedKeys.isFull()) {
-			// make place
-			m_aBufferedKeys.read();
+		return; //--------------------------------------------------------------
+	}
+	if (! prepareBufferKey()) {
+		return; //--------------------------------------------------------------
+	}
+	bufferKey(BufferedKey{eType, eKey, nCaptureTimeUsec, false});
+	if (m_eState == STATE_CONNECTED) {
+		sendOrCoalesceBufferedKeys();
+	}
+}
+void BtKeyClient::sendKeysToServer(const std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> >& aKeys) noexcept
+{
+	sendKeysToServer(aKeys, g_get_monotonic_time());
+}
+void BtKeyClient::sendKeysToServer(const std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> >& aKeys
+									, int64_t nCaptureTimeUsec) noexcept
+{
+	if (m_refSenderThread) {
+		if ((! aKeys.empty()) && ! m_refSenderThread->sendKeysToServer(aKeys, nCaptureTimeUsec)) {
+			dropSenderKeys(static_cast<int32_t>(aKeys.size()));
 		}
-		m_aBufferedKeys.write(std::make_pair(eType, eKey));
+		return; //--------------------------------------------------------------
+	}
+	if (aKeys.empty() || ! prepareBufferKey()) {
+		return; //--------------------------------------------------------------
+	}
+	const int32_t nTotKeys = std::min(static_cast<int32_t>(aKeys.size()), m_aBufferedKeys.capacity());
+	for (int32_t nIdx = 0; nIdx < nTotKeys; ++nIdx) {
+		const auto& oPair = aKeys[nIdx];
+		assert((oPair.first == hk::KEY_PRESS) || (oPair.first == hk::KEY_RELEASE) || (oPair.first == hk::KEY_RELEASE_CANCEL));
+		bufferKey(BufferedKey{oPair.first, oPair.second, nCaptureTimeUsec, (nIdx + 1 < nTotKeys)});
+	}
+	if (m_eState == STATE_CONNECTED) {
+		sendOrCoalesceBufferedKeys();
+	}
+}
+void BtKeyClient::sendOrCoalesceBufferedKeys() noexcept
+{
+	assert(m_eState == STATE_CONNECTED);
+	if ((m_nCoalesceWindowUsec <= 0) || m_aBufferedKeys.isFull()) {
 		sendPacketsFromBufferedKeys();
+		return; //--------------------------------------------------------------
 	}
+	if (m_oScheduler.isScheduled(m_nCoalesceTimer)) {
+		// the deadline of the first waiting key holds
+		return; //--------------------------------------------------------------
+	}
+	m_oScheduler.schedule(m_nCoalesceTimer, m_aBufferedKeys.peekValue(0).m_nCaptureTimeUsec + m_nCoalesceWindowUsec);
 }
-void BtKeyClient::sendPacketsFromBufferedKeys() noexcept
+void BtKeyClient::doCoalesceTimeout() noexcept
 {
-	const auto eOldState = m_eState;
-
-	STATE eNewState = STATE_SENDING;
-	m_nTotPackets = 0;
+	if ((m_eState == STATE_CONNECTED) && ! m_aBufferedKeys.isEmpty()) {
+		sendPacketsFromBufferedKeys();
+	}
+}
+namespace
+{
+// Whether the key changes the pressed state of the hardware key
+bool isPressOrRelease(hk::KEY_INPUT_TYPE eType) noexcept
+{
+	return (eType == hk::KEY_PRESS) || (eType == hk::KEY_RELEASE) || (eType == hk::KEY_RELEASE_CANCEL);
+}
+} // namespace
+void BtKeyClient::bufferKey(const BufferedKey& oKey) noexcept
+{
+	if (m_aBufferedKeys.isFull()) {
+		if (! mergeBufferedKeys(oKey)) {
+			// the key is dropped, it can't continue a chord
+			if ((! oKey.m_bChordNext) && ! m_aBufferedKeys.isEmpty()) {
+				m_aBufferedKeys.peekValue(m_aBufferedKeys.size() - 1).m_bChordNext = false;
+			}
+			return; //----------------------------------------------------------
+		}
+	}
+	m_aBufferedKeys.write(oKey);
+}
+bool BtKeyClient::isPressedBefore(int32_t nIdx, hk::HARDWARE_KEY eKey) const noexcept
+{
+	for (int32_t nCur = nIdx - 1; nCur >= 0; --nCur) {
+		const BufferedKey& oKey = m_aBufferedKeys.peekValue(nCur);
+		if ((oKey.m_eKey == eKey) && isPressOrRelease(oKey.m_eType)) {
+			return (oKey.m_eType == hk::KEY_PRESS); //------------------------------
+		}
+	}
+	return (std::find(m_aSentPressedKeys.begin(), m_aSentPressedKeys.end(), eKey) != m_aSentPressedKeys.end());
+}
+void BtKeyClient::trackSentKey(const BufferedKey& oKey) noexcept
+{
+	if (! isPressOrRelease(oKey.m_eType)) {
+		return; //--------------------------------------------------------------
+	}
+	auto itFind = std::find(m_aSentPressedKeys.begin(), m_aSentPressedKeys.end(), oKey.m_eKey);
+	const bool bPressed = (itFind != m_aSentPressedKeys.end());
+	if (oKey.m_eType == hk::KEY_PRESS) {
+		if (! bPressed) {
+			m_aSentPressedKeys.push_back(oKey.m_eKey);
+		}
+	} else if (bPressed) {
+		m_aSentPressedKeys.erase(itFind);
+	}
+}
+void BtKeyClient::removeBufferedKey(int32_t nIdx) noexcept
+{
+	const int32_t nSize = m_aBufferedKeys.size();
+	assert((nIdx >= 0) && (nIdx < nSize));
+	if (nIdx > 0) {
+		// if the last key of a chord is removed the previous becomes the last
+		BufferedKey& oPrev = m_aBufferedKeys.peekValue(nIdx - 1);
+		if (oPrev.m_bChordNext && ! m_aBufferedKeys.peekValue(nIdx).m_bChordNext) {
+			oPrev.m_bChordNext = false;
+		}
+	}
+	for (int32_t nCur = 0; nCur < nSize; ++nCur) {
+		const BufferedKey oKey = m_aBufferedKeys.read();
+		if (nCur != nIdx) {
+			m_aBufferedKeys.write(oKey);
+		}
+	}
+}
+bool BtKeyClient::mergeBufferedKeys(const BufferedKey& oKey) noexcept
+{
+	const int32_t nSize = m_aBufferedKeys.size();
+	const auto isRedundant = [&](int32_t nIdx, const BufferedKey& oCur)
+	{
+		return isPressOrRelease(oCur.m_eType) && ((oCur.m_eType == hk::KEY_PRESS) == isPressedBefore(nIdx, oCur.m_eKey));
+	};
+	// the new key doesn't change the state of its hardware key
+	if ((oKey.m_eType == hk::KEY_NOOP) || isRedundant(nSize, oKey)) {
+		++m_oSendStats.m_nMergedRedundant;
+		return false; //--------------------------------------------------------
+	}
+	// a buffered key that doesn't change the state of its hardware key
+	for (int32_t nIdx = 0; nIdx < nSize; ++nIdx) {
+		const BufferedKey& oCur = m_aBufferedKeys.peekValue(nIdx);
+		if ((oCur.m_eType == hk::KEY_NOOP) || isRedundant(nIdx, oCur)) {
+			removeBufferedKey(nIdx);
+			++m_oSendStats.m_nMergedRedundant;
+			return true; //-----------------------------------------------------
+		}
+	}
+	// now the buffered keys of a hardware key alternate between press and release,
+	// two consecutive ones cancel each other
+	for (int32_t nIdx = 0; nIdx < nSize - 1; ++nIdx) {
+		const hk::HARDWARE_KEY eKey = m_aBufferedKeys.peekValue(nIdx).m_eKey;
+		for (int32_t nNext = nIdx + 1; nNext < nSize; ++nNext) {
+			if (m_aBufferedKeys.peekValue(nNext).m_eKey == eKey) {
+				removeBufferedKey(nNext);
+				removeBufferedKey(nIdx);
+				++m_oSendStats.m_nMergedPairs;
+				return true; //-------------------------------------------------
+			}
+		}
+	}
+	// the new key cancels the buffered key of the same hardware key
+	for (int32_t nIdx = 0; nIdx < nSize; ++nIdx) {
+		if (m_aBufferedKeys.peekValue(nIdx).m_eKey == oKey.m_eKey) {
+			removeBufferedKey(nIdx);
+			++m_oSendStats.m_nMergedPairs;
+			return false; //----------------------------------------------------
+		}
+	}
+	// all the buffered keys are of different hardware keys, losing a press
+	// is better than losing a release which would leave the key pressed
+	for (int32_t nIdx = 0; nIdx < nSize; ++nIdx) {
+		if (m_aBufferedKeys.peekValue(nIdx).m_eType == hk::KEY_PRESS) {
+			removeBufferedKey(nIdx);
+			++m_oSendStats.m_nDroppedPresses;
+			return true; //-----------------------------------------------------
+		}
+	}
+	if (oKey.m_eType == hk::KEY_PRESS) {
+		++m_oSendStats.m_nDroppedPresses;
+		return false; //--------------------------------------------------------
+	}
+	// only releases: forget the oldest
+	removeBufferedKey(0);
+	++m_oSendStats.m_nDroppedKeys;
+	return true;
+}
+bool BtKeyClient::encodePacketsV1() noexcept
+{
+	bool bRemove = false;
+	KeyPacket* p0Packets = reinterpret_cast<KeyPacket*>(m_aSendRecords);
+	int32_t nTotPackets = 0;
 	while (! m_aBufferedKeys.isEmpty()) {
-		const auto oPair = m_aBufferedKeys.read();
-		hk::KEY_INPUT_TYPE eType = oPair.first;
-		hk::HARDWARE_KEY eKey = oPair.second;
-//std::cout << "BtKeyClient::sendPacketsFromBufferedKeys  eType=" << static_cast<int32_t>(eType) << "  eKey=" << static_cast<int32_t>(eKey) << '\n';
-		auto& oKeyPacket = m_aPackets[m_nTotPackets];
+		const BufferedKey oKey = m_aBufferedKeys.read();
+		trackSentKey(oKey);
+		hk::KEY_INPUT_TYPE eType = oKey.m_eType;
+		hk::HARDWARE_KEY eKey = oKey.m_eKey;
+//std::cout << "BtKeyClient::encodePacketsV1  eType=" << static_cast<int32_t>(eType) << "  eKey=" << static_cast<int32_t>(eKey) << '\n';
+		auto& oKeyPacket = p0Packets[nTotPackets];
 		oKeyPacket.m_nMagic1 = s_nMagic1; // '7';
 		oKeyPacket.m_nMagic2 = s_nMagic2; // 'A';
+		oKeyPacket.m_nKeyType = 0;
+		oKeyPacket.m_nHardwareKey = 0;
 		if (eType == hk::KEY_REMOVE_DEVICE) {
 			oKeyPacket.m_nCmd = PACKET_CMD_REMOVE_DEVICE;
-			eNewState = STATE_REMOVING;
+			bRemove = true;
 		} else if (eType == hk::KEY_NOOP) {
 			oKeyPacket.m_nCmd = PACKET_CMD_NOOP;
 		} else {
@@ -260,10 +708,125 @@ void BtKeyClient::sendPacketsFromBufferedKeys() noexcept
 			oKeyPacket.m_nKeyType = static_cast<char>(eType);
 			oKeyPacket.m_nHardwareKey = static_cast<int32_t>(eKey);
 		}
-		++m_nTotPackets;
+		++nTotPackets;
+	}
+	m_aSendIov[0].iov_base = m_aSendRecords;
+	m_aSendIov[0].iov_len = nTotPackets * sizeof(KeyPacket);
+	m_oSendMsg.msg_iovlen = 1;
+	return bRemove;
+}
+bool BtKeyClient::encodePacketsV2() noexcept
+{
+	assert(m_aBufferedKeys.size() <= 255);
+	bool bRemove = false;
+	int32_t nPos = 0;
+	int32_t nTotRecords = 0;
+	int64_t nPrevCaptureTimeUsec = -1;
+	uint32_t nBaseTimeUsec = 0;
+	while (! m_aBufferedKeys.isEmpty()) {
+		const BufferedKey oKey = m_aBufferedKeys.read();
+		trackSentKey(oKey);
+		if (nPrevCaptureTimeUsec < 0) {
+			nBaseTimeUsec = static_cast<uint32_t>(oKey.m_nCaptureTimeUsec);
+			nPrevCaptureTimeUsec = oKey.m_nCaptureTimeUsec;
+		}
+		// the monotonic clock doesn't go back but be safe
+		const int64_t nDeltaUsec = std::max<int64_t>(0, oKey.m_nCaptureTimeUsec - nPrevCaptureTimeUsec);
+		nPrevCaptureTimeUsec = oKey.m_nCaptureTimeUsec;
+		++nTotRecords;
+		if (oKey.m_bChordNext && ! m_aBufferedKeys.isEmpty()) {
+			static_assert(s_nSendBufferSize <= std::min(PACKET_V2_MAX_CHORD_KEYS, 127), "");
+			m_aSendRecords[nPos] = static_cast<uint8_t>(PACKET_CMD_CHORD << 4);
+			++nPos;
+			// the number of keys (single byte varint) is set when known
+			const int32_t nCountPos = nPos;
+			++nPos;
+			nPos += packetWriteVarint(m_aSendRecords + nPos, static_cast<uint32_t>(std::min<int64_t>(nDeltaUsec, UINT32_MAX)));
+			int32_t nChordKeys = 0;
+			BufferedKey oChordKey = oKey;
+			while (true) {
+				const uint32_t nValue = (static_cast<uint32_t>(oChordKey.m_eKey) << 2) | static_cast<uint32_t>(oChordKey.m_eType);
+				nPos += packetWriteVarint(m_aSendRecords + nPos, nValue);
+				++nChordKeys;
+				if ((! oChordKey.m_bChordNext) || m_aBufferedKeys.isEmpty()) {
+					break; // while ------
+				}
+				oChordKey = m_aBufferedKeys.read();
+				trackSentKey(oChordKey);
+			}
+			m_aSendRecords[nCountPos] = static_cast<uint8_t>(nChordKeys);
+			continue; // while ------
+		}
+		int32_t nCmd = PACKET_CMD_KEY;
+		int32_t nKeyType = 0;
+		uint32_t nHardwareKey = 0;
+		if (oKey.m_eType == hk::KEY_REMOVE_DEVICE) {
+			nCmd = PACKET_CMD_REMOVE_DEVICE;
+			bRemove = true;
+		} else if (oKey.m_eType == hk::KEY_NOOP) {
+			nCmd = PACKET_CMD_NOOP;
+		} else {
+			nKeyType = static_cast<int32_t>(oKey.m_eType);
+			nHardwareKey = static_cast<uint32_t>(oKey.m_eKey);
+		}
+		assert((nKeyType >= 0) && (nKeyType <= 0x0F));
+		m_aSendRecords[nPos] = static_cast<uint8_t>((nCmd << 4) | nKeyType);
+		++nPos;
+		nPos += packetWriteVarint(m_aSendRecords + nPos, nHardwareKey);
+		nPos += packetWriteVarint(m_aSendRecords + nPos, static_cast<uint32_t>(std::min<int64_t>(nDeltaUsec, UINT32_MAX)));
+	}
+	KeyPacketV2Header& oHeader = m_oSendHeader;
+	oHeader.m_nMagic1 = s_nMagic1; // '7';
+	oHeader.m_nMagic2 = s_nMagic2V2; // 'B';
+	oHeader.m_nCount = static_cast<uint8_t>(nTotRecords);
+	oHeader.m_nFlags = 0;
+	oHeader.m_nSequence = htobl(m_nSequence);
+	oHeader.m_nBaseTimeUsec = htobl(nBaseTimeUsec);
+	++m_nSequence;
+	m_aSendIov[0].iov_base = &m_oSendHeader;
+	m_aSendIov[0].iov_len = sizeof(KeyPacketV2Header);
+	m_aSendIov[1].iov_base = m_aSendRecords;
+	m_aSendIov[1].iov_len = nPos;
+	m_oSendMsg.msg_iovlen = 2;
+	return bRemove;
+}
+ssize_t BtKeyClient::sendEncoded() noexcept
+{
+	return ::sendmsg(m_nClientFD, &m_oSendMsg, 0);
+}
+void BtKeyClient::countSentEncoded() noexcept
+{
+	++m_oSendStats.m_nDatagrams;
+	m_oSendStats.m_nKeys += m_nSendKeys;
+}
+void BtKeyClient::sendPacketsFromBufferedKeys() noexcept
+{
+	const auto eOldState = m_eState;
+
+	assert(! m_aBufferedKeys.isEmpty());
+	// the waiting keys are sent now
+	m_oScheduler.cancel(m_nCoalesceTimer);
+	const bool bRemoveQueued = (m_aBufferedKeys.peekValue(m_aBufferedKeys.size() - 1).m_eType == hk::KEY_REMOVE_DEVICE);
+	if ((! bRemoveQueued) && ! hasCredit()) {
+		// wait for the server to acknowledge, the keys stay buffered
+		if (! m_bWaitingForCredit) {
+			m_bWaitingForCredit = true;
+			++m_oSendStats.m_nCreditStalls;
+			m_oScheduler.schedule(m_nSendTimer, DeadlineScheduler::getNowUsec() + m_nTimeoutSend * INT64_C(1000));
+		}
+		m_eState = STATE_SENDING;
+		if (eOldState != m_eState) {
+			m_oStateChangedSignal();
+		}
+		return; //--------------------------------------------------------------
 	}
-//std::cout << "BtKeyClient::sendPacketsFromBufferedKeys  m_nTotPackets=" << m_nTotPackets << '\n';
-	const auto nRes = ::send(m_nClientFD, m_aPackets, sizeof(KeyPacket) * m_nTotPackets, 0);
+	m_bWaitingForCredit = false;
+
+	const int32_t nTotBufferedKeys = m_aBufferedKeys.size();
+	const bool bRemove = ((m_nProtocolVersion >= PACKET_PROTOCOL_VERSION_2) ? encodePacketsV2() : encodePacketsV1());
+	m_nSendKeys = nTotBufferedKeys - m_aBufferedKeys.size();
+	const STATE eNewState = (bRemove ? STATE_REMOVING : STATE_SENDING);
+	const auto nRes = sendEncoded();
 	if (nRes < 0) {
 #if (EAGAIN == EWOULDBLOCK)
 		if (errno == EAGAIN) {
@@ -273,9 +836,9 @@ void BtKeyClient::sendPacketsFromBufferedKeys() noexcept
 			if (!m_refPendingSend) {
 				m_refPendingSend = Glib::RefPtr<PendingWriteSource>{ new PendingWriteSource(m_nClientFD) };
 				m_refPendingSend->connect(sigc::mem_fun(this, &BtKeyClient::doPendingSend));
-				m_refPendingSend->attach();
+				m_refPendingSend->attach(m_refContext);
 			}
-			m_nStartedSendingTime = m_refIntervalTimeout->getElapsed();
+			m_oScheduler.schedule(m_nSendTimer, DeadlineScheduler::getNowUsec() + m_nTimeoutSend * INT64_C(1000));
 			m_eState = eNewState;
 			if (eOldState != m_eState) {
 				m_oStateChangedSignal();
@@ -285,14 +848,16 @@ void BtKeyClient::sendPacketsFromBufferedKeys() noexcept
 			return; //----------------------------------------------------------
 		}
 	} else {
-		assert(m_refIntervalTimeout);
-		m_nLastSentTime = m_refIntervalTimeout->getElapsed();
+		countSentEncoded();
+		m_nLastSentTime = DeadlineScheduler::getNowUsec();
 		m_sLastError.clear();
 		if (eNewState != STATE_SENDING) {
 			// removing or disconnecting
 			disconnectInternal("");
 			return; //----------------------------------------------------------
 		}
+		m_oScheduler.cancel(m_nSendTimer);
+		scheduleKeepAlive();
 		m_eState = STATE_CONNECTED;
 		if (eOldState != m_eState) {
 			m_oStateChangedSignal();
@@ -301,6 +866,13 @@ void BtKeyClient::sendPacketsFromBufferedKeys() noexcept
 }
 void BtKeyClient::sendRemoveToServer() noexcept
 {
+	if (m_refSenderThread) {
+		if (! m_refSenderThread->sendRemoveToServer()) {
+			m_sLastError = "Sender thread queue full";
+			m_oErrorSignal();
+		}
+		return; //--------------------------------------------------------------
+	}
 	if ((m_eState == STATE_CONNECTING) || (m_eState == STATE_DISCONNECTED)) {
 		// this command only works when connected
 		return;
@@ -308,7 +880,7 @@ void BtKeyClient::sendRemoveToServer() noexcept
 	if (m_eState == STATE_SENDING) {
 		m_aBufferedKeys.clear();
 	}
-	m_aBufferedKeys.write(std::make_pair(hk::KEY_REMOVE_DEVICE, hk::HK_NULL));
+	m_aBufferedKeys.write(BufferedKey{hk::KEY_REMOVE_DEVICE, hk::HK_NULL, g_get_monotonic_time(), false});
 	sendPacketsFromBufferedKeys();
 }
 //void BtKeyClient::sendDisconnectToServer()
@@ -320,35 +892,41 @@ void BtKeyClient::sendRemoveToServer() noexcept
 //	m_aBufferedKeys.write(std::make_pair(hk::KEY_DISCONNECT_DEVICE, hk::HK_NULL));
 //	sendPacketsFromBufferedKeys();
 //}
-bool BtKeyClient::doIntervalTimeout() noexcept
+void BtKeyClient::doConnectTimeout() noexcept
 {
-//std::cout << "BtKeyClient::doIntervalTimeout()  m_eState=" << static_cast<int32_t>(m_eState) << '\n';
-	assert(m_refIntervalTimeout);
-	const bool bContinue = true;
-	const int64_t nElapsed = m_refIntervalTimeout->getElapsed();
 	if (m_eState == STATE_CONNECTING) {
-		if (nElapsed - m_nStartedConnectingTime > m_nTimeoutConnect) {
-			// timed out
-			disconnectInternal("Connecting timed out");
-		}
-	} else if (m_eState == STATE_CONNECTED) {
-		if ((m_nNoopAfter > 0) && (nElapsed - m_nLastSentTime > std::max(m_nNoopAfter, m_nTimeoutSend * 2))) {
-			assert(m_aBufferedKeys.isEmpty());
-			m_aBufferedKeys.write(std::make_pair(hk::KEY_NOOP, hk::HK_NULL));
-			sendPacketsFromBufferedKeys();
-		}
-	} else if (m_eState == STATE_SENDING) {
-		if (nElapsed - m_nStartedSendingTime > m_nTimeoutSend) {
-			// timed out
-			m_sLastError = "Sending timed out";
-			m_eState = STATE_CONNECTED;
-			m_oErrorSignal();
-			m_oStateChangedSignal();
-		}
-	} else {
-		// in the meantime disconnectFromServer was called?
+		disconnectInternal("Connecting timed out");
 	}
-	return bContinue;
+}
+void BtKeyClient::doSendTimeout() noexcept
+{
+//std::cout << "BtKeyClient::doSendTimeout()  m_eState=" << static_cast<int32_t>(m_eState) << '\n';
+	if (m_eState != STATE_SENDING) {
+		return; //--------------------------------------------------------------
+	}
+	if (m_bWaitingForCredit) {
+		// the acknowledgements were probably lost, assume all datagrams arrived
+		m_nAckedSequence = m_nSequence;
+		++m_oSendStats.m_nCreditTimeouts;
+		sendPacketsFromBufferedKeys();
+		return; //--------------------------------------------------------------
+	}
+	m_sLastError = "Sending timed out";
+	m_eState = STATE_CONNECTED;
+	scheduleKeepAlive();
+	m_oErrorSignal();
+	m_oStateChangedSignal();
+}
+void BtKeyClient::doKeepAliveTimeout() noexcept
+{
+	if (m_eState != STATE_CONNECTED) {
+		// rescheduled when back to connected
+		return; //--------------------------------------------------------------
+	}
+	if (m_aBufferedKeys.isEmpty()) {
+		m_aBufferedKeys.write(BufferedKey{hk::KEY_NOOP, hk::HK_NULL, g_get_monotonic_time(), false});
+	} // else coalescing keys: send them instead
+	sendPacketsFromBufferedKeys();
 }
 
 } // namespace stmi
@@ -22,22 +22,31 @@
 #define STMI_BT_KEY_CLIENT_H
 
 #include "btclientsources.h"
+#include "btclienttransport.h"
 #include "circularbuffer.h"
+#include "deadlinescheduler.h"
 #include "hardwarekey.h"
 #include "keypacket.h"
 
 #include <sigc++/signal.h>
 
+#include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <bluetooth/bluetooth.h>
 
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdint.h>
 
 namespace stmi
 {
 
+class BtKeySenderThread;
+struct BtKeySenderEvent;
+
 class BtKeyClient
 {
 public:
@@ -47,15 +56,79 @@ public:
 	/** Constructor.
 	 * @param nTimeoutConnect The timeout in milliseconds for connecting to server.
 	 * @param nTimeoutSend The timeout in milliseconds for sending a packet.
-	 * @param nInterval The interval on which timeouts are checked.
 	 * @param nNoopAfter The time in milliseconds without activity after which a NOOP packet is sent. Zero means never.
+	 * @param nMaxProtocolVersion The highest protocol version negotiated with the server. Must be from 1 to 3.
+	 */
+	BtKeyClient(int32_t nTimeoutConnect, int32_t nTimeoutSend, int32_t nNoopAfter, int32_t nMaxProtocolVersion) noexcept;
+	/** Constructor.
+	 * @param nTimeoutConnect The timeout in milliseconds for connecting to server.
+	 * @param nTimeoutSend The timeout in milliseconds for sending a packet.
+	 * @param nNoopAfter The time in milliseconds without activity after which a NOOP packet is sent. Zero means never.
+	 * @param nMaxProtocolVersion The highest protocol version negotiated with the server. Must be from 1 to 3.
+	 * @param refContext The main context of the thread using the instance. If null the default.
+	 */
+	BtKeyClient(int32_t nTimeoutConnect, int32_t nTimeoutSend, int32_t nNoopAfter, int32_t nMaxProtocolVersion
+				, const Glib::RefPtr<Glib::MainContext>& refContext) noexcept;
+	/** Destructor.
+	 * Stops the sender thread if started.
 	 */
-	BtKeyClient(int32_t nTimeoutConnect, int32_t nTimeoutSend, int32_t nInterval, int32_t nNoopAfter) noexcept;
+	~BtKeyClient() noexcept;
+
+	/** Moves the connection to a dedicated sender thread.
+	 * The thread owns the socket, the state machine and the timers, so that
+	 * neither the keys nor the keep alive and flow control packets wait for
+	 * the drawing of the main loop. The methods of this instance, still to be
+	 * called from the main thread, pass the commands and keys to the thread
+	 * through a lock-free queue. The state, the error, the protocol version,
+	 * the applied socket options and the send counters are updated (and the
+	 * signals emitted) by the default main context when the thread reports
+	 * a change; the send counters can therefore lag behind.
+	 *
+	 * Must be called while disconnected. The socket options and the coalescing
+	 * window must be set before.
+	 * @param sError Set to the error if false is returned.
+	 * @return Whether the thread was started.
+	 */
+	bool startSenderThread(std::string& sError) noexcept;
+	/** Whether the sender thread was started.
+	 * @return Whether the connection is handled by the sender thread.
+	 */
+	bool hasSenderThread() const noexcept { return !!m_refSenderThread; }
 
 	int32_t getTimeoutConnect() const noexcept { return m_nTimeoutConnect; }
 	int32_t getTimeoutSend() const noexcept { return m_nTimeoutSend; }
-	int32_t getInterval() const noexcept { return m_nInterval; }
 	int32_t getL2capPort() const noexcept { return m_nL2capPort; }
+	/** The protocol version used with the currently connected server.
+	 * It is 1 until the server answers the handshake.
+	 * @return The version.
+	 */
+	int32_t getProtocolVersion() const noexcept { return m_nProtocolVersion; }
+	/** Whether the server controls the flow of the datagrams (protocol v3).
+	 * If true the client doesn't send more datagrams than the credit granted by
+	 * the server's acknowledgements and keeps the keys queued meanwhile.
+	 * @return Whether flow controlled.
+	 */
+	bool isFlowControlled() const noexcept { return (m_nProtocolVersion >= PACKET_PROTOCOL_VERSION_3); }
+	/** Sets the options of the sockets of the following connections.
+	 * @param oTuning The options.
+	 */
+	void setSocketTuning(const ClientSocketTuning& oTuning) noexcept { m_oSocketTuning = oTuning; }
+	const ClientSocketTuning& getSocketTuning() const noexcept { return m_oSocketTuning; }
+	/** The options of the socket as reported by the kernel once connected.
+	 * The L2CAP MTUs are the negotiated ones.
+	 * @return The options. All 0 if never connected.
+	 */
+	const ClientSocketTuning& getAppliedSocketTuning() const noexcept { return m_oAppliedSocketTuning; }
+	/** Sets the coalescing window.
+	 * If positive, a key sent while connected isn't sent immediately but waits for
+	 * other keys at most the given time, measured from the capture of the first
+	 * waiting key, so that they are all sent in one datagram. The keys are also sent
+	 * as soon as the send buffer is full or another packet has to be sent.
+	 * The deadline is kept by a microsecond precision timer.
+	 * @param nWindowUsec The maximum delay in microseconds. 0 means keys are sent immediately.
+	 */
+	void setCoalesceWindow(int32_t nWindowUsec) noexcept;
+	int32_t getCoalesceWindow() const noexcept { return m_nCoalesceWindowUsec; }
 
 	// state machine states
 	enum STATE {
@@ -73,46 +146,172 @@ public:
 	 * @param oBtAddr The address.
 	 */
 	void connectToServer(const bdaddr_t& oBtAddr, int32_t nL2capPort) noexcept;
+	/** Connect to a BtKey server through the given transport.
+	 * Example: UnixClientTransport to connect to a local server without bluetooth.
+	 * @param refTransport The transport. Cannot be null.
+	 */
+	void connectToServer(std::unique_ptr<ClientTransport> refTransport) noexcept;
 	void disconnectFromServer() noexcept;
 	void sendRemoveToServer() noexcept;
 
 	void sendKeyToServer(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey) noexcept;
+	/** Sends a key captured earlier.
+	 * @param eType The type.
+	 * @param eKey The key.
+	 * @param nCaptureTimeUsec The g_get_monotonic_time() the key was captured.
+	 */
+	void sendKeyToServer(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey, int64_t nCaptureTimeUsec) noexcept;
+	/** Sends keys pressed or released at the same time.
+	 * With protocol v2 they are sent as a chord that the server delivers together
+	 * with the same time. Keys beyond the send buffer size are dropped.
+	 * @param aKeys The keys. The type must be KEY_PRESS, KEY_RELEASE or KEY_RELEASE_CANCEL.
+	 */
+	void sendKeysToServer(const std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> >& aKeys) noexcept;
+	/** Sends keys pressed or released at the same time captured earlier.
+	 * @param aKeys The keys. See sendKeysToServer(const std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> >&).
+	 * @param nCaptureTimeUsec The g_get_monotonic_time() the keys were captured.
+	 */
+	void sendKeysToServer(const std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> >& aKeys
+						, int64_t nCaptureTimeUsec) noexcept;
+
+	/** The counters of the send queue.
+	 * When the queue is full (because sending blocks or the credit is exhausted)
+	 * room is made by merging keys in a way that keeps the final state of each
+	 * key: first the redundant keys (a press of an already pressed key or a release
+	 * of a released key) are dropped, then a press and the following release of the
+	 * same key (or vice versa) cancel each other, then the oldest press is dropped.
+	 * Releases are only dropped (m_nDroppedKeys) if the queue is full of releases
+	 * of different keys or if the queue to the sender thread is full.
+	 */
+	struct SendStats
+	{
+		int64_t m_nMergedRedundant = 0; /**< The redundant keys dropped. */
+		int64_t m_nMergedPairs = 0; /**< The pairs of keys that canceled each other. */
+		int64_t m_nDroppedPresses = 0; /**< The presses dropped. */
+		int64_t m_nDroppedKeys = 0; /**< The other keys dropped. Could leave a key pressed on the server. */
+		int64_t m_nAcks = 0; /**< The acknowledgements received (v3). */
+		int64_t m_nCreditStalls = 0; /**< The times sending waited for credit (v3). */
+		int64_t m_nCreditTimeouts = 0; /**< The times the credit was reset after the send timeout (v3). */
+		int64_t m_nDatagrams = 0; /**< The datagrams sent. */
+		int64_t m_nKeys = 0; /**< The keys (including noops) sent. Divided by m_nDatagrams shows the coalescing. */
+	};
+	/** The send queue counters.
+	 * They are cumulated over all connections.
+	 * @return The counters.
+	 */
+	const SendStats& getSendStats() const noexcept { return m_oSendStats; }
 
 	sigc::signal<void> m_oStateChangedSignal;
 	sigc::signal<void> m_oErrorSignal;
 
-	static constexpr int32_t s_nDefaultInterval = 500;
 	static constexpr int32_t s_nDefaultTimeoutConnect = 10 * 1000;
 	static constexpr int32_t s_nDefaultTimeoutSend = 1 * 1000;
 	static constexpr int32_t s_nDefaultNoopAfter = 5 * 1000;
+	static constexpr int32_t s_nDefaultMaxProtocolVersion = PACKET_PROTOCOL_VERSION_3;
 private:
 	bool doPendingConnect(int32_t nSourceId, bool bError) noexcept;
 	bool doPendingSend(int32_t nSourceId, bool bError) noexcept;
-	bool doIntervalTimeout() noexcept;
+	bool doPendingRead(int32_t nSourceId, bool bError) noexcept;
+	// The timers
+	void doConnectTimeout() noexcept;
+	void doSendTimeout() noexcept;
+	void doKeepAliveTimeout() noexcept;
+	void doCoalesceTimeout() noexcept;
+	void scheduleKeepAlive() noexcept;
 	//
 	void disconnectInternal(const std::string& sErrorString) noexcept;
 	void sendPacketsFromBufferedKeys() noexcept;
+	// Sends the buffered keys now or when the coalescing window expires
+	void sendOrCoalesceBufferedKeys() noexcept;
+	// Fills m_aSendRecords (and m_oSendHeader) from m_aBufferedKeys and sets
+	// m_oSendMsg to them, returns whether a remove command was added
+	bool encodePacketsV1() noexcept;
+	bool encodePacketsV2() noexcept;
+	// Sends the datagram encoded in m_oSendMsg, the result of sendmsg()
+	ssize_t sendEncoded() noexcept;
+	// Adds the datagram encoded in m_oSendMsg to the counters once it was sent
+	void countSentEncoded() noexcept;
+	void setConnected() noexcept;
+	void sendHello() noexcept;
+	// Creates m_refPendingRead if not already
+	void startReading() noexcept;
+	void checkHelloAnswer() noexcept;
+	// Returns whether the key can be buffered
+	bool prepareBufferKey() noexcept;
+	void startFlowControl() noexcept;
+	// Whether a datagram can be sent now
+	bool hasCredit() const noexcept;
+	void handleAck(const KeyPacketAck& oAck) noexcept;
+	// Main thread, a change reported by the sender thread
+	void onSenderEvent(const BtKeySenderEvent& oEvent) noexcept;
+	void dropSenderKeys(int32_t nTotKeys) noexcept;
 private:
+	struct BufferedKey
+	{
+		hk::KEY_INPUT_TYPE m_eType;
+		hk::HARDWARE_KEY m_eKey;
+		int64_t m_nCaptureTimeUsec; // Monotonic clock
+		bool m_bChordNext; // Whether the next key is part of the same chord
+	};
+	// Adds a key to m_aBufferedKeys, merging the buffered keys if full
+	void bufferKey(const BufferedKey& oKey) noexcept;
+	// Makes room in the full m_aBufferedKeys for oKey, returns false if oKey must be dropped
+	bool mergeBufferedKeys(const BufferedKey& oKey) noexcept;
+	void removeBufferedKey(int32_t nIdx) noexcept;
+	// Whether eKey is pressed after the first nIdx buffered keys are sent
+	bool isPressedBefore(int32_t nIdx, hk::HARDWARE_KEY eKey) const noexcept;
+	// Updates m_aSentPressedKeys with a key that is sent
+	void trackSentKey(const BufferedKey& oKey) noexcept;
 	const int32_t m_nTimeoutConnect;
 	const int32_t m_nTimeoutSend;
-	const int32_t m_nInterval;
 	const int32_t m_nNoopAfter;
+	const int32_t m_nMaxProtocolVersion;
 	STATE m_eState;
 	std::string m_sLastError;
 	int32_t m_nClientFD; // The socket
 	bdaddr_t m_oBtAddr; // The address of the server
 	int32_t m_nL2capPort; // The port of the server
-	int64_t m_nStartedConnectingTime;
-	int64_t m_nStartedSendingTime;
-	CircularBuffer<std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY>> m_aBufferedKeys;
-	int64_t m_nLastSentTime;
+	std::unique_ptr<ClientTransport> m_refTransport; // The transport of the current connection
+	ClientSocketTuning m_oSocketTuning;
+	ClientSocketTuning m_oAppliedSocketTuning; // Of the last connection
+	CircularBuffer<BufferedKey> m_aBufferedKeys;
+	int64_t m_nLastSentTime; // Monotonic clock microseconds
 	static constexpr int32_t s_nSendBufferSize = 20;
-	KeyPacket m_aPackets[s_nSendBufferSize] __attribute__ ((aligned(__alignof__(KeyPacket))));
-	int32_t m_nTotPackets; // number of packets in m_aPackets
+	static constexpr int32_t s_nSendRecordsBytes = s_nSendBufferSize * PACKET_V2_MAX_RECORD_SIZE;
+	static_assert(s_nSendRecordsBytes >= s_nSendBufferSize * static_cast<int32_t>(sizeof(KeyPacket)), "");
+	// The encoded datagram being sent: the v2 header and the records (or the v1 packets)
+	// gathered by sendmsg(). A send retried after EAGAIN reuses it as is.
+	KeyPacketV2Header m_oSendHeader;
+	uint8_t m_aSendRecords[s_nSendRecordsBytes] __attribute__ ((aligned(__alignof__(KeyPacket))));
+	struct ::iovec m_aSendIov[2];
+	struct ::msghdr m_oSendMsg;
+	int32_t m_nSendKeys; // The number of keys encoded in m_oSendMsg
+	int32_t m_nProtocolVersion; // The version used with the connected server
+	bool m_bHelloPending; // Whether the handshake was sent but not answered yet
+	uint32_t m_nSequence; // The sequence number of the next v2 datagram
+	// Flow control (v3)
+	uint32_t m_nAckedSequence; // The sequence number of the first unacknowledged datagram
+	int32_t m_nCredit; // The number of datagrams that can be sent from m_nAckedSequence on
+	bool m_bWaitingForCredit; // Whether the buffered keys wait for an acknowledgement
+	std::vector<hk::HARDWARE_KEY> m_aSentPressedKeys; // The keys pressed as far as the server knows
+	SendStats m_oSendStats;
+	int32_t m_nCoalesceWindowUsec;
 
+	Glib::RefPtr<Glib::MainContext> m_refContext; // Null if the default
 	Glib::RefPtr<PendingWriteSource> m_refPendingConnect;
 	Glib::RefPtr<PendingWriteSource> m_refPendingSend;
-	Glib::RefPtr<IntervalTimeoutSource> m_refIntervalTimeout;
+	Glib::RefPtr<PendingReadSource> m_refPendingRead; // Hello answer and acks (v3)
+
+	// Only the next deadline wakes up the main loop
+	DeadlineScheduler m_oScheduler;
+	int32_t m_nConnectTimer;
+	int32_t m_nSendTimer;
+	int32_t m_nKeepAliveTimer;
+	int32_t m_nCoalesceTimer;
+
+	// If set, the other fields only mirror the state of the sender thread's client
+	std::unique_ptr<BtKeySenderThread> m_refSenderThread;
+	int64_t m_nSenderDroppedKeys; // The keys that didn't fit in the queue to the sender thread
 private:
 	BtKeyClient(const BtKeyClient& oSource) = delete;
 	BtKeyClient& operator=(const BtKeyClient& oSource) = delete;
@@ -0,0 +1,335 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   btkeysender.cc
+ */
+
+#include "btkeysender.h"
+#include "btkeyservers.h"
+
+#include <cassert>
+#include <system_error>
+#include <utility>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace stmi
+{
+
+BtKeySenderThread::BtKeySenderThread(int32_t nTimeoutConnect, int32_t nTimeoutSend, int32_t nNoopAfter, int32_t nMaxProtocolVersion
+									, const ClientSocketTuning& oSocketTuning, int32_t nCoalesceWindowUsec) noexcept
+: m_nTimeoutConnect(nTimeoutConnect)
+, m_nTimeoutSend(nTimeoutSend)
+, m_nNoopAfter(nNoopAfter)
+, m_nMaxProtocolVersion(nMaxProtocolVersion)
+, m_oSocketTuning(oSocketTuning)
+, m_nCoalesceWindowUsec(nCoalesceWindowUsec)
+, m_oCommands(s_nCommandsCapacity)
+, m_nCommandsFD(-1)
+, m_oEvents(s_nEventsCapacity)
+, m_nEventsFD(-1)
+, m_bStopRequested(false)
+, m_p0Worker(nullptr)
+, m_nChordCaptureTimeUsec(0)
+{
+}
+BtKeySenderThread::~BtKeySenderThread() noexcept
+{
+	if (m_oThread.joinable()) {
+		m_bStopRequested.store(true, std::memory_order_release);
+		wakeUp(m_nCommandsFD);
+		m_oThread.join();
+	}
+	if (m_refPendingEvents) {
+		m_refPendingEvents->destroy();
+		m_refPendingEvents.reset();
+	}
+	if (m_nEventsFD >= 0) {
+		::close(m_nEventsFD);
+	}
+	if (m_nCommandsFD >= 0) {
+		::close(m_nCommandsFD);
+	}
+}
+bool BtKeySenderThread::start(const sigc::slot<void, const BtKeySenderEvent&>& oEventSlot, std::string& sError) noexcept
+{
+	assert(! m_oThread.joinable());
+	m_nCommandsFD = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_nCommandsFD < 0) {
+		sError = std::string("Sender thread eventfd failed: ") + strerror(errno);
+		return false; //--------------------------------------------------------
+	}
+	m_nEventsFD = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_nEventsFD < 0) {
+		sError = std::string("Sender thread eventfd failed: ") + strerror(errno);
+		return false; //--------------------------------------------------------
+	}
+	m_oEventSlot = oEventSlot;
+	m_refPendingEvents = Glib::RefPtr<PendingReadSource>{ new PendingReadSource(m_nEventsFD) };
+	m_refPendingEvents->connect(sigc::mem_fun(this, &BtKeySenderThread::doPendingEvents));
+	m_refPendingEvents->attach();
+
+	m_refContext = Glib::MainContext::create();
+	m_refLoop = Glib::MainLoop::create(m_refContext);
+	try {
+		m_oThread = std::thread(&BtKeySenderThread::run, this);
+	} catch (const std::system_error& oErr) {
+		m_refPendingEvents->destroy();
+		m_refPendingEvents.reset();
+		sError = std::string("Couldn't start sender thread: ") + oErr.what();
+		return false; //--------------------------------------------------------
+	}
+	return true;
+}
+void BtKeySenderThread::wakeUp(int32_t nEventFD) noexcept
+{
+	const uint64_t nOne = 1;
+	const auto nRes = ::write(nEventFD, &nOne, sizeof(nOne));
+	// only fails if the counter overflows, the reader is woken up anyway
+	static_cast<void>(nRes);
+}
+void BtKeySenderThread::drainWakeUps(int32_t nEventFD) noexcept
+{
+	uint64_t nCount;
+	const auto nRes = ::read(nEventFD, &nCount, sizeof(nCount));
+	// fails with EAGAIN if already drained
+	static_cast<void>(nRes);
+}
+
+bool BtKeySenderThread::pushCommand(const Command& oCommand) noexcept
+{
+	assert(m_oThread.joinable());
+	if (! m_oCommands.push(oCommand)) {
+		return false; //--------------------------------------------------------
+	}
+	wakeUp(m_nCommandsFD);
+	return true;
+}
+bool BtKeySenderThread::connectToServer(const bdaddr_t& oBtAddr, int32_t nL2capPort) noexcept
+{
+	Command oCommand;
+	oCommand.m_eCmd = CMD_CONNECT;
+	oCommand.m_oBtAddr = BtKeyServers::getAddrCopy(oBtAddr);
+	oCommand.m_nL2capPort = nL2capPort;
+	return pushCommand(oCommand);
+}
+bool BtKeySenderThread::connectToServer(std::unique_ptr<ClientTransport> refTransport) noexcept
+{
+	assert(refTransport);
+	Command oCommand;
+	oCommand.m_eCmd = CMD_CONNECT_TRANSPORT;
+	oCommand.m_p0Transport = refTransport.get();
+	if (! pushCommand(oCommand)) {
+		return false; //--------------------------------------------------------
+	}
+	// now owned by the command
+	refTransport.release();
+	return true;
+}
+bool BtKeySenderThread::disconnectFromServer() noexcept
+{
+	Command oCommand;
+	oCommand.m_eCmd = CMD_DISCONNECT;
+	return pushCommand(oCommand);
+}
+bool BtKeySenderThread::sendRemoveToServer() noexcept
+{
+	Command oCommand;
+	oCommand.m_eCmd = CMD_REMOVE;
+	return pushCommand(oCommand);
+}
+bool BtKeySenderThread::sendKeyToServer(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey, int64_t nCaptureTimeUsec) noexcept
+{
+	Command oCommand;
+	oCommand.m_eCmd = CMD_KEY;
+	oCommand.m_eType = eType;
+	oCommand.m_eKey = eKey;
+	oCommand.m_nCaptureTimeUsec = nCaptureTimeUsec;
+	return pushCommand(oCommand);
+}
+bool BtKeySenderThread::sendKeysToServer(const std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> >& aKeys
+										, int64_t nCaptureTimeUsec) noexcept
+{
+	assert(m_oThread.joinable());
+	assert(! aKeys.empty());
+	const int32_t nTotKeys = static_cast<int32_t>(aKeys.size());
+	if (m_oCommands.freeSlots() < nTotKeys) {
+		return false; //--------------------------------------------------------
+	}
+	Command oCommand;
+	oCommand.m_eCmd = CMD_KEY;
+	oCommand.m_nCaptureTimeUsec = nCaptureTimeUsec;
+	for (int32_t nIdx = 0; nIdx < nTotKeys; ++nIdx) {
+		oCommand.m_eType = aKeys[nIdx].first;
+		oCommand.m_eKey = aKeys[nIdx].second;
+		oCommand.m_bChordNext = (nIdx + 1 < nTotKeys);
+		// room checked above
+		m_oCommands.push(oCommand);
+	}
+	// once per chord
+	wakeUp(m_nCommandsFD);
+	return true;
+}
+bool BtKeySenderThread::doPendingEvents(int32_t nSourceId, bool /*bError*/) noexcept
+{
+	const bool bContinue = true;
+
+	if (!m_refPendingEvents) {
+		return ! bContinue; //--------------------------------------------------
+	}
+	if (nSourceId != m_refPendingEvents->getSourceId()) {
+		return ! bContinue; //--------------------------------------------------
+	}
+	drainWakeUps(m_nEventsFD);
+	BtKeySenderEvent oEvent;
+	while (m_oEvents.pop(oEvent)) {
+		m_oEventSlot(oEvent);
+	}
+	return bContinue;
+}
+
+void BtKeySenderThread::run() noexcept
+{
+	m_refContext->push_thread_default();
+	{
+		BtKeyClient oWorker(m_nTimeoutConnect, m_nTimeoutSend, m_nNoopAfter, m_nMaxProtocolVersion, m_refContext);
+		oWorker.setSocketTuning(m_oSocketTuning);
+		oWorker.setCoalesceWindow(m_nCoalesceWindowUsec);
+		oWorker.m_oStateChangedSignal.connect([this]()
+		{
+			pushEvent(false);
+		});
+		oWorker.m_oErrorSignal.connect([this]()
+		{
+			pushEvent(true);
+		});
+		m_p0Worker = &oWorker;
+
+		auto refPendingCommands = Glib::RefPtr<PendingReadSource>{ new PendingReadSource(m_nCommandsFD) };
+		refPendingCommands->connect(sigc::mem_fun(this, &BtKeySenderThread::doPendingCommands));
+		refPendingCommands->attach(m_refContext);
+
+		m_refLoop->run();
+
+		refPendingCommands->destroy();
+		m_oFlushEventsConn.disconnect();
+		// the events are no longer delivered
+		oWorker.disconnectFromServer();
+		m_p0Worker = nullptr;
+	}
+	// the transports of the commands that weren't executed
+	Command oCommand;
+	while (m_oCommands.pop(oCommand)) {
+		delete oCommand.m_p0Transport;
+	}
+	m_refContext->pop_thread_default();
+}
+bool BtKeySenderThread::doPendingCommands(int32_t /*nSourceId*/, bool bError) noexcept
+{
+	const bool bContinue = true;
+
+	if (bError || m_bStopRequested.load(std::memory_order_acquire)) {
+		m_refLoop->quit();
+		return ! bContinue; //--------------------------------------------------
+	}
+	drainWakeUps(m_nCommandsFD);
+	Command oCommand;
+	while (m_oCommands.pop(oCommand)) {
+		switch (oCommand.m_eCmd) {
+		case CMD_CONNECT:
+		{
+			m_p0Worker->connectToServer(oCommand.m_oBtAddr, oCommand.m_nL2capPort);
+		} break;
+		case CMD_CONNECT_TRANSPORT:
+		{
+			m_p0Worker->connectToServer(std::unique_ptr<ClientTransport>(oCommand.m_p0Transport));
+		} break;
+		case CMD_DISCONNECT:
+		{
+			m_p0Worker->disconnectFromServer();
+		} break;
+		case CMD_REMOVE:
+		{
+			m_p0Worker->sendRemoveToServer();
+		} break;
+		case CMD_KEY:
+		{
+			if (m_aChord.empty()) {
+				m_nChordCaptureTimeUsec = oCommand.m_nCaptureTimeUsec;
+			}
+			m_aChord.emplace_back(oCommand.m_eType, oCommand.m_eKey);
+			if (! oCommand.m_bChordNext) {
+				sendChord();
+			}
+			// otherwise the rest of the chord might still be being pushed,
+			// it's sent with the following wake up
+		} break;
+		}
+	}
+	return bContinue;
+}
+void BtKeySenderThread::sendChord() noexcept
+{
+	if (m_aChord.size() == 1) {
+		m_p0Worker->sendKeyToServer(m_aChord[0].first, m_aChord[0].second, m_nChordCaptureTimeUsec);
+	} else {
+		m_p0Worker->sendKeysToServer(m_aChord, m_nChordCaptureTimeUsec);
+	}
+	m_aChord.clear();
+}
+void BtKeySenderThread::pushEvent(bool bError) noexcept
+{
+	if (m_bStopRequested.load(std::memory_order_acquire)) {
+		return; //--------------------------------------------------------------
+	}
+	m_aEventsBacklog.push_back(BtKeySenderEvent{});
+	BtKeySenderEvent& oEvent = m_aEventsBacklog.back();
+	oEvent.m_bError = bError;
+	oEvent.m_eState = m_p0Worker->getState();
+	oEvent.m_sError = m_p0Worker->getError();
+	oEvent.m_nProtocolVersion = m_p0Worker->getProtocolVersion();
+	oEvent.m_oAppliedSocketTuning = m_p0Worker->getAppliedSocketTuning();
+	oEvent.m_oSendStats = m_p0Worker->getSendStats();
+	flushEvents();
+}
+bool BtKeySenderThread::flushEvents() noexcept
+{
+	const bool bContinue = true;
+	// The events are never dropped: the main thread would miss the last
+	// state. If the ring is full (the main loop is stuck) they are retried.
+	auto itEvent = m_aEventsBacklog.begin();
+	while ((itEvent != m_aEventsBacklog.end()) && m_oEvents.push(*itEvent)) {
+		++itEvent;
+	}
+	if (itEvent != m_aEventsBacklog.begin()) {
+		m_aEventsBacklog.erase(m_aEventsBacklog.begin(), itEvent);
+		wakeUp(m_nEventsFD);
+	}
+	if (m_aEventsBacklog.empty()) {
+		return ! bContinue; //--------------------------------------------------
+	}
+	if (! m_oFlushEventsConn.connected()) {
+		m_oFlushEventsConn = m_refContext->signal_timeout().connect(
+								sigc::mem_fun(this, &BtKeySenderThread::flushEvents), s_nFlushEventsRetryMillisec);
+	}
+	return bContinue;
+}
+
+} // namespace stmi
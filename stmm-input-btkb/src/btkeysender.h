@@ -0,0 +1,201 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   btkeysender.h
+ */
+
+#ifndef STMI_BT_KEY_SENDER_H
+#define STMI_BT_KEY_SENDER_H
+
+#include "btclientsources.h"
+#include "btclienttransport.h"
+#include "btkeyclient.h"
+#include "hardwarekey.h"
+#include "spscring.h"
+
+#include <glibmm.h>
+#include <sigc++/signal.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <bluetooth/bluetooth.h>
+
+#include <stdint.h>
+
+namespace stmi
+{
+
+/** A snapshot of the worker of BtKeySenderThread.
+ */
+struct BtKeySenderEvent
+{
+	bool m_bError = false; /**< Whether an error (otherwise a change of state). */
+	BtKeyClient::STATE m_eState = BtKeyClient::STATE_DISCONNECTED; /**< The state. */
+	std::string m_sError; /**< The last error. */
+	int32_t m_nProtocolVersion = PACKET_PROTOCOL_VERSION_1; /**< The protocol version. */
+	ClientSocketTuning m_oAppliedSocketTuning; /**< The applied socket options. */
+	BtKeyClient::SendStats m_oSendStats; /**< The send queue counters. */
+};
+
+/** Thread owning the connection to the server.
+ * The thread runs its own main loop with a BtKeyClient (the worker) that owns
+ * the socket, the state machine and the timers. A slow frame of the GTK main
+ * loop therefore neither delays the keys nor the keep alive and flow control
+ * packets.
+ *
+ * The commands (and keys) are passed to the thread through a lock-free single
+ * producer single consumer ring. The changes of state and errors of the worker
+ * come back as snapshots through another ring and are delivered by the
+ * default main context.
+ *
+ * All the public methods must be called from the main thread.
+ */
+class BtKeySenderThread
+{
+public:
+	/** Constructor.
+	 * The parameters are those of the worker BtKeyClient.
+	 * @see BtKeyClient::BtKeyClient()
+	 */
+	BtKeySenderThread(int32_t nTimeoutConnect, int32_t nTimeoutSend, int32_t nNoopAfter, int32_t nMaxProtocolVersion
+					, const ClientSocketTuning& oSocketTuning, int32_t nCoalesceWindowUsec) noexcept;
+	/** Destructor.
+	 * Stops the thread, disconnecting from the server.
+	 */
+	~BtKeySenderThread() noexcept;
+
+	/** Starts the thread.
+	 * @param oEventSlot Called by the default main context for each event of the worker.
+	 * @param sError Set to the error if false is returned.
+	 * @return Whether started.
+	 */
+	bool start(const sigc::slot<void, const BtKeySenderEvent&>& oEventSlot, std::string& sError) noexcept;
+
+	/** Connects the worker to a BtKey server.
+	 * @param oBtAddr The address.
+	 * @param nL2capPort The port.
+	 * @return Whether the command could be queued.
+	 */
+	bool connectToServer(const bdaddr_t& oBtAddr, int32_t nL2capPort) noexcept;
+	/** Connects the worker through the given transport.
+	 * @param refTransport The transport. Cannot be null. Is used by the thread.
+	 * @return Whether the command could be queued.
+	 */
+	bool connectToServer(std::unique_ptr<ClientTransport> refTransport) noexcept;
+	/** Disconnects the worker.
+	 * @return Whether the command could be queued.
+	 */
+	bool disconnectFromServer() noexcept;
+	/** Sends the remove command.
+	 * @return Whether the command could be queued.
+	 */
+	bool sendRemoveToServer() noexcept;
+	/** Sends a key.
+	 * @param eType The type.
+	 * @param eKey The key.
+	 * @param nCaptureTimeUsec The g_get_monotonic_time() the key was captured.
+	 * @return Whether the key could be queued.
+	 */
+	bool sendKeyToServer(hk::KEY_INPUT_TYPE eType, hk::HARDWARE_KEY eKey, int64_t nCaptureTimeUsec) noexcept;
+	/** Sends keys pressed or released at the same time.
+	 * Either all or none of the keys are queued.
+	 * @param aKeys The keys. Cannot be empty.
+	 * @param nCaptureTimeUsec The g_get_monotonic_time() the keys were captured.
+	 * @return Whether the keys could be queued.
+	 */
+	bool sendKeysToServer(const std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> >& aKeys
+						, int64_t nCaptureTimeUsec) noexcept;
+private:
+	enum CMD_TYPE
+	{
+		CMD_CONNECT = 0
+		, CMD_CONNECT_TRANSPORT = 1
+		, CMD_DISCONNECT = 2
+		, CMD_REMOVE = 3
+		, CMD_KEY = 4
+	};
+	struct Command
+	{
+		CMD_TYPE m_eCmd = CMD_DISCONNECT;
+		bdaddr_t m_oBtAddr{}; // CMD_CONNECT
+		int32_t m_nL2capPort = -1; // CMD_CONNECT
+		ClientTransport* m_p0Transport = nullptr; // CMD_CONNECT_TRANSPORT, owned by the command
+		hk::KEY_INPUT_TYPE m_eType = hk::KEY_PRESS; // CMD_KEY
+		hk::HARDWARE_KEY m_eKey = hk::HK_NULL; // CMD_KEY
+		int64_t m_nCaptureTimeUsec = 0; // CMD_KEY: g_get_monotonic_time() in the main thread
+		bool m_bChordNext = false; // CMD_KEY: whether the next key is part of the same chord
+	};
+	// Main thread
+	bool pushCommand(const Command& oCommand) noexcept;
+	bool doPendingEvents(int32_t nSourceId, bool bError) noexcept;
+	// Sender thread
+	void run() noexcept;
+	bool doPendingCommands(int32_t nSourceId, bool bError) noexcept;
+	void sendChord() noexcept;
+	void pushEvent(bool bError) noexcept;
+	bool flushEvents() noexcept;
+	// Both
+	static void wakeUp(int32_t nEventFD) noexcept;
+	static void drainWakeUps(int32_t nEventFD) noexcept;
+private:
+	const int32_t m_nTimeoutConnect;
+	const int32_t m_nTimeoutSend;
+	const int32_t m_nNoopAfter;
+	const int32_t m_nMaxProtocolVersion;
+	const ClientSocketTuning m_oSocketTuning;
+	const int32_t m_nCoalesceWindowUsec;
+
+	// Main thread to sender thread
+	SpscRing<Command> m_oCommands;
+	int32_t m_nCommandsFD; // eventfd
+	// Sender thread to main thread
+	SpscRing<BtKeySenderEvent> m_oEvents;
+	int32_t m_nEventsFD; // eventfd
+
+	std::atomic<bool> m_bStopRequested;
+	std::thread m_oThread;
+
+	// Main thread
+	sigc::slot<void, const BtKeySenderEvent&> m_oEventSlot;
+	Glib::RefPtr<PendingReadSource> m_refPendingEvents;
+
+	// Sender thread (created by the main thread)
+	Glib::RefPtr<Glib::MainContext> m_refContext;
+	Glib::RefPtr<Glib::MainLoop> m_refLoop;
+	// Only accessed by the sender thread
+	BtKeyClient* m_p0Worker;
+	std::vector< std::pair<hk::KEY_INPUT_TYPE, hk::HARDWARE_KEY> > m_aChord;
+	int64_t m_nChordCaptureTimeUsec;
+	std::vector<BtKeySenderEvent> m_aEventsBacklog; // The events that didn't fit in m_oEvents
+	sigc::connection m_oFlushEventsConn;
+
+	static constexpr int32_t s_nCommandsCapacity = 256;
+	static constexpr int32_t s_nEventsCapacity = 64;
+	static constexpr int32_t s_nFlushEventsRetryMillisec = 10;
+private:
+	BtKeySenderThread() = delete;
+	BtKeySenderThread(const BtKeySenderThread& oSource) = delete;
+	BtKeySenderThread& operator=(const BtKeySenderThread& oSource) = delete;
+};
+
+} // namespace stmi
+
+#endif /* STMI_BT_KEY_SENDER_H */
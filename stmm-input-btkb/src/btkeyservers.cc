@@ -32,6 +32,7 @@ namespace stmi
 {
 
 static constexpr int32_t s_nMaxServers = 255;
+static constexpr int64_t s_nRefreshCheckUsec = 1000 * 1000;
 
 
 BtKeyServers::BtKeyServers() noexcept
@@ -54,8 +55,11 @@ BtKeyServers::BtKeyServers(int32_t n1s28PeriodsAddr, int32_t nL2capPort
 	return refreshServers(bFlush, n1s28PeriodsAddr);
 })
 , m_nRefreshStarted(-1)
+, m_nRefreshSeconds(0)
+, m_bRefreshStartedOnce(false)
 , m_bHungThread(false)
 {
+	m_nRefreshTimer = m_oScheduler.addTimer(sigc::mem_fun(this, &BtKeyServers::doRefreshTimeout));
 	if (!bExtraServer) {
 		m_oExtraAddr = getEmptyAddr();
 	}
@@ -178,13 +182,10 @@ bool BtKeyServers::startRefreshServers() noexcept
 		addLocalAddress();
 	}
 
-	if (!m_refIntervalTimeout) {
-		m_refIntervalTimeout = Glib::RefPtr<IntervalTimeoutSource>{ new IntervalTimeoutSource(1000) };
-		m_refIntervalTimeout->connectSlot(sigc::mem_fun(this, &BtKeyServers::doIntervalTimeout));
-		m_refIntervalTimeout->attach();
-	}
-
-	m_nRefreshStarted = m_refIntervalTimeout->getElapsed();
+	m_bRefreshStartedOnce = true;
+	m_nRefreshStarted = DeadlineScheduler::getNowUsec();
+	m_nRefreshSeconds = 0;
+	m_oScheduler.schedule(m_nRefreshTimer, m_nRefreshStarted + s_nRefreshCheckUsec);
 
 	m_oRefreshFuture = std::async(std::launch::async, m_oPersistentFunction, m_bFlush, m_n1s28PeriodsAddr);
 	return true;
@@ -247,18 +248,17 @@ std::pair<std::string, std::vector<BtKeyServers::ServerInfo>> BtKeyServers::refr
 	::close(nHciFD);
 	return std::make_pair("", aServers);
 }
-bool BtKeyServers::doIntervalTimeout() noexcept
+void BtKeyServers::doRefreshTimeout() noexcept
 {
-//std::cout << "BtKeyServers::doIntervalTimeout()" << '\n';
-	const bool bContinue = true;
+//std::cout << "BtKeyServers::doRefreshTimeout()" << '\n';
 	if (m_nRefreshStarted < 0) {
-		return bContinue;
+		return;
 	}
 
 	assert(m_oRefreshFuture.valid());
 	std::future_status oStatus = m_oRefreshFuture.wait_for(std::chrono::seconds(0));
 	if (oStatus == std::future_status::ready) {
-//std::cout << "BtKeyServers::doIntervalTimeout() READY" << '\n';
+//std::cout << "BtKeyServers::doRefreshTimeout() READY" << '\n';
 		m_aServers.clear();
 		addLocalAddress();
 		auto oPair = m_oRefreshFuture.get();
@@ -274,10 +274,11 @@ bool BtKeyServers::doIntervalTimeout() noexcept
 		}
 		m_oServersChangedSignal.emit();
 	} else {
-//std::cout << "BtKeyServers::doIntervalTimeout() NOT READY" << '\n';
+//std::cout << "BtKeyServers::doRefreshTimeout() NOT READY" << '\n';
 		// not ready yet, inform of progress
-		int64_t nElapsedMillisec = m_refIntervalTimeout->getElapsed() - m_nRefreshStarted;
-		m_oRefreshProgressSignal.emit(nElapsedMillisec / 1000);
+		++m_nRefreshSeconds;
+		const int64_t nElapsedMillisec = m_nRefreshSeconds * INT64_C(1000);
+		m_oRefreshProgressSignal.emit(m_nRefreshSeconds);
 		if (nElapsedMillisec > std::max(14000, 2 * 1280 * m_n1s28PeriodsAddr)) {
 			// something is wrong with the driver
 			// since the thread probably won't stop termination is needed on exit
@@ -286,13 +287,15 @@ bool BtKeyServers::doIntervalTimeout() noexcept
 			m_nRefreshStarted = -1;
 			m_sLastError = "Refresh takes too long: hci driver error\nPlease restart the application.";
 			m_oServersChangedSignal.emit();
+		} else {
+			// the next second (not drifting)
+			m_oScheduler.schedule(m_nRefreshTimer, m_nRefreshStarted + (m_nRefreshSeconds + 1) * s_nRefreshCheckUsec);
 		}
 	}
-	return bContinue;
 }
 const std::vector<BtKeyServers::ServerInfo>& BtKeyServers::getServers() noexcept
 {
-	if (isEmptyAddr(m_oExtraAddr) && !m_refIntervalTimeout) {
+	if (isEmptyAddr(m_oExtraAddr) && ! m_bRefreshStartedOnce) {
 		startRefreshServers();
 	}
 	return m_aServers;
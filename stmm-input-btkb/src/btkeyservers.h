@@ -21,7 +21,7 @@
 #ifndef STMI_BT_KEY_SERVERS_H
 #define STMI_BT_KEY_SERVERS_H
 
-#include "btclientsources.h"
+#include "deadlinescheduler.h"
 
 #include <sigc++/signal.h>
 #include <glibmm/refptr.h>
@@ -118,7 +118,7 @@ private:
 	BtKeyServers(int32_t n1s28PeriodsAddr, int32_t nL2capPort, bool bExtraServer, const ::bdaddr_t& oExtraAddr, bool bFlush) noexcept;
 	void addExtraServer(std::vector<ServerInfo>& aServers) noexcept;
 
-	bool doIntervalTimeout() noexcept;
+	void doRefreshTimeout() noexcept;
 	// std::future function
 	std::pair<std::string, std::vector<BtKeyServers::ServerInfo>> refreshServers(bool bFlush, int32_t n1s28PeriodsAddr) noexcept;
 	void addLocalAddress() noexcept;
@@ -134,12 +134,15 @@ private:
 	// if sError is not empty aServers is empty.
 	std::function< std::pair<std::string, std::vector<BtKeyServers::ServerInfo>>(bool, int32_t) > m_oPersistentFunction;
 	std::future< std::pair<std::string, std::vector<ServerInfo>> > m_oRefreshFuture; // Value: (sError, aServers)
-	int64_t m_nRefreshStarted; // time refresh was started
+	int64_t m_nRefreshStarted; // time refresh was started (monotonic microseconds), -1 if not refreshing
+	int32_t m_nRefreshSeconds; // the seconds since the start of the refresh
+	bool m_bRefreshStartedOnce;
 
 	bool m_bHungThread;
 
-	// This timeout checks if the future has completed
-	Glib::RefPtr<IntervalTimeoutSource> m_refIntervalTimeout;
+	// Every second of a refresh checks if the future has completed
+	DeadlineScheduler m_oScheduler;
+	int32_t m_nRefreshTimer;
 private:
 	BtKeyServers(const BtKeyServers& oSource) = delete;
 	BtKeyServers& operator=(const BtKeyServers& oSource) = delete;
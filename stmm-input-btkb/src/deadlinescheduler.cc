@@ -0,0 +1,151 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   deadlinescheduler.cc
+ */
+
+#include "deadlinescheduler.h"
+
+#include <glib.h>
+
+#include <algorithm>
+#include <cassert>
+
+namespace stmi
+{
+
+DeadlineScheduler::DeadlineScheduler() noexcept
+: DeadlineScheduler(Glib::RefPtr<Glib::MainContext>{})
+{
+}
+DeadlineScheduler::DeadlineScheduler(const Glib::RefPtr<Glib::MainContext>& refContext) noexcept
+: m_refContext(refContext)
+, m_nArmedDeadlineUsec(-1)
+, m_bDispatching(false)
+{
+	m_refTimer = Glib::RefPtr<OneShotTimerSource>{ new OneShotTimerSource() };
+	if (! m_refTimer->getErrorStr().empty()) {
+		// use the less precise Glib timeouts
+		m_refTimer.reset();
+		return; //--------------------------------------------------------------
+	}
+	m_refTimer->connect(sigc::mem_fun(this, &DeadlineScheduler::doTimeout));
+	m_refTimer->attach(m_refContext);
+}
+DeadlineScheduler::~DeadlineScheduler() noexcept
+{
+	m_oFallbackConn.disconnect();
+	if (m_refTimer) {
+		m_refTimer->destroy();
+	}
+}
+int64_t DeadlineScheduler::getNowUsec() noexcept
+{
+	return g_get_monotonic_time();
+}
+int32_t DeadlineScheduler::addTimer(const sigc::slot<void>& oSlot) noexcept
+{
+	m_aTimers.push_back(Timer{oSlot, -1});
+	return static_cast<int32_t>(m_aTimers.size()) - 1;
+}
+void DeadlineScheduler::schedule(int32_t nTimerId, int64_t nDeadlineUsec) noexcept
+{
+	assert((nTimerId >= 0) && (nTimerId < static_cast<int32_t>(m_aTimers.size())));
+	m_aTimers[nTimerId].m_nDeadlineUsec = std::max<int64_t>(0, nDeadlineUsec);
+	rearm();
+}
+void DeadlineScheduler::cancel(int32_t nTimerId) noexcept
+{
+	assert((nTimerId >= 0) && (nTimerId < static_cast<int32_t>(m_aTimers.size())));
+	if (m_aTimers[nTimerId].m_nDeadlineUsec < 0) {
+		return; //--------------------------------------------------------------
+	}
+	m_aTimers[nTimerId].m_nDeadlineUsec = -1;
+	rearm();
+}
+bool DeadlineScheduler::isScheduled(int32_t nTimerId) const noexcept
+{
+	assert((nTimerId >= 0) && (nTimerId < static_cast<int32_t>(m_aTimers.size())));
+	return (m_aTimers[nTimerId].m_nDeadlineUsec >= 0);
+}
+void DeadlineScheduler::rearm() noexcept
+{
+	if (m_bDispatching) {
+		// done when all expired timers were called
+		return; //--------------------------------------------------------------
+	}
+	int64_t nEarliestUsec = -1;
+	for (const auto& oTimer : m_aTimers) {
+		if ((oTimer.m_nDeadlineUsec >= 0) && ((nEarliestUsec < 0) || (oTimer.m_nDeadlineUsec < nEarliestUsec))) {
+			nEarliestUsec = oTimer.m_nDeadlineUsec;
+		}
+	}
+	if (nEarliestUsec == m_nArmedDeadlineUsec) {
+		return; //--------------------------------------------------------------
+	}
+	m_nArmedDeadlineUsec = nEarliestUsec;
+	if (! m_refTimer) {
+		armFallback(nEarliestUsec);
+		return; //--------------------------------------------------------------
+	}
+	if (nEarliestUsec < 0) {
+		m_refTimer->disarm();
+	} else if (! m_refTimer->arm(nEarliestUsec)) {
+		armFallback(nEarliestUsec);
+	}
+}
+void DeadlineScheduler::armFallback(int64_t nDeadlineUsec) noexcept
+{
+	m_oFallbackConn.disconnect();
+	if (nDeadlineUsec < 0) {
+		return; //--------------------------------------------------------------
+	}
+	// round up, expiring early would just rearm
+	const int64_t nDelayMillisec = (std::max<int64_t>(0, nDeadlineUsec - getNowUsec()) + 999) / 1000;
+	const sigc::slot<bool> oSlot = [this]()
+	{
+		doTimeout();
+		return false;
+	};
+	if (m_refContext) {
+		m_oFallbackConn = m_refContext->signal_timeout().connect(oSlot, static_cast<uint32_t>(nDelayMillisec));
+	} else {
+		m_oFallbackConn = Glib::signal_timeout().connect(oSlot, static_cast<uint32_t>(nDelayMillisec));
+	}
+}
+bool DeadlineScheduler::doTimeout() noexcept
+{
+	const bool bContinue = true;
+	m_nArmedDeadlineUsec = -1;
+	const int64_t nNowUsec = getNowUsec();
+	m_bDispatching = true;
+	// callbacks can add timers, don't use iterators
+	for (int32_t nIdx = 0; nIdx < static_cast<int32_t>(m_aTimers.size()); ++nIdx) {
+		Timer& oTimer = m_aTimers[nIdx];
+		if ((oTimer.m_nDeadlineUsec < 0) || (oTimer.m_nDeadlineUsec > nNowUsec)) {
+			continue; // for ------
+		}
+		oTimer.m_nDeadlineUsec = -1;
+		const sigc::slot<void> oSlot = oTimer.m_oSlot;
+		oSlot();
+	}
+	m_bDispatching = false;
+	rearm();
+	return bContinue;
+}
+
+} // namespace stmi
@@ -0,0 +1,106 @@
+/*
+ * Copyright © 2020  Stefano Marsili, <stemars@gmx.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * File:   deadlinescheduler.h
+ */
+
+#ifndef STMI_DEADLINE_SCHEDULER_H
+#define STMI_DEADLINE_SCHEDULER_H
+
+#include "btclientsources.h"
+
+#include <glibmm.h>
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace stmi
+{
+
+/** Calls timers at their deadlines.
+ * A single one-shot timer is armed for the earliest deadline, nothing wakes up
+ * the main loop while no timer is scheduled. The deadlines are microseconds of
+ * the monotonic clock (see getNowUsec()).
+ *
+ * The few timers of a client are kept in a vector, a wheel isn't worth it.
+ */
+class DeadlineScheduler
+{
+public:
+	/** Constructor.
+	 * The timers are called by the default main context.
+	 */
+	DeadlineScheduler() noexcept;
+	/** Constructor.
+	 * @param refContext The main context calling the timers. If null the default.
+	 */
+	explicit DeadlineScheduler(const Glib::RefPtr<Glib::MainContext>& refContext) noexcept;
+	~DeadlineScheduler() noexcept;
+
+	/** Adds a timer.
+	 * The timer isn't scheduled.
+	 * @param oSlot The callback. Can schedule timers (also its own).
+	 * @return The timer id.
+	 */
+	int32_t addTimer(const sigc::slot<void>& oSlot) noexcept;
+	/** Schedules a timer.
+	 * Replaces the current deadline of the timer if scheduled.
+	 * @param nTimerId The timer id.
+	 * @param nDeadlineUsec The deadline. If in the past the timer is called as soon as possible.
+	 */
+	void schedule(int32_t nTimerId, int64_t nDeadlineUsec) noexcept;
+	/** Cancels a timer.
+	 * Does nothing if not scheduled.
+	 * @param nTimerId The timer id.
+	 */
+	void cancel(int32_t nTimerId) noexcept;
+	/** Whether a timer is scheduled.
+	 * @param nTimerId The timer id.
+	 * @return Whether scheduled.
+	 */
+	bool isScheduled(int32_t nTimerId) const noexcept;
+
+	/** The current time.
+	 * @return The monotonic clock in microseconds (as g_get_monotonic_time()).
+	 */
+	static int64_t getNowUsec() noexcept;
+private:
+	bool doTimeout() noexcept;
+	void rearm() noexcept;
+	void armFallback(int64_t nDeadlineUsec) noexcept;
+private:
+	struct Timer
+	{
+		sigc::slot<void> m_oSlot;
+		int64_t m_nDeadlineUsec; // -1 if not scheduled
+	};
+	std::vector<Timer> m_aTimers;
+	Glib::RefPtr<Glib::MainContext> m_refContext;
+	Glib::RefPtr<OneShotTimerSource> m_refTimer; // Null if timerfd not available
+	sigc::connection m_oFallbackConn; // Millisecond Glib timeout used if m_refTimer is null
+	int64_t m_nArmedDeadlineUsec; // -1 if not armed
+	bool m_bDispatching;
+private:
+	DeadlineScheduler(const DeadlineScheduler& oSource) = delete;
+	DeadlineScheduler& operator=(const DeadlineScheduler& oSource) = delete;
+};
+
+} // namespace stmi
+
+#endif /* STMI_DEADLINE_SCHEDULER_H */
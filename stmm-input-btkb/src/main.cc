@@ -63,13 +63,22 @@ void printUsage() noexcept
 	//std::cout << "                         (default: " << BtKeyClient::s_nDefaultTimeoutSend << ")." << '\n';
 	//std::cout << "  -n --noop N            Send NOOP after N milliseconds" << '\n';
 	//std::cout << "                         (default: " << BtKeyClient::s_nDefaultNoopAfter << ", none: 0)." << '\n';
-	//std::cout << "  -i --interval N        Interval: N milliseconds" << '\n';
-	//std::cout << "                         Granularity of timeout checks and noop" << '\n';
-	//std::cout << "                         (default: " << BtKeyClient::s_nDefaultInterval << ")." << '\n';
 	//std::cout << "  -r --refresh N         N * 1.28 sec detection time (Refresh)." << '\n';
 	//std::cout << "                         (default: " << BtKeyServers::s_nDefault1s28PeriodsAddr << ")." << '\n';
 	std::cout << "  -f --flush             Forget previously found devices" << '\n';
 	std::cout << "                         with a new Refresh." << '\n';
+	std::cout << "  -1 --protocol-v1       Don't negotiate the compact protocol v2" << '\n';
+	std::cout << "                         with the server." << '\n';
+	std::cout << "  -2 --protocol-v2       Don't negotiate flow control (protocol v3)" << '\n';
+	std::cout << "                         with the server." << '\n';
+	std::cout << "  -m --mtu N             L2CAP incoming and outgoing MTU: N bytes" << '\n';
+	std::cout << "                         (default: system)." << '\n';
+	std::cout << "  -t --flush-timeout N   L2CAP flush timeout: N milliseconds" << '\n';
+	std::cout << "                         (default: system, never flushed)." << '\n';
+	std::cout << "  -w --coalesce N        Gather the keys pressed within N microseconds" << '\n';
+	std::cout << "                         in one packet (default: 0, send immediately)." << '\n';
+	std::cout << "  -T --sender-thread     Connect and send from a dedicated thread" << '\n';
+	std::cout << "                         not slowed down by the drawing." << '\n';
 }
 
 void evalNoArg(int& nArgC, char**& aArgV, const std::string& sOption1, const std::string& sOption2, bool& bVar) noexcept
@@ -144,10 +153,16 @@ int btkbMain(int nArgC, char** aArgV) noexcept
 {
 	int32_t nTimeoutConnect = BtKeyClient::s_nDefaultTimeoutConnect;
 	int32_t nTimeoutSend = BtKeyClient::s_nDefaultTimeoutSend;
-	int32_t nInterval = BtKeyClient::s_nDefaultInterval;
 	int32_t nNoopAfter = BtKeyClient::s_nDefaultNoopAfter;
+	int32_t nIgnoredInterval = 0;
 	int32_t n1s28Periods = BtKeyServers::s_nDefault1s28PeriodsAddr;
 	bool bRefreshFlush = false;
+	bool bProtocolV1 = false;
+	bool bProtocolV2 = false;
+	bool bSenderThread = false;
+	int32_t nMtu = 0;
+	int32_t nFlushTimeout = 0;
+	int32_t nCoalesceWindow = 0;
 	int32_t nL2capPort = BtKeyServers::s_nDefaultL2capPort;
 	::bdaddr_t oExtraAddr;
 	::memset(&oExtraAddr, 0, sizeof(oExtraAddr));
@@ -168,8 +183,13 @@ int btkbMain(int nArgC, char** aArgV) noexcept
 			return EXIT_SUCCESS; //---------------------------------------------
 		}
 		evalNoArg(nArgC, aArgV, "--flush", "-f", bRefreshFlush);
+		evalNoArg(nArgC, aArgV, "--protocol-v1", "-1", bProtocolV1);
+		evalNoArg(nArgC, aArgV, "--protocol-v2", "-2", bProtocolV2);
+		evalNoArg(nArgC, aArgV, "--sender-thread", "-T", bSenderThread);
 		//
-		bool bOk = evalIntArg(nArgC, aArgV, "--interval", "-i", nInterval, 50);
+		// Obsolete: the timeouts are now scheduled at their deadlines,
+		// still accepted so that existing invocations don't fail
+		bool bOk = evalIntArg(nArgC, aArgV, "--interval", "-i", nIgnoredInterval, 50);
 		if (!bOk) {
 			return EXIT_FAILURE; //---------------------------------------------
 		}
@@ -193,6 +213,18 @@ int btkbMain(int nArgC, char** aArgV) noexcept
 		if (!bOk) {
 			return EXIT_FAILURE; //---------------------------------------------
 		}
+		bOk = evalIntArg(nArgC, aArgV, "--mtu", "-m", nMtu, 48);
+		if (!bOk) {
+			return EXIT_FAILURE; //---------------------------------------------
+		}
+		bOk = evalIntArg(nArgC, aArgV, "--flush-timeout", "-t", nFlushTimeout, 1);
+		if (!bOk) {
+			return EXIT_FAILURE; //---------------------------------------------
+		}
+		bOk = evalIntArg(nArgC, aArgV, "--coalesce", "-w", nCoalesceWindow, 0);
+		if (!bOk) {
+			return EXIT_FAILURE; //---------------------------------------------
+		}
 		bOk = evalAddrArg(nArgC, aArgV, "--extra-server", "-e", oExtraAddr);
 		if (!bOk) {
 			return EXIT_FAILURE; //---------------------------------------------
@@ -215,7 +247,22 @@ int btkbMain(int nArgC, char** aArgV) noexcept
 	BtKeyServers oServers(n1s28Periods, nL2capPort, oExtraAddr, bRefreshFlush);
 	{
 		// client model
-		BtKeyClient oClient(nTimeoutConnect, nTimeoutSend, nInterval, nNoopAfter);
+		const int32_t nMaxProtocolVersion = (bProtocolV1 ? PACKET_PROTOCOL_VERSION_1
+											: (bProtocolV2 ? PACKET_PROTOCOL_VERSION_2 : BtKeyClient::s_nDefaultMaxProtocolVersion));
+		BtKeyClient oClient(nTimeoutConnect, nTimeoutSend, nNoopAfter, nMaxProtocolVersion);
+		ClientSocketTuning oTuning;
+		oTuning.m_nInMtu = nMtu;
+		oTuning.m_nOutMtu = nMtu;
+		oTuning.m_nFlushTimeoutMsec = nFlushTimeout;
+		oClient.setSocketTuning(oTuning);
+		oClient.setCoalesceWindow(nCoalesceWindow);
+		if (bSenderThread) {
+			std::string sError;
+			if (! oClient.startSenderThread(sError)) {
+				std::cerr << "Error: " << sError << '\n';
+				return EXIT_FAILURE; //-----------------------------------------
+			}
+		}
 
 		const Glib::ustring sAppName = "com.efanomars.stmm-input-btkb";
 		const Glib::ustring sWindoTitle = "stmm-input-btkb " + Config::getVersionString();